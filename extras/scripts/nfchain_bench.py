@@ -0,0 +1,338 @@
+#!/usr/bin/env python3
+
+"""
+nfchain_bench replays synthetic or pcap traffic through an NF chain with
+packet-generator streams, without a NIC, and prints a JSON summary:
+Mpps, clocks per packet of every node, per-NF costs from "show nfchain
+perf" and the memory of the NF flow tables.
+
+Synthetic traffic is a set of UDP flows whose packet counts follow a Zipf
+law of the given skew (0 for uniform), written to a pcap with a fixed
+seed, so that runs with the same arguments replay the same packets. Each
+worker replays the pcap from its own stream on pg0, through the chain set
+up on pg0, and the chain sends the packets back out of pg0.
+
+Example, from a built tree:
+
+  extras/scripts/nfchain_bench.py \\
+      --vpp build-root/install-vpp-native/vpp/bin/vpp \\
+      --workers 2 --flows 100000 --zipf 1.1 --size 64 \\
+      --chain clb ratelimiter flowcounter --duration 10
+"""
+
+import argparse
+import bisect
+import itertools
+import json
+import os
+import random
+import re
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+NFS = ["clb", "ratelimiter", "flowcounter", "cpolicer", "sourcecounter"]
+
+# pcap file header, ethernet link type
+PCAP_HEADER = struct.pack("<IHHiIII", 0xA1B2C3D4, 2, 4, 0, 0, 65535, 1)
+
+MIN_SIZE = 60
+
+
+def ip4_checksum(header):
+    """One's complement sum of a header whose checksum field is 0"""
+    total = sum(struct.unpack("!%dH" % (len(header) // 2), header))
+    while total >> 16:
+        total = (total & 0xFFFF) + (total >> 16)
+    return ~total & 0xFFFF
+
+
+def udp4_packet(flow, n_dsts, size):
+    """Ethernet / IPv4 / UDP frame of size bytes for flow number flow"""
+    src = 0x0A000000 + flow
+    dst = 0xAC100000 + flow % n_dsts
+    sport = 1024 + flow % 60000
+    dport = 5000
+    ip_len = size - 14
+    ip = struct.pack("!BBHHHBBHII", 0x45, 0, ip_len, 0, 0, 64, 17, 0, src, dst)
+    ip = ip[:10] + struct.pack("!H", ip4_checksum(ip)) + ip[12:]
+    udp = struct.pack("!HHHH", sport, dport, ip_len - 20, 0)
+    eth = bytes.fromhex("020000000001020000000002") + struct.pack("!H", 0x0800)
+    return eth + ip + udp + bytes(size - 42)
+
+
+def write_pcap(path, args):
+    """Write args.packets packets of args.flows Zipf-distributed flows"""
+    rng = random.Random(args.seed)
+    weights = [1.0 / (rank**args.zipf) for rank in range(1, args.flows + 1)]
+    cum_weights = list(itertools.accumulate(weights))
+    # Flow numbers by rank, so that heavy flows are spread over the tables
+    flows = list(range(args.flows))
+    rng.shuffle(flows)
+
+    with open(path, "wb") as f:
+        f.write(PCAP_HEADER)
+        for i in range(args.packets):
+            rank = bisect.bisect_left(cum_weights, rng.random() * cum_weights[-1])
+            flow = flows[min(rank, args.flows - 1)]
+            data = udp4_packet(flow, args.dsts, args.size)
+            f.write(struct.pack("<IIII", i // 1000000, i % 1000000, *[len(data)] * 2))
+            f.write(data)
+
+
+def startup_conf(args, tmpdir):
+    """VPP startup config, every socket and segment private to tmpdir"""
+    plugins = "plugin default { enable }\n  plugin dpdk_plugin.so { disable }"
+    if args.plugin_path:
+        plugins = f"path {args.plugin_path}\n  " + plugins
+    cpu = f"cpu {{ workers {args.workers} }}" if args.workers else ""
+    return f"""
+unix {{
+  nodaemon
+  cli-listen {tmpdir}/cli.sock
+  log {tmpdir}/vpp.log
+  exec {tmpdir}/setup.cli
+}}
+api-segment {{ prefix nfchain-bench-{os.getpid()} }}
+socksvr {{ socket-name {tmpdir}/api.sock }}
+statseg {{ socket-name {tmpdir}/stats.sock }}
+buffers {{ buffers-per-numa {args.buffers} }}
+{cpu}
+plugins {{
+  {plugins}
+}}
+{args.startup_config or ""}
+"""
+
+
+def setup_cli(args, pcap):
+    """Interface, chain and one stream per worker, streams left disabled"""
+    lines = [
+        "create packet-generator interface pg0",
+        "set interface state pg0 up",
+    ]
+    if args.fused:
+        lines.append("nfchain fused pg0")
+    else:
+        lines.append("nfchain chain pg0 " + " ".join(args.chain))
+    if args.config:
+        with open(args.config) as f:
+            lines += [line.rstrip() for line in f]
+    for worker in range(max(args.workers, 1)):
+        lines.append(
+            f"packet-generator new {{ name s{worker} limit 1e15 "
+            f"node ethernet-input interface pg0 worker {worker} "
+            f"pcap {pcap} }}"
+        )
+    lines.append("packet-generator disable-stream")
+    return "\n".join(lines) + "\n"
+
+
+class Vpp:
+    def __init__(self, args, tmpdir):
+        self.vppctl = args.vppctl
+        self.sock = f"{tmpdir}/cli.sock"
+        self.process = subprocess.Popen(
+            [args.vpp, "-c", f"{tmpdir}/startup.conf"],
+            stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL,
+        )
+        for _ in range(100):
+            if self.process.poll() is not None:
+                raise RuntimeError(
+                    f"vpp exited with {self.process.returncode}, "
+                    f"see {tmpdir}/vpp.log"
+                )
+            if os.path.exists(self.sock):
+                try:
+                    self.cli("show version")
+                    return
+                except subprocess.CalledProcessError:
+                    pass
+            time.sleep(0.1)
+        raise RuntimeError("vpp CLI did not come up")
+
+    def cli(self, command):
+        return subprocess.run(
+            [self.vppctl, "-s", self.sock, command],
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout
+
+    def stop(self):
+        self.process.terminate()
+        try:
+            self.process.wait(timeout=10)
+        except subprocess.TimeoutExpired:
+            self.process.kill()
+
+
+def parse_runtime(text):
+    """Clocks per packet of every node with packets, over all threads"""
+    nodes = {}
+    for line in text.splitlines():
+        fields = line.split()
+        # Name State Calls Vectors Suspends Clocks Vectors/Call
+        if len(fields) < 7 or not fields[-5].isdigit():
+            continue
+        name, vectors, clocks = fields[0], int(fields[-4]), float(fields[-2])
+        if vectors == 0:
+            continue
+        n = nodes.setdefault(name, {"packets": 0, "clocks": 0.0})
+        n["packets"] += vectors
+        n["clocks"] += clocks * vectors
+    return {
+        name: {
+            "packets": n["packets"],
+            "clocks_per_packet": n["clocks"] / n["packets"],
+        }
+        for name, n in nodes.items()
+    }
+
+
+def parse_perf(text):
+    """Per-NF, per-stage costs from show nfchain perf"""
+    perf = {}
+    stage = None
+    for line in text.splitlines():
+        m = re.match(r"(\S+) (\S+): (\d+) frames, (\d+) packets", line)
+        if m:
+            stage = perf.setdefault(m.group(1), {})[m.group(2)] = {
+                "frames": int(m.group(3)),
+                "packets": int(m.group(4)),
+            }
+            continue
+        m = re.match(r"  (\S+)\s+([\d.]+)/packet", line)
+        if m and stage is not None:
+            stage[m.group(1).replace("-", "_") + "_per_packet"] = float(m.group(2))
+    return perf
+
+
+def memory_size(text):
+    """Inverse of format_memory_size"""
+    m = re.match(r"([\d.]+)([kmg]?)", text)
+    return int(float(m.group(1)) * 1024 ** " kmg".index(m.group(2) or " "))
+
+
+def parse_bihash(text):
+    """Flow table memory and entries by table, per-thread tables summed"""
+    tables = {}
+    table = None
+    for line in text.splitlines():
+        m = re.match(r"Hash table '(.*?)(_\d+)?'", line)
+        if m:
+            table = tables.setdefault(m.group(1), {"bytes": 0, "entries": 0})
+            continue
+        if table is None:
+            continue
+        m = re.search(r"(\d+) active elements", line)
+        if m:
+            table["entries"] += int(m.group(1))
+        m = re.search(r"bytes: used (\S+),", line) or re.search(
+            r"used (\d+) b \(", line
+        )
+        if m:
+            table["bytes"] += memory_size(m.group(1).rstrip(","))
+    return tables
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter
+    )
+    parser.add_argument("--vpp", default="vpp", help="vpp binary")
+    parser.add_argument("--vppctl", default="vppctl", help="vppctl binary")
+    parser.add_argument("--plugin-path", help="plugin directory")
+    parser.add_argument("--workers", type=int, default=1)
+    parser.add_argument("--chain", nargs="+", choices=NFS, default=NFS[:3])
+    parser.add_argument(
+        "--fused", action="store_true", help="run the fused node, not --chain"
+    )
+    parser.add_argument(
+        "--pcap", help="replay this pcap instead of synthetic traffic"
+    )
+    parser.add_argument("--flows", type=int, default=10000)
+    parser.add_argument(
+        "--zipf", type=float, default=0.0, help="flow skew, 0 for uniform"
+    )
+    parser.add_argument("--size", type=int, default=64, help="frame bytes")
+    parser.add_argument("--dsts", type=int, default=256, help="destinations")
+    parser.add_argument(
+        "--packets", type=int, default=1 << 16, help="synthetic pcap packets"
+    )
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--duration", type=float, default=10.0, help="seconds")
+    parser.add_argument("--buffers", type=int, default=65536)
+    parser.add_argument(
+        "--config", help="file of CLI commands setting the NFs up, run first"
+    )
+    parser.add_argument("--startup-config", help="extra startup config")
+    parser.add_argument("--output", help="write the summary here, not stdout")
+    parser.add_argument("--keep", action="store_true", help="keep the run dir")
+    args = parser.parse_args()
+
+    if args.size < MIN_SIZE:
+        parser.error(f"--size must be at least {MIN_SIZE}")
+    if args.flows < 1 or args.flows > 1 << 24:
+        parser.error("--flows must be in [1, 16M]")
+
+    tmpdir = tempfile.mkdtemp(prefix="nfchain-bench-")
+    pcap = args.pcap and os.path.abspath(args.pcap)
+    if not pcap:
+        pcap = f"{tmpdir}/traffic.pcap"
+        write_pcap(pcap, args)
+    with open(f"{tmpdir}/startup.conf", "w") as f:
+        f.write(startup_conf(args, tmpdir))
+    with open(f"{tmpdir}/setup.cli", "w") as f:
+        f.write(setup_cli(args, pcap))
+
+    vpp = Vpp(args, tmpdir)
+    try:
+        vpp.cli("nfchain perf enable")
+        vpp.cli("clear runtime")
+        vpp.cli("clear nfchain perf")
+        start = time.monotonic()
+        vpp.cli("packet-generator enable-stream")
+        time.sleep(args.duration)
+        vpp.cli("packet-generator disable-stream")
+        elapsed = time.monotonic() - start
+        nodes = parse_runtime(vpp.cli("show runtime"))
+        perf = parse_perf(vpp.cli("show nfchain perf"))
+        tables = parse_bihash(vpp.cli("show bihash"))
+    finally:
+        vpp.stop()
+        if not args.keep:
+            shutil.rmtree(tmpdir)
+
+    packets = nodes.get("pg-input", {}).get("packets", 0)
+    summary = {
+        "parameters": {
+            "chain": "fused" if args.fused else args.chain,
+            "workers": args.workers,
+            "pcap": args.pcap,
+            "flows": None if args.pcap else args.flows,
+            "zipf": None if args.pcap else args.zipf,
+            "size": None if args.pcap else args.size,
+            "seed": args.seed,
+            "duration": args.duration,
+        },
+        "packets": packets,
+        "mpps": packets / elapsed / 1e6,
+        "nodes": nodes,
+        "nfs": perf,
+        "tables": tables,
+    }
+    text = json.dumps(summary, indent=2, sort_keys=True) + "\n"
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text)
+    else:
+        sys.stdout.write(text)
+
+
+if __name__ == "__main__":
+    main()
@@ -20,9 +20,14 @@
 #include <vnet/vnet.h>
 #include <vnet/plugin/plugin.h>
 #include <clb/clb.h>
+#include <nfchain/flow_dump.h>
+#include <vnet/ip/ip_types_api.h>
+#include <vnet/ethernet/ethernet_types_api.h>
+#include <vppinfra/xxhash.h>
 
 #include <vlibapi/api.h>
 #include <vlibmemory/api.h>
+#include <vnet/format_fns.h>
 
 #include <clb/clb.api_enum.h>
 #include <clb/clb.api_types.h>
@@ -36,7 +41,9 @@ VLIB_PLUGIN_REGISTER () = {
     .description = "Custom LB plugin",
 };
 
-clb_main_t clb_main;
+__clib_export clb_main_t clb_main;
+__clib_export nfchain_hop_t clb_chain_hop;
+__clib_export nfchain_nf_stats_t clb_nf_stats;
 
 /**
  * @brief Enable/disable the macswap plugin. 
@@ -121,6 +128,319 @@ VLIB_CLI_COMMAND (sr_content_command, static) = {
     .function = macswap_enable_disable_command_fn,
 };
 
+static int
+clb_backend_address_cmp (void *a1, void *a2)
+{
+  clb_main_t * sm = &clb_main;
+  u32 *i1 = a1, *i2 = a2;
+  u32 v1 = clib_net_to_host_u32 (sm->backends[*i1].address.as_u32);
+  u32 v2 = clib_net_to_host_u32 (sm->backends[*i2].address.as_u32);
+
+  return v1 < v2 ? -1 : v1 > v2;
+}
+
+/**
+ * @brief Build the Maglev table for the active backends.
+ *
+ * Each backend walks its own permutation of the slots, derived from its
+ * address, and the backends take turns claiming their next free slot.
+ * The table depends only on the set of addresses, and adding or removing
+ * one backend moves few slots between the others.
+ */
+static u32 *
+clb_maglev_build (clb_main_t * sm)
+{
+  u32 *indices = 0, *offset = 0, *skip = 0, *table = 0;
+  clb_backend_t * be;
+  u32 i, n, filled = 0;
+
+  pool_foreach (be, sm->backends)
+    {
+      if (be->is_active)
+        vec_add1 (indices, be - sm->backends);
+    }
+
+  n = vec_len (indices);
+  if (n == 0)
+    return 0;
+
+  /* Same order whatever the pool layout */
+  vec_sort_with_function (indices, clb_backend_address_cmp);
+
+  vec_validate (offset, n - 1);
+  vec_validate (skip, n - 1);
+  for (i = 0; i < n; i++)
+    {
+      u64 a = sm->backends[indices[i]].address.as_u32;
+
+      offset[i] = clib_xxhash (a) % CLB_MAGLEV_TABLE_SIZE;
+      skip[i] = clib_xxhash (a ^ 0x9e3779b97f4a7c15ULL)
+        % (CLB_MAGLEV_TABLE_SIZE - 1) + 1;
+    }
+
+  vec_validate_init_empty (table, CLB_MAGLEV_TABLE_SIZE - 1, ~0);
+  while (1)
+    for (i = 0; i < n; i++)
+      {
+        while (table[offset[i]] != ~0)
+          offset[i] = (offset[i] + skip[i]) % CLB_MAGLEV_TABLE_SIZE;
+
+        table[offset[i]] = indices[i];
+        if (++filled == CLB_MAGLEV_TABLE_SIZE)
+          goto done;
+      }
+
+done:
+  vec_free (indices);
+  vec_free (offset);
+  vec_free (skip);
+  return table;
+}
+
+static void
+clb_backend_free (void *data)
+{
+  clb_main_t * sm = &clb_main;
+
+  pool_put_index (sm->backends, pointer_to_uword (data));
+}
+
+/**
+ * @brief Add, update or delete a backend.
+ *
+ * New flows are spread over the active backends by the Maglev table,
+ * existing flows stay on their backend until it is deleted. A new backend
+ * reusing a deleted one's index gets a new generation, so the old flows
+ * do not follow the index.
+ *
+ * Workers keep forwarding: the new Maglev table is published in place of
+ * the old one, which is freed, as are deleted backends, once no worker
+ * can read them (see vlib/rcu.h). Growing the backend pool, rewriting a
+ * live backend's MAC, and the first add and last delete, which create and
+ * free the table workers check n_active_backends for, stop the workers.
+ */
+int clb_backend_add_del (clb_main_t * sm, ip4_address_t * address,
+                         mac_address_t * mac, int is_add)
+{
+  vlib_main_t * vm = vlib_get_main ();
+  clb_backend_t * be;
+  u32 *maglev, *old;
+  uword * p, index;
+  int barrier;
+
+  p = hash_get (sm->backend_by_address, address->as_u32);
+  if (!is_add && !p)
+    return VNET_API_ERROR_NO_SUCH_ENTRY;
+
+  if (is_add)
+    barrier = p || sm->n_active_backends == 0
+      || pool_get_will_expand (sm->backends);
+  else
+    barrier = sm->n_active_backends == 1;
+  if (barrier)
+    vlib_worker_thread_barrier_sync (vm);
+
+  if (is_add)
+    {
+      if (p)
+        be = pool_elt_at_index (sm->backends, p[0]);
+      else
+        {
+          pool_get_zero (sm->backends, be);
+          be->address = *address;
+          be->generation = ++sm->backend_generation;
+          hash_set (sm->backend_by_address, address->as_u32,
+                    be - sm->backends);
+          sm->n_active_backends++;
+        }
+      be->mac = *mac;
+      clib_atomic_store_rel_n (&be->is_active, 1);
+    }
+  else
+    {
+      index = p[0];
+      be = pool_elt_at_index (sm->backends, index);
+      be->is_active = 0;
+      hash_unset (sm->backend_by_address, address->as_u32);
+      sm->n_active_backends--;
+      /* Not reused while a worker may still pick it */
+      vlib_rcu_call (clb_backend_free, uword_to_pointer (index, void *));
+    }
+
+  old = sm->maglev;
+  maglev = clb_maglev_build (sm);
+  clib_atomic_store_rel_n (&sm->maglev, maglev);
+
+  if (barrier)
+    {
+      vlib_worker_thread_barrier_release (vm);
+      vec_free (old);
+    }
+  else
+    vlib_rcu_vec_free (old);
+  return 0;
+}
+
+static clib_error_t *
+backend_add_del_command_fn (vlib_main_t * vm,
+                            unformat_input_t * input,
+                            vlib_cli_command_t * cmd)
+{
+  clb_main_t * sm = &clb_main;
+  ip4_address_t address;
+  mac_address_t mac = ZERO_MAC_ADDRESS;
+  int have_address = 0, have_mac = 0;
+  int is_add = 1;
+  int rv;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "%U", unformat_ip4_address, &address))
+      have_address = 1;
+    else if (unformat (input, "mac %U", unformat_mac_address_t, &mac))
+      have_mac = 1;
+    else if (unformat (input, "del"))
+      is_add = 0;
+    else
+      return clib_error_return (0, "unknown input `%U'",
+                                format_unformat_error, input);
+  }
+
+  if (!have_address)
+    return clib_error_return (0, "Please specify a backend address...");
+  if (is_add && !have_mac)
+    return clib_error_return (0, "Please specify the backend's MAC...");
+
+  rv = clb_backend_add_del (sm, &address, &mac, is_add);
+
+  switch(rv) {
+  case 0:
+    break;
+
+  case VNET_API_ERROR_NO_SUCH_ENTRY:
+    return clib_error_return (0, "No such backend");
+
+  default:
+    return clib_error_return (0, "clb_backend_add_del returned %d", rv);
+  }
+  return 0;
+}
+
+/**
+ * @brief CLI command to add/delete clb backends.
+ */
+VLIB_CLI_COMMAND (backend_add_del_command, static) = {
+    .path = "clb backend",
+    .short_help = "clb backend <ip4-address> mac <mac-address> [del]",
+    .function = backend_add_del_command_fn,
+};
+
+static clib_error_t *
+show_backends_command_fn (vlib_main_t * vm,
+                          unformat_input_t * input,
+                          vlib_cli_command_t * cmd)
+{
+  clb_main_t * sm = &clb_main;
+  clb_backend_t * be;
+  u32 *slots = 0, *bi;
+
+  /* Each backend's share of new flows */
+  vec_validate (slots, pool_len (sm->backends));
+  vec_foreach (bi, sm->maglev)
+    slots[bi[0]]++;
+
+  pool_foreach (be, sm->backends)
+    {
+      vlib_cli_output (vm, "[%d] %U mac %U, %u of %u table slots",
+                       be - sm->backends, format_ip4_address, &be->address,
+                       format_mac_address_t, &be->mac,
+                       slots[be - sm->backends], vec_len (sm->maglev));
+    }
+
+  vec_free (slots);
+  return 0;
+}
+
+/**
+ * @brief CLI command to show clb backends.
+ */
+VLIB_CLI_COMMAND (show_backends_command, static) = {
+    .path = "show clb backends",
+    .short_help = "show clb backends",
+    .function = show_backends_command_fn,
+};
+
+static int
+clb_show_flow (clib_bihash_kv_16_8_t * kv, void *arg)
+{
+  nfchain_flow_show_ctx_t *ctx = arg;
+
+  vlib_cli_output (ctx->vm, "[%d] %U backend %llu idle %us",
+                   ctx->thread_index, format_nfchain_flow_key, kv,
+                   clb_flow_backend (kv->value),
+                   nfchain_flow_idle (ctx->now, kv->value));
+
+  return --ctx->n_left ? BIHASH_WALK_CONTINUE : BIHASH_WALK_STOP;
+}
+
+static int
+clb_show_flow6 (clib_bihash_kv_40_8_t * kv, void *arg)
+{
+  nfchain_flow_show_ctx_t *ctx = arg;
+
+  vlib_cli_output (ctx->vm, "[%d] %U backend %llu idle %us",
+                   ctx->thread_index, format_nfchain_flow_key6, kv,
+                   clb_flow_backend (kv->value),
+                   nfchain_flow_idle (ctx->now, kv->value));
+
+  return --ctx->n_left ? BIHASH_WALK_CONTINUE : BIHASH_WALK_STOP;
+}
+
+static clib_error_t *
+show_clb_flows_command_fn (vlib_main_t * vm,
+                           unformat_input_t * input,
+                           vlib_cli_command_t * cmd)
+{
+  clb_main_t * sm = &clb_main;
+  nfchain_flow_show_ctx_t ctx = { .vm = vm, .n_left = 100 };
+  u32 bucket;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "max %u", &ctx.n_left))
+      ;
+    else
+      return clib_error_return (0, "unknown input `%U'",
+                                format_unformat_error, input);
+  }
+
+  ctx.now = nfchain_flow_now (vm);
+  for (ctx.thread_index = 0; ctx.thread_index < vec_len (sm->per_cpu) &&
+         ctx.n_left; ctx.thread_index++)
+    {
+      bucket = 0;
+      clib_bihash_foreach_key_value_pair_from_16_8
+        (&sm->per_cpu[ctx.thread_index].hash_table, &bucket, ~0,
+         clb_show_flow, &ctx);
+    }
+  for (ctx.thread_index = 0; ctx.thread_index < vec_len (sm->per_cpu) &&
+         ctx.n_left; ctx.thread_index++)
+    {
+      bucket = 0;
+      clib_bihash_foreach_key_value_pair_from_40_8
+        (&sm->per_cpu[ctx.thread_index].hash_table6, &bucket, ~0,
+         clb_show_flow6, &ctx);
+    }
+  return 0;
+}
+
+/**
+ * @brief CLI command to show the sticky flow table.
+ */
+VLIB_CLI_COMMAND (show_clb_flows_command, static) = {
+    .path = "show clb flows",
+    .short_help = "show clb flows [max <n>]",
+    .function = show_clb_flows_command_fn,
+};
+
 /**
  * @brief Plugin API message handler.
  */
@@ -137,6 +457,74 @@ static void vl_api_clb_macswap_enable_disable_t_handler
   REPLY_MACRO(VL_API_CLB_MACSWAP_ENABLE_DISABLE_REPLY);
 }
 
+static void vl_api_clb_backend_add_del_t_handler
+(vl_api_clb_backend_add_del_t * mp)
+{
+  vl_api_clb_backend_add_del_reply_t * rmp;
+  clb_main_t * sm = &clb_main;
+  ip4_address_t address;
+  mac_address_t mac;
+  int rv;
+
+  ip4_address_decode (mp->address, &address);
+  mac_address_decode (mp->mac, &mac);
+  rv = clb_backend_add_del (sm, &address, &mac, mp->is_add);
+
+  REPLY_MACRO(VL_API_CLB_BACKEND_ADD_DEL_REPLY);
+}
+
+static int
+clb_send_flow_details (clib_bihash_kv_16_8_t * kv, void *arg)
+{
+  nfchain_flow_dump_ctx_t *ctx = arg;
+  vl_api_clb_flow_details_t *mp;
+
+  mp = vl_msg_api_alloc (sizeof (*mp));
+  clib_memset (mp, 0, sizeof (*mp));
+  mp->_vl_msg_id = htons (VL_API_CLB_FLOW_DETAILS + ctx->msg_id_base);
+  mp->context = ctx->context;
+  mp->thread_index = htonl (ctx->thread_index);
+  nfchain_flow_details_address (kv, &mp->src_address, &mp->dst_address,
+                                &mp->src_port, &mp->dst_port);
+  mp->backend_index = htonl (clb_flow_backend (kv->value));
+  mp->idle = htonl (nfchain_flow_idle (ctx->now, kv->value));
+
+  vl_api_send_msg (ctx->rp, (u8 *) mp);
+  return BIHASH_WALK_CONTINUE;
+}
+
+static int
+clb_send_flow_details6 (clib_bihash_kv_40_8_t * kv, void *arg)
+{
+  nfchain_flow_dump_ctx_t *ctx = arg;
+  vl_api_clb_flow_details_t *mp;
+
+  mp = vl_msg_api_alloc (sizeof (*mp));
+  clib_memset (mp, 0, sizeof (*mp));
+  mp->_vl_msg_id = htons (VL_API_CLB_FLOW_DETAILS + ctx->msg_id_base);
+  mp->context = ctx->context;
+  mp->thread_index = htonl (ctx->thread_index);
+  nfchain_flow_details_address6 (kv, &mp->src_address, &mp->dst_address,
+                                 &mp->src_port, &mp->dst_port);
+  mp->backend_index = htonl (clb_flow_backend (kv->value));
+  mp->idle = htonl (nfchain_flow_idle (ctx->now, kv->value));
+
+  vl_api_send_msg (ctx->rp, (u8 *) mp);
+  return BIHASH_WALK_CONTINUE;
+}
+
+static void vl_api_clb_flow_get_t_handler
+(vl_api_clb_flow_get_t * mp)
+{
+  vl_api_clb_flow_get_reply_t * rmp;
+  clb_main_t * sm = &clb_main;
+  int rv = 0;
+
+  NFCHAIN_FLOW_DUMP46_MACRO (VL_API_CLB_FLOW_GET_REPLY, sm->per_cpu,
+                             clb_send_flow_details,
+                             clb_send_flow_details6);
+}
+
 /* API definitions */
 #include <clb/clb.api.c>
 
@@ -152,12 +540,16 @@ static uint32_t ipv4_hash_crc(const void *data,  uint32_t data_len, uint32_t ini
 static clib_error_t * clb_init (vlib_main_t * vm)
 {
   clb_main_t * sm = &clb_main;
+  uword memory_size;
+  u32 nbuckets;
 
   sm->vnet_main =  vnet_get_main ();
 
   /* Add our API messages to the global name_crc hash table */
   sm->msg_id_base = setup_message_id_table ();
 
+  sm->backend_by_address = hash_create (0, sizeof (uword));
+
   /* Create per CPU hash tables! */
   sm->per_cpu = 0;
   vlib_thread_main_t *tm = vlib_get_thread_main ();
@@ -172,10 +564,22 @@ static clib_error_t * clb_init (vlib_main_t * vm)
   hash_params.hash_func = ipv4_hash_crc;
 */
   
+  if (sm->flow_timeout == 0)
+    sm->flow_timeout = NFCHAIN_FLOW_DEFAULT_TIMEOUT;
+  if (sm->max_flows == 0)
+    sm->max_flows = NFCHAIN_FLOW_DEFAULT_MAX_FLOWS;
+  if (sm->prefetch_distance == 0)
+    sm->prefetch_distance = NFCHAIN_FLOW_PREFETCH_DISTANCE;
+  nfchain_flow_table_size (sm->max_flows, &nbuckets, &memory_size);
+
   for (int i=0; i < tm->n_vlib_mains; i++) {
     char* name = (char *) format(0, "clb_%d", i);
-    clib_bihash_init_16_8(&sm->per_cpu[i].hash_table, 
-                            name, 2097152, 1 << 30);
+    nfchain_flow_table_init (16_8, &sm->per_cpu[i].hash_table, name, i,
+                             nbuckets, memory_size, sm->log2_page_sz);
+    /* IPv6 entries are twice the size */
+    name = (char *) format(0, "clb6_%d", i);
+    nfchain_flow_table_init (40_8, &sm->per_cpu[i].hash_table6, name, i,
+                             nbuckets, 2 * memory_size, sm->log2_page_sz);
 //    hash_params.name = (char *) format(0, "clb_%d", i);
 //    sm->per_cpu[i].sticky_ht = rte_hash_create(&hash_params); 
   }
@@ -185,6 +589,47 @@ static clib_error_t * clb_init (vlib_main_t * vm)
 
 VLIB_INIT_FUNCTION (clb_init);
 
+/**
+ * @brief Startup config, e.g.
+ *   clb { flows 1000000 timeout 60 prefetch-distance 4 }
+ *
+ * Each thread's table is sized for flows concurrent flows, on the
+ * thread's NUMA node, on page-size pages (e.g. 2m) if set. Flows idle
+ * for timeout seconds are deleted.
+ * Flow table lookups are prefetched prefetch-distance packets ahead.
+ */
+static clib_error_t *
+clb_config (vlib_main_t * vm, unformat_input_t * input)
+{
+  clb_main_t * sm = &clb_main;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "flows %u", &sm->max_flows))
+      ;
+    else if (unformat (input, "page-size %U", unformat_log2_page_size,
+                       &sm->log2_page_sz))
+      ;
+    else if (unformat (input, "timeout %u", &sm->flow_timeout))
+      ;
+    else if (unformat (input, "prefetch-distance %u",
+                       &sm->prefetch_distance))
+      ;
+    else
+      return clib_error_return (0, "unknown input '%U'",
+                                format_unformat_error, input);
+  }
+
+  if (sm->flow_timeout > NFCHAIN_FLOW_TIME_MASK / 2)
+    return clib_error_return (0, "timeout %u too large", sm->flow_timeout);
+  if (sm->prefetch_distance > NFCHAIN_FLOW_PREFETCH_DISTANCE_MAX)
+    return clib_error_return (0, "prefetch-distance %u too large",
+                              sm->prefetch_distance);
+
+  return 0;
+}
+
+VLIB_EARLY_CONFIG_FUNCTION (clb_config, "clb");
+
 /**
  * @brief Hook the clb plugin into the VPP graph hierarchy.
  */
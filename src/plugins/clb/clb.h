@@ -18,20 +18,54 @@
 #include <vnet/vnet.h>
 #include <vnet/ip/ip.h>
 #include <vnet/ethernet/ethernet.h>
+#include <vnet/tcp/tcp_packet.h>
 
 #include <vppinfra/hash.h>
 #include <vppinfra/error.h>
 #include <vppinfra/elog.h>
 
 #include <vppinfra/bihash_16_8.h>
+#include <vppinfra/bihash_40_8.h>
+#include <nfchain/flow_age.h>
+#include <nfchain/chain.h>
+#include <nfchain/nf_stats.h>
+#include <nfchain/flow_pipeline.h>
+#include <nfchain/flow_ctx.h>
 
 typedef struct {
   /**
    * Each CPU has its own sticky flow hash table.
    * One single table is used for all VIPs.
+   * Values hold the flow's backend index, stamped for aging.
    */
   clib_bihash_16_8_t hash_table;
-} fc_per_cpu_t;
+
+  /* IPv6 flows, see nfchain_flow_ctx_key6 */
+  clib_bihash_40_8_t hash_table6;
+
+  /* Next buckets for the aging sweeps */
+  u32 sweep_cursor;
+  u32 sweep_cursor6;
+} clb_per_cpu_t;
+
+/* Maglev lookup table size, a prime well above the number of backends */
+#define CLB_MAGLEV_TABLE_SIZE 65537
+
+typedef struct {
+  ip4_address_t address;
+  mac_address_t mac;
+
+  /* Cleared on delete, sticky flows still pointing here pick again */
+  u8 is_active;
+
+  /* Set on add, tells flows of a deleted backend from its index reuse */
+  u16 generation;
+} clb_backend_t;
+
+/* Flow values hold the backend index in the low bits of the count, and
+ * its generation above, see flow_age.h */
+#define CLB_FLOW_BACKEND_BITS 24
+#define CLB_FLOW_BACKEND_MASK ((1 << CLB_FLOW_BACKEND_BITS) - 1)
 
 typedef struct {
     /* API message ID base */
@@ -40,8 +74,27 @@ typedef struct {
     /* convenience */
     vnet_main_t * vnet_main;
 
+    /* Idle flow timeout in seconds, table size in concurrent flows */
+    u32 flow_timeout;
+    u32 max_flows;
+
+    /* Flow table page size, 0 for default pages */
+    clib_mem_page_sz_t log2_page_sz;
+
+    /* Flow table prefetch distance in packets, see nfchain/flow_pipeline.h */
+    u32 prefetch_distance;
+
     /* Some global data is per-cpu */
-    fc_per_cpu_t *per_cpu;
+    clb_per_cpu_t *per_cpu;
+
+    /* Backend pool, and pool index by address */
+    clb_backend_t *backends;
+    uword *backend_by_address;
+    u32 n_active_backends;
+    u16 backend_generation;
+
+    /* Maglev table, CLB_MAGLEV_TABLE_SIZE backend indices */
+    u32 *maglev;
 
 } clb_main_t;
 
@@ -49,6 +102,212 @@ extern clb_main_t clb_main;
 
 extern vlib_node_registration_t clb_node;
 
+/* Next hops when on a runtime NF chain, see nfchain/chain.h */
+extern nfchain_hop_t clb_chain_hop;
+extern nfchain_nf_stats_t clb_nf_stats;
+
+int clb_backend_add_del (clb_main_t * sm, ip4_address_t * address,
+                         mac_address_t * mac, int is_add);
+
+#define foreach_clb_error \
+_(SWAPPED, "Mac swap packets processed") \
+_(NO_BACKEND, "Packets with no backend configured") \
+_(INSERTS, "Packets inserted") \
+_(EXPIRED, "Flows expired")
+
+typedef enum
+{
+#define _(sym,str) CLB_ERROR_##sym,
+  foreach_clb_error
+#undef _
+    CLB_N_ERROR,
+} clb_error_t;
+
+static_always_inline u32
+clb_flow_backend (u64 value)
+{
+  return nfchain_flow_count (value) & CLB_FLOW_BACKEND_MASK;
+}
+
+static_always_inline u16
+clb_flow_generation (u64 value)
+{
+  return nfchain_flow_count (value) >> CLB_FLOW_BACKEND_BITS;
+}
+
+/**
+ * @brief Pick the backend of a live flow entry, and stamp it with now.
+ * New flows, and flows whose backend was deleted, pick one from the
+ * Maglev table. A deleted backend's index may already be reused, the
+ * generation tells them apart.
+ */
+static_always_inline u32
+clb_flow_pick (clb_main_t * fcm, u64 * value, int is_new, u64 hash, u32 now)
+{
+  u32 bi = clb_flow_backend (*value);
+  clb_backend_t *be = &fcm->backends[bi];
+
+  if (is_new || PREDICT_FALSE (!be->is_active ||
+                               be->generation !=
+                               clb_flow_generation (*value)))
+    {
+      bi = fcm->maglev[hash % CLB_MAGLEV_TABLE_SIZE];
+      be = &fcm->backends[bi];
+    }
+  *value = nfchain_flow_stamp
+    (((u64) be->generation << CLB_FLOW_BACKEND_BITS) | bi, now);
+
+  return bi;
+}
+
+/**
+ * @brief Per-packet body of the clb node, shared with fused NF chains.
+ * Pins the flow to a backend in the calling thread's sticky table, new
+ * flows (and flows whose backend was deleted) pick one from the Maglev
+ * table. The entry is stamped with now, see flow_age.h.
+ * Returns 1 if the flow is new, backend_index is ~0 if there are no
+ * backends.
+ */
+static_always_inline int
+clb_flow_update (clb_main_t * fcm, u32 thread_index,
+                 clib_bihash_kv_16_8_t * key, u64 hash, u32 now,
+                 u32 * backend_index)
+{
+  clib_bihash_kv_16_8_t *kv;
+  int is_new;
+
+  if (PREDICT_FALSE (fcm->n_active_backends == 0))
+    {
+      *backend_index = ~0;
+      return 0;
+    }
+
+  /* Update in place, the pointer is only valid until the next add */
+  key->value = 0;
+  kv = clib_bihash_search_or_add_with_hash_16_8
+    (&fcm->per_cpu[thread_index].hash_table, hash, key, &is_new);
+  if (PREDICT_FALSE (kv == 0))
+    {
+      /* Table full, balance without stickiness */
+      *backend_index = fcm->maglev[hash % CLB_MAGLEV_TABLE_SIZE];
+      return 0;
+    }
+
+  *backend_index = clb_flow_pick (fcm, &kv->value, is_new, hash, now);
+  return is_new;
+}
+
+/**
+ * @brief clb_flow_update for a buffer, IPv4 or IPv6.
+ */
+static_always_inline int
+clb_flow_update_buffer (clb_main_t * fcm, u32 thread_index,
+                        vlib_buffer_t * b, clib_bihash_kv_16_8_t * key,
+                        u64 hash, u32 now, u32 * backend_index)
+{
+  clib_bihash_kv_40_8_t key6, *kv;
+  int is_new;
+
+  if (PREDICT_TRUE (vnet_buffer2 (b)->flow_ctx.ip_version != 6))
+    return clb_flow_update (fcm, thread_index, key, hash, now,
+                            backend_index);
+
+  if (PREDICT_FALSE (fcm->n_active_backends == 0))
+    {
+      *backend_index = ~0;
+      return 0;
+    }
+
+  nfchain_flow_ctx_key6 (b, &key6);
+  kv = clib_bihash_search_or_add_with_hash_40_8
+    (&fcm->per_cpu[thread_index].hash_table6, hash, &key6, &is_new);
+  if (PREDICT_FALSE (kv == 0))
+    {
+      *backend_index = fcm->maglev[hash % CLB_MAGLEV_TABLE_SIZE];
+      return 0;
+    }
+
+  *backend_index = clb_flow_pick (fcm, &kv->value, is_new, hash, now);
+  return is_new;
+}
+
+/**
+ * @brief Sweep a few buckets of the thread's tables for idle flows.
+ * Returns the number of flows deleted.
+ */
+static_always_inline u32
+clb_flow_age (clb_main_t * fcm, u32 thread_index, u32 now)
+{
+  clb_per_cpu_t *pc = &fcm->per_cpu[thread_index];
+  nfchain_flow_age_t age = { .now = now, .timeout = fcm->flow_timeout };
+
+  return clib_bihash_sweep_16_8 (&pc->hash_table, &pc->sweep_cursor,
+                                 NFCHAIN_FLOW_SWEEP_WORK,
+                                 nfchain_flow_is_stale, &age) +
+    clib_bihash_sweep_40_8 (&pc->hash_table6, &pc->sweep_cursor6,
+                            NFCHAIN_FLOW_SWEEP_WORK,
+                            nfchain_flow_is_stale6, &age);
+}
+
+/**
+ * @brief Steer a packet to its backend.
+ * The destination MAC becomes the backend's, sourced from the MAC the
+ * packet was sent to, and the IPv4 destination becomes the backend's
+ * address, with the IP and TCP/UDP checksums patched incrementally, and
+ * the flow context is invalidated for the nodes after us.
+ * Backends are IPv4, other packets are only steered at L2, for backends
+ * answering on the service address directly.
+ */
+static_always_inline void
+clb_rewrite (clb_main_t * fcm, vlib_buffer_t * b, u32 backend_index)
+{
+  vnet_buffer_opaque2_t *o = vnet_buffer2 (b);
+  clb_backend_t *be = &fcm->backends[backend_index];
+  ethernet_header_t *eth = vlib_buffer_get_current (b);
+  ip4_header_t *ip4 = (ip4_header_t *) (b->data + o->flow_ctx.l3_hdr_offset);
+  void *l4 = b->data + o->flow_ctx.l4_hdr_offset;
+  u32 old = ip4->dst_address.as_u32;
+  u16 *l4_checksum = 0;
+  int is_udp = 0;
+  ip_csum_t sum;
+
+  clib_memcpy_fast (eth->src_address, eth->dst_address, 6);
+  clib_memcpy_fast (eth->dst_address, be->mac.bytes, 6);
+
+  if (PREDICT_FALSE (o->flow_ctx.ip_version != 4))
+    return;
+
+  sum = ip_csum_update (ip4->checksum, old, be->address.as_u32,
+                        ip4_header_t, dst_address);
+  ip4->checksum = ip_csum_fold (sum);
+  ip4->dst_address = be->address;
+  /* The cached flow key holds the old destination */
+  b->flags &= ~VNET_BUFFER_F_FLOW_CTX_VALID;
+
+  /* The L4 checksums cover the destination through the pseudo header,
+   * non-first fragments have no L4 header */
+  if (ip4_get_fragment_offset (ip4))
+    ;
+  else if (o->flow_ctx.protocol == IP_PROTOCOL_TCP)
+    l4_checksum = &((tcp_header_t *) l4)->checksum;
+  else if (o->flow_ctx.protocol == IP_PROTOCOL_UDP &&
+           ((udp_header_t *) l4)->checksum)
+    {
+      l4_checksum = &((udp_header_t *) l4)->checksum;
+      is_udp = 1;
+    }
+
+  if (l4_checksum)
+    {
+      sum = ip_csum_update (*l4_checksum, old, be->address.as_u32,
+                            ip4_header_t, dst_address);
+      *l4_checksum = ip_csum_fold (sum);
+      /* 0 means no checksum for UDP */
+      if (is_udp && *l4_checksum == 0)
+        *l4_checksum = 0xffff;
+    }
+}
+
 #define CLB_PLUGIN_BUILD_VER "1.0"
 
 #endif /* __included_clb_h__ */
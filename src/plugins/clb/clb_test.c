@@ -22,6 +22,10 @@
 #include <vlibapi/api.h>
 #include <vlibmemory/api.h>
 #include <vppinfra/error.h>
+#include <vpp/api/types.h>
+#include <vnet/ip/ip.h>
+#include <vnet/ip/ip_types_api.h>
+#include <vnet/ethernet/ethernet_types_api.h>
 
 #define __plugin_msg_base clb_test_main.msg_id_base
 #include <vlibapi/vat_helper_macros.h>
@@ -29,6 +33,7 @@
 uword unformat_sw_if_index (unformat_input_t * input, va_list * args);
 
 /* Declare message IDs */
+#include <vnet/format_fns.h>
 #include <clb/clb.api_enum.h>
 #include <clb/clb.api_types.h>
 
@@ -78,6 +83,101 @@ static int api_clb_macswap_enable_disable (vat_main_t * vam)
     return ret;
 }
 
+static int api_clb_backend_add_del (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    vl_api_clb_backend_add_del_t * mp;
+    ip4_address_t address;
+    mac_address_t mac = ZERO_MAC_ADDRESS;
+    int have_address = 0;
+    int is_add = 1;
+    int ret;
+
+    /* Parse args required to build the message */
+    while (unformat_check_input (i) != UNFORMAT_END_OF_INPUT) {
+        if (unformat (i, "%U", unformat_ip4_address, &address))
+            have_address = 1;
+        else if (unformat (i, "mac %U", unformat_mac_address_t, &mac))
+            ;
+        else if (unformat (i, "del"))
+            is_add = 0;
+        else
+            break;
+    }
+
+    if (!have_address) {
+        errmsg ("missing backend address\n");
+        return -99;
+    }
+
+    /* Construct the API message */
+    M(CLB_BACKEND_ADD_DEL, mp);
+    ip4_address_encode (&address, mp->address);
+    mac_address_encode (&mac, mp->mac);
+    mp->is_add = is_add;
+
+    /* send it... */
+    S(mp);
+
+    /* Wait for a reply... */
+    W (ret);
+    return ret;
+}
+
+static int api_clb_flow_get (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    vl_api_clb_flow_get_t * mp;
+    u64 cursor = 0;
+    int ret;
+
+    /* Parse args required to build the message */
+    while (unformat_check_input (i) != UNFORMAT_END_OF_INPUT) {
+        if (unformat (i, "cursor %llu", &cursor))
+            ;
+        else
+            break;
+    }
+
+    /* Construct the API message */
+    M(CLB_FLOW_GET, mp);
+    mp->cursor = clib_host_to_net_u64 (cursor);
+
+    /* send it... */
+    S(mp);
+
+    /* Wait for a reply... */
+    W (ret);
+    return ret;
+}
+
+static __clib_unused void vl_api_clb_flow_details_t_handler
+(vl_api_clb_flow_details_t * mp)
+{
+    vat_main_t * vam = clb_test_main.vat_main;
+
+    fformat (vam->ofp, "[%d] %U:%d -> %U:%d backend %u idle %us\n",
+             ntohl (mp->thread_index),
+             format_vl_api_address, &mp->src_address, ntohs (mp->src_port),
+             format_vl_api_address, &mp->dst_address, ntohs (mp->dst_port),
+             ntohl (mp->backend_index), ntohl (mp->idle));
+}
+
+static void vl_api_clb_flow_get_reply_t_handler
+(vl_api_clb_flow_get_reply_t * mp)
+{
+    vat_main_t * vam = clb_test_main.vat_main;
+    i32 retval = ntohl (mp->retval);
+
+    if (retval == VNET_API_ERROR_EAGAIN) {
+        fformat (vam->ofp, "more to come, continue with cursor %llu\n",
+                 clib_net_to_host_u64 (mp->cursor));
+        retval = 0;
+    }
+    vam->retval = retval;
+    vam->result_ready = 1;
+}
+
 /*
  * List of messages that the api test plugin sends,
  * and that the data plane plugin processes
@@ -20,9 +20,11 @@
 #include <vnet/vnet.h>
 #include <vnet/plugin/plugin.h>
 #include <cpolicer/cpolicer.h>
+#include <vnet/ip/ip_types_api.h>
 
 #include <vlibapi/api.h>
 #include <vlibmemory/api.h>
+#include <vnet/format_fns.h>
 
 #include <cpolicer/cpolicer.api_enum.h>
 #include <cpolicer/cpolicer.api_types.h>
@@ -39,6 +41,8 @@ VLIB_PLUGIN_REGISTER () = {
 };
 
 cpolicer_main_t cpolicer_main;
+__clib_export nfchain_hop_t cpolicer_chain_hop;
+__clib_export nfchain_nf_stats_t cpolicer_nf_stats;
 
 /**
  * @brief Enable/disable the macswap plugin. 
@@ -123,6 +127,316 @@ VLIB_CLI_COMMAND (sr_content_command, static) = {
     .function = macswap_enable_disable_command_fn,
 };
 
+static int
+cpolicer_prefix_len_cmp (void *a1, void *a2)
+{
+  u8 *l1 = a1, *l2 = a2;
+
+  return (int) *l2 - (int) *l1;
+}
+
+/*
+ * Divide the template between the policing threads: each polices the
+ * share of a destination's traffic it receives at 1/n of the rates, with
+ * 1/n of the burst, from full buckets.
+ */
+static void
+cpolicer_binding_share (cpolicer_main_t * sm, cpolicer_binding_t * b)
+{
+  policer_t *s = &b->share;
+  u32 n = sm->n_shares;
+
+  *s = b->template;
+  s->cir_tokens_per_period = clib_max (s->cir_tokens_per_period / n, 1);
+  if (s->pir_tokens_per_period)
+    s->pir_tokens_per_period = clib_max (s->pir_tokens_per_period / n, 1);
+  s->current_limit /= n;
+  s->extended_limit /= n;
+  s->current_bucket = s->current_limit;
+  s->extended_bucket = s->extended_limit;
+}
+
+/**
+ * @brief Bind a vnet policer, by name, to a destination prefix, or unbind
+ * the prefix.
+ *
+ * Each destination under the prefix gets its own token buckets on each
+ * worker, made from a copy of the policer taken now: later changes to the
+ * vnet policer need a new bind. Each of the n workers polices at 1/n of
+ * the policer's rates and burst, so the rates hold for a destination
+ * whose traffic is spread evenly over the workers, as by RSS, and are
+ * lower for one served by fewer. Destinations under a changed binding
+ * start over with full buckets. Only IPv4 packets are policed.
+ */
+int cpolicer_bind (cpolicer_main_t * sm, ip4_address_t * prefix, u8 len,
+                   u8 * policer_name, int is_add)
+{
+  vnet_policer_main_t * pm = &vnet_policer_main;
+  vlib_main_t * vm = vlib_get_main ();
+  cpolicer_binding_t * b;
+  ip4_address_t masked;
+  uword * p, * pi = 0;
+  u64 key;
+
+  if (len > 32)
+    return VNET_API_ERROR_INVALID_VALUE;
+
+  masked.as_u32 = prefix->as_u32 & ip4_main.fib_masks[len];
+  key = ((u64) masked.as_u32 << 8) | len;
+  p = hash_get (sm->binding_by_prefix, key);
+
+  if (is_add)
+    {
+      pi = hash_get_mem (pm->policer_index_by_name, policer_name);
+      if (pi == 0)
+        return VNET_API_ERROR_NO_SUCH_ENTRY;
+    }
+  else if (p == 0)
+    return VNET_API_ERROR_NO_SUCH_ENTRY;
+
+  vlib_worker_thread_barrier_sync (vm);
+
+  sm->epoch++;
+  if (is_add)
+    {
+      if (p)
+        b = pool_elt_at_index (sm->bindings, p[0]);
+      else
+        {
+          pool_get_aligned_zero (sm->bindings, b, CLIB_CACHE_LINE_BYTES);
+          hash_set (sm->binding_by_prefix, key, b - sm->bindings);
+        }
+      b->template = pm->policers[pi[0]];
+      b->template.name = 0;
+      cpolicer_binding_share (sm, b);
+      vec_free (b->policer_name);
+      b->policer_name = format (0, "%s%c", policer_name, 0);
+      b->prefix = masked;
+      b->len = len;
+      b->policer_index = pi[0];
+      b->epoch = sm->epoch;
+    }
+  else
+    {
+      vec_free (sm->bindings[p[0]].policer_name);
+      pool_put_index (sm->bindings, p[0]);
+      hash_unset (sm->binding_by_prefix, key);
+    }
+
+  /* Rebuild the lengths probed by cpolicer_classify */
+  vec_reset_length (sm->prefix_lens);
+  pool_foreach (b, sm->bindings)
+    if (vec_search (sm->prefix_lens, b->len) == ~0)
+      vec_add1 (sm->prefix_lens, b->len);
+  vec_sort_with_function (sm->prefix_lens, cpolicer_prefix_len_cmp);
+
+  vlib_worker_thread_barrier_release (vm);
+
+  return 0;
+}
+
+static clib_error_t *
+bind_command_fn (vlib_main_t * vm,
+                 unformat_input_t * input,
+                 vlib_cli_command_t * cmd)
+{
+  cpolicer_main_t * sm = &cpolicer_main;
+  ip4_address_t prefix;
+  u32 len = ~0;
+  u8 * name = 0;
+  int is_add = 1;
+  int rv;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "%U/%d", unformat_ip4_address, &prefix, &len))
+      ;
+    else if (unformat (input, "policer %s", &name))
+      ;
+    else if (unformat (input, "del"))
+      is_add = 0;
+    else
+      {
+        vec_free (name);
+        return clib_error_return (0, "unknown input `%U'",
+                                  format_unformat_error, input);
+      }
+  }
+
+  if (len == ~0)
+    return clib_error_return (0, "Please specify a prefix...");
+  if (is_add && name == 0)
+    return clib_error_return (0, "Please specify a policer...");
+
+  /* Policer names are hashed with their NUL */
+  vec_add1 (name, 0);
+  rv = cpolicer_bind (sm, &prefix, len, name, is_add);
+  vec_free (name);
+
+  switch(rv) {
+  case 0:
+    break;
+
+  case VNET_API_ERROR_INVALID_VALUE:
+    return clib_error_return (0, "Invalid prefix length %d", len);
+
+  case VNET_API_ERROR_NO_SUCH_ENTRY:
+    return clib_error_return (0, is_add ? "No such policer" :
+                              "No such binding");
+
+  default:
+    return clib_error_return (0, "cpolicer_bind returned %d", rv);
+  }
+  return 0;
+}
+
+/**
+ * @brief CLI command to bind policers to destination prefixes.
+ * Each worker polices its share of a destination's packets at 1/n of the
+ * policer's rates and burst, n the number of workers, see cpolicer_bind.
+ */
+VLIB_CLI_COMMAND (bind_command, static) = {
+    .path = "cpolicer bind",
+    .short_help =
+    "cpolicer bind <ip4-prefix> policer <name> | cpolicer bind <ip4-prefix> del",
+    .function = bind_command_fn,
+};
+
+static clib_error_t *
+show_bindings_command_fn (vlib_main_t * vm,
+                          unformat_input_t * input,
+                          vlib_cli_command_t * cmd)
+{
+  cpolicer_main_t * sm = &cpolicer_main;
+  cpolicer_binding_t * b;
+
+  pool_foreach (b, sm->bindings)
+    {
+      vlib_cli_output (vm, "[%d] %U/%d policer %s (index %d)",
+                       b - sm->bindings, format_ip4_address, &b->prefix,
+                       b->len, b->policer_name, b->policer_index);
+      vlib_cli_output (vm, "  %s rate, cir %u pir %u tok/period, "
+                       "cur lim %u ext lim %u",
+                       b->template.single_rate ? "single" : "dual",
+                       b->template.cir_tokens_per_period,
+                       b->template.pir_tokens_per_period,
+                       b->template.current_limit, b->template.extended_limit);
+      vlib_cli_output (vm, "  per thread (1/%u), cir %u pir %u tok/period, "
+                       "cur lim %u ext lim %u", sm->n_shares,
+                       b->share.cir_tokens_per_period,
+                       b->share.pir_tokens_per_period,
+                       b->share.current_limit, b->share.extended_limit);
+    }
+  return 0;
+}
+
+/**
+ * @brief CLI command to show the policer bindings.
+ */
+VLIB_CLI_COMMAND (show_bindings_command, static) = {
+    .path = "show cpolicer bindings",
+    .short_help = "show cpolicer bindings",
+    .function = show_bindings_command_fn,
+};
+
+/**
+ * @brief Sum the per-thread replicas for a single destination address.
+ */
+u64 cpolicer_get_count (cpolicer_main_t * sm, ip4_address_t * dst)
+{
+  clib_bihash_kv_16_8_t kv, value;
+  fc_per_cpu_t * pc;
+  u64 count = 0;
+
+  kv.key[0] = ((u64) dst->as_u32);
+  kv.key[1] = 0;
+
+  /* Workers grow their state pools */
+  vlib_worker_thread_barrier_sync (vlib_get_main ());
+  vec_foreach (pc, sm->per_cpu)
+    if (clib_bihash_search_16_8 (&pc->hash_table, &kv, &value) == 0)
+      count += pc->dsts[nfchain_flow_count (value.value)].packets;
+  vlib_worker_thread_barrier_release (vlib_get_main ());
+
+  return count;
+}
+
+typedef struct {
+  fc_per_cpu_t *pc;
+  uword *index_by_key;
+  u64 *keys;
+  u64 *counts;
+} cpolicer_merge_ctx_t;
+
+static int
+cpolicer_merge_kvp (clib_bihash_kv_16_8_t * kv, void *arg)
+{
+  cpolicer_merge_ctx_t *ctx = arg;
+  u64 packets = ctx->pc->dsts[nfchain_flow_count (kv->value)].packets;
+  uword *p;
+
+  p = hash_get (ctx->index_by_key, kv->key[0]);
+  if (p)
+    ctx->counts[p[0]] += packets;
+  else
+    {
+      hash_set (ctx->index_by_key, kv->key[0], vec_len (ctx->keys));
+      vec_add1 (ctx->keys, kv->key[0]);
+      vec_add1 (ctx->counts, packets);
+    }
+  return BIHASH_WALK_CONTINUE;
+}
+
+static clib_error_t *
+show_cpolicer_command_fn (vlib_main_t * vm,
+                           unformat_input_t * input,
+                           vlib_cli_command_t * cmd)
+{
+  cpolicer_main_t * sm = &cpolicer_main;
+  cpolicer_merge_ctx_t ctx = { 0 };
+  ip4_address_t addr;
+  int i;
+
+  if (unformat (input, "%U", unformat_ip4_address, &addr))
+    {
+      vlib_cli_output (vm, "%U: %llu", format_ip4_address, &addr,
+                       cpolicer_get_count (sm, &addr));
+      return 0;
+    }
+
+  /* Merge the per-thread replicas into a single view */
+  ctx.index_by_key = hash_create (0, sizeof (uword));
+  vlib_worker_thread_barrier_sync (vm);
+  for (i = 0; i < vec_len (sm->per_cpu); i++)
+    {
+      ctx.pc = &sm->per_cpu[i];
+      clib_bihash_foreach_key_value_pair_16_8 (&ctx.pc->hash_table,
+                                               cpolicer_merge_kvp, &ctx);
+    }
+  vlib_worker_thread_barrier_release (vm);
+
+  vlib_cli_output (vm, "%d destinations", vec_len (ctx.keys));
+  for (i = 0; i < vec_len (ctx.keys); i++)
+    {
+      addr.as_u32 = (u32) (ctx.keys[i]);
+      vlib_cli_output (vm, "  %U: %llu", format_ip4_address, &addr,
+                       ctx.counts[i]);
+    }
+
+  hash_free (ctx.index_by_key);
+  vec_free (ctx.keys);
+  vec_free (ctx.counts);
+  return 0;
+}
+
+/**
+ * @brief CLI command to show the merged per-destination counters.
+ */
+VLIB_CLI_COMMAND (show_cpolicer_command, static) = {
+    .path = "show cpolicer",
+    .short_help = "show cpolicer [<ip4-address>]",
+    .function = show_cpolicer_command_fn,
+};
+
 /**
  * @brief Plugin API message handler.
  */
@@ -139,6 +453,26 @@ static void vl_api_cpolicer_macswap_enable_disable_t_handler
   REPLY_MACRO(VL_API_CPOLICER_MACSWAP_ENABLE_DISABLE_REPLY);
 }
 
+static void vl_api_cpolicer_bind_t_handler
+(vl_api_cpolicer_bind_t * mp)
+{
+  vl_api_cpolicer_bind_reply_t * rmp;
+  cpolicer_main_t * sm = &cpolicer_main;
+  ip4_address_t prefix;
+  u8 * name;
+  int rv;
+
+  ip4_address_decode (mp->prefix.address, &prefix);
+  name = 0;
+  vec_add (name, mp->policer_name,
+           strnlen ((char *) mp->policer_name, sizeof (mp->policer_name)));
+  vec_add1 (name, 0);
+  rv = cpolicer_bind (sm, &prefix, mp->prefix.len, name, mp->is_add);
+  vec_free (name);
+
+  REPLY_MACRO(VL_API_CPOLICER_BIND_REPLY);
+}
+
 /* API definitions */
 #include <cpolicer/cpolicer.api.c>
 
@@ -154,6 +488,8 @@ static uint32_t ipv4_hash_crc(const void *data,  uint32_t data_len, uint32_t ini
 static clib_error_t * cpolicer_init (vlib_main_t * vm)
 {
   cpolicer_main_t * sm = &cpolicer_main;
+  uword memory_size;
+  u32 nbuckets;
 
   sm->vnet_main =  vnet_get_main ();
 
@@ -164,11 +500,29 @@ static clib_error_t * cpolicer_init (vlib_main_t * vm)
   sm->per_cpu = 0;
   vlib_thread_main_t *tm = vlib_get_thread_main ();
   vec_validate(sm->per_cpu, tm->n_vlib_mains - 1);
+
+  /* The workers police, or the main thread when there are none */
+  sm->n_shares = clib_max (tm->n_vlib_mains - 1, 1);
   
-  int i = 0;
-  char* name = (char *) format(0, "cpolicer_%d", i);
-  clib_bihash_init_16_8(&sm->per_cpu[i].hash_table, 
-                            name, 4194304, 1 << 30);
+  /*
+   * One replica per thread, so workers never contend on bucket locks.
+   * Each is sized for max_flows concurrent flows, idle ones are aged out.
+   */
+  if (sm->flow_timeout == 0)
+    sm->flow_timeout = NFCHAIN_FLOW_DEFAULT_TIMEOUT;
+  if (sm->max_flows == 0)
+    sm->max_flows = NFCHAIN_FLOW_DEFAULT_MAX_FLOWS;
+  if (sm->prefetch_distance == 0)
+    sm->prefetch_distance = NFCHAIN_FLOW_PREFETCH_DISTANCE;
+  nfchain_flow_table_size (sm->max_flows, &nbuckets, &memory_size);
+
+  for (int i=0; i < tm->n_vlib_mains; i++) {
+    char* name = (char *) format(0, "cpolicer_%d", i);
+    nfchain_flow_table_init (16_8, &sm->per_cpu[i].hash_table, name, i,
+                             nbuckets, memory_size, sm->log2_page_sz);
+  }
+
+  sm->binding_by_prefix = hash_create (0, sizeof (uword));
 
   clib_spinlock_init (&sm->writer_lock);
   return 0;
@@ -176,6 +530,47 @@ static clib_error_t * cpolicer_init (vlib_main_t * vm)
 
 VLIB_INIT_FUNCTION (cpolicer_init);
 
+/**
+ * @brief Startup config, e.g.
+ *   cpolicer { flows 1000000 timeout 60 prefetch-distance 4 }
+ *
+ * Each thread's table is sized for flows concurrent flows, on the
+ * thread's NUMA node, on page-size pages (e.g. 2m) if set. Flows idle
+ * for timeout seconds are deleted.
+ * Flow table lookups are prefetched prefetch-distance packets ahead.
+ */
+static clib_error_t *
+cpolicer_config (vlib_main_t * vm, unformat_input_t * input)
+{
+  cpolicer_main_t * sm = &cpolicer_main;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "flows %u", &sm->max_flows))
+      ;
+    else if (unformat (input, "page-size %U", unformat_log2_page_size,
+                       &sm->log2_page_sz))
+      ;
+    else if (unformat (input, "timeout %u", &sm->flow_timeout))
+      ;
+    else if (unformat (input, "prefetch-distance %u",
+                       &sm->prefetch_distance))
+      ;
+    else
+      return clib_error_return (0, "unknown input '%U'",
+                                format_unformat_error, input);
+  }
+
+  if (sm->flow_timeout > NFCHAIN_FLOW_TIME_MASK / 2)
+    return clib_error_return (0, "timeout %u too large", sm->flow_timeout);
+  if (sm->prefetch_distance > NFCHAIN_FLOW_PREFETCH_DISTANCE_MAX)
+    return clib_error_return (0, "prefetch-distance %u too large",
+                              sm->prefetch_distance);
+
+  return 0;
+}
+
+VLIB_EARLY_CONFIG_FUNCTION (cpolicer_config, "cpolicer");
+
 /**
  * @brief Hook the cpolicer plugin into the VPP graph hierarchy.
  */
@@ -24,15 +24,66 @@
 #include <vppinfra/elog.h>
 
 #include <vppinfra/bihash_16_8.h>
+#include <vnet/policer/policer.h>
+#include <nfchain/flow_age.h>
+#include <nfchain/chain.h>
+#include <nfchain/nf_stats.h>
+#include <nfchain/flow_pipeline.h>
+
+/*
+ * A destination's state, next to its token buckets. The binding is
+ * looked up again when the bindings change (epoch), and the buckets
+ * reset from the template when the binding is not the one they were
+ * made from (binding_index, binding_epoch).
+ */
+typedef struct {
+  u64 packets;
+  u32 binding_index;
+  u32 binding_epoch;
+  u32 epoch;
+} cpolicer_dst_t;
 
 typedef struct {
   /**
-   * Each CPU has its own sticky flow hash table.
-   * One single table is used for all VIPs.
+   * Each CPU has its own replica of the per-destination table.
+   * Workers only ever touch their own replica, the control plane
+   * sums the replicas when it needs a global view. Values hold the
+   * index of the destination's state in policers and dsts.
    */
   clib_bihash_16_8_t hash_table;
+
+  /* Next bucket for the aging sweep */
+  u32 sweep_cursor;
+
+  /*
+   * Per destination srTCM / trTCM token buckets and state, parallel
+   * pools. Each worker polices its own share of a destination's
+   * traffic, at its share of the bound rate, so buckets are never
+   * shared or locked.
+   */
+  policer_t *policers;
+  cpolicer_dst_t *dsts;
 } fc_per_cpu_t;
 
+/* A policer template bound to a destination prefix */
+typedef struct {
+  policer_t template;
+
+  /* The template's rates and burst limits divided between the threads
+     policing, the buckets each thread starts its destinations from */
+  policer_t share;
+
+  ip4_address_t prefix;
+  u8 len;
+
+  /* vnet policer the template was copied from, and when */
+  u8 *policer_name;
+  u32 policer_index;
+  u32 epoch;
+} cpolicer_binding_t;
+
+#define CPOLICER_BINDING_NONE ((u32) ~0)
+
 typedef struct {
     /* API message ID base */
     u16 msg_id_base;
@@ -40,9 +91,32 @@ typedef struct {
     /* convenience */
     vnet_main_t * vnet_main;
 
+    /* Idle flow timeout in seconds, table size in concurrent flows */
+    u32 flow_timeout;
+    u32 max_flows;
+
+    /* Flow table page size, 0 for default pages */
+    clib_mem_page_sz_t log2_page_sz;
+
+    /* Flow table prefetch distance in packets, see nfchain/flow_pipeline.h */
+    u32 prefetch_distance;
+
     /* Some global data is per-cpu */
     fc_per_cpu_t *per_cpu;
 
+    /* Bindings, and their index by (prefix << 8 | len) */
+    cpolicer_binding_t *bindings;
+    uword *binding_by_prefix;
+
+    /* Bound prefix lengths, longest first */
+    u8 *prefix_lens;
+
+    /* Bumped on every binding change */
+    u32 epoch;
+
+    /* Threads policing, each at 1/n_shares of the bound rates */
+    u32 n_shares;
+
     clib_spinlock_t writer_lock;
 
 } cpolicer_main_t;
@@ -51,6 +125,34 @@ extern cpolicer_main_t cpolicer_main;
 
 extern vlib_node_registration_t cpolicer_node;
 
+/* Next hops when on a runtime NF chain, see nfchain/chain.h */
+extern nfchain_hop_t cpolicer_chain_hop;
+extern nfchain_nf_stats_t cpolicer_nf_stats;
+
+u64 cpolicer_get_count (cpolicer_main_t * cm, ip4_address_t * dst);
+int cpolicer_bind (cpolicer_main_t * cm, ip4_address_t * prefix, u8 len,
+                   u8 * policer_name, int is_add);
+
+/**
+ * @brief Binding of the longest bound prefix holding dst, in network
+ * order, CPOLICER_BINDING_NONE if none.
+ */
+static_always_inline u32
+cpolicer_classify (cpolicer_main_t * cm, u32 dst)
+{
+  uword *p;
+  u8 *len;
+
+  vec_foreach (len, cm->prefix_lens)
+    {
+      u64 key = ((u64) (dst & ip4_main.fib_masks[*len]) << 8) | *len;
+      p = hash_get (cm->binding_by_prefix, key);
+      if (p)
+        return p[0];
+    }
+  return CPOLICER_BINDING_NONE;
+}
+
 #define CPOLICER_PLUGIN_BUILD_VER "1.0"
 
 #endif /* __included_cpolicer_h__ */
@@ -22,6 +22,8 @@
 #include <vlibapi/api.h>
 #include <vlibmemory/api.h>
 #include <vppinfra/error.h>
+#include <vnet/ip/ip.h>
+#include <vnet/ip/ip_types_api.h>
 
 #define __plugin_msg_base cpolicer_test_main.msg_id_base
 #include <vlibapi/vat_helper_macros.h>
@@ -29,6 +31,7 @@
 uword unformat_sw_if_index (unformat_input_t * input, va_list * args);
 
 /* Declare message IDs */
+#include <vnet/format_fns.h>
 #include <cpolicer/cpolicer.api_enum.h>
 #include <cpolicer/cpolicer.api_types.h>
 
@@ -78,6 +81,58 @@ static int api_cpolicer_macswap_enable_disable (vat_main_t * vam)
     return ret;
 }
 
+static int api_cpolicer_bind (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    vl_api_cpolicer_bind_t * mp;
+    ip4_address_t prefix;
+    u32 len = ~0;
+    u8 * name = 0;
+    int is_add = 1;
+    int ret;
+
+    /* Parse args required to build the message */
+    while (unformat_check_input (i) != UNFORMAT_END_OF_INPUT) {
+        if (unformat (i, "%U/%d", unformat_ip4_address, &prefix, &len))
+            ;
+        else if (unformat (i, "policer %s", &name))
+            ;
+        else if (unformat (i, "del"))
+            is_add = 0;
+        else
+            break;
+    }
+
+    if (len == ~0) {
+        errmsg ("missing prefix\n");
+        return -99;
+    }
+    if (is_add && name == 0) {
+        errmsg ("missing policer name\n");
+        return -99;
+    }
+    if (vec_len (name) >= sizeof (mp->policer_name)) {
+        errmsg ("policer name too long\n");
+        vec_free (name);
+        return -99;
+    }
+
+    /* Construct the API message */
+    M(CPOLICER_BIND, mp);
+    clib_memcpy (mp->prefix.address, &prefix, sizeof (prefix));
+    mp->prefix.len = len;
+    clib_memcpy (mp->policer_name, name, vec_len (name));
+    mp->is_add = is_add;
+    vec_free (name);
+
+    /* send it... */
+    S(mp);
+
+    /* Wait for a reply... */
+    W (ret);
+    return ret;
+}
+
 /*
  * List of messages that the api test plugin sends,
  * and that the data plane plugin processes
@@ -18,6 +18,9 @@
 #include <vnet/ethernet/ethernet.h>
 #include <vppinfra/error.h>
 #include <cpolicer/cpolicer.h>
+#include <vnet/policer/police_inlines.h>
+#include <nfchain/flow_ctx.h>
+#include <nfchain/flow_pipeline.h>
 
 typedef struct
 {
@@ -29,6 +32,8 @@ typedef struct
   ip4_address_t dst_ip;
   u16 src_port;
   u16 dst_port;
+  u32 binding_index;
+  u8 color;
 } cpolicer_trace_t;
 
 
@@ -49,6 +54,8 @@ format_cpolicer_trace (u8 * s, va_list * args)
 	      format_ip4_address, &t->src_ip,
 	      format_ip4_address, &t->dst_ip);
   s = format (s, "  src port %d -> dst port %d", t->src_port, t->dst_port);
+  if (t->binding_index != CPOLICER_BINDING_NONE)
+    s = format (s, "\n  binding %d color %d", t->binding_index, t->color);
 
   return s;
 }
@@ -57,7 +64,12 @@ extern vlib_node_registration_t cpolicer_node;
 
 #define foreach_cpolicer_error \
 _(SWAPPED, "Mac swap packets processed") \
-_(INSERTS, "Packets inserted")
+_(INSERTS, "Packets inserted") \
+_(EXPIRED, "Flows expired") \
+_(EXCEED, "Packets exceeding the committed rate") \
+_(VIOLATE, "Packets violating the peak rate or burst") \
+_(DROPPED, "Packets dropped by policer") \
+_(NOT_IP4, "Non-IPv4 packets, not policed")
 
 typedef enum
 {
@@ -76,269 +88,283 @@ static char *cpolicer_error_strings[] = {
 typedef enum
 {
   POLICER_NEXT_INTERFACE_OUTPUT,
+  POLICER_NEXT_DROP,
   POLICER_N_NEXT,
 } cpolicer_next_t;
 
 
 static_always_inline clib_bihash_kv_16_8_t
-get_hash_key(ip4_header_t *ip4){
+get_hash_key(vnet_buffer_opaque2_t *o){
 	clib_bihash_kv_16_8_t key;
 
-	key.key[0] = (u64)(ip4->dst_address.as_u32);
+	/* dst address, low half of the 5-tuple key, IPv4 only */
+	key.key[0] = (u32) o->flow_ctx.key[0];
 	key.key[1] = 0;
 
 	return key;
 }
 
-static_always_inline void hash_callback(clib_bihash_kv_16_8_t *key, void *arg){
-	clib_bihash_kv_16_8_t *my_kv = (clib_bihash_kv_16_8_t *)arg;
-	u64 maxValue = 0x7FFFFFFFFFFFFFFF;
-	if (my_kv->value >= maxValue){
-		my_kv->value = 0;
-	}
-
-	my_kv->value = key->value + 1;
-}
-
+typedef struct
+{
+  cpolicer_main_t *sm;
+  fc_per_cpu_t *pc;
+  u32 thread_index;
+  u32 now;
+  u32 n_inserted;
+  u32 n_not_ip4;
+
+  /* Policer time, see vnet/policer/police.h */
+  u64 time;
+  u32 n_results[NUM_POLICE_RESULTS];
+} cpolicer_frame_ctx_t;
 
+typedef struct
+{
+  nfchain_flow_age_t age;
+  fc_per_cpu_t *pc;
+} cpolicer_age_t;
 
 /*
- * Simple dual/single loop version, default version which will compile
- * everywhere.
- *
- * Node costs 30 clocks/pkt at a vector size of 51
+ * Aging sweep callback. Swept entries are always deleted, so their
+ * destination state is freed here.
  */
+static int
+cpolicer_flow_is_stale (clib_bihash_kv_16_8_t * kv, void *arg)
+{
+  cpolicer_age_t *a = arg;
 
-#define VERSION_1 1
-#ifdef VERSION_1
-#define foreach_mac_address_offset              \
-_(0)                                            \
-_(1)                                            \
-_(2)                                            \
-_(3)                                            \
-_(4)                                            \
-_(5)
+  if (!nfchain_flow_is_stale (kv, &a->age))
+    return 0;
+  pool_put_index (a->pc->policers, nfchain_flow_count (kv->value));
+  return 1;
+}
 
-VLIB_NODE_FN (cpolicer_node) (vlib_main_t * vm, vlib_node_runtime_t * node,
-			    vlib_frame_t * frame)
+static_always_inline u32
+cpolicer_dst_alloc (cpolicer_main_t * cm, fc_per_cpu_t * pc)
 {
-  u32 n_left_from, *from, *to_next;
-  cpolicer_next_t next_index;
-  u32 thread_index = 0;
-  clib_bihash_16_8_t hash_table = cpolicer_main.per_cpu[thread_index].hash_table;
-
-  u32 pkts_swapped = 0;
-  u32 pkts_inserted = 0;
+  policer_t *pol;
+  cpolicer_dst_t *d;
+  u32 index;
+
+  pool_get_aligned (pc->policers, pol, CLIB_CACHE_LINE_BYTES);
+  index = pol - pc->policers;
+  vec_validate (pc->dsts, index);
+
+  d = pc->dsts + index;
+  d->packets = 0;
+  d->binding_index = CPOLICER_BINDING_NONE;
+  /* Any other epoch forces a lookup */
+  d->epoch = ~cm->epoch;
+  return index;
+}
 
-  from = vlib_frame_vector_args (frame);
-  n_left_from = frame->n_vectors;
-  next_index = node->cached_next_index;
+/*
+ * Token buckets of destination index, 0 if no template is bound to it.
+ * The buckets start full, from the template, when the destination is
+ * first seen or moves to another binding.
+ */
+static_always_inline policer_t *
+cpolicer_dst_policer (cpolicer_main_t * cm, fc_per_cpu_t * pc, u32 index,
+		      u32 dst, u64 time)
+{
+  cpolicer_dst_t *d = pc->dsts + index;
+  cpolicer_binding_t *binding;
+  u32 binding_index;
 
-  while (n_left_from > 0)
+  if (PREDICT_FALSE (d->epoch != cm->epoch))
     {
-      u32 n_left_to_next;
+      binding_index = cpolicer_classify (cm, dst);
+      binding = binding_index == CPOLICER_BINDING_NONE ? 0 :
+	cm->bindings + binding_index;
+      if (binding_index != d->binding_index ||
+	  (binding && binding->epoch != d->binding_epoch))
+	{
+	  d->binding_index = binding_index;
+	  if (binding)
+	    {
+	      pc->policers[index] = binding->share;
+	      pc->policers[index].last_update_time = time;
+	      d->binding_epoch = binding->epoch;
+	    }
+	}
+      d->epoch = cm->epoch;
+    }
 
-      vlib_get_next_frame (vm, node, next_index, to_next, n_left_to_next);
-
-	  clib_bihash_kv_16_8_t key0, key1, key2, key3, key4, key5;
-	  u64 hash2, hash3, hash4, hash5;
+  if (d->binding_index == CPOLICER_BINDING_NONE)
+    return 0;
+  return pc->policers + index;
+}
 
+/*
+ * Rewrite the DSCP of an IPv4 or IPv6 packet, after up to two VLAN tags.
+ */
+static_always_inline void
+cpolicer_mark (vlib_buffer_t * b, ip_dscp_t dscp)
+{
+  ip4_header_t *ip4;
+  ip6_header_t *ip6;
+  i16 l3_hdr_offset;
+  u16 type;
 
-	  if (n_left_from >= 8 && n_left_to_next >= 2) {
-		vlib_buffer_t *p0, *p1, *p2, *p3;
-		ethernet_header_t *en0, *en1, *en2, *en3;
+  type = nfchain_flow_ethertype (b, &l3_hdr_offset);
+  if (type == clib_host_to_net_u16 (ETHERNET_TYPE_IP4))
+    {
+      ip4 = (ip4_header_t *) (b->data + l3_hdr_offset);
+      ip4->tos = (ip4->tos & IP4_NON_DSCP_BITS) | (dscp << IP4_DSCP_SHIFT);
+      ip4->checksum = ip4_header_checksum (ip4);
+    }
+  else if (type == clib_host_to_net_u16 (ETHERNET_TYPE_IP6))
+    {
+      ip6 = (ip6_header_t *) (b->data + l3_hdr_offset);
+      ip6->ip_version_traffic_class_and_flow_label &=
+	clib_host_to_net_u32 (IP6_NON_DSCP_BITS);
+      ip6->ip_version_traffic_class_and_flow_label |=
+	clib_host_to_net_u32 (dscp << IP6_DSCP_SHIFT);
+    }
+}
 
-		p0 = vlib_get_buffer (vm, from[0]);
-		p1 = vlib_get_buffer (vm, from[1]);
-		p2 = vlib_get_buffer (vm, from[2]);
-		p3 = vlib_get_buffer (vm, from[3]);
+static_always_inline u64
+cpolicer_key (vlib_buffer_t * b, clib_bihash_kv_16_8_t * key, void *aux)
+{
+  *key = get_hash_key (vnet_buffer2 (b));
+  return clib_bihash_hash_16_8 (key);
+}
 
-		en0 = vlib_buffer_get_current (p0);
-		en1 = vlib_buffer_get_current (p1);
-		en2 = vlib_buffer_get_current (p2);
-		en3 = vlib_buffer_get_current (p3);
+static_always_inline u16
+cpolicer_update (vlib_main_t * vm, vlib_node_runtime_t * node,
+                 vlib_buffer_t * b, clib_bihash_kv_16_8_t * key, u64 hash,
+                 void *aux, void *arg)
+{
+  cpolicer_frame_ctx_t *ctx = arg;
+  u32 sw_if_index = vnet_buffer (b)->sw_if_index[VLIB_RX];
+  u32 binding_index = CPOLICER_BINDING_NONE;
+  policer_result_e color = POLICE_CONFORM;
+  clib_bihash_kv_16_8_t *kv;
+  policer_t *pol;
+  u32 index;
+  int is_new;
+  u16 next;
+
+  /* Send pkt back out the RX interface, via the rest of its chain */
+  vnet_buffer (b)->sw_if_index[VLIB_TX] = sw_if_index;
+  next = nfchain_hop_next (&cpolicer_chain_hop, sw_if_index,
+			   POLICER_NEXT_INTERFACE_OUTPUT);
+
+  /* Bindings are IPv4 prefixes, other packets have no destination */
+  if (PREDICT_FALSE (vnet_buffer2 (b)->flow_ctx.ip_version != 4))
+    {
+      ctx->n_not_ip4++;
+      kv = 0;
+    }
+  else
+    {
+      /* Stamp in place, the pointer is only valid until the next add */
+      key->value = 0;
+      kv = clib_bihash_search_or_add_with_hash_16_8
+	(&ctx->pc->hash_table, hash, key, &is_new);
+      ctx->n_inserted += is_new;
+    }
 
-		key0 = get_hash_key((ip4_header_t *) (en0 + 1));
-		key1 = get_hash_key((ip4_header_t *) (en1 + 1));
-		key2 = get_hash_key((ip4_header_t *) (en2 + 1));
-		key3 = get_hash_key((ip4_header_t *) (en3 + 1));
-
-		hash2 = clib_bihash_hash_16_8(&key2);
-		hash3 = clib_bihash_hash_16_8(&key3);
-
-	  }
-	  
-	  while (n_left_from >= 8 && n_left_to_next >= 2){
-		u32 next0 = POLICER_NEXT_INTERFACE_OUTPUT;
-	  	u32 next1 = POLICER_NEXT_INTERFACE_OUTPUT;
-	  	u32 sw_if_index0, sw_if_index1;
-
-	  	u32 bi0, bi1;
-	  	vlib_buffer_t *b0, *b1;
-		
-
-		/* Prefetch 6th and 7th vlib buffers. */
-	  	{
-	    	vlib_buffer_t *p6, *p7;
-
-		    p6 = vlib_get_buffer (vm, from[6]);
-		    p7 = vlib_get_buffer (vm, from[7]);
-
-	    	vlib_prefetch_buffer_header (p6, LOAD);
-	    	vlib_prefetch_buffer_header (p7, LOAD);
-
-		    clib_prefetch_store (p6->data);
-		    clib_prefetch_store (p7->data);
-	  	}
-
-		/* record keys and hashes, plus prefetch buckets. */
-		{
-			vlib_buffer_t *p4, *p5;
-			ethernet_header_t *en4, *en5;
-
-		    p4 = vlib_get_buffer (vm, from[4]);
-		    p5 = vlib_get_buffer (vm, from[5]);
-
-			en4 = vlib_buffer_get_current (p4);
-			en5 = vlib_buffer_get_current (p5);
-
-			key4 = get_hash_key((ip4_header_t *) (en4 + 1));
-			key5 = get_hash_key((ip4_header_t *) (en5 + 1));
-
-			hash4 = clib_bihash_hash_16_8(&key4);
-			hash5 = clib_bihash_hash_16_8(&key5);
-
-			clib_bihash_prefetch_bucket_16_8(&hash_table, hash4);
-			clib_bihash_prefetch_bucket_16_8(&hash_table, hash5);
-
-		}
-
-		/* prefetch data. */
-		{
-			clib_bihash_prefetch_data_16_8(&hash_table, hash2);
-			clib_bihash_prefetch_data_16_8(&hash_table, hash3);
-		}
-
-		to_next[0] = bi0 = from[0];
-		to_next[1] = bi1 = from[1];
-	  	from += 2;
-	  	to_next += 2;
-	  	n_left_from -= 2;
-	  	n_left_to_next -= 2;
-	  	
-		b0 = vlib_get_buffer (vm, bi0);
-	  	b1 = vlib_get_buffer (vm, bi1);
-
-		key0.value = 1;
-		key1.value = 1;
-		clib_bihash_add_with_overwrite_cb_16_8(&cpolicer_main.per_cpu[0].hash_table, &key0, hash_callback, &key0);
-		clib_bihash_add_with_overwrite_cb_16_8(&cpolicer_main.per_cpu[0].hash_table, &key1, hash_callback, &key1);
-
-		/* shift stored keys and hashes by 2 on every iteration */
-		key0 = key2;
-		key1 = key3;
-		key2 = key4;
-		key3 = key5;
-		hash2 = hash4;
-		hash3 = hash5;
-
-
-    	sw_if_index0 = vnet_buffer (b0)->sw_if_index[VLIB_RX];
-    	sw_if_index1 = vnet_buffer (b1)->sw_if_index[VLIB_RX];
-
-	    /* Send pkt back out the RX interface */
-	  	vnet_buffer (b0)->sw_if_index[VLIB_TX] = sw_if_index0;
-	  	vnet_buffer (b1)->sw_if_index[VLIB_TX] = sw_if_index1;
-
-		vlib_validate_buffer_enqueue_x2 (vm, node, next_index,
-					   to_next, n_left_to_next,
-					   bi0, bi1, next0, next1);
-	  }
-
-      while (n_left_from > 0 && n_left_to_next > 0)
-	  {
-		u32 bi0;
-		vlib_buffer_t *b0;
-		u32 next0 = POLICER_NEXT_INTERFACE_OUTPUT;
-		u32 sw_if_index0;
-		ethernet_header_t *en0;
-		u16 src_port;
-		u16 dst_port;
-
-		/* speculatively enqueue b0 to the current next frame */
-		bi0 = from[0];
-		to_next[0] = bi0;
-		from += 1;
-		to_next += 1;
-		n_left_from -= 1;
-		n_left_to_next -= 1;
-
-		b0 = vlib_get_buffer (vm, bi0);
-	  	/*
-	   	* Direct from the driver, we should be at offset 0
-	   	* aka at &b0->data[0]
-	   	*/
-	  	ASSERT (b0->current_data == 0);
-
-		en0 = vlib_buffer_get_current (b0);
-		en0->dst_address[0] = en0->dst_address[1];
-
-		ip4_header_t* ip40 = (ip4_header_t *) (en0 + 1);
-		ip4_address_t src_ip;
-		ip4_address_t dst_ip;
-		src_ip = ip40->src_address;
-		dst_ip = ip40->dst_address;
-		udp_header_t *udp0 = (udp_header_t *)(ip40 + 1);
-		src_port = udp0->src_port;
-		dst_port = udp0->dst_port;
-
-
-		clib_bihash_kv_16_8_t key = get_hash_key(ip40);
-
-		cpolicer_main_t * fcm = &cpolicer_main;
-
-		key.value = 1;
-		clib_bihash_add_with_overwrite_cb_16_8(&fcm->per_cpu[thread_index].hash_table, &key, hash_callback, &key);
-
-    	sw_if_index0 = vnet_buffer (b0)->sw_if_index[VLIB_RX];
-
-	    /* Send pkt back out the RX interface */
-	  	vnet_buffer (b0)->sw_if_index[VLIB_TX] = sw_if_index0;
-
-	  	if (PREDICT_FALSE ((node->flags & VLIB_NODE_FLAG_TRACE)
-			     && (b0->flags & VLIB_BUFFER_IS_TRACED)))
+  if (PREDICT_TRUE (kv != 0))
+    {
+      index = is_new ? cpolicer_dst_alloc (ctx->sm, ctx->pc) :
+	nfchain_flow_count (kv->value);
+      kv->value = nfchain_flow_stamp (index, ctx->now);
+      ctx->pc->dsts[index].packets++;
+
+      pol = cpolicer_dst_policer (ctx->sm, ctx->pc, index, (u32) key->key[0],
+				  ctx->time);
+      if (pol)
+	{
+	  binding_index = ctx->pc->dsts[index].binding_index;
+	  color = vnet_police_packet (pol, vlib_buffer_length_in_chain (vm, b),
+				      POLICE_CONFORM, ctx->time);
+	  ctx->n_results[color]++;
+	  if (pol->action[color] == QOS_ACTION_DROP)
 	    {
-	      cpolicer_trace_t *t = vlib_add_trace (vm, node, b0, sizeof (*t));
-	      t->sw_if_index = sw_if_index0;
-	      t->next_index = next0;
-	      clib_memcpy_fast (t->new_src_mac, en0->src_address,
-				sizeof (t->new_src_mac));
-	      clib_memcpy_fast (t->new_dst_mac, en0->dst_address,
-				sizeof (t->new_dst_mac));
-		  t->src_ip = src_ip;
-	      t->dst_ip = dst_ip;
-	      t->src_port = src_port;
-		  t->dst_port = dst_port;
+	      b->error = node->errors[POLICER_ERROR_DROPPED];
+	      next = POLICER_NEXT_DROP;
 	    }
+	  else if (pol->action[color] == QOS_ACTION_MARK_AND_TRANSMIT)
+	    cpolicer_mark (b, pol->mark_dscp[color]);
+	}
+    }
 
-	  	pkts_swapped += 1;
+  if (PREDICT_FALSE ((node->flags & VLIB_NODE_FLAG_TRACE)
+		     && (b->flags & VLIB_BUFFER_IS_TRACED)))
+    {
+      clib_bihash_kv_16_8_t flow = nfchain_flow_ctx_key (vnet_buffer2 (b));
+      ethernet_header_t *en = vlib_buffer_get_current (b);
+      cpolicer_trace_t *t = vlib_add_trace (vm, node, b, sizeof (*t));
+      t->sw_if_index = sw_if_index;
+      t->next_index = next;
+      clib_memcpy_fast (t->new_src_mac, en->src_address,
+			sizeof (t->new_src_mac));
+      clib_memcpy_fast (t->new_dst_mac, en->dst_address,
+			sizeof (t->new_dst_mac));
+      t->src_ip.as_u32 = flow.key[0] >> 32;
+      t->dst_ip.as_u32 = (u32) flow.key[0];
+      t->src_port = flow.key[1] >> 16;
+      t->dst_port = (u16) flow.key[1];
+      t->binding_index = binding_index;
+      t->color = color;
+    }
 
-	  	/* verify speculative enqueue, maybe switch current next frame */
-	  	vlib_validate_buffer_enqueue_x1 (vm, node, next_index,
-					   to_next, n_left_to_next,
-					   bi0, next0);
-	  }
+  return next;
+}
 
-      vlib_put_next_frame (vm, node, next_index, n_left_to_next);
-    }
-  
+/*
+ * Frame at a time through the flow pipeline, see nfchain/flow_pipeline.h.
+ */
+VLIB_NODE_FN (cpolicer_node) (vlib_main_t * vm, vlib_node_runtime_t * node,
+			    vlib_frame_t * frame)
+{
+  cpolicer_main_t *sm = &cpolicer_main;
+  cpolicer_frame_ctx_t ctx = {
+    .sm = sm,
+    .pc = &sm->per_cpu[vm->thread_index],
+    .thread_index = vm->thread_index,
+    .now = nfchain_flow_now (vm),
+    .time = clib_cpu_time_now () >> POLICER_TICKS_PER_PERIOD_SHIFT,
+  };
+  cpolicer_age_t age = {
+    .age = { .now = ctx.now, .timeout = sm->flow_timeout },
+    .pc = ctx.pc,
+  };
+  nfchain_nf_sample_t sample;
+  u32 n_expired;
+
+  nfchain_nf_stats_begin (&cpolicer_nf_stats, ctx.thread_index, &sample);
+  nfchain_flow_dispatch_pipeline
+    (vm, node, frame, &ctx.pc->hash_table,
+     sm->prefetch_distance, 0, cpolicer_key, cpolicer_update, &ctx);
+  nfchain_nf_stats_end (&cpolicer_nf_stats, ctx.thread_index,
+			NFCHAIN_NF_STAGE_FRAME, &sample, frame->n_vectors);
+
+  /* Age out idle flows, a few buckets per dispatch */
+  nfchain_nf_stats_begin (&cpolicer_nf_stats, ctx.thread_index, &sample);
+  n_expired = clib_bihash_sweep_16_8
+    (&ctx.pc->hash_table, &ctx.pc->sweep_cursor, NFCHAIN_FLOW_SWEEP_WORK,
+     cpolicer_flow_is_stale, &age);
+  nfchain_nf_stats_end (&cpolicer_nf_stats, ctx.thread_index,
+			NFCHAIN_NF_STAGE_SWEEP, &sample, frame->n_vectors);
+
+  vlib_node_increment_counter (vm, cpolicer_node.index,
+			       POLICER_ERROR_SWAPPED, frame->n_vectors);
+  vlib_node_increment_counter (vm, cpolicer_node.index,
+			       POLICER_ERROR_INSERTS, ctx.n_inserted);
+  vlib_node_increment_counter (vm, cpolicer_node.index,
+			       POLICER_ERROR_EXPIRED, n_expired);
+  vlib_node_increment_counter (vm, cpolicer_node.index,
+			       POLICER_ERROR_EXCEED,
+			       ctx.n_results[POLICE_EXCEED]);
   vlib_node_increment_counter (vm, cpolicer_node.index,
-			       POLICER_ERROR_SWAPPED, pkts_swapped);
+			       POLICER_ERROR_VIOLATE,
+			       ctx.n_results[POLICE_VIOLATE]);
   vlib_node_increment_counter (vm, cpolicer_node.index,
-			       POLICER_ERROR_INSERTS, pkts_inserted);
+			       POLICER_ERROR_NOT_IP4, ctx.n_not_ip4);
   return frame->n_vectors;
 }
-#endif
 
 
 /* *INDENT-OFF* */
@@ -357,6 +383,7 @@ VLIB_REGISTER_NODE (cpolicer_node) =
   /* edit / add dispositions here */
   .next_nodes = {
     [POLICER_NEXT_INTERFACE_OUTPUT] = "sourcecounter",
+    [POLICER_NEXT_DROP] = "error-drop",
   },
 };
 /* *INDENT-ON* */
@@ -20,9 +20,11 @@
 #include <vnet/vnet.h>
 #include <vnet/plugin/plugin.h>
 #include <flowcounter/flowcounter.h>
+#include <nfchain/flow_dump.h>
 
 #include <vlibapi/api.h>
 #include <vlibmemory/api.h>
+#include <vnet/format_fns.h>
 
 #include <flowcounter/flowcounter.api_enum.h>
 #include <flowcounter/flowcounter.api_types.h>
@@ -36,7 +38,9 @@ VLIB_PLUGIN_REGISTER () = {
     .description = "FlowCounter plugin",
 };
 
-flowcounter_main_t flowcounter_main;
+__clib_export flowcounter_main_t flowcounter_main;
+__clib_export nfchain_hop_t flowcounter_chain_hop;
+__clib_export nfchain_nf_stats_t flowcounter_nf_stats;
 
 /**
  * @brief Enable/disable the macswap plugin. 
@@ -121,6 +125,78 @@ VLIB_CLI_COMMAND (sr_content_command, static) = {
     .function = macswap_enable_disable_command_fn,
 };
 
+static int
+flowcounter_show_flow (clib_bihash_kv_16_8_t * kv, void *arg)
+{
+  nfchain_flow_show_ctx_t *ctx = arg;
+
+  vlib_cli_output (ctx->vm, "[%d] %U packets %llu idle %us",
+                   ctx->thread_index, format_nfchain_flow_key, kv,
+                   nfchain_flow_count (kv->value),
+                   nfchain_flow_idle (ctx->now, kv->value));
+
+  return --ctx->n_left ? BIHASH_WALK_CONTINUE : BIHASH_WALK_STOP;
+}
+
+static int
+flowcounter_show_flow6 (clib_bihash_kv_40_8_t * kv, void *arg)
+{
+  nfchain_flow_show_ctx_t *ctx = arg;
+
+  vlib_cli_output (ctx->vm, "[%d] %U packets %llu idle %us",
+                   ctx->thread_index, format_nfchain_flow_key6, kv,
+                   nfchain_flow_count (kv->value),
+                   nfchain_flow_idle (ctx->now, kv->value));
+
+  return --ctx->n_left ? BIHASH_WALK_CONTINUE : BIHASH_WALK_STOP;
+}
+
+static clib_error_t *
+show_flowcounter_flows_command_fn (vlib_main_t * vm,
+                                   unformat_input_t * input,
+                                   vlib_cli_command_t * cmd)
+{
+  flowcounter_main_t * sm = &flowcounter_main;
+  nfchain_flow_show_ctx_t ctx = { .vm = vm, .n_left = 100 };
+  u32 bucket;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "max %u", &ctx.n_left))
+      ;
+    else
+      return clib_error_return (0, "unknown input `%U'",
+                                format_unformat_error, input);
+  }
+
+  ctx.now = nfchain_flow_now (vm);
+  for (ctx.thread_index = 0; ctx.thread_index < vec_len (sm->per_cpu) &&
+         ctx.n_left; ctx.thread_index++)
+    {
+      bucket = 0;
+      clib_bihash_foreach_key_value_pair_from_16_8
+        (&sm->per_cpu[ctx.thread_index].hash_table, &bucket, ~0,
+         flowcounter_show_flow, &ctx);
+    }
+  for (ctx.thread_index = 0; ctx.thread_index < vec_len (sm->per_cpu) &&
+         ctx.n_left; ctx.thread_index++)
+    {
+      bucket = 0;
+      clib_bihash_foreach_key_value_pair_from_40_8
+        (&sm->per_cpu[ctx.thread_index].hash_table6, &bucket, ~0,
+         flowcounter_show_flow6, &ctx);
+    }
+  return 0;
+}
+
+/**
+ * @brief CLI command to show the per-flow packet counters.
+ */
+VLIB_CLI_COMMAND (show_flowcounter_flows_command, static) = {
+    .path = "show flowcounter flows",
+    .short_help = "show flowcounter flows [max <n>]",
+    .function = show_flowcounter_flows_command_fn,
+};
+
 /**
  * @brief Plugin API message handler.
  */
@@ -137,6 +213,58 @@ static void vl_api_flowcounter_macswap_enable_disable_t_handler
   REPLY_MACRO(VL_API_FLOWCOUNTER_MACSWAP_ENABLE_DISABLE_REPLY);
 }
 
+static int
+flowcounter_send_flow_details (clib_bihash_kv_16_8_t * kv, void *arg)
+{
+  nfchain_flow_dump_ctx_t *ctx = arg;
+  vl_api_flowcounter_flow_details_t *mp;
+
+  mp = vl_msg_api_alloc (sizeof (*mp));
+  clib_memset (mp, 0, sizeof (*mp));
+  mp->_vl_msg_id = htons (VL_API_FLOWCOUNTER_FLOW_DETAILS + ctx->msg_id_base);
+  mp->context = ctx->context;
+  mp->thread_index = htonl (ctx->thread_index);
+  nfchain_flow_details_address (kv, &mp->src_address, &mp->dst_address,
+                                &mp->src_port, &mp->dst_port);
+  mp->packets = clib_host_to_net_u64 (nfchain_flow_count (kv->value));
+  mp->idle = htonl (nfchain_flow_idle (ctx->now, kv->value));
+
+  vl_api_send_msg (ctx->rp, (u8 *) mp);
+  return BIHASH_WALK_CONTINUE;
+}
+
+static int
+flowcounter_send_flow_details6 (clib_bihash_kv_40_8_t * kv, void *arg)
+{
+  nfchain_flow_dump_ctx_t *ctx = arg;
+  vl_api_flowcounter_flow_details_t *mp;
+
+  mp = vl_msg_api_alloc (sizeof (*mp));
+  clib_memset (mp, 0, sizeof (*mp));
+  mp->_vl_msg_id = htons (VL_API_FLOWCOUNTER_FLOW_DETAILS + ctx->msg_id_base);
+  mp->context = ctx->context;
+  mp->thread_index = htonl (ctx->thread_index);
+  nfchain_flow_details_address6 (kv, &mp->src_address, &mp->dst_address,
+                                 &mp->src_port, &mp->dst_port);
+  mp->packets = clib_host_to_net_u64 (nfchain_flow_count (kv->value));
+  mp->idle = htonl (nfchain_flow_idle (ctx->now, kv->value));
+
+  vl_api_send_msg (ctx->rp, (u8 *) mp);
+  return BIHASH_WALK_CONTINUE;
+}
+
+static void vl_api_flowcounter_flow_get_t_handler
+(vl_api_flowcounter_flow_get_t * mp)
+{
+  vl_api_flowcounter_flow_get_reply_t * rmp;
+  flowcounter_main_t * sm = &flowcounter_main;
+  int rv = 0;
+
+  NFCHAIN_FLOW_DUMP46_MACRO (VL_API_FLOWCOUNTER_FLOW_GET_REPLY, sm->per_cpu,
+                             flowcounter_send_flow_details,
+                             flowcounter_send_flow_details6);
+}
+
 /* API definitions */
 #include <flowcounter/flowcounter.api.c>
 
@@ -146,12 +274,25 @@ static uint32_t ipv4_hash_crc(const void *data,  uint32_t data_len, uint32_t ini
 }
 */
 
+static void
+flowcounter_topk_collect (vlib_stats_collector_data_t * d)
+{
+  flowcounter_main_t * sm = &flowcounter_main;
+  nfchain_flow_topk_t * t = &sm->topk;
+
+  nfchain_flow_topk_collect (t, &sm->per_cpu[t->thread_index].hash_table,
+                             &sm->per_cpu[t->thread_index].hash_table6,
+                             vec_len (sm->per_cpu), d);
+}
+
 /**
  * @brief Initialize the flowcounter plugin.
  */
 static clib_error_t * flowcounter_init (vlib_main_t * vm)
 {
   flowcounter_main_t * sm = &flowcounter_main;
+  uword memory_size;
+  u32 nbuckets;
 
   sm->vnet_main =  vnet_get_main ();
 
@@ -172,19 +313,82 @@ static clib_error_t * flowcounter_init (vlib_main_t * vm)
   hash_params.hash_func = ipv4_hash_crc;
 */
   
+  if (sm->flow_timeout == 0)
+    sm->flow_timeout = NFCHAIN_FLOW_DEFAULT_TIMEOUT;
+  if (sm->max_flows == 0)
+    sm->max_flows = NFCHAIN_FLOW_DEFAULT_MAX_FLOWS;
+  if (sm->prefetch_distance == 0)
+    sm->prefetch_distance = NFCHAIN_FLOW_PREFETCH_DISTANCE;
+  nfchain_flow_table_size (sm->max_flows, &nbuckets, &memory_size);
+
   for (int i=0; i < tm->n_vlib_mains; i++) {
     char* name = (char *) format(0, "flowcounter_%d", i);
-    clib_bihash_init_16_8(&sm->per_cpu[i].hash_table, 
-                            name, 2097152, 1 << 30);
+    nfchain_flow_table_init (16_8, &sm->per_cpu[i].hash_table, name, i,
+                             nbuckets, memory_size, sm->log2_page_sz);
+    /* IPv6 entries are twice the size */
+    name = (char *) format(0, "flowcounter6_%d", i);
+    nfchain_flow_table_init (40_8, &sm->per_cpu[i].hash_table6, name, i,
+                             nbuckets, 2 * memory_size, sm->log2_page_sz);
 //    hash_params.name = (char *) format(0, "flowcounter_%d", i);
 //    sm->per_cpu[i].sticky_ht = rte_hash_create(&hash_params); 
   }
 
+  if (sm->topk.k)
+    nfchain_flow_topk_init (&sm->topk, "flowcounter", format_nfchain_flow_key,
+                            format_nfchain_flow_key6,
+                            flowcounter_topk_collect);
+
   return 0;
 }
 
 VLIB_INIT_FUNCTION (flowcounter_init);
 
+/**
+ * @brief Startup config, e.g.
+ *   flowcounter { flows 1000000 timeout 60 prefetch-distance 4 topk 10 }
+ *
+ * Each thread's table is sized for flows concurrent flows, on the
+ * thread's NUMA node, on page-size pages (e.g. 2m) if set. Flows idle
+ * for timeout seconds are deleted. topk exports the top K counters to
+ * the stats segment, see nfchain/flow_topk.h.
+ * Flow table lookups are prefetched prefetch-distance packets ahead.
+ */
+static clib_error_t *
+flowcounter_config (vlib_main_t * vm, unformat_input_t * input)
+{
+  flowcounter_main_t * sm = &flowcounter_main;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "flows %u", &sm->max_flows))
+      ;
+    else if (unformat (input, "page-size %U", unformat_log2_page_size,
+                       &sm->log2_page_sz))
+      ;
+    else if (unformat (input, "timeout %u", &sm->flow_timeout))
+      ;
+    else if (unformat (input, "prefetch-distance %u",
+                       &sm->prefetch_distance))
+      ;
+    else if (unformat (input, "topk %u", &sm->topk.k))
+      ;
+    else
+      return clib_error_return (0, "unknown input '%U'",
+                                format_unformat_error, input);
+  }
+
+  if (sm->flow_timeout > NFCHAIN_FLOW_TIME_MASK / 2)
+    return clib_error_return (0, "timeout %u too large", sm->flow_timeout);
+  if (sm->prefetch_distance > NFCHAIN_FLOW_PREFETCH_DISTANCE_MAX)
+    return clib_error_return (0, "prefetch-distance %u too large",
+                              sm->prefetch_distance);
+  if (sm->topk.k > NFCHAIN_FLOW_TOPK_MAX)
+    return clib_error_return (0, "topk %u too large", sm->topk.k);
+
+  return 0;
+}
+
+VLIB_EARLY_CONFIG_FUNCTION (flowcounter_config, "flowcounter");
+
 /**
  * @brief Hook the flowcounter plugin into the VPP graph hierarchy.
  */
@@ -24,6 +24,13 @@
 #include <vppinfra/elog.h>
 
 #include <vppinfra/bihash_16_8.h>
+#include <vppinfra/bihash_40_8.h>
+#include <nfchain/flow_age.h>
+#include <nfchain/chain.h>
+#include <nfchain/nf_stats.h>
+#include <nfchain/flow_pipeline.h>
+#include <nfchain/flow_ctx.h>
+#include <nfchain/flow_topk.h>
 
 typedef struct {
   /**
@@ -31,7 +38,14 @@ typedef struct {
    * One single table is used for all VIPs.
    */
   clib_bihash_16_8_t hash_table;
-} fc_per_cpu_t;
+
+  /* IPv6 flows, see nfchain_flow_ctx_key6 */
+  clib_bihash_40_8_t hash_table6;
+
+  /* Next buckets for the aging sweeps */
+  u32 sweep_cursor;
+  u32 sweep_cursor6;
+} flowcounter_per_cpu_t;
 
 typedef struct {
     /* API message ID base */
@@ -40,8 +54,21 @@ typedef struct {
     /* convenience */
     vnet_main_t * vnet_main;
 
+    /* Idle flow timeout in seconds, table size in concurrent flows */
+    u32 flow_timeout;
+    u32 max_flows;
+
+    /* Flow table page size, 0 for default pages */
+    clib_mem_page_sz_t log2_page_sz;
+
+    /* Flow table prefetch distance in packets, see nfchain/flow_pipeline.h */
+    u32 prefetch_distance;
+
+    /* Top K export to the stats segment */
+    nfchain_flow_topk_t topk;
+
     /* Some global data is per-cpu */
-    fc_per_cpu_t *per_cpu;
+    flowcounter_per_cpu_t *per_cpu;
 
 } flowcounter_main_t;
 
@@ -49,6 +76,100 @@ extern flowcounter_main_t flowcounter_main;
 
 extern vlib_node_registration_t flowcounter_node;
 
+/* Next hops when on a runtime NF chain, see nfchain/chain.h */
+extern nfchain_hop_t flowcounter_chain_hop;
+extern nfchain_nf_stats_t flowcounter_nf_stats;
+
+#define foreach_flowcounter_error \
+_(SWAPPED, "Mac swap packets processed") \
+_(INSERTS, "Packets inserted") \
+_(EXPIRED, "Flows expired")
+
+typedef enum
+{
+#define _(sym,str) FLOWCOUNTER_ERROR_##sym,
+  foreach_flowcounter_error
+#undef _
+    FLOWCOUNTER_N_ERROR,
+} flowcounter_error_t;
+
+/**
+ * @brief Per-packet body of the flowcounter node, shared with fused NF chains.
+ * Bumps the flow counter in the calling thread's table and stamps it
+ * with now, see flow_age.h.
+ * Returns 1 if the flow is new.
+ */
+static_always_inline int
+flowcounter_flow_update (flowcounter_main_t * fcm, u32 thread_index,
+                         clib_bihash_kv_16_8_t * key, u64 hash, u32 now,
+                         u64 * count)
+{
+  clib_bihash_kv_16_8_t *kv;
+  int is_new;
+
+  /* Bump in place, the pointer is only valid until the next add */
+  key->value = 0;
+  kv = clib_bihash_search_or_add_with_hash_16_8
+    (&fcm->per_cpu[thread_index].hash_table, hash, key, &is_new);
+  if (PREDICT_FALSE (kv == 0))
+    {
+      *count = 0;
+      return 0;
+    }
+  kv->value = nfchain_flow_touch (kv->value, now);
+  *count = nfchain_flow_count (kv->value);
+
+  return is_new;
+}
+
+/**
+ * @brief flowcounter_flow_update for a buffer, IPv4 or IPv6.
+ */
+static_always_inline int
+flowcounter_flow_update_buffer (flowcounter_main_t * fcm, u32 thread_index,
+                                vlib_buffer_t * b,
+                                clib_bihash_kv_16_8_t * key, u64 hash,
+                                u32 now, u64 * count)
+{
+  clib_bihash_kv_40_8_t key6, *kv;
+  int is_new;
+
+  if (PREDICT_TRUE (vnet_buffer2 (b)->flow_ctx.ip_version != 6))
+    return flowcounter_flow_update (fcm, thread_index, key, hash, now,
+                                    count);
+
+  nfchain_flow_ctx_key6 (b, &key6);
+  kv = clib_bihash_search_or_add_with_hash_40_8
+    (&fcm->per_cpu[thread_index].hash_table6, hash, &key6, &is_new);
+  if (PREDICT_FALSE (kv == 0))
+    {
+      *count = 0;
+      return 0;
+    }
+  kv->value = nfchain_flow_touch (kv->value, now);
+  *count = nfchain_flow_count (kv->value);
+
+  return is_new;
+}
+
+/**
+ * @brief Sweep a few buckets of the thread's tables for idle flows.
+ * Returns the number of flows deleted.
+ */
+static_always_inline u32
+flowcounter_flow_age (flowcounter_main_t * fcm, u32 thread_index, u32 now)
+{
+  flowcounter_per_cpu_t *pc = &fcm->per_cpu[thread_index];
+  nfchain_flow_age_t age = { .now = now, .timeout = fcm->flow_timeout };
+
+  return clib_bihash_sweep_16_8 (&pc->hash_table, &pc->sweep_cursor,
+                                 NFCHAIN_FLOW_SWEEP_WORK,
+                                 nfchain_flow_is_stale, &age) +
+    clib_bihash_sweep_40_8 (&pc->hash_table6, &pc->sweep_cursor6,
+                            NFCHAIN_FLOW_SWEEP_WORK,
+                            nfchain_flow_is_stale6, &age);
+}
+
 #define FLOWCOUNTER_PLUGIN_BUILD_VER "1.0"
 
 #endif /* __included_flowcounter_h__ */
@@ -18,6 +18,8 @@
 #include <vnet/ethernet/ethernet.h>
 #include <vppinfra/error.h>
 #include <flowcounter/flowcounter.h>
+#include <nfchain/flow_ctx.h>
+#include <nfchain/flow_pipeline.h>
 
 typedef struct
 {
@@ -53,20 +55,6 @@ format_flowcounter_trace (u8 * s, va_list * args)
   return s;
 }
 
-extern vlib_node_registration_t flowcounter_node;
-
-#define foreach_flowcounter_error \
-_(SWAPPED, "Mac swap packets processed") \
-_(INSERTS, "Packets inserted")
-
-typedef enum
-{
-#define _(sym,str) FLOWCOUNTER_ERROR_##sym,
-  foreach_flowcounter_error
-#undef _
-    FLOWCOUNTER_N_ERROR,
-} flowcounter_error_t;
-
 static char *flowcounter_error_strings[] = {
 #define _(sym,string) string,
   foreach_flowcounter_error
@@ -80,281 +68,89 @@ typedef enum
 } flowcounter_next_t;
 
 
-static_always_inline clib_bihash_kv_16_8_t
-get_hash_key(ip4_header_t *ip4){
-	clib_bihash_kv_16_8_t key;
-	udp_header_t *udp = (udp_header_t *)(ip4 + 1);
-
-	key.key[0] = ( ((u64) ip4->src_address.as_u32) << 32) | (ip4->dst_address.as_u32);
-	key.key[1] = ( ((u32) udp->src_port) << 16) | udp->dst_port;
+typedef struct
+{
+  flowcounter_main_t *fcm;
+  u32 thread_index;
+  u32 now;
+  u32 n_inserted;
+} flowcounter_frame_ctx_t;
+
+static_always_inline u16
+flowcounter_update (vlib_main_t * vm, vlib_node_runtime_t * node,
+		    vlib_buffer_t * b, clib_bihash_kv_16_8_t * key, u64 hash,
+		    void *aux, void *arg)
+{
+  flowcounter_frame_ctx_t *ctx = arg;
+  u32 sw_if_index = vnet_buffer (b)->sw_if_index[VLIB_RX];
+  u16 next;
+  u64 count;
+
+  ctx->n_inserted += flowcounter_flow_update_buffer (ctx->fcm,
+						     ctx->thread_index, b, key,
+						     hash, ctx->now, &count);
+
+  /* Send pkt back out the RX interface, via the rest of its chain */
+  vnet_buffer (b)->sw_if_index[VLIB_TX] = sw_if_index;
+  next = nfchain_hop_next (&flowcounter_chain_hop, sw_if_index,
+			   FLOWCOUNTER_NEXT_INTERFACE_OUTPUT);
+
+  if (PREDICT_FALSE ((node->flags & VLIB_NODE_FLAG_TRACE)
+		     && (b->flags & VLIB_BUFFER_IS_TRACED)))
+    {
+      ethernet_header_t *en = vlib_buffer_get_current (b);
+      flowcounter_trace_t *t = vlib_add_trace (vm, node, b, sizeof (*t));
+      t->sw_if_index = sw_if_index;
+      t->next_index = next;
+      clib_memcpy_fast (t->new_src_mac, en->src_address,
+			sizeof (t->new_src_mac));
+      clib_memcpy_fast (t->new_dst_mac, en->dst_address,
+			sizeof (t->new_dst_mac));
+      t->src_ip.as_u32 = key->key[0] >> 32;
+      t->dst_ip.as_u32 = (u32) key->key[0];
+      t->src_port = key->key[1] >> 16;
+      t->dst_port = (u16) key->key[1];
+    }
 
-	return key;
+  return next;
 }
 
-
 /*
- * Simple dual/single loop version, default version which will compile
- * everywhere.
- *
- * Node costs 30 clocks/pkt at a vector size of 51
+ * Frame at a time through the flow pipeline, see nfchain/flow_pipeline.h.
  */
-
-#define VERSION_1 1
-#ifdef VERSION_1
-#define foreach_mac_address_offset              \
-_(0)                                            \
-_(1)                                            \
-_(2)                                            \
-_(3)                                            \
-_(4)                                            \
-_(5)
-
 VLIB_NODE_FN (flowcounter_node) (vlib_main_t * vm, vlib_node_runtime_t * node,
 			    vlib_frame_t * frame)
 {
-  u32 n_left_from, *from, *to_next;
-  flowcounter_next_t next_index;
-  u32 thread_index = vm->thread_index;
-  clib_bihash_16_8_t hash_table = flowcounter_main.per_cpu[thread_index].hash_table;
-
-  u32 pkts_swapped = 0;
-  u32 pkts_inserted = 0;
-
-  from = vlib_frame_vector_args (frame);
-  n_left_from = frame->n_vectors;
-  next_index = node->cached_next_index;
-
-  while (n_left_from > 0)
-    {
-      u32 n_left_to_next;
-
-      vlib_get_next_frame (vm, node, next_index, to_next, n_left_to_next);
-
-	  clib_bihash_kv_16_8_t key0, key1, key2, key3, key4, key5;
-	  u64 hash0, hash1, hash2, hash3, hash4, hash5;
-
-
-	  if (n_left_from >= 8 && n_left_to_next >= 2) {
-		vlib_buffer_t *p0, *p1, *p2, *p3;
-		ethernet_header_t *en0, *en1, *en2, *en3;
-
-		p0 = vlib_get_buffer (vm, from[0]);
-		p1 = vlib_get_buffer (vm, from[1]);
-		p2 = vlib_get_buffer (vm, from[2]);
-		p3 = vlib_get_buffer (vm, from[3]);
-
-		en0 = vlib_buffer_get_current (p0);
-		en1 = vlib_buffer_get_current (p1);
-		en2 = vlib_buffer_get_current (p2);
-		en3 = vlib_buffer_get_current (p3);
-
-		key0 = get_hash_key((ip4_header_t *) (en0 + 1));
-		key1 = get_hash_key((ip4_header_t *) (en1 + 1));
-		key2 = get_hash_key((ip4_header_t *) (en2 + 1));
-		key3 = get_hash_key((ip4_header_t *) (en3 + 1));
-
-		hash0 = clib_bihash_hash_16_8(&key0);
-		hash1 = clib_bihash_hash_16_8(&key1);
-		hash2 = clib_bihash_hash_16_8(&key2);
-		hash3 = clib_bihash_hash_16_8(&key3);
-
-	  }
-	  
-	  while (n_left_from >= 8 && n_left_to_next >= 2){
-		u32 next0 = FLOWCOUNTER_NEXT_INTERFACE_OUTPUT;
-	  	u32 next1 = FLOWCOUNTER_NEXT_INTERFACE_OUTPUT;
-	  	u32 sw_if_index0, sw_if_index1;
-
-	  	u32 bi0, bi1;
-	  	vlib_buffer_t *b0, *b1;
-		
-
-		/* Prefetch 6th and 7th vlib buffers. */
-	  	{
-	    	vlib_buffer_t *p6, *p7;
-
-		    p6 = vlib_get_buffer (vm, from[6]);
-		    p7 = vlib_get_buffer (vm, from[7]);
-
-	    	vlib_prefetch_buffer_header (p6, LOAD);
-	    	vlib_prefetch_buffer_header (p7, LOAD);
+  flowcounter_main_t *fcm = &flowcounter_main;
+  flowcounter_frame_ctx_t ctx = {
+    .fcm = fcm,
+    .thread_index = vm->thread_index,
+    .now = nfchain_flow_now (vm),
+  };
+  nfchain_nf_sample_t sample;
+  u32 n_expired;
+
+  nfchain_nf_stats_begin (&flowcounter_nf_stats, ctx.thread_index, &sample);
+  nfchain_flow_dispatch_pipeline
+    (vm, node, frame, &fcm->per_cpu[ctx.thread_index].hash_table,
+     fcm->prefetch_distance, 0, 0, flowcounter_update, &ctx);
+  nfchain_nf_stats_end (&flowcounter_nf_stats, ctx.thread_index,
+			NFCHAIN_NF_STAGE_FRAME, &sample, frame->n_vectors);
+
+  /* Age out idle flows, a few buckets per dispatch */
+  nfchain_nf_stats_begin (&flowcounter_nf_stats, ctx.thread_index, &sample);
+  n_expired = flowcounter_flow_age (fcm, ctx.thread_index, ctx.now);
+  nfchain_nf_stats_end (&flowcounter_nf_stats, ctx.thread_index,
+			NFCHAIN_NF_STAGE_SWEEP, &sample, frame->n_vectors);
 
-		    clib_prefetch_store (p6->data);
-		    clib_prefetch_store (p7->data);
-	  	}
-
-		/* record keys and hashes, plus prefetch buckets. */
-		{
-			vlib_buffer_t *p4, *p5;
-			ethernet_header_t *en4, *en5;
-
-		    p4 = vlib_get_buffer (vm, from[4]);
-		    p5 = vlib_get_buffer (vm, from[5]);
-
-			en4 = vlib_buffer_get_current (p4);
-			en5 = vlib_buffer_get_current (p5);
-
-			key4 = get_hash_key((ip4_header_t *) (en4 + 1));
-			key5 = get_hash_key((ip4_header_t *) (en5 + 1));
-
-			hash4 = clib_bihash_hash_16_8(&key4);
-			hash5 = clib_bihash_hash_16_8(&key5);
-
-			clib_bihash_prefetch_bucket_16_8(&hash_table, hash4);
-			clib_bihash_prefetch_bucket_16_8(&hash_table, hash5);
-
-		}
-
-		/* prefetch data. */
-		{
-			clib_bihash_prefetch_data_16_8(&hash_table, hash2);
-			clib_bihash_prefetch_data_16_8(&hash_table, hash3);
-		}
-
-		to_next[0] = bi0 = from[0];
-		to_next[1] = bi1 = from[1];
-	  	from += 2;
-	  	to_next += 2;
-	  	n_left_from -= 2;
-	  	n_left_to_next -= 2;
-	  	
-		b0 = vlib_get_buffer (vm, bi0);
-	  	b1 = vlib_get_buffer (vm, bi1);
-
-		clib_bihash_kv_16_8_t value0, value1;
-
-		if (clib_bihash_search_inline_with_hash_16_8 (&flowcounter_main.per_cpu[thread_index].hash_table, hash0, &value0) < 0) {
-			key0.value = 1;
-			pkts_inserted += 1;
-		}
-		else
-			key0.value = value0.value + 1;
-		
-		clib_bihash_add_del_with_hash_16_8(&flowcounter_main.per_cpu[thread_index].hash_table, &key0, hash0, 1);
-
-		if (clib_bihash_search_inline_with_hash_16_8 (&flowcounter_main.per_cpu[thread_index].hash_table, hash1, &value1) < 0) {
-			key1.value = 1;
-			pkts_inserted += 1;
-		}
-		else
-			key1.value = value1.value + 1;
-		
-		clib_bihash_add_del_with_hash_16_8(&flowcounter_main.per_cpu[thread_index].hash_table, &key1, hash1, 1);
-
-		/* shift stored keys and hashes by 2 on every iteration */
-		key0 = key2;
-		key1 = key3;
-		key2 = key4;
-		key3 = key5;
-		hash0 = hash2;
-		hash1 = hash3;
-		hash2 = hash4;
-		hash3 = hash5;
-
-
-    	sw_if_index0 = vnet_buffer (b0)->sw_if_index[VLIB_RX];
-    	sw_if_index1 = vnet_buffer (b1)->sw_if_index[VLIB_RX];
-
-	    /* Send pkt back out the RX interface */
-	  	vnet_buffer (b0)->sw_if_index[VLIB_TX] = sw_if_index0;
-	  	vnet_buffer (b1)->sw_if_index[VLIB_TX] = sw_if_index1;
-
-		vlib_validate_buffer_enqueue_x2 (vm, node, next_index,
-					   to_next, n_left_to_next,
-					   bi0, bi1, next0, next1);
-	  }
-
-      while (n_left_from > 0 && n_left_to_next > 0)
-	  {
-		u32 bi0;
-		vlib_buffer_t *b0;
-		u32 next0 = FLOWCOUNTER_NEXT_INTERFACE_OUTPUT;
-		u32 sw_if_index0;
-		ethernet_header_t *en0;
-		u16 src_port;
-		u16 dst_port;
-
-		/* speculatively enqueue b0 to the current next frame */
-		bi0 = from[0];
-		to_next[0] = bi0;
-		from += 1;
-		to_next += 1;
-		n_left_from -= 1;
-		n_left_to_next -= 1;
-
-		b0 = vlib_get_buffer (vm, bi0);
-	  	/*
-	   	* Direct from the driver, we should be at offset 0
-	   	* aka at &b0->data[0]
-	   	*/
-	  	ASSERT (b0->current_data == 0);
-
-		en0 = vlib_buffer_get_current (b0);
-		en0->dst_address[0] = en0->dst_address[1];
-
-		ip4_header_t* ip40 = (ip4_header_t *) (en0 + 1);
-		ip4_address_t src_ip;
-		ip4_address_t dst_ip;
-		src_ip = ip40->src_address;
-		dst_ip = ip40->dst_address;
-		udp_header_t *udp0 = (udp_header_t *)(ip40 + 1);
-		src_port = udp0->src_port;
-		dst_port = udp0->dst_port;
-
-
-		clib_bihash_kv_16_8_t key = get_hash_key(ip40);
-		clib_bihash_kv_16_8_t value;
-
-		flowcounter_main_t * fcm = &flowcounter_main;
-		if (clib_bihash_search_16_8 (&fcm->per_cpu[thread_index].hash_table, &key, &value) < 0) {
-			key.value = 1;
-			pkts_inserted += 1;
-		}
-		else {
-			key.value = value.value + 1;
-		}
-		
-		clib_bihash_add_del_16_8(&fcm->per_cpu[thread_index].hash_table, &key, 1);
-
-    	sw_if_index0 = vnet_buffer (b0)->sw_if_index[VLIB_RX];
-
-	    /* Send pkt back out the RX interface */
-	  	vnet_buffer (b0)->sw_if_index[VLIB_TX] = sw_if_index0;
-
-	  	if (PREDICT_FALSE ((node->flags & VLIB_NODE_FLAG_TRACE)
-			     && (b0->flags & VLIB_BUFFER_IS_TRACED)))
-	    {
-	      flowcounter_trace_t *t = vlib_add_trace (vm, node, b0, sizeof (*t));
-	      t->sw_if_index = sw_if_index0;
-	      t->next_index = next0;
-	      clib_memcpy_fast (t->new_src_mac, en0->src_address,
-				sizeof (t->new_src_mac));
-	      clib_memcpy_fast (t->new_dst_mac, en0->dst_address,
-				sizeof (t->new_dst_mac));
-		  t->src_ip = src_ip;
-	      t->dst_ip = dst_ip;
-	      t->src_port = src_port;
-		  t->dst_port = dst_port;
-	    }
-
-	  	pkts_swapped += 1;
-
-	  	/* verify speculative enqueue, maybe switch current next frame */
-	  	vlib_validate_buffer_enqueue_x1 (vm, node, next_index,
-					   to_next, n_left_to_next,
-					   bi0, next0);
-	  }
-
-      vlib_put_next_frame (vm, node, next_index, n_left_to_next);
-    }
-  
   vlib_node_increment_counter (vm, flowcounter_node.index,
-			       FLOWCOUNTER_ERROR_SWAPPED, pkts_swapped);
+			       FLOWCOUNTER_ERROR_SWAPPED, frame->n_vectors);
+  vlib_node_increment_counter (vm, flowcounter_node.index,
+			       FLOWCOUNTER_ERROR_INSERTS, ctx.n_inserted);
   vlib_node_increment_counter (vm, flowcounter_node.index,
-			       FLOWCOUNTER_ERROR_INSERTS, pkts_inserted);
+			       FLOWCOUNTER_ERROR_EXPIRED, n_expired);
   return frame->n_vectors;
 }
-#endif
 
 
 /* *INDENT-OFF* */
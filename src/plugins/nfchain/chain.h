@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __included_nfchain_chain_h__
+#define __included_nfchain_chain_h__
+
+#include <vlib/vlib.h>
+
+/**
+ * Runtime NF chains.
+ *
+ * Each chainable NF plugin exports an nfchain_hop_t named <nf>_chain_hop,
+ * and sends packets that conform on to nfchain_hop_next() instead of its
+ * static next node. The nfchain plugin fills the hops of the NFs on an
+ * interface's chain with the next index of the following NF, or of
+ * interface-output for the last one. Interfaces without a chain keep the
+ * static next nodes.
+ *
+ * Entries are single u16 stores, so chains are rewired under traffic
+ * without stopping the workers. The vector only grows under the barrier.
+ */
+
+/**
+ * NFs that can be put on a chain, by node (and plugin) name. The order
+ * is that of the nfchain_nf API enum.
+ */
+#define foreach_nfchain_nf      \
+_(clb, CLB)                     \
+_(ratelimiter, RATELIMITER)     \
+_(flowcounter, FLOWCOUNTER)     \
+_(cpolicer, CPOLICER)           \
+_(sourcecounter, SOURCECOUNTER)
+
+typedef enum
+{
+#define _(nf,NF) NFCHAIN_NF_##NF,
+  foreach_nfchain_nf
+#undef _
+    NFCHAIN_N_NF,
+} nfchain_nf_index_t;
+
+#define NFCHAIN_HOP_NONE ((u16) ~0)
+
+typedef struct
+{
+  /* Next index by RX sw_if_index, NFCHAIN_HOP_NONE if not chained */
+  u16 *next_by_sw_if_index;
+} nfchain_hop_t;
+
+/**
+ * @brief Next index for a packet received on sw_if_index, next if the
+ * interface has no chain through this NF.
+ */
+static_always_inline u16
+nfchain_hop_next (nfchain_hop_t * hop, u32 sw_if_index, u16 next)
+{
+  u16 *v = hop->next_by_sw_if_index;
+
+  if (sw_if_index < vec_len (v) && v[sw_if_index] != NFCHAIN_HOP_NONE)
+    return v[sw_if_index];
+  return next;
+}
+
+#endif /* __included_nfchain_chain_h__ */
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
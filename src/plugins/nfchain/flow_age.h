@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __included_nfchain_flow_age_h__
+#define __included_nfchain_flow_age_h__
+
+#include <vlib/vlib.h>
+#include <vppinfra/bihash_16_8.h>
+#include <vppinfra/bihash_40_8.h>
+
+/**
+ * Aging for the per-thread NF flow tables.
+ *
+ * Counter values are stamped with the time they were last hit: the count
+ * (or other per-flow data, such as clb's backend) is in bits 0-39, the
+ * last-seen time in seconds in bits 40-63. Every dispatch sweeps a slice
+ * of the thread's table and deletes the entries idle for longer
+ * than the timeout, so tables can be sized by concurrent rather than
+ * total flows. IPv6 flows live in a second, bihash_40_8, table swept
+ * the same way.
+ */
+
+#define NFCHAIN_FLOW_COUNT_MASK ((1ULL << 40) - 1)
+#define NFCHAIN_FLOW_TIME_MASK ((1 << 24) - 1)
+
+/* Buckets plus entries swept per dispatch, see clib_bihash_sweep */
+#define NFCHAIN_FLOW_SWEEP_WORK 256
+
+#define NFCHAIN_FLOW_DEFAULT_TIMEOUT 60
+#define NFCHAIN_FLOW_DEFAULT_MAX_FLOWS (1 << 20)
+
+typedef struct
+{
+  u32 now;
+  u32 timeout;
+} nfchain_flow_age_t;
+
+static_always_inline u32
+nfchain_flow_now (vlib_main_t * vm)
+{
+  return (u32) vlib_time_now (vm) & NFCHAIN_FLOW_TIME_MASK;
+}
+
+static_always_inline u64
+nfchain_flow_count (u64 value)
+{
+  return value & NFCHAIN_FLOW_COUNT_MASK;
+}
+
+static_always_inline u32
+nfchain_flow_last_seen (u64 value)
+{
+  return value >> 40;
+}
+
+/**
+ * @brief Count one more hit at time now.
+ */
+static_always_inline u64
+nfchain_flow_touch (u64 value, u32 now)
+{
+  return ((u64) now << 40) | ((value + 1) & NFCHAIN_FLOW_COUNT_MASK);
+}
+
+/**
+ * @brief Stamp time now on a value whose low bits hold data, not a count.
+ */
+static_always_inline u64
+nfchain_flow_stamp (u64 value, u32 now)
+{
+  return ((u64) now << 40) | (value & NFCHAIN_FLOW_COUNT_MASK);
+}
+
+static inline int
+nfchain_flow_is_stale (clib_bihash_kv_16_8_t * kv, void *arg)
+{
+  nfchain_flow_age_t *age = arg;
+  u32 idle = (age->now - nfchain_flow_last_seen (kv->value)) &
+    NFCHAIN_FLOW_TIME_MASK;
+
+  return idle > age->timeout;
+}
+
+static inline int
+nfchain_flow_is_stale6 (clib_bihash_kv_40_8_t * kv, void *arg)
+{
+  nfchain_flow_age_t *age = arg;
+  u32 idle = (age->now - nfchain_flow_last_seen (kv->value)) &
+    NFCHAIN_FLOW_TIME_MASK;
+
+  return idle > age->timeout;
+}
+
+/**
+ * @brief Table geometry for a number of concurrent flows per thread.
+ * About two flows per bucket, and room for the pages to split.
+ */
+static_always_inline void
+nfchain_flow_table_size (u32 max_flows, u32 * nbuckets, uword * memory_size)
+{
+  *nbuckets = 1 << max_log2 (clib_max (max_flows / 2, 1024));
+  *memory_size = clib_max ((uword) max_flows << 7, 64ULL << 20);
+}
+
+/*
+ * Free page groups the flow tables keep at hand: single pages for the
+ * first flow of a bucket (tables without pages at the bucket level),
+ * pairs for bucket splits, fours for resplits. Enough for a million or
+ * so new flows a second, with a refill every 10ms.
+ */
+#define NFCHAIN_FLOW_TABLE_RESERVE 1024
+
+/**
+ * @brief NUMA node for the flow table heap of a thread, none in particular
+ * for workers which aren't pinned to a core.
+ */
+static_always_inline u8
+nfchain_flow_table_numa (u32 thread_index)
+{
+  int numa = vlib_get_thread_numa (thread_index);
+
+  return numa < 0 ? BIHASH_NUMA_ANY : numa;
+}
+
+/**
+ * @brief Set up the flow table of a thread, on a heap of its own of size
+ * bytes of page_sz pages, on the NUMA node the thread runs on, rather
+ * than on the main heap's node and pages. Bucket splits take pages from
+ * a reserve, topped up by the main thread, see clib_bihash_set_reserve.
+ * type is the bihash flavour, e.g. 16_8.
+ */
+#define nfchain_flow_table_init(type, table, table_name, thread_index,   \
+                                n_buckets, size, page_sz)               \
+do {                                                                    \
+  clib_bihash_init2_args_##type##_t _a = {                              \
+    .h = (table),                                                       \
+    .name = (table_name),                                               \
+    .nbuckets = (n_buckets),                                            \
+    .memory_size = (size),                                              \
+    .private_heap = 1,                                                  \
+    .numa_node = nfchain_flow_table_numa (thread_index),                \
+    .log2_page_sz = (page_sz),                                          \
+  };                                                                    \
+  clib_bihash_init2_##type (&_a);                                       \
+  clib_bihash_set_reserve_##type ((table), 0,                           \
+                                  NFCHAIN_FLOW_TABLE_RESERVE);          \
+  clib_bihash_set_reserve_##type ((table), 1,                           \
+                                  NFCHAIN_FLOW_TABLE_RESERVE);          \
+  clib_bihash_set_reserve_##type ((table), 2,                           \
+                                  NFCHAIN_FLOW_TABLE_RESERVE / 16);     \
+  clib_bihash_refill_##type ((table));                                  \
+} while (0)
+
+#endif /* __included_nfchain_flow_age_h__ */
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __included_nfchain_flow_ctx_h__
+#define __included_nfchain_flow_ctx_h__
+
+#include <vnet/vnet.h>
+#include <vnet/buffer.h>
+#include <vnet/ip/ip.h>
+#include <vnet/ethernet/ethernet.h>
+
+#include <vppinfra/bihash_16_8.h>
+#include <vppinfra/bihash_40_8.h>
+#include <vppinfra/vector/flow_key.h>
+
+/**
+ * Flow keys:
+ *   IPv4 (clib_bihash_kv_16_8_t)
+ *     key[0] = src_address << 32 | dst_address
+ *     key[1] = protocol << 32 | src_port << 16 | dst_port
+ *   IPv6 (clib_bihash_kv_40_8_t)
+ *     key[0..1] = src_address, key[2..3] = dst_address
+ *     key[4] = protocol << 32 | src_port << 16 | dst_port
+ * Addresses and ports are in network order. Ports are 0 for protocols
+ * other than TCP, UDP and SCTP, and for fragments. Non-IP packets get an
+ * all zero IPv4 key.
+ */
+
+static_always_inline int
+nfchain_flow_has_ports (u8 protocol)
+{
+  return protocol == IP_PROTOCOL_TCP || protocol == IP_PROTOCOL_UDP ||
+    protocol == IP_PROTOCOL_SCTP;
+}
+
+/**
+ * @brief Ethertype of the packet after up to two VLAN tags, in network
+ * order. The L3 header offset is returned in l3_hdr_offset.
+ */
+static_always_inline u16
+nfchain_flow_ethertype (vlib_buffer_t * b, i16 * l3_hdr_offset)
+{
+  ethernet_header_t *e = vlib_buffer_get_current (b);
+  ethernet_vlan_header_t *vlan = (ethernet_vlan_header_t *) (e + 1);
+  u16 type = e->type;
+
+  *l3_hdr_offset = b->current_data + sizeof (ethernet_header_t);
+  if (PREDICT_FALSE (ethernet_frame_is_tagged (clib_net_to_host_u16 (type))))
+    {
+      type = vlan->type;
+      *l3_hdr_offset += sizeof (ethernet_vlan_header_t);
+      if (ethernet_frame_is_tagged (clib_net_to_host_u16 (type)))
+	{
+	  type = vlan[1].type;
+	  *l3_hdr_offset += sizeof (ethernet_vlan_header_t);
+	}
+    }
+
+  return type;
+}
+
+/**
+ * @brief IPv6 flow key of a buffer whose context has ip_version 6.
+ * The addresses are read back from the IPv6 header.
+ */
+static_always_inline void
+nfchain_flow_ctx_key6 (vlib_buffer_t * b, clib_bihash_kv_40_8_t * key)
+{
+  vnet_buffer_opaque2_t *o = vnet_buffer2 (b);
+  ip6_header_t *ip6 =
+    (ip6_header_t *) (b->data + o->flow_ctx.l3_hdr_offset);
+
+  key->key[0] = ip6->src_address.as_u64[0];
+  key->key[1] = ip6->src_address.as_u64[1];
+  key->key[2] = ip6->dst_address.as_u64[0];
+  key->key[3] = ip6->dst_address.as_u64[1];
+  key->key[4] = o->flow_ctx.key[1];
+  key->value = 0;
+}
+
+/**
+ * @brief Parse a packet into its flow context, whatever its encapsulation.
+ */
+static_always_inline void
+nfchain_flow_ctx_parse (vlib_buffer_t * b, vnet_buffer_opaque2_t * o)
+{
+  u16 type = nfchain_flow_ethertype (b, &o->flow_ctx.l3_hdr_offset);
+  u8 *l3 = b->data + o->flow_ctx.l3_hdr_offset;
+  udp_header_t *l4;
+  u8 protocol = 0;
+  int has_ports = 0;
+
+  o->flow_ctx.key[0] = 0;
+  o->flow_ctx.ip_version = 0;
+  o->flow_ctx.l4_hdr_offset = o->flow_ctx.l3_hdr_offset;
+
+  if (PREDICT_TRUE (type == clib_host_to_net_u16 (ETHERNET_TYPE_IP4)))
+    {
+      ip4_header_t *ip4 = (ip4_header_t *) l3;
+
+      protocol = ip4->protocol;
+      has_ports = nfchain_flow_has_ports (protocol) && !ip4_is_fragment (ip4);
+      o->flow_ctx.key[0] = ((u64) ip4->src_address.as_u32 << 32) |
+	ip4->dst_address.as_u32;
+      o->flow_ctx.l4_hdr_offset += ip4_header_bytes (ip4);
+      o->flow_ctx.ip_version = 4;
+    }
+  else if (type == clib_host_to_net_u16 (ETHERNET_TYPE_IP6))
+    {
+      ip6_header_t *ip6 = (ip6_header_t *) l3;
+      ip6_ext_hdr_chain_t chain;
+      int i, last;
+
+      /* The last header of the chain is the L4 one */
+      protocol = ip6->protocol;
+      o->flow_ctx.l4_hdr_offset += sizeof (ip6_header_t);
+      last = ip6_ext_header_walk (b, ip6, -1, &chain);
+      if (PREDICT_TRUE (last >= 0))
+	{
+	  protocol = chain.eh[last].protocol;
+	  o->flow_ctx.l4_hdr_offset = o->flow_ctx.l3_hdr_offset +
+	    chain.eh[last].offset;
+	}
+      has_ports = nfchain_flow_has_ports (protocol);
+      for (i = 0; i < last; i++)
+	if (chain.eh[i].protocol == IP_PROTOCOL_IPV6_FRAGMENTATION)
+	  has_ports = 0;
+      o->flow_ctx.ip_version = 6;
+    }
+
+  l4 = (udp_header_t *) (b->data + o->flow_ctx.l4_hdr_offset);
+  o->flow_ctx.key[1] = (u64) protocol << 32;
+  if (has_ports)
+    o->flow_ctx.key[1] |= ((u32) l4->src_port << 16) | l4->dst_port;
+  o->flow_ctx.protocol = protocol;
+
+  if (PREDICT_FALSE (o->flow_ctx.ip_version == 6))
+    {
+      clib_bihash_kv_40_8_t kv;
+
+      nfchain_flow_ctx_key6 (b, &kv);
+      o->flow_ctx.hash = clib_bihash_hash_40_8 (&kv);
+    }
+  else
+    {
+      clib_bihash_kv_16_8_t kv;
+
+      kv.key[0] = o->flow_ctx.key[0];
+      kv.key[1] = o->flow_ctx.key[1];
+      o->flow_ctx.hash = clib_bihash_hash_16_8 (&kv);
+    }
+}
+
+/**
+ * @brief Return the buffer's flow context, parsing the packet only if no
+ * earlier NF in the chain has done so.
+ *
+ * The flag lives in b->flags, which drivers reset from the buffer
+ * template, so a context left in opaque2 by a previous packet is never
+ * mistaken for a valid one.
+ */
+static_always_inline vnet_buffer_opaque2_t *
+nfchain_flow_ctx_get (vlib_buffer_t * b)
+{
+  vnet_buffer_opaque2_t *o = vnet_buffer2 (b);
+
+  if (PREDICT_TRUE (b->flags & VNET_BUFFER_F_FLOW_CTX_VALID))
+    return o;
+
+  nfchain_flow_ctx_parse (b, o);
+  b->flags |= VNET_BUFFER_F_FLOW_CTX_VALID;
+  return o;
+}
+
+/**
+ * @brief nfchain_flow_ctx_get for a whole frame.
+ *
+ * Untagged IPv4 TCP/UDP/SCTP packets without options or fragmentation,
+ * the bulk of the traffic, are gathered into key arrays by the
+ * vectorized clib_ip4_flow_key_extract and hashed in one loop. The
+ * others go through nfchain_flow_ctx_parse one by one. Either way, the
+ * per-packet nfchain_flow_ctx_get calls that follow only check the flag.
+ */
+static_always_inline void
+nfchain_flow_ctx_get_n (vlib_buffer_t ** b, u32 n_buffers)
+{
+  void *ip4[VLIB_FRAME_SIZE];
+  u64 key0[VLIB_FRAME_SIZE], key1[VLIB_FRAME_SIZE], hash[VLIB_FRAME_SIZE];
+  u32 fast[VLIB_FRAME_SIZE];
+  u32 i, n = 0;
+
+  for (i = 0; i < n_buffers; i++)
+    {
+      ethernet_header_t *e;
+      ip4_header_t *h;
+
+      if (i + 4 < n_buffers)
+	{
+	  vlib_prefetch_buffer_header (b[i + 4], LOAD);
+	  vlib_prefetch_buffer_data (b[i + 4], LOAD);
+	}
+      if (b[i]->flags & VNET_BUFFER_F_FLOW_CTX_VALID)
+	continue;
+
+      e = vlib_buffer_get_current (b[i]);
+      h = (ip4_header_t *) (e + 1);
+      if (PREDICT_TRUE (e->type == clib_host_to_net_u16 (ETHERNET_TYPE_IP4) &&
+			h->ip_version_and_header_length == 0x45 &&
+			!ip4_is_fragment (h) &&
+			nfchain_flow_has_ports (h->protocol)))
+	{
+	  ip4[n] = h;
+	  fast[n++] = i;
+	}
+      else
+	{
+	  nfchain_flow_ctx_parse (b[i], vnet_buffer2 (b[i]));
+	  b[i]->flags |= VNET_BUFFER_F_FLOW_CTX_VALID;
+	}
+    }
+
+  clib_ip4_flow_key_extract (ip4, key0, key1, n);
+#ifdef clib_crc32c_uses_intrinsics
+  clib_flow_key_crc32c (key0, key1, hash, n);
+#else
+  for (i = 0; i < n; i++)
+    {
+      clib_bihash_kv_16_8_t kv = {.key = {key0[i], key1[i]} };
+      hash[i] = clib_bihash_hash_16_8 (&kv);
+    }
+#endif
+
+  for (i = 0; i < n; i++)
+    {
+      vlib_buffer_t *b0 = b[fast[i]];
+      vnet_buffer_opaque2_t *o = vnet_buffer2 (b0);
+
+      o->flow_ctx.l3_hdr_offset = b0->current_data +
+	sizeof (ethernet_header_t);
+      o->flow_ctx.l4_hdr_offset = o->flow_ctx.l3_hdr_offset +
+	sizeof (ip4_header_t);
+      o->flow_ctx.key[0] = key0[i];
+      o->flow_ctx.key[1] = key1[i];
+      o->flow_ctx.hash = hash[i];
+      o->flow_ctx.protocol = key1[i] >> 32;
+      o->flow_ctx.ip_version = 4;
+      b0->flags |= VNET_BUFFER_F_FLOW_CTX_VALID;
+    }
+}
+
+/**
+ * @brief IPv4 flow key of a buffer, as used by the chained NFs' tables.
+ * IPv6 flows are keyed by nfchain_flow_ctx_key6.
+ */
+static_always_inline clib_bihash_kv_16_8_t
+nfchain_flow_ctx_key (vnet_buffer_opaque2_t * o)
+{
+  clib_bihash_kv_16_8_t key;
+
+  key.key[0] = o->flow_ctx.key[0];
+  key.key[1] = o->flow_ctx.key[1];
+
+  return key;
+}
+
+#endif /* __included_nfchain_flow_ctx_h__ */
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
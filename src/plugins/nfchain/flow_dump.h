@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __included_nfchain_flow_dump_h__
+#define __included_nfchain_flow_dump_h__
+
+#include <vlib/vlib.h>
+#include <vnet/ip/ip.h>
+#include <vlibapi/api.h>
+#include <vlibmemory/api.h>
+#include <vnet/ip/ip_types_api.h>
+#include <vppinfra/bihash_16_8.h>
+#include <vppinfra/bihash_40_8.h>
+#include <nfchain/flow_age.h>
+
+/**
+ * Dumping the per-thread NF flow tables.
+ *
+ * Tables are walked a slice of buckets at a time, each bucket copied
+ * under its lock, so dumps never stop the workers updating them. NFs with
+ * IPv6 tables dump those after the IPv4 ones.
+ */
+
+/* Buckets walked between checks for yielding the API process */
+#define NFCHAIN_FLOW_DUMP_BUCKETS 256
+
+typedef struct
+{
+  vl_api_registration_t *rp;
+  u32 context;
+  u16 msg_id_base;
+
+  /* Table being walked, and the time for idle ages */
+  u32 thread_index;
+  u32 now;
+} nfchain_flow_dump_ctx_t;
+
+/* Context of show <nf> flows, walk callbacks stop once n_left hits 0 */
+typedef struct
+{
+  vlib_main_t *vm;
+  u32 thread_index;
+  u32 now;
+  u32 n_left;
+} nfchain_flow_show_ctx_t;
+
+/* Cursor bit of the IPv6 tables, see NFCHAIN_FLOW_DUMP46_MACRO */
+#define NFCHAIN_FLOW_DUMP_CURSOR_IP6 (1ULL << 63)
+
+/**
+ * @brief Reply to an <nf>_flow_get message.
+ *
+ * cb sends an <nf>_flow_details message for each entry of each thread's
+ * table, from mp->cursor on. The cursor is the thread index in the upper
+ * 32 bits and the bucket in the lower ones. As with
+ * REPLY_AND_DETAILS_MACRO, a reply with VNET_API_ERROR_EAGAIN carries the
+ * cursor to resume from, a complete walk replies with cursor ~0.
+ */
+#define NFCHAIN_FLOW_DUMP_MACRO(t, per_cpu, cb)                               \
+  _NFCHAIN_FLOW_DUMP (                                                        \
+    t, per_cpu, 0,                                                            \
+    clib_bihash_foreach_key_value_pair_from_16_8 (                            \
+      &(per_cpu)[thread_index].hash_table, &bucket,                           \
+      NFCHAIN_FLOW_DUMP_BUCKETS, cb, &_ctx))
+
+/**
+ * @brief NFCHAIN_FLOW_DUMP_MACRO for NFs with IPv6 tables as well.
+ * cb6 sends the entries of the hash_table6 tables, walked once all the
+ * IPv4 ones are, the cursor has NFCHAIN_FLOW_DUMP_CURSOR_IP6 set then.
+ */
+#define NFCHAIN_FLOW_DUMP46_MACRO(t, per_cpu, cb, cb6)                        \
+  _NFCHAIN_FLOW_DUMP (                                                        \
+    t, per_cpu, 1,                                                            \
+    (is_ip6 ? clib_bihash_foreach_key_value_pair_from_40_8 (                  \
+		&(per_cpu)[thread_index].hash_table6, &bucket,                \
+		NFCHAIN_FLOW_DUMP_BUCKETS, cb6, &_ctx) :                      \
+	      clib_bihash_foreach_key_value_pair_from_16_8 (                  \
+		&(per_cpu)[thread_index].hash_table, &bucket,                 \
+		NFCHAIN_FLOW_DUMP_BUCKETS, cb, &_ctx)))
+
+#define _NFCHAIN_FLOW_DUMP(t, per_cpu, has_ip6, walk)                         \
+  do                                                                          \
+    {                                                                         \
+      nfchain_flow_dump_ctx_t _ctx = { 0 };                                   \
+      vlib_main_t *vm = vlib_get_main ();                                     \
+      f64 start = vlib_time_now (vm);                                         \
+      u64 cursor = clib_net_to_host_u64 (mp->cursor);                         \
+      int is_ip6 = (has_ip6) && (cursor & NFCHAIN_FLOW_DUMP_CURSOR_IP6);      \
+      u32 thread_index = (cursor & ~NFCHAIN_FLOW_DUMP_CURSOR_IP6) >> 32;      \
+      u32 bucket = (u32) cursor;                                              \
+                                                                              \
+      _ctx.rp = vl_api_client_index_to_registration (mp->client_index);      \
+      if (_ctx.rp == 0)                                                       \
+	return;                                                               \
+      _ctx.context = mp->context;                                             \
+      _ctx.msg_id_base = REPLY_MSG_ID_BASE;                                   \
+      _ctx.now = nfchain_flow_now (vm);                                       \
+                                                                              \
+      while (thread_index < vec_len (per_cpu))                                \
+	{                                                                     \
+	  _ctx.thread_index = thread_index;                                   \
+	  if (!(walk))                                                        \
+	    thread_index++;                                                   \
+	  if (thread_index == vec_len (per_cpu) && (has_ip6) && !is_ip6)      \
+	    {                                                                 \
+	      is_ip6 = 1;                                                     \
+	      thread_index = 0;                                               \
+	    }                                                                 \
+	  if (thread_index < vec_len (per_cpu) &&                             \
+	      vl_api_process_may_suspend (vm, _ctx.rp, start))                \
+	    {                                                                 \
+	      rv = VNET_API_ERROR_EAGAIN;                                     \
+	      break;                                                          \
+	    }                                                                 \
+	}                                                                     \
+                                                                              \
+      cursor = rv == VNET_API_ERROR_EAGAIN ?                                  \
+		 ((u64) thread_index << 32) | bucket |                        \
+		   (is_ip6 ? NFCHAIN_FLOW_DUMP_CURSOR_IP6 : 0) :              \
+		 ~0ULL;                                                       \
+      REPLY_MACRO2 (t, ({ rmp->cursor = clib_host_to_net_u64 (cursor); }));   \
+    }                                                                         \
+  while (0)
+
+/**
+ * @brief Seconds since an aging-stamped value was last hit.
+ */
+static_always_inline u32
+nfchain_flow_idle (u32 now, u64 value)
+{
+  return (now - nfchain_flow_last_seen (value)) & NFCHAIN_FLOW_TIME_MASK;
+}
+
+/**
+ * @brief Fill the address and port fields of an <nf>_flow_details message
+ * from a 5-tuple flow key, whose addresses and ports are in network order.
+ */
+static_always_inline void
+nfchain_flow_details_tuple (clib_bihash_kv_16_8_t * kv, u8 * src_address,
+			    u8 * dst_address, u16 * src_port, u16 * dst_port)
+{
+  u32 src = kv->key[0] >> 32;
+  u32 dst = (u32) kv->key[0];
+
+  clib_memcpy (src_address, &src, sizeof (src));
+  clib_memcpy (dst_address, &dst, sizeof (dst));
+  *src_port = (u16) (kv->key[1] >> 16);
+  *dst_port = (u16) kv->key[1];
+}
+
+/**
+ * @brief nfchain_flow_details_tuple for messages whose addresses are
+ * vl_api_address_t, from an IPv4 flow key.
+ */
+static_always_inline void
+nfchain_flow_details_address (clib_bihash_kv_16_8_t * kv,
+			      vl_api_address_t * src_address,
+			      vl_api_address_t * dst_address, u16 * src_port,
+			      u16 * dst_port)
+{
+  src_address->af = ADDRESS_IP4;
+  dst_address->af = ADDRESS_IP4;
+  nfchain_flow_details_tuple (kv, src_address->un.ip4, dst_address->un.ip4,
+			      src_port, dst_port);
+}
+
+/**
+ * @brief nfchain_flow_details_address from an IPv6 flow key, see
+ * nfchain_flow_ctx_key6.
+ */
+static_always_inline void
+nfchain_flow_details_address6 (clib_bihash_kv_40_8_t * kv,
+			       vl_api_address_t * src_address,
+			       vl_api_address_t * dst_address, u16 * src_port,
+			       u16 * dst_port)
+{
+  src_address->af = ADDRESS_IP6;
+  dst_address->af = ADDRESS_IP6;
+  clib_memcpy (src_address->un.ip6, &kv->key[0], 16);
+  clib_memcpy (dst_address->un.ip6, &kv->key[2], 16);
+  *src_port = (u16) (kv->key[4] >> 16);
+  *dst_port = (u16) kv->key[4];
+}
+
+/**
+ * @brief Format a 5-tuple flow key, see nfchain_flow_ctx_get.
+ */
+static inline u8 *
+format_nfchain_flow_key (u8 * s, va_list * args)
+{
+  clib_bihash_kv_16_8_t *kv = va_arg (*args, clib_bihash_kv_16_8_t *);
+  ip4_address_t src, dst;
+
+  src.as_u32 = kv->key[0] >> 32;
+  dst.as_u32 = (u32) kv->key[0];
+
+  return format (s, "%U:%d -> %U:%d proto %d", format_ip4_address, &src,
+		 clib_net_to_host_u16 ((u16) (kv->key[1] >> 16)),
+		 format_ip4_address, &dst,
+		 clib_net_to_host_u16 ((u16) kv->key[1]),
+		 (u8) (kv->key[1] >> 32));
+}
+
+/**
+ * @brief Format an IPv6 5-tuple flow key, see nfchain_flow_ctx_key6.
+ */
+static inline u8 *
+format_nfchain_flow_key6 (u8 * s, va_list * args)
+{
+  clib_bihash_kv_40_8_t *kv = va_arg (*args, clib_bihash_kv_40_8_t *);
+
+  return format (s, "[%U]:%d -> [%U]:%d proto %d", format_ip6_address,
+		 &kv->key[0], clib_net_to_host_u16 ((u16) (kv->key[4] >> 16)),
+		 format_ip6_address, &kv->key[2],
+		 clib_net_to_host_u16 ((u16) kv->key[4]),
+		 (u8) (kv->key[4] >> 32));
+}
+
+#endif /* __included_nfchain_flow_dump_h__ */
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __included_nfchain_flow_pipeline_h__
+#define __included_nfchain_flow_pipeline_h__
+
+#include <vlib/vlib.h>
+#include <vppinfra/bihash_16_8.h>
+#include <nfchain/flow_ctx.h>
+
+/**
+ * Software-pipelined flow table lookups, the bihash counterpart of
+ * vnet/pipeline.h.
+ *
+ * A frame goes through the stages
+ *   parse    nfchain_flow_ctx_get_n, the whole frame at once
+ *   key      key_fn, the whole frame at once
+ *   bucket   prefetch, 2 * distance packets ahead of update
+ *   data     prefetch, distance packets ahead of update
+ *   update   update_fn, which returns the packet's next index
+ * then is enqueued. Only the two prefetch stages are interleaved, the
+ * others are cheap once the frame is in cache.
+ *
+ * Usage:
+ *
+ *   static_always_inline u16
+ *   my_update (vlib_main_t * vm, vlib_node_runtime_t * node,
+ *              vlib_buffer_t * b, clib_bihash_kv_16_8_t * key, u64 hash,
+ *              void * aux, void * ctx)
+ *   { ... }
+ *
+ *   VLIB_NODE_FN (my_node) (vlib_main_t * vm, vlib_node_runtime_t * node,
+ *                           vlib_frame_t * frame)
+ *   {
+ *     return nfchain_flow_dispatch_pipeline (vm, node, frame, h, distance,
+ *                                            0, 0, my_update, &ctx);
+ *   }
+ *
+ * The stage functions are inlined, pass them as constants. A 0 key_fn
+ * keys packets by their 5-tuple, see nfchain_flow_ctx_key. When aux_size
+ * is not 0, each packet gets aux_size bytes of scratch space, carried
+ * from key_fn to update_fn, as AUX_DATA_TYPE does for vnet/pipeline.h.
+ * Keys of IPv6 packets are up to the stage functions, their prefetches
+ * are for the IPv4 table h only. A 0 distance prefetches nothing, for
+ * stages that do not use h.
+ */
+
+/* Default prefetch distance, in packets */
+#define NFCHAIN_FLOW_PREFETCH_DISTANCE 4
+
+/* Largest distance, buckets are prefetched twice as far */
+#define NFCHAIN_FLOW_PREFETCH_DISTANCE_MAX 32
+
+/**
+ * @brief Key stage: fill key for b, return its hash.
+ */
+typedef u64 (nfchain_flow_key_fn_t) (vlib_buffer_t * b,
+				     clib_bihash_kv_16_8_t * key, void *aux);
+
+/**
+ * @brief Update stage: look key up and act on b, return its next index.
+ */
+typedef u16 (nfchain_flow_update_fn_t) (vlib_main_t * vm,
+					vlib_node_runtime_t * node,
+					vlib_buffer_t * b,
+					clib_bihash_kv_16_8_t * key,
+					u64 hash, void *aux, void *ctx);
+
+static_always_inline uword
+nfchain_flow_dispatch_pipeline (vlib_main_t * vm, vlib_node_runtime_t * node,
+				vlib_frame_t * frame, clib_bihash_16_8_t * h,
+				u32 distance, u32 aux_size,
+				nfchain_flow_key_fn_t * key_fn,
+				nfchain_flow_update_fn_t * update_fn,
+				void *ctx)
+{
+  vlib_buffer_t *bufs[VLIB_FRAME_SIZE];
+  clib_bihash_kv_16_8_t keys[VLIB_FRAME_SIZE];
+  u64 hashes[VLIB_FRAME_SIZE];
+  u16 nexts[VLIB_FRAME_SIZE];
+  u8 *aux = 0;
+  u32 *from, n, i, bucket_dist, data_dist;
+
+  from = vlib_frame_vector_args (frame);
+  n = frame->n_vectors;
+
+  if (aux_size)
+    aux = alloca (n * aux_size);
+
+  distance = clib_min (distance, NFCHAIN_FLOW_PREFETCH_DISTANCE_MAX);
+  data_dist = distance;
+  bucket_dist = 2 * distance;
+
+  /* Parse and hash once, or reuse an upstream NF's flow context */
+  vlib_get_buffers (vm, from, bufs, n);
+  nfchain_flow_ctx_get_n (bufs, n);
+
+  for (i = 0; i < n; i++)
+    {
+      if (key_fn)
+	hashes[i] = key_fn (bufs[i], &keys[i], aux_size ? aux + i * aux_size :
+			    0);
+      else
+	{
+	  keys[i] = nfchain_flow_ctx_key (vnet_buffer2 (bufs[i]));
+	  hashes[i] = vnet_buffer2 (bufs[i])->flow_ctx.hash;
+	}
+    }
+
+  for (i = 0; i < clib_min (n, bucket_dist); i++)
+    clib_bihash_prefetch_bucket_16_8 (h, hashes[i]);
+  for (i = 0; i < clib_min (n, data_dist); i++)
+    clib_bihash_prefetch_data_16_8 (h, hashes[i]);
+
+  for (i = 0; i < n; i++)
+    {
+      if (distance && i + bucket_dist < n)
+	clib_bihash_prefetch_bucket_16_8 (h, hashes[i + bucket_dist]);
+      if (distance && i + data_dist < n)
+	clib_bihash_prefetch_data_16_8 (h, hashes[i + data_dist]);
+
+      nexts[i] = update_fn (vm, node, bufs[i], &keys[i], hashes[i],
+			    aux_size ? aux + i * aux_size : 0, ctx);
+    }
+
+  vlib_buffer_enqueue_to_next (vm, node, from, nexts, n);
+  return n;
+}
+
+#endif /* __included_nfchain_flow_pipeline_h__ */
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
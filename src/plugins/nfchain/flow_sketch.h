@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __included_nfchain_flow_sketch_h__
+#define __included_nfchain_flow_sketch_h__
+
+#include <vlib/vlib.h>
+#include <vppinfra/xxhash.h>
+#include <vppinfra/vector/mask_compare.h>
+
+/**
+ * Heavy-hitter sketch of per-key packet counts, in bounded memory.
+ *
+ * A count-min sketch, NFCHAIN_FLOW_SKETCH_DEPTH rows of width counters,
+ * estimates the count of any key, never below the true one. A
+ * space-saving list keeps the k keys with the largest estimates. A key
+ * with 64 bit hash h counts in bucket
+ *   (h * a[row]) >> (64 - log2 (width))
+ * of each row, a multiply-shift hash per row with its own odd a[row]. Rows
+ * thus collide independently, where h1 + row * h2 double hashing would
+ * make keys agreeing on 2 * log2 (width) bits collide in every row.
+ * Sketches of the same width agree on buckets and merge by adding up
+ * counters.
+ *
+ * Each worker updates its own sketch. The control plane merges them, and
+ * re-estimates the keys of every list on the merged counters. Workers
+ * are never stopped, a merge sees counters a few packets apart.
+ *
+ * Memory is depth * width * 8 + k * 16 bytes, whatever the number of
+ * keys: 64KB + 1KB with the defaults, small enough to stay in L2.
+ */
+
+#define NFCHAIN_FLOW_SKETCH_DEPTH 4
+#define NFCHAIN_FLOW_SKETCH_DEFAULT_WIDTH 2048
+#define NFCHAIN_FLOW_SKETCH_MIN_WIDTH 64
+#define NFCHAIN_FLOW_SKETCH_MAX_WIDTH (1 << 20)
+#define NFCHAIN_FLOW_SKETCH_DEFAULT_K 64
+#define NFCHAIN_FLOW_SKETCH_MAX_K 1024
+
+typedef struct
+{
+  /* NFCHAIN_FLOW_SKETCH_DEPTH rows of width counters */
+  u64 *counts;
+  u32 width;
+  u32 width_shift;
+
+  /* Top keys and their estimates, keys padded to a multiple of 64 */
+  u64 *keys;
+  u64 *estimates;
+  u32 n_keys;
+  u32 k;
+
+  /* Smallest estimate of a full list */
+  u32 min_index;
+} nfchain_flow_sketch_t;
+
+/**
+ * @brief Allocate a sketch, width must be a power of 2.
+ */
+static inline void
+nfchain_flow_sketch_init (nfchain_flow_sketch_t * s, u32 width, u32 k)
+{
+  ASSERT (is_pow2 (width) && width >= NFCHAIN_FLOW_SKETCH_MIN_WIDTH);
+  ASSERT (k && k <= NFCHAIN_FLOW_SKETCH_MAX_K);
+
+  s->width = width;
+  s->width_shift = 64 - min_log2 (width);
+  s->k = k;
+  vec_validate_aligned (s->counts, NFCHAIN_FLOW_SKETCH_DEPTH * width - 1,
+			CLIB_CACHE_LINE_BYTES);
+  /* clib_mask_compare_u64 loads 64 keys at a time */
+  vec_validate_aligned (s->keys, round_pow2 (k, 64) - 1,
+			CLIB_CACHE_LINE_BYTES);
+  vec_validate (s->estimates, k - 1);
+}
+
+static_always_inline u64
+nfchain_flow_sketch_hash (u64 key)
+{
+  return clib_xxhash (key);
+}
+
+static_always_inline u64 *
+nfchain_flow_sketch_counter (nfchain_flow_sketch_t * s, u64 hash, u32 row)
+{
+  static const u64 a[NFCHAIN_FLOW_SKETCH_DEPTH] = {
+    PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4,
+  };
+
+  return s->counts + row * s->width + ((hash * a[row]) >> s->width_shift);
+}
+
+/**
+ * @brief Estimated count of key, at least its true count.
+ */
+static_always_inline u64
+nfchain_flow_sketch_estimate (nfchain_flow_sketch_t * s, u64 hash)
+{
+  u64 estimate = ~0ULL;
+  u32 row;
+
+  for (row = 0; row < NFCHAIN_FLOW_SKETCH_DEPTH; row++)
+    estimate = clib_min (estimate,
+			 nfchain_flow_sketch_counter (s, hash, row)[0]);
+  return estimate;
+}
+
+static_always_inline void
+nfchain_flow_sketch_find_min (nfchain_flow_sketch_t * s)
+{
+  u32 i;
+
+  s->min_index = 0;
+  for (i = 1; i < s->n_keys; i++)
+    if (s->estimates[i] < s->estimates[s->min_index])
+      s->min_index = i;
+}
+
+/**
+ * @brief Space-saving step: keep key in the top list if its estimate
+ * makes it, evicting the smallest of a full list.
+ */
+static_always_inline void
+nfchain_flow_sketch_offer (nfchain_flow_sketch_t * s, u64 key, u64 estimate)
+{
+  u64 bitmap[NFCHAIN_FLOW_SKETCH_MAX_K / 64];
+  u32 i, j;
+
+  /* Most keys of a spread never beat the smallest of a full list */
+  if (s->n_keys == s->k && estimate <= s->estimates[s->min_index])
+    return;
+
+  clib_mask_compare_u64 (key, s->keys, bitmap, s->n_keys);
+  for (i = 0; i < round_pow2 (s->n_keys, 64) / 64; i++)
+    if (bitmap[i])
+      {
+	j = i * 64 + count_trailing_zeros (bitmap[i]);
+	s->estimates[j] = estimate;
+	if (s->n_keys == s->k && j == s->min_index)
+	  nfchain_flow_sketch_find_min (s);
+	return;
+      }
+
+  j = s->n_keys < s->k ? s->n_keys++ : s->min_index;
+  s->keys[j] = key;
+  s->estimates[j] = estimate;
+  if (s->n_keys == s->k)
+    nfchain_flow_sketch_find_min (s);
+}
+
+/**
+ * @brief Count n packets of key, hash from nfchain_flow_sketch_hash.
+ */
+static_always_inline void
+nfchain_flow_sketch_add (nfchain_flow_sketch_t * s, u64 key, u64 hash, u64 n)
+{
+  u64 *c, estimate = ~0ULL;
+  u32 row;
+
+  for (row = 0; row < NFCHAIN_FLOW_SKETCH_DEPTH; row++)
+    {
+      c = nfchain_flow_sketch_counter (s, hash, row);
+      c[0] += n;
+      estimate = clib_min (estimate, c[0]);
+    }
+
+  nfchain_flow_sketch_offer (s, key, estimate);
+}
+
+/**
+ * @brief Halve every count, so that old traffic fades out.
+ */
+static inline void
+nfchain_flow_sketch_decay (nfchain_flow_sketch_t * s)
+{
+  u32 i;
+
+  for (i = 0; i < vec_len (s->counts); i++)
+    s->counts[i] >>= 1;
+  for (i = 0; i < s->n_keys; i++)
+    s->estimates[i] >>= 1;
+}
+
+/**
+ * @brief Merge a vector of sketches of m's width into m.
+ * Keys are re-estimated on the merged counters, the estimates of the
+ * source lists are not read, and may be torn by a worker.
+ */
+static inline void
+nfchain_flow_sketch_merge (nfchain_flow_sketch_t * m,
+			   nfchain_flow_sketch_t ** sketches)
+{
+  nfchain_flow_sketch_t *s;
+  u32 i, j, n_keys;
+  u64 key;
+
+  vec_zero (m->counts);
+  m->n_keys = 0;
+
+  for (i = 0; i < vec_len (sketches); i++)
+    {
+      s = sketches[i];
+      ASSERT (s->width == m->width);
+      for (j = 0; j < vec_len (m->counts); j++)
+	m->counts[j] += s->counts[j];
+    }
+
+  for (i = 0; i < vec_len (sketches); i++)
+    {
+      s = sketches[i];
+      n_keys = clib_min (s->n_keys, s->k);
+      for (j = 0; j < n_keys; j++)
+	{
+	  key = s->keys[j];
+	  nfchain_flow_sketch_offer
+	    (m, key, nfchain_flow_sketch_estimate
+	     (m, nfchain_flow_sketch_hash (key)));
+	}
+    }
+}
+
+/**
+ * @brief Order of the top list, largest estimate first.
+ */
+static inline u32 *
+nfchain_flow_sketch_sort (nfchain_flow_sketch_t * s)
+{
+  u32 *order = 0, i, j;
+
+  for (i = 0; i < s->n_keys; i++)
+    {
+      vec_add1 (order, i);
+      for (j = i; j > 0 && s->estimates[order[j - 1]] < s->estimates[i]; j--)
+	order[j] = order[j - 1];
+      order[j] = i;
+    }
+  return order;
+}
+
+#endif /* __included_nfchain_flow_sketch_h__ */
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __included_nfchain_flow_topk_h__
+#define __included_nfchain_flow_topk_h__
+
+#include <vlib/vlib.h>
+#include <vlib/stats/stats.h>
+#include <vppinfra/bihash_16_8.h>
+#include <vppinfra/bihash_40_8.h>
+#include <vppinfra/mhash.h>
+#include <nfchain/flow_age.h>
+
+/**
+ * Top-K export of per-flow counters to the stats segment.
+ *
+ * A stats collector walks the per-thread tables a slice of buckets per
+ * stats update, the IPv6 ones after the IPv4 ones for NFs which have
+ * them, sums the counts of keys found in several tables, and
+ * once every table has been walked publishes the K largest as two
+ * vectors of the same order:
+ *   /<nf>/top/flows    key names (string vector)
+ *   /<nf>/top/packets  counts (counter vector, thread 0)
+ * Buckets are copied under their lock, workers are never stopped.
+ */
+
+#define NFCHAIN_FLOW_TOPK_MAX 1024
+
+/* Buckets walked per stats update */
+#define NFCHAIN_FLOW_TOPK_BUCKETS (64 << 10)
+
+typedef struct
+{
+  /* Flows published, 0 if disabled */
+  u32 k;
+
+  /* Format a clib_bihash_kv_16_8_t key, and a clib_bihash_kv_40_8_t one */
+  format_function_t *format_key;
+  format_function_t *format_key6;
+
+  /* Stats segment entries */
+  u32 counts_index;
+  vlib_stats_string_vector_t names;
+
+  /* Walk position */
+  u32 thread_index;
+  u32 bucket;
+  u8 is_ip6;
+
+  /* Counts merged over the tables walked so far, value is the count */
+  mhash_t index_by_key;
+  clib_bihash_kv_16_8_t *merged;
+  mhash_t index_by_key6;
+  clib_bihash_kv_40_8_t *merged6;
+} nfchain_flow_topk_t;
+
+/* One of the K largest, an index in merged or merged6 */
+typedef struct
+{
+  u64 count;
+  u32 index;
+  u8 is_ip6;
+} nfchain_flow_topk_entry_t;
+
+static inline int
+nfchain_flow_topk_merge_kvp (clib_bihash_kv_16_8_t * kv, void *arg)
+{
+  nfchain_flow_topk_t *t = arg;
+  clib_bihash_kv_16_8_t *m;
+  uword *p;
+
+  p = mhash_get (&t->index_by_key, kv->key);
+  if (p)
+    {
+      t->merged[p[0]].value += nfchain_flow_count (kv->value);
+      return BIHASH_WALK_CONTINUE;
+    }
+
+  mhash_set (&t->index_by_key, kv->key, vec_len (t->merged), 0);
+  vec_add2 (t->merged, m, 1);
+  m->key[0] = kv->key[0];
+  m->key[1] = kv->key[1];
+  m->value = nfchain_flow_count (kv->value);
+  return BIHASH_WALK_CONTINUE;
+}
+
+static inline int
+nfchain_flow_topk_merge_kvp6 (clib_bihash_kv_40_8_t * kv, void *arg)
+{
+  nfchain_flow_topk_t *t = arg;
+  clib_bihash_kv_40_8_t *m;
+  uword *p;
+
+  p = mhash_get (&t->index_by_key6, kv->key);
+  if (p)
+    {
+      t->merged6[p[0]].value += nfchain_flow_count (kv->value);
+      return BIHASH_WALK_CONTINUE;
+    }
+
+  mhash_set (&t->index_by_key6, kv->key, vec_len (t->merged6), 0);
+  vec_add2 (t->merged6, m, 1);
+  clib_memcpy_fast (m->key, kv->key, sizeof (m->key));
+  m->value = nfchain_flow_count (kv->value);
+  return BIHASH_WALK_CONTINUE;
+}
+
+/**
+ * @brief Insert into a sorted top K, most entries fail the first test.
+ */
+static inline void
+nfchain_flow_topk_insert (nfchain_flow_topk_t * t,
+			  nfchain_flow_topk_entry_t ** top, u64 count,
+			  u32 index, u8 is_ip6)
+{
+  nfchain_flow_topk_entry_t *v = *top;
+  u32 j;
+
+  if (vec_len (v) == t->k && count <= v[t->k - 1].count)
+    return;
+  if (vec_len (v) < t->k)
+    vec_validate (v, vec_len (v));
+  for (j = vec_len (v) - 1; j > 0 && v[j - 1].count < count; j--)
+    v[j] = v[j - 1];
+  v[j].count = count;
+  v[j].index = index;
+  v[j].is_ip6 = is_ip6;
+  *top = v;
+}
+
+/**
+ * @brief Publish the K largest merged counts and start over.
+ */
+static inline void
+nfchain_flow_topk_publish (nfchain_flow_topk_t * t,
+			   vlib_stats_collector_data_t * d)
+{
+  counter_t **counters = d->entry->data;
+  nfchain_flow_topk_entry_t *top = 0;
+  clib_bihash_kv_16_8_t *m;
+  clib_bihash_kv_40_8_t *m6;
+  u32 i;
+
+  vec_foreach (m, t->merged)
+    nfchain_flow_topk_insert (t, &top, m->value, m - t->merged, 0);
+  vec_foreach (m6, t->merged6)
+    nfchain_flow_topk_insert (t, &top, m6->value, m6 - t->merged6, 1);
+
+  for (i = 0; i < t->k; i++)
+    {
+      if (i < vec_len (top))
+	{
+	  if (top[i].is_ip6)
+	    vlib_stats_set_string_vector (&t->names, i, "%U", t->format_key6,
+					  &t->merged6[top[i].index]);
+	  else
+	    vlib_stats_set_string_vector (&t->names, i, "%U", t->format_key,
+					  &t->merged[top[i].index]);
+	  counters[0][i] = top[i].count;
+	}
+      else
+	{
+	  vlib_stats_set_string_vector (&t->names, i, "");
+	  counters[0][i] = 0;
+	}
+    }
+
+  vec_free (top);
+  vec_reset_length (t->merged);
+  mhash_free (&t->index_by_key);
+  mhash_init (&t->index_by_key, sizeof (uword), sizeof (m->key));
+  vec_reset_length (t->merged6);
+  mhash_free (&t->index_by_key6);
+  mhash_init (&t->index_by_key6, sizeof (uword), sizeof (m6->key));
+  t->thread_index = 0;
+  t->bucket = 0;
+  t->is_ip6 = 0;
+}
+
+/**
+ * @brief One stats update worth of top-K work.
+ * Walks the next slice of the current thread's table, h or once all
+ * n_tables IPv4 ones are done h6, and publishes once the last of those is
+ * done. h6 is 0 for NFs without IPv6 tables. Called from the NF's stats
+ * collector.
+ */
+static inline void
+nfchain_flow_topk_collect (nfchain_flow_topk_t * t, clib_bihash_16_8_t * h,
+			   clib_bihash_40_8_t * h6, u32 n_tables,
+			   vlib_stats_collector_data_t * d)
+{
+  int more;
+
+  if (t->is_ip6)
+    more = clib_bihash_foreach_key_value_pair_from_40_8
+      (h6, &t->bucket, NFCHAIN_FLOW_TOPK_BUCKETS,
+       nfchain_flow_topk_merge_kvp6, t);
+  else
+    more = clib_bihash_foreach_key_value_pair_from_16_8
+      (h, &t->bucket, NFCHAIN_FLOW_TOPK_BUCKETS, nfchain_flow_topk_merge_kvp,
+       t);
+  if (!more)
+    t->thread_index++;
+
+  if (t->thread_index < n_tables)
+    return;
+
+  if (h6 && !t->is_ip6)
+    {
+      t->is_ip6 = 1;
+      t->thread_index = 0;
+    }
+  else
+    nfchain_flow_topk_publish (t, d);
+}
+
+/**
+ * @brief Create the stats entries for an NF's top K, and register the
+ * collector driving nfchain_flow_topk_collect.
+ */
+static inline void
+nfchain_flow_topk_init (nfchain_flow_topk_t * t, char *nf,
+			format_function_t * format_key,
+			format_function_t * format_key6,
+			vlib_stats_collector_fn_t collect_fn)
+{
+  vlib_stats_collector_reg_t r = { };
+
+  t->format_key = format_key;
+  t->format_key6 = format_key6;
+  t->names = vlib_stats_add_string_vector ("/%s/top/flows", nf);
+  t->counts_index = vlib_stats_add_counter_vector ("/%s/top/packets", nf);
+  vlib_stats_validate (t->counts_index, 0, t->k - 1);
+  mhash_init (&t->index_by_key, sizeof (uword),
+	      sizeof (((clib_bihash_kv_16_8_t *) 0)->key));
+  mhash_init (&t->index_by_key6, sizeof (uword),
+	      sizeof (((clib_bihash_kv_40_8_t *) 0)->key));
+
+  r.entry_index = t->counts_index;
+  r.collect_fn = collect_fn;
+  vlib_stats_register_collector_fn (&r);
+}
+
+#endif /* __included_nfchain_flow_topk_h__ */
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * @file
+ * @brief NF chain plugin, per-NF cost accounting: perf events, CLI and
+ * stats segment export of the NFs' nfchain_nf_stats_t samples.
+ */
+
+#include <vnet/vnet.h>
+#include <vnet/plugin/plugin.h>
+#include <vlib/stats/stats.h>
+#include <nfchain/nfchain.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/* Stats segment names, the fused node last */
+static char * nfchain_perf_nf_names[NFCHAIN_PERF_N_NF] = {
+#define _(nf,NF) #nf,
+  foreach_nfchain_nf
+#undef _
+  "fused",
+};
+
+static char * nfchain_perf_stage_names[NFCHAIN_NF_N_STAGE] = {
+#define _(s,n) n,
+  foreach_nfchain_nf_stage
+#undef _
+};
+
+static char * nfchain_perf_stat_names[NFCHAIN_NF_N_STAT] = {
+#define _(s,n) n,
+  foreach_nfchain_nf_stat
+#undef _
+};
+
+/**
+ * @brief Look up the samples of every loaded NF plugin.
+ * NFs whose plugin is not loaded are skipped.
+ */
+static void
+nfchain_perf_resolve (nfchain_perf_t * p)
+{
+  u8 * plugin, * symbol;
+  int i;
+
+  for (i = 0; i < NFCHAIN_N_NF; i++)
+    {
+      if (p->nfs[i].stats)
+        continue;
+      plugin = format (0, "%s_plugin.so%c", nfchain_perf_nf_names[i], 0);
+      symbol = format (0, "%s_nf_stats%c", nfchain_perf_nf_names[i], 0);
+      p->nfs[i].stats = vlib_get_plugin_symbol ((char *) plugin,
+                                                (char *) symbol);
+      vec_free (plugin);
+      vec_free (symbol);
+    }
+  p->nfs[NFCHAIN_N_NF].stats = &nfchain_fused_nf_stats;
+}
+
+static void
+nfchain_perf_close (nfchain_perf_t * p)
+{
+  uword page_size = clib_mem_get_page_size ();
+  int i;
+
+  for (i = 0; i < vec_len (p->pages); i++)
+    munmap (p->pages[i], page_size);
+  for (i = 0; i < vec_len (p->fds); i++)
+    close (p->fds[i]);
+  vec_reset_length (p->pages);
+  vec_reset_length (p->fds);
+  vec_zero (p->pmcs);
+}
+
+#ifdef __x86_64__
+/**
+ * @brief rdpmc index + 1 of an event, 0 if it cannot be read from user
+ * space, and the mask of its counter width. See struct
+ * perf_event_mmap_page, the page is under a seqlock.
+ */
+static u32
+nfchain_perf_pmc_index (struct perf_event_mmap_page * page, u64 * mask)
+{
+  u32 seq, index, cap, width;
+
+  do
+    {
+      seq = page->lock;
+      CLIB_COMPILER_BARRIER ();
+      index = page->index;
+      cap = page->cap_user_rdpmc;
+      width = page->pmc_width;
+      CLIB_COMPILER_BARRIER ();
+    }
+  while (page->lock != seq);
+
+  *mask = width && width < 64 ? ((u64) 1 << width) - 1 : ~0ULL;
+  return cap ? index : 0;
+}
+
+/**
+ * @brief Count the perf events on a thread, as one group.
+ *
+ * As with the perfmon plugin's node bundles, counter indices are read
+ * once, assuming workers stay on the CPU they are pinned to.
+ */
+static clib_error_t *
+nfchain_perf_open (nfchain_perf_t * p, u32 thread_index)
+{
+  static const u64 configs[NFCHAIN_NF_N_EVENTS] = {
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+  };
+  struct perf_event_attr pe = {
+    .size = sizeof (struct perf_event_attr),
+    .type = PERF_TYPE_HARDWARE,
+    .exclude_kernel = 1,
+    .disabled = 1,
+  };
+  uword page_size = clib_mem_get_page_size ();
+  int pid = vlib_worker_threads[thread_index].lwp;
+  int fd, group_fd = -1, i;
+  void * page;
+
+  for (i = 0; i < NFCHAIN_NF_N_EVENTS; i++)
+    {
+      pe.config = configs[i];
+      fd = syscall (__NR_perf_event_open, &pe, pid, -1, group_fd, 0);
+      if (fd == -1)
+        return clib_error_return_unix (0, "perf_event_open");
+      vec_add1 (p->fds, fd);
+      if (group_fd == -1)
+        group_fd = fd;
+
+      page = mmap (0, page_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (page == MAP_FAILED)
+        return clib_error_return_unix (0, "mmap");
+      vec_add1 (p->pages, page);
+    }
+
+  if (ioctl (group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == -1)
+    return clib_error_return_unix (0, "ioctl (PERF_EVENT_IOC_ENABLE)");
+
+  for (i = 0; i < NFCHAIN_NF_N_EVENTS; i++)
+    {
+      page = p->pages[vec_len (p->pages) - NFCHAIN_NF_N_EVENTS + i];
+      p->pmcs[thread_index].pmc_index[i] =
+        nfchain_perf_pmc_index (page, &p->pmcs[thread_index].pmc_mask[i]);
+      if (p->pmcs[thread_index].pmc_index[i] == 0)
+        return clib_error_return (0, "thread %u: no rdpmc access to %s",
+                                  thread_index,
+                                  nfchain_perf_stat_names[i + 1]);
+    }
+  return 0;
+}
+#endif
+
+/**
+ * @brief Copy an NF stage's samples to the stats segment.
+ * Registered on the stage's totals entry, private_data is
+ * nf * NFCHAIN_NF_N_STAGE + stage.
+ */
+static void
+nfchain_perf_collect (vlib_stats_collector_data_t * d)
+{
+  nfchain_perf_t * p = &nfchain_main.perf;
+  nfchain_perf_nf_t * n = p->nfs + d->private_data / NFCHAIN_NF_N_STAGE;
+  u32 stage = d->private_data % NFCHAIN_NF_N_STAGE;
+  counter_t ** totals = d->entry->data, ** hist;
+  nfchain_nf_stats_thread_t * t;
+  u32 thread_index, i;
+
+  for (thread_index = 0; thread_index < vec_len (totals); thread_index++)
+    {
+      t = n->stats->threads + thread_index * NFCHAIN_NF_N_STAGE + stage;
+      totals[thread_index][NFCHAIN_PERF_TOTAL_FRAMES] = t->n_frames;
+      totals[thread_index][NFCHAIN_PERF_TOTAL_PACKETS] = t->n_packets;
+      for (i = 0; i < NFCHAIN_NF_N_STAT; i++)
+        {
+          totals[thread_index][NFCHAIN_PERF_TOTAL_PACKETS + 1 + i] =
+            t->total[i];
+          hist = vlib_stats_get_entry_data_pointer (n->hist_index[stage][i]);
+          clib_memcpy_fast (hist[thread_index], t->hist[i],
+                            sizeof (t->hist[i]));
+        }
+    }
+}
+
+/**
+ * @brief Create the stats segment entries of every resolved NF:
+ *   /nfchain/perf/<nf>/<stage>/totals  frames, packets, then per-stat sums
+ *   /nfchain/perf/<nf>/<stage>/<stat>  per-packet cost histogram
+ * by thread. Collectors cannot be unregistered, so this is done once.
+ */
+static void
+nfchain_perf_stats_register (nfchain_perf_t * p, u32 n_threads)
+{
+  vlib_stats_collector_reg_t r = { };
+  nfchain_perf_nf_t * n;
+  char * nf;
+  u32 stage, i;
+
+  for (n = p->nfs; n < p->nfs + NFCHAIN_PERF_N_NF; n++)
+    {
+      if (n->stats == 0)
+        continue;
+      nf = nfchain_perf_nf_names[n - p->nfs];
+      for (stage = 0; stage < NFCHAIN_NF_N_STAGE; stage++)
+        {
+          n->totals_index[stage] = vlib_stats_add_counter_vector
+            ("/nfchain/perf/%s/%s/totals", nf,
+             nfchain_perf_stage_names[stage]);
+          vlib_stats_validate (n->totals_index[stage], n_threads - 1,
+                               NFCHAIN_PERF_N_TOTAL - 1);
+          for (i = 0; i < NFCHAIN_NF_N_STAT; i++)
+            {
+              n->hist_index[stage][i] = vlib_stats_add_counter_vector
+                ("/nfchain/perf/%s/%s/%s", nf,
+                 nfchain_perf_stage_names[stage], nfchain_perf_stat_names[i]);
+              vlib_stats_validate (n->hist_index[stage][i], n_threads - 1,
+                                   NFCHAIN_NF_STATS_N_BUCKETS - 1);
+            }
+
+          r.entry_index = n->totals_index[stage];
+          r.collect_fn = nfchain_perf_collect;
+          r.private_data = (n - p->nfs) * NFCHAIN_NF_N_STAGE + stage;
+          vlib_stats_register_collector_fn (&r);
+        }
+    }
+  p->stats_registered = 1;
+}
+
+/**
+ * @brief Turn per-NF cost sampling on or off.
+ *
+ * Sampling always reads the TSC. The perf events are opened on every
+ * thread on enable and closed on disable; if they cannot be, sampling
+ * falls back to clocks only. NFs only see enabled flip under the barrier,
+ * never a closed event. Samples are kept across disable / enable.
+ */
+int
+nfchain_perf_enable_disable (nfchain_main_t * sm, int enable_disable)
+{
+  nfchain_perf_t * p = &sm->perf;
+  vlib_main_t * vm = vlib_get_main ();
+  u32 n_threads = vlib_get_n_threads ();
+  nfchain_perf_nf_t * n;
+  clib_error_t * error = 0;
+  u32 thread_index;
+
+  if (!enable_disable == !p->enabled)
+    return 0;
+
+  if (enable_disable)
+    {
+      nfchain_perf_resolve (p);
+      vec_validate_aligned (p->pmcs, n_threads - 1, CLIB_CACHE_LINE_BYTES);
+#ifdef __x86_64__
+      for (thread_index = 0; thread_index < n_threads && !error;
+           thread_index++)
+        error = nfchain_perf_open (p, thread_index);
+#else
+      error = clib_error_return (0, "rdpmc not supported");
+#endif
+      if (error)
+        {
+          clib_warning ("nfchain: %U, counting clocks only",
+                        format_clib_error, error);
+          clib_error_free (error);
+          nfchain_perf_close (p);
+        }
+
+      for (n = p->nfs; n < p->nfs + NFCHAIN_PERF_N_NF; n++)
+        if (n->stats)
+          {
+            vec_validate_aligned (n->stats->threads,
+                                  n_threads * NFCHAIN_NF_N_STAGE - 1,
+                                  CLIB_CACHE_LINE_BYTES);
+            n->stats->pmcs = p->pmcs;
+          }
+      if (!p->stats_registered)
+        nfchain_perf_stats_register (p, n_threads);
+    }
+
+  vlib_worker_thread_barrier_sync (vm);
+  for (n = p->nfs; n < p->nfs + NFCHAIN_PERF_N_NF; n++)
+    if (n->stats)
+      n->stats->enabled = enable_disable != 0;
+  vlib_worker_thread_barrier_release (vm);
+
+  if (!enable_disable)
+    nfchain_perf_close (p);
+
+  p->enabled = enable_disable != 0;
+  return 0;
+}
+
+static clib_error_t *
+perf_enable_disable_command_fn (vlib_main_t * vm,
+                                unformat_input_t * input,
+                                vlib_cli_command_t * cmd)
+{
+  nfchain_main_t * sm = &nfchain_main;
+  int enable_disable = 1;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "disable"))
+      enable_disable = 0;
+    else if (unformat (input, "enable"))
+      enable_disable = 1;
+    else
+      break;
+  }
+
+  nfchain_perf_enable_disable (sm, enable_disable);
+  return 0;
+}
+
+/**
+ * @brief CLI command to turn per-NF cost sampling on or off.
+ */
+VLIB_CLI_COMMAND (perf_enable_disable_command, static) = {
+    .path = "nfchain perf",
+    .short_help = "nfchain perf [enable | disable]",
+    .function = perf_enable_disable_command_fn,
+};
+
+/* Lower bound of a histogram bucket, in units per packet */
+static u8 *
+format_nfchain_perf_bucket (u8 * s, va_list * args)
+{
+  u32 bucket = va_arg (*args, u32);
+
+  if (bucket == 0)
+    return format (s, "<%.4g", 1.0 / (1 << NFCHAIN_NF_STATS_FRAC_BITS));
+  return format (s, ">=%.4g", (f64) (1ULL << (bucket - 1)) /
+                 (1 << NFCHAIN_NF_STATS_FRAC_BITS));
+}
+
+static clib_error_t *
+show_perf_command_fn (vlib_main_t * vm,
+                      unformat_input_t * input,
+                      vlib_cli_command_t * cmd)
+{
+  nfchain_perf_t * p = &nfchain_main.perf;
+  nfchain_nf_stats_thread_t sum, * t;
+  nfchain_perf_nf_t * n;
+  u32 stage, thread_index, i, b;
+  int verbose = 0;
+
+  if (unformat (input, "verbose"))
+    verbose = 1;
+
+  vlib_cli_output (vm, "sampling %s%s", p->enabled ? "on" : "off",
+                   p->enabled && vec_len (p->fds) == 0 ?
+                   ", clocks only" : "");
+
+  for (n = p->nfs; n < p->nfs + NFCHAIN_PERF_N_NF; n++)
+    {
+      if (n->stats == 0 || vec_len (n->stats->threads) == 0)
+        continue;
+      for (stage = 0; stage < NFCHAIN_NF_N_STAGE; stage++)
+        {
+          clib_memset (&sum, 0, sizeof (sum));
+          for (thread_index = 0;
+               thread_index < vec_len (n->stats->threads) / NFCHAIN_NF_N_STAGE;
+               thread_index++)
+            {
+              t = n->stats->threads + thread_index * NFCHAIN_NF_N_STAGE +
+                stage;
+              sum.n_frames += t->n_frames;
+              sum.n_packets += t->n_packets;
+              for (i = 0; i < NFCHAIN_NF_N_STAT; i++)
+                {
+                  sum.total[i] += t->total[i];
+                  for (b = 0; b < NFCHAIN_NF_STATS_N_BUCKETS; b++)
+                    sum.hist[i][b] += t->hist[i][b];
+                }
+            }
+          if (sum.n_packets == 0)
+            continue;
+
+          vlib_cli_output (vm, "%s %s: %llu frames, %llu packets",
+                           nfchain_perf_nf_names[n - p->nfs],
+                           nfchain_perf_stage_names[stage],
+                           sum.n_frames, sum.n_packets);
+          for (i = 0; i < NFCHAIN_NF_N_STAT; i++)
+            {
+              vlib_cli_output (vm, "  %-14s %.2f/packet",
+                               nfchain_perf_stat_names[i],
+                               (f64) sum.total[i] / sum.n_packets);
+              if (!verbose)
+                continue;
+              for (b = 0; b < NFCHAIN_NF_STATS_N_BUCKETS; b++)
+                if (sum.hist[i][b])
+                  vlib_cli_output (vm, "    %U: %llu frames",
+                                   format_nfchain_perf_bucket, b,
+                                   sum.hist[i][b]);
+            }
+        }
+    }
+  return 0;
+}
+
+/**
+ * @brief CLI command to show the per-NF costs, per packet, and with
+ * verbose the histograms of frames by per-packet cost.
+ */
+VLIB_CLI_COMMAND (show_perf_command, static) = {
+    .path = "show nfchain perf",
+    .short_help = "show nfchain perf [verbose]",
+    .function = show_perf_command_fn,
+};
+
+static clib_error_t *
+clear_perf_command_fn (vlib_main_t * vm,
+                       unformat_input_t * input,
+                       vlib_cli_command_t * cmd)
+{
+  nfchain_perf_t * p = &nfchain_main.perf;
+  nfchain_perf_nf_t * n;
+
+  vlib_worker_thread_barrier_sync (vm);
+  for (n = p->nfs; n < p->nfs + NFCHAIN_PERF_N_NF; n++)
+    if (n->stats)
+      vec_zero (n->stats->threads);
+  vlib_worker_thread_barrier_release (vm);
+  return 0;
+}
+
+/**
+ * @brief CLI command to reset the per-NF cost samples.
+ */
+VLIB_CLI_COMMAND (clear_perf_command, static) = {
+    .path = "clear nfchain perf",
+    .short_help = "clear nfchain perf",
+    .function = clear_perf_command_fn,
+};
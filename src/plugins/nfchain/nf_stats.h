@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __included_nfchain_nf_stats_h__
+#define __included_nfchain_nf_stats_h__
+
+#include <vlib/vlib.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+/**
+ * Per-NF cost accounting.
+ *
+ * Each NF plugin exports an nfchain_nf_stats_t named <nf>_nf_stats, and
+ * brackets the stages of its node function with nfchain_nf_stats_begin()
+ * and nfchain_nf_stats_end():
+ *   frame   the packets, flow table lookups included
+ *   sweep   the flow tables' aging sweep
+ * While sampling is on, each stage of each frame reads the TSC and the
+ * perf events counted on the thread (LLC misses, branch misses), and adds
+ * its per-packet cost to a per-thread histogram. The nfchain plugin
+ * turns sampling on and off, opens the perf events and exports the
+ * histograms to the stats segment. Off, a stage costs one load and a
+ * predicted branch.
+ */
+
+#define foreach_nfchain_nf_stage \
+_(FRAME, "frame")                \
+_(SWEEP, "sweep")
+
+typedef enum
+{
+#define _(s,n) NFCHAIN_NF_STAGE_##s,
+  foreach_nfchain_nf_stage
+#undef _
+    NFCHAIN_NF_N_STAGE,
+} nfchain_nf_stage_t;
+
+/* Sampled values, the perf events in the order they are opened */
+#define foreach_nfchain_nf_stat          \
+_(CLOCKS, "clocks")                      \
+_(LLC_MISSES, "llc-misses")              \
+_(BRANCH_MISSES, "branch-misses")
+
+typedef enum
+{
+#define _(s,n) NFCHAIN_NF_STAT_##s,
+  foreach_nfchain_nf_stat
+#undef _
+    NFCHAIN_NF_N_STAT,
+} nfchain_nf_stat_t;
+
+#define NFCHAIN_NF_N_EVENTS (NFCHAIN_NF_N_STAT - 1)
+
+/*
+ * Histograms count frames by per-packet cost, in 1/16ths: bucket 0 holds
+ * costs under 1/16 per packet, bucket b > 0 costs in [2^(b-1), 2^b)
+ * sixteenths, the last one everything above.
+ */
+#define NFCHAIN_NF_STATS_FRAC_BITS 4
+#define NFCHAIN_NF_STATS_N_BUCKETS 24
+
+/* Perf events of a thread, set up by the nfchain plugin */
+typedef struct
+{
+  /* rdpmc counter index + 1 of each event, 0 if not counting */
+  u32 pmc_index[NFCHAIN_NF_N_EVENTS];
+
+  /* Counter width mask of each event, rdpmc values wrap at pmc_width */
+  u64 pmc_mask[NFCHAIN_NF_N_EVENTS];
+} nfchain_nf_stats_pmc_t;
+
+typedef struct
+{
+  CLIB_CACHE_LINE_ALIGN_MARK (cacheline0);
+  u64 n_frames;
+  u64 n_packets;
+  u64 total[NFCHAIN_NF_N_STAT];
+  u64 hist[NFCHAIN_NF_N_STAT][NFCHAIN_NF_STATS_N_BUCKETS];
+} nfchain_nf_stats_thread_t;
+
+typedef struct
+{
+  /* Sampling on, set last by nfchain once the rest is in place */
+  volatile u8 enabled;
+
+  /* By thread */
+  nfchain_nf_stats_pmc_t *pmcs;
+
+  /* By thread and stage, thread * NFCHAIN_NF_N_STAGE + stage */
+  nfchain_nf_stats_thread_t *threads;
+} nfchain_nf_stats_t;
+
+typedef struct
+{
+  u8 enabled;
+  u64 start[NFCHAIN_NF_N_STAT];
+} nfchain_nf_sample_t;
+
+static_always_inline void
+nfchain_nf_stats_read (nfchain_nf_stats_pmc_t * pmc, u64 * values)
+{
+  u32 i;
+
+  values[NFCHAIN_NF_STAT_CLOCKS] = clib_cpu_time_now ();
+  for (i = 0; i < NFCHAIN_NF_N_EVENTS; i++)
+#ifdef __x86_64__
+    values[i + 1] = pmc->pmc_index[i] ? _rdpmc (pmc->pmc_index[i] - 1) : 0;
+#else
+    values[i + 1] = 0;
+#endif
+}
+
+static_always_inline void
+nfchain_nf_stats_begin (nfchain_nf_stats_t * st, u32 thread_index,
+			nfchain_nf_sample_t * s)
+{
+  s->enabled = st->enabled;
+  if (PREDICT_FALSE (s->enabled))
+    nfchain_nf_stats_read (st->pmcs + thread_index, s->start);
+}
+
+static_always_inline void
+nfchain_nf_stats_end (nfchain_nf_stats_t * st, u32 thread_index,
+		      nfchain_nf_stage_t stage, nfchain_nf_sample_t * s,
+		      u32 n_packets)
+{
+  nfchain_nf_stats_pmc_t *pmc;
+  nfchain_nf_stats_thread_t *t;
+  u64 end[NFCHAIN_NF_N_STAT], delta, per_packet;
+  u32 i, bucket;
+
+  if (PREDICT_TRUE (!s->enabled) || n_packets == 0)
+    return;
+
+  pmc = st->pmcs + thread_index;
+  nfchain_nf_stats_read (pmc, end);
+  t = st->threads + thread_index * NFCHAIN_NF_N_STAGE + stage;
+  t->n_frames++;
+  t->n_packets += n_packets;
+
+  for (i = 0; i < NFCHAIN_NF_N_STAT; i++)
+    {
+      delta = end[i] - s->start[i];
+      if (i != NFCHAIN_NF_STAT_CLOCKS)
+	delta &= pmc->pmc_mask[i - 1];
+      per_packet = (delta << NFCHAIN_NF_STATS_FRAC_BITS) / n_packets;
+      bucket = per_packet ? min_log2 (per_packet) + 1 : 0;
+      t->total[i] += delta;
+      t->hist[i][clib_min (bucket, NFCHAIN_NF_STATS_N_BUCKETS - 1)]++;
+    }
+}
+
+#endif /* __included_nfchain_nf_stats_h__ */
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
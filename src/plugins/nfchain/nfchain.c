@@ -0,0 +1,542 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/**
+ * @file
+ * @brief NF chain plugin, plugin API / trace / CLI handling.
+ */
+
+#include <vnet/vnet.h>
+#include <vnet/plugin/plugin.h>
+#include <nfchain/nfchain.h>
+
+#include <vlibapi/api.h>
+#include <vlibmemory/api.h>
+
+#include <nfchain/nfchain.api_enum.h>
+#include <nfchain/nfchain.api_types.h>
+
+#define REPLY_MSG_ID_BASE sm->msg_id_base
+#include <vlibapi/api_helper_macros.h>
+
+
+VLIB_PLUGIN_REGISTER () = {
+    .version = NFCHAIN_PLUGIN_BUILD_VER,
+    .description = "NF chain fusion plugin",
+};
+
+nfchain_main_t nfchain_main;
+nfchain_nf_stats_t nfchain_fused_nf_stats;
+
+/**
+ * @brief Look up the state of every fused NF in its own plugin.
+ *
+ * The fused node updates the NFs' own tables and counters, so the
+ * NF plugins must be loaded.
+ */
+static int nfchain_fused_resolve (nfchain_main_t * sm)
+{
+  vlib_main_t * vm = vlib_get_main ();
+  vlib_node_t * n;
+
+  if (sm->fused_nfs_resolved)
+    return 0;
+
+#define _(nf,NF)                                                        \
+  sm->nf##_main = vlib_get_plugin_symbol (#nf "_plugin.so", #nf "_main"); \
+  n = vlib_get_node_by_name (vm, (u8 *) #nf);                           \
+  if (sm->nf##_main == 0 || n == 0)                                     \
+    return VNET_API_ERROR_UNSUPPORTED;                                  \
+  sm->nf##_node_index = n->index;
+  foreach_nfchain_fused_nf
+#undef _
+
+  n = vlib_get_node (vm, sm->ratelimiter_node_index);
+  sm->ratelimiter_drop_error =
+    n->error_heap_index + RATELIMITER_ERROR_DROPPED;
+
+  sm->fused_nfs_resolved = 1;
+  return 0;
+}
+
+/**
+ * @brief Enable/disable the fused NF chain.
+ *
+ * Action function shared between message handler and debug CLI.
+ */
+
+int nfchain_fused_enable_disable (nfchain_main_t * sm, u32 sw_if_index,
+                                  int enable_disable)
+{
+  vnet_sw_interface_t * sw;
+  int rv = 0;
+
+  /* Utterly wrong? */
+  if (pool_is_free_index (sm->vnet_main->interface_main.sw_interfaces,
+                          sw_if_index))
+    return VNET_API_ERROR_INVALID_SW_IF_INDEX;
+
+  /* Not a physical port? */
+  sw = vnet_get_sw_interface (sm->vnet_main, sw_if_index);
+  if (sw->type != VNET_SW_INTERFACE_TYPE_HARDWARE)
+    return VNET_API_ERROR_INVALID_SW_IF_INDEX;
+
+  if (enable_disable && (rv = nfchain_fused_resolve (sm)))
+    return rv;
+
+  vnet_feature_enable_disable ("device-input", "nfchain-fused",
+                               sw_if_index, enable_disable, 0, 0);
+  return rv;
+}
+
+static clib_error_t *
+fused_enable_disable_command_fn (vlib_main_t * vm,
+                                 unformat_input_t * input,
+                                 vlib_cli_command_t * cmd)
+{
+  nfchain_main_t * sm = &nfchain_main;
+  u32 sw_if_index = ~0;
+  int enable_disable = 1;
+
+  int rv;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "disable"))
+      enable_disable = 0;
+    else if (unformat (input, "%U", unformat_vnet_sw_interface,
+                       sm->vnet_main, &sw_if_index))
+      ;
+    else
+      break;
+  }
+
+  if (sw_if_index == ~0)
+    return clib_error_return (0, "Please specify an interface...");
+
+  rv = nfchain_fused_enable_disable (sm, sw_if_index, enable_disable);
+
+  switch(rv) {
+  case 0:
+    break;
+
+  case VNET_API_ERROR_INVALID_SW_IF_INDEX:
+    return clib_error_return
+      (0, "Invalid interface, only works on physical ports");
+    break;
+
+  case VNET_API_ERROR_UNSUPPORTED:
+    return clib_error_return
+      (0, "clb, ratelimiter and flowcounter plugins must be loaded");
+    break;
+
+  default:
+    return clib_error_return (0, "nfchain_fused_enable_disable returned %d",
+                              rv);
+  }
+  return 0;
+}
+
+/**
+ * @brief CLI command to enable/disable the fused NF chain.
+ */
+VLIB_CLI_COMMAND (fused_enable_disable_command, static) = {
+    .path = "nfchain fused",
+    .short_help =
+    "nfchain fused <interface-name> [disable]",
+    .function = fused_enable_disable_command_fn,
+};
+
+static char * nfchain_nf_names[] = {
+#define _(nf,NF) #nf,
+  foreach_nfchain_nf
+#undef _
+};
+
+/**
+ * @brief Look up a chainable NF's hops and node in its own plugin.
+ */
+static int nfchain_nf_resolve (nfchain_main_t * sm, u8 nf)
+{
+  vlib_main_t * vm = vlib_get_main ();
+  nfchain_nf_t * n = &sm->nfs[nf];
+  u8 * plugin, * symbol;
+  vlib_node_t * node;
+
+  if (n->hop)
+    return 0;
+
+  node = vlib_get_node_by_name (vm, (u8 *) nfchain_nf_names[nf]);
+  plugin = format (0, "%s_plugin.so%c", nfchain_nf_names[nf], 0);
+  symbol = format (0, "%s_chain_hop%c", nfchain_nf_names[nf], 0);
+  n->hop = vlib_get_plugin_symbol ((char *) plugin, (char *) symbol);
+  vec_free (plugin);
+  vec_free (symbol);
+
+  if (n->hop == 0 || node == 0)
+    {
+      n->hop = 0;
+      return VNET_API_ERROR_UNSUPPORTED;
+    }
+  n->node_index = node->index;
+  return 0;
+}
+
+/**
+ * @brief Set the NF chain of an interface, nfs is a vector of
+ * nfchain_nf_index_t in chain order, empty to remove the chain.
+ *
+ * The first NF is enabled on the interface's device-input arc, every
+ * NF's hop is pointed at the next one and the last one's at
+ * interface-output. Only new graph arcs and hop vector growth take the
+ * barrier, rewiring known arcs does not stop the workers: packets
+ * already between two NFs may take the old order for the rest of their
+ * frame.
+ */
+int nfchain_chain_set (nfchain_main_t * sm, u32 sw_if_index, u8 * nfs)
+{
+  vlib_main_t * vm = vlib_get_main ();
+  vnet_sw_interface_t * sw;
+  u32 in_chain = 0, next_node;
+  u16 * nexts = 0;
+  u8 * old, * nf;
+  int i, grow = 0, rv;
+
+  /* Utterly wrong? */
+  if (pool_is_free_index (sm->vnet_main->interface_main.sw_interfaces,
+                          sw_if_index))
+    return VNET_API_ERROR_INVALID_SW_IF_INDEX;
+
+  /* Not a physical port? */
+  sw = vnet_get_sw_interface (sm->vnet_main, sw_if_index);
+  if (sw->type != VNET_SW_INTERFACE_TYPE_HARDWARE)
+    return VNET_API_ERROR_INVALID_SW_IF_INDEX;
+
+  vec_foreach (nf, nfs)
+    {
+      if (*nf >= NFCHAIN_N_NF || (in_chain & (1 << *nf)))
+        return VNET_API_ERROR_INVALID_VALUE;
+      if ((rv = nfchain_nf_resolve (sm, *nf)))
+        return rv;
+      in_chain |= 1 << *nf;
+      grow |= sw_if_index >= vec_len (sm->nfs[*nf].hop->next_by_sw_if_index);
+    }
+
+  vec_foreach_index (i, nfs)
+    {
+      next_node = i + 1 < vec_len (nfs) ? sm->nfs[nfs[i + 1]].node_index :
+        vlib_get_node_by_name (vm, (u8 *) "interface-output")->index;
+      vec_add1 (nexts, vlib_node_add_next (vm, sm->nfs[nfs[i]].node_index,
+                                           next_node));
+    }
+
+  /* Workers read the hops, they must not move under them */
+  if (grow)
+    {
+      vlib_worker_thread_barrier_sync (vm);
+      vec_foreach (nf, nfs)
+        vec_validate_init_empty (sm->nfs[*nf].hop->next_by_sw_if_index,
+                                 sw_if_index, NFCHAIN_HOP_NONE);
+      vlib_worker_thread_barrier_release (vm);
+    }
+
+  /* Tail first, the chain is complete by the time its head is */
+  for (i = vec_len (nfs) - 1; i >= 0; i--)
+    sm->nfs[nfs[i]].hop->next_by_sw_if_index[sw_if_index] = nexts[i];
+  vec_free (nexts);
+
+  vec_validate (sm->chain_by_sw_if_index, sw_if_index);
+  old = sm->chain_by_sw_if_index[sw_if_index];
+
+  /* Enter the new chain before leaving the old one */
+  if (vec_len (nfs) && (vec_len (old) == 0 || old[0] != nfs[0]))
+    vnet_feature_enable_disable ("device-input", nfchain_nf_names[nfs[0]],
+                                 sw_if_index, 1, 0, 0);
+  if (vec_len (old) && (vec_len (nfs) == 0 || old[0] != nfs[0]))
+    vnet_feature_enable_disable ("device-input", nfchain_nf_names[old[0]],
+                                 sw_if_index, 0, 0, 0);
+
+  /* NFs off the chain go back to their static next nodes */
+  vec_foreach (nf, old)
+    if (!(in_chain & (1 << *nf)))
+      sm->nfs[*nf].hop->next_by_sw_if_index[sw_if_index] = NFCHAIN_HOP_NONE;
+
+  vec_free (old);
+  sm->chain_by_sw_if_index[sw_if_index] = vec_dup (nfs);
+  return 0;
+}
+
+static uword
+unformat_nfchain_nf (unformat_input_t * input, va_list * args)
+{
+  u8 * nf = va_arg (*args, u8 *);
+  int i;
+
+  for (i = 0; i < NFCHAIN_N_NF; i++)
+    if (unformat (input, nfchain_nf_names[i]))
+      {
+        *nf = i;
+        return 1;
+      }
+  return 0;
+}
+
+static u8 *
+format_nfchain_chain (u8 * s, va_list * args)
+{
+  u8 * nfs = va_arg (*args, u8 *);
+  u8 * nf;
+
+  vec_foreach (nf, nfs)
+    s = format (s, "%s%s", nf == nfs ? "" : " -> ", nfchain_nf_names[*nf]);
+  return s;
+}
+
+static clib_error_t *
+nfchain_chain_error (int rv)
+{
+  switch(rv) {
+  case 0:
+    return 0;
+
+  case VNET_API_ERROR_INVALID_SW_IF_INDEX:
+    return clib_error_return
+      (0, "Invalid interface, only works on physical ports");
+
+  case VNET_API_ERROR_INVALID_VALUE:
+    return clib_error_return (0, "An NF can only appear once in a chain");
+
+  case VNET_API_ERROR_UNSUPPORTED:
+    return clib_error_return (0, "NF plugin not loaded");
+
+  default:
+    return clib_error_return (0, "nfchain_chain_set returned %d", rv);
+  }
+}
+
+static clib_error_t *
+chain_set_command_fn (vlib_main_t * vm,
+                      unformat_input_t * input,
+                      vlib_cli_command_t * cmd)
+{
+  nfchain_main_t * sm = &nfchain_main;
+  u32 sw_if_index = ~0;
+  u8 * nfs = 0, nf;
+  int is_del = 0;
+  clib_error_t * error;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "del"))
+      is_del = 1;
+    else if (unformat (input, "%U", unformat_nfchain_nf, &nf))
+      vec_add1 (nfs, nf);
+    else if (unformat (input, "%U", unformat_vnet_sw_interface,
+                       sm->vnet_main, &sw_if_index))
+      ;
+    else
+      break;
+  }
+
+  if (sw_if_index == ~0)
+    return clib_error_return (0, "Please specify an interface...");
+  if (!is_del && vec_len (nfs) == 0)
+    return clib_error_return (0, "Please specify the chain's NFs...");
+  if (is_del)
+    vec_reset_length (nfs);
+
+  error = nfchain_chain_error (nfchain_chain_set (sm, sw_if_index, nfs));
+  vec_free (nfs);
+  return error;
+}
+
+/**
+ * @brief CLI command to set or remove an interface's NF chain.
+ */
+VLIB_CLI_COMMAND (chain_set_command, static) = {
+    .path = "nfchain chain",
+    .short_help =
+    "nfchain chain <interface-name> <nf> [<nf> ...] | del",
+    .function = chain_set_command_fn,
+};
+
+static clib_error_t *
+show_chains_command_fn (vlib_main_t * vm,
+                        unformat_input_t * input,
+                        vlib_cli_command_t * cmd)
+{
+  nfchain_main_t * sm = &nfchain_main;
+  u8 ** nfs;
+
+  vec_foreach (nfs, sm->chain_by_sw_if_index)
+    if (vec_len (nfs[0]))
+      vlib_cli_output (vm, "%U: %U", format_vnet_sw_if_index_name,
+                       sm->vnet_main, nfs - sm->chain_by_sw_if_index,
+                       format_nfchain_chain, nfs[0]);
+  return 0;
+}
+
+/**
+ * @brief CLI command to show the interfaces' NF chains.
+ */
+VLIB_CLI_COMMAND (show_chains_command, static) = {
+    .path = "show nfchain chains",
+    .short_help = "show nfchain chains",
+    .function = show_chains_command_fn,
+};
+
+/**
+ * @brief Plugin API message handler.
+ */
+static void vl_api_nfchain_fused_enable_disable_t_handler
+(vl_api_nfchain_fused_enable_disable_t * mp)
+{
+  vl_api_nfchain_fused_enable_disable_reply_t * rmp;
+  nfchain_main_t * sm = &nfchain_main;
+  int rv;
+
+  rv = nfchain_fused_enable_disable (sm, ntohl(mp->sw_if_index),
+                                     (int) (mp->enable_disable));
+
+  REPLY_MACRO(VL_API_NFCHAIN_FUSED_ENABLE_DISABLE_REPLY);
+}
+
+static void vl_api_nfchain_chain_set_t_handler
+(vl_api_nfchain_chain_set_t * mp)
+{
+  vl_api_nfchain_chain_set_reply_t * rmp;
+  nfchain_main_t * sm = &nfchain_main;
+  u8 * nfs = 0;
+  int rv;
+
+  vec_add (nfs, mp->nfs, mp->n_nfs);
+  rv = nfchain_chain_set (sm, ntohl(mp->sw_if_index), nfs);
+  vec_free (nfs);
+
+  REPLY_MACRO(VL_API_NFCHAIN_CHAIN_SET_REPLY);
+}
+
+static void vl_api_nfchain_perf_enable_disable_t_handler
+(vl_api_nfchain_perf_enable_disable_t * mp)
+{
+  vl_api_nfchain_perf_enable_disable_reply_t * rmp;
+  nfchain_main_t * sm = &nfchain_main;
+  int rv;
+
+  rv = nfchain_perf_enable_disable (sm, (int) (mp->enable_disable));
+
+  REPLY_MACRO(VL_API_NFCHAIN_PERF_ENABLE_DISABLE_REPLY);
+}
+
+/* API definitions */
+#include <nfchain/nfchain.api.c>
+
+/**
+ * @brief Initialize the nfchain plugin.
+ */
+static clib_error_t * nfchain_init (vlib_main_t * vm)
+{
+  nfchain_main_t * sm = &nfchain_main;
+
+  sm->vnet_main =  vnet_get_main ();
+
+  /* Add our API messages to the global name_crc hash table */
+  sm->msg_id_base = setup_message_id_table ();
+
+  return 0;
+}
+
+VLIB_INIT_FUNCTION (nfchain_init);
+
+/**
+ * @brief Parse the startup config, e.g.
+ * nfchain { chain eth0 { clb ratelimiter flowcounter } }
+ */
+static clib_error_t *
+nfchain_config (vlib_main_t * vm, unformat_input_t * input)
+{
+  nfchain_main_t * sm = &nfchain_main;
+  nfchain_chain_config_t * cc;
+  unformat_input_t sub;
+  u8 * interface, nf;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT)
+    {
+      if (unformat (input, "chain %s %U", &interface,
+                    unformat_vlib_cli_sub_input, &sub))
+        {
+          vec_add2 (sm->chain_configs, cc, 1);
+          cc->interface = interface;
+          while (unformat_check_input (&sub) != UNFORMAT_END_OF_INPUT)
+            {
+              if (!unformat (&sub, "%U", unformat_nfchain_nf, &nf))
+                return clib_error_return (0, "unknown NF `%U'",
+                                          format_unformat_error, &sub);
+              vec_add1 (cc->nfs, nf);
+            }
+          unformat_free (&sub);
+        }
+      else
+        return clib_error_return (0, "unknown input `%U'",
+                                  format_unformat_error, input);
+    }
+
+  return 0;
+}
+
+VLIB_CONFIG_FUNCTION (nfchain_config, "nfchain");
+
+/**
+ * @brief Set up the startup config chains, now that interfaces exist.
+ * A chain that cannot be set up is reported and skipped.
+ */
+static clib_error_t *
+nfchain_main_loop_enter (vlib_main_t * vm)
+{
+  nfchain_main_t * sm = &nfchain_main;
+  nfchain_chain_config_t * cc;
+  clib_error_t * error;
+  unformat_input_t in;
+  u32 sw_if_index;
+
+  vec_foreach (cc, sm->chain_configs)
+    {
+      /* Frees cc->interface */
+      unformat_init_vector (&in, cc->interface);
+      if (!unformat (&in, "%U", unformat_vnet_sw_interface, sm->vnet_main,
+                     &sw_if_index))
+        error = clib_error_return (0, "nfchain: unknown interface `%v'",
+                                   cc->interface);
+      else
+        error = nfchain_chain_error (nfchain_chain_set (sm, sw_if_index,
+                                                        cc->nfs));
+      if (error)
+        clib_error_report (error);
+      unformat_free (&in);
+      vec_free (cc->nfs);
+    }
+
+  vec_free (sm->chain_configs);
+  return 0;
+}
+
+VLIB_MAIN_LOOP_ENTER_FUNCTION (nfchain_main_loop_enter);
+
+/**
+ * @brief Hook the fused NF chain into the VPP graph hierarchy.
+ */
+VNET_FEATURE_INIT (nfchain_fused, static) =
+{
+  .arc_name = "device-input",
+  .node_name = "nfchain-fused",
+  .runs_before = VNET_FEATURES ("sample"),
+};
@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __included_nfchain_h__
+#define __included_nfchain_h__
+
+#include <vnet/vnet.h>
+#include <vnet/ip/ip.h>
+#include <vnet/ethernet/ethernet.h>
+
+#include <vppinfra/hash.h>
+#include <vppinfra/error.h>
+#include <vppinfra/elog.h>
+
+#include <vppinfra/bihash_16_8.h>
+
+#include <clb/clb.h>
+#include <ratelimiter/ratelimiter.h>
+#include <flowcounter/flowcounter.h>
+#include <nfchain/flow_ctx.h>
+#include <nfchain/chain.h>
+#include <nfchain/nf_stats.h>
+
+/**
+ * NFs composed into the fused node, in chain order.
+ * Each NF plugin provides <nf>_main, a <nf> node, <NF>_ERROR_SWAPPED /
+ * <NF>_ERROR_INSERTS counters and a <nf>_flow_update() per-packet body.
+ * The ratelimiter body also decides whether the packet goes on.
+ */
+#define foreach_nfchain_fused_nf \
+_(clb, CLB)                      \
+_(ratelimiter, RATELIMITER)      \
+_(flowcounter, FLOWCOUNTER)
+
+typedef enum
+{
+#define _(nf,NF) NFCHAIN_FUSED_NF_##NF,
+  foreach_nfchain_fused_nf
+#undef _
+    NFCHAIN_N_FUSED_NF,
+} nfchain_fused_nf_t;
+
+/* A chainable NF, resolved from its plugin on first use */
+typedef struct {
+    nfchain_hop_t * hop;
+    u32 node_index;
+} nfchain_nf_t;
+
+/* Cost accounting of an NF, or of the fused node */
+typedef struct {
+    /* The NF's samples, 0 if its plugin is not loaded */
+    nfchain_nf_stats_t * stats;
+
+    /* Stats segment entries by stage, [thread][NFCHAIN_PERF_TOTAL_*] */
+    u32 totals_index[NFCHAIN_NF_N_STAGE];
+    /* Histograms by stage and stat, [thread][bucket] */
+    u32 hist_index[NFCHAIN_NF_N_STAGE][NFCHAIN_NF_N_STAT];
+} nfchain_perf_nf_t;
+
+/* The chainable NFs, then the fused node */
+#define NFCHAIN_PERF_N_NF (NFCHAIN_N_NF + 1)
+
+/* Columns of a totals entry, the per-stat totals follow */
+#define NFCHAIN_PERF_TOTAL_FRAMES 0
+#define NFCHAIN_PERF_TOTAL_PACKETS 1
+#define NFCHAIN_PERF_N_TOTAL (2 + NFCHAIN_NF_N_STAT)
+
+typedef struct {
+    nfchain_perf_nf_t nfs[NFCHAIN_PERF_N_NF];
+
+    /* Perf events by thread, shared by every NF */
+    nfchain_nf_stats_pmc_t * pmcs;
+
+    /* Open perf events and their mmapped pages */
+    int * fds;
+    void ** pages;
+
+    u8 enabled;
+    u8 stats_registered;
+} nfchain_perf_t;
+
+/* A chain from the startup config, set up once interfaces exist */
+typedef struct {
+    u8 * interface;
+    u8 * nfs;
+} nfchain_chain_config_t;
+
+typedef struct {
+    /* API message ID base */
+    u16 msg_id_base;
+
+    /* convenience */
+    vnet_main_t * vnet_main;
+
+    /* Per-NF state, resolved from the NF plugins on first enable */
+#define _(nf,NF)                \
+    nf##_main_t * nf##_main;    \
+    u32 nf##_node_index;
+    foreach_nfchain_fused_nf
+#undef _
+
+    /* ratelimiter drops are counted against the ratelimiter node */
+    vlib_error_t ratelimiter_drop_error;
+
+    u8 fused_nfs_resolved;
+
+    /* Runtime chains: NF indices (nfchain_nf_index_t) by sw_if_index */
+    nfchain_nf_t nfs[NFCHAIN_N_NF];
+    u8 ** chain_by_sw_if_index;
+    nfchain_chain_config_t * chain_configs;
+
+    /* Per-NF cost accounting, see nfchain/nf_stats.h */
+    nfchain_perf_t perf;
+
+} nfchain_main_t;
+
+extern nfchain_main_t nfchain_main;
+
+extern vlib_node_registration_t nfchain_fused_node;
+
+/* Samples of the fused node, the fused NFs' own are left alone */
+extern nfchain_nf_stats_t nfchain_fused_nf_stats;
+
+int nfchain_chain_set (nfchain_main_t * sm, u32 sw_if_index, u8 * nfs);
+int nfchain_perf_enable_disable (nfchain_main_t * sm, int enable_disable);
+
+#define NFCHAIN_PLUGIN_BUILD_VER "1.0"
+
+#endif /* __included_nfchain_h__ */
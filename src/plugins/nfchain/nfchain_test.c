@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ *------------------------------------------------------------------
+ * nfchain_test.c - test harness plugin
+ *------------------------------------------------------------------
+ */
+
+#include <vat/vat.h>
+#include <vlibapi/api.h>
+#include <vlibmemory/api.h>
+#include <vppinfra/error.h>
+
+#define __plugin_msg_base nfchain_test_main.msg_id_base
+#include <vlibapi/vat_helper_macros.h>
+
+uword unformat_sw_if_index (unformat_input_t * input, va_list * args);
+
+/* Declare message IDs */
+#include <nfchain/nfchain.api_enum.h>
+#include <nfchain/nfchain.api_types.h>
+#include <nfchain/chain.h>
+
+typedef struct {
+    /* API message ID base */
+    u16 msg_id_base;
+    vat_main_t *vat_main;
+} nfchain_test_main_t;
+
+nfchain_test_main_t nfchain_test_main;
+
+static int api_nfchain_fused_enable_disable (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    int enable_disable = 1;
+    u32 sw_if_index = ~0;
+    vl_api_nfchain_fused_enable_disable_t * mp;
+    int ret;
+
+    /* Parse args required to build the message */
+    while (unformat_check_input (i) != UNFORMAT_END_OF_INPUT) {
+        if (unformat (i, "%U", unformat_sw_if_index, vam, &sw_if_index))
+            ;
+	else if (unformat (i, "sw_if_index %d", &sw_if_index))
+	    ;
+        else if (unformat (i, "disable"))
+            enable_disable = 0;
+        else
+            break;
+    }
+
+    if (sw_if_index == ~0) {
+        errmsg ("missing interface name / explicit sw_if_index number \n");
+        return -99;
+    }
+
+    /* Construct the API message */
+    M(NFCHAIN_FUSED_ENABLE_DISABLE, mp);
+    mp->sw_if_index = ntohl (sw_if_index);
+    mp->enable_disable = enable_disable;
+
+    /* send it... */
+    S(mp);
+
+    /* Wait for a reply... */
+    W (ret);
+    return ret;
+}
+
+static char * nfchain_test_nf_names[] = {
+#define _(nf,NF) #nf,
+  foreach_nfchain_nf
+#undef _
+};
+
+static int api_nfchain_chain_set (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    u32 sw_if_index = ~0;
+    vl_api_nfchain_chain_set_t * mp;
+    u8 nfs[NFCHAIN_N_NF];
+    int n_nfs = 0, nf, is_del = 0;
+    int ret;
+
+    /* Parse args required to build the message */
+    while (unformat_check_input (i) != UNFORMAT_END_OF_INPUT) {
+        for (nf = 0; nf < NFCHAIN_N_NF; nf++)
+            if (unformat (i, nfchain_test_nf_names[nf]))
+                break;
+        if (nf < NFCHAIN_N_NF) {
+            if (n_nfs == NFCHAIN_N_NF) {
+                errmsg ("too many NFs \n");
+                return -99;
+            }
+            nfs[n_nfs++] = nf;
+        }
+        else if (unformat (i, "%U", unformat_sw_if_index, vam, &sw_if_index))
+            ;
+	else if (unformat (i, "sw_if_index %d", &sw_if_index))
+	    ;
+        else if (unformat (i, "del"))
+            is_del = 1;
+        else
+            break;
+    }
+
+    if (sw_if_index == ~0) {
+        errmsg ("missing interface name / explicit sw_if_index number \n");
+        return -99;
+    }
+    if (is_del)
+        n_nfs = 0;
+
+    /* Construct the API message */
+    M2(NFCHAIN_CHAIN_SET, mp, n_nfs * sizeof (mp->nfs[0]));
+    mp->sw_if_index = ntohl (sw_if_index);
+    mp->n_nfs = n_nfs;
+    clib_memcpy (mp->nfs, nfs, n_nfs);
+
+    /* send it... */
+    S(mp);
+
+    /* Wait for a reply... */
+    W (ret);
+    return ret;
+}
+
+static int api_nfchain_perf_enable_disable (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    int enable_disable = 1;
+    vl_api_nfchain_perf_enable_disable_t * mp;
+    int ret;
+
+    /* Parse args required to build the message */
+    while (unformat_check_input (i) != UNFORMAT_END_OF_INPUT) {
+        if (unformat (i, "disable"))
+            enable_disable = 0;
+        else if (unformat (i, "enable"))
+            enable_disable = 1;
+        else
+            break;
+    }
+
+    /* Construct the API message */
+    M(NFCHAIN_PERF_ENABLE_DISABLE, mp);
+    mp->enable_disable = enable_disable;
+
+    /* send it... */
+    S(mp);
+
+    /* Wait for a reply... */
+    W (ret);
+    return ret;
+}
+
+/*
+ * List of messages that the api test plugin sends,
+ * and that the data plane plugin processes
+ */
+#include <nfchain/nfchain.api_test.c>
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <vlib/vlib.h>
+#include <vnet/vnet.h>
+#include <vnet/pg/pg.h>
+#include <vnet/ethernet/ethernet.h>
+#include <vppinfra/error.h>
+#include <nfchain/nfchain.h>
+
+typedef enum
+{
+  NFCHAIN_FUSED_NEXT_INTERFACE_OUTPUT,
+  NFCHAIN_FUSED_NEXT_DROP,
+  NFCHAIN_FUSED_N_NEXT,
+} nfchain_fused_next_t;
+
+typedef struct
+{
+  u32 next_index;
+  u32 sw_if_index;
+  ip4_address_t src_ip;
+  ip4_address_t dst_ip;
+  u16 src_port;
+  u16 dst_port;
+  /* One section per fused NF */
+  u64 count[NFCHAIN_N_FUSED_NF];
+  u8 is_new[NFCHAIN_N_FUSED_NF];
+  u32 len;
+} nfchain_fused_trace_t;
+
+
+/* packet trace format function */
+static u8 *
+format_nfchain_fused_trace (u8 * s, va_list * args)
+{
+  CLIB_UNUSED (vlib_main_t * vm) = va_arg (*args, vlib_main_t *);
+  CLIB_UNUSED (vlib_node_t * node) = va_arg (*args, vlib_node_t *);
+  nfchain_fused_trace_t *t = va_arg (*args, nfchain_fused_trace_t *);
+
+  s = format (s, "NFCHAIN-FUSED: sw_if_index %d, next index %d\n",
+	      t->sw_if_index, t->next_index);
+  s = format (s, "  src ip %U -> dst ip %U \n",
+	      format_ip4_address, &t->src_ip,
+	      format_ip4_address, &t->dst_ip);
+  s = format (s, "  src port %d -> dst port %d",
+	      t->src_port, t->dst_port);
+  if ((u32) t->count[NFCHAIN_FUSED_NF_CLB] == ~0)
+    s = format (s, "\n  CLB: no backend");
+  else
+    s = format (s, "\n  CLB: backend %d%s",
+		(u32) t->count[NFCHAIN_FUSED_NF_CLB],
+		t->is_new[NFCHAIN_FUSED_NF_CLB] ? " (new)" : "");
+  s = format (s, "\n  RATELIMITER: len %d, tokens left %llu%s%s", t->len,
+	      t->count[NFCHAIN_FUSED_NF_RATELIMITER],
+	      t->is_new[NFCHAIN_FUSED_NF_RATELIMITER] ? " (new)" : "",
+	      t->next_index == NFCHAIN_FUSED_NEXT_DROP ? ", dropped" : "");
+  if (t->next_index != NFCHAIN_FUSED_NEXT_DROP)
+    s = format (s, "\n  FLOWCOUNTER: flow count %llu%s",
+		t->count[NFCHAIN_FUSED_NF_FLOWCOUNTER],
+		t->is_new[NFCHAIN_FUSED_NF_FLOWCOUNTER] ? " (new)" : "");
+
+  return s;
+}
+
+/*
+ * Fused clb -> ratelimiter -> flowcounter.
+ *
+ * The frame is parsed and hashed once, then every packet runs through
+ * all NF bodies back to back while the frame is still hot. Each NF
+ * keeps its own table, and its counters are charged to its own node.
+ * Packets over rate stop at the ratelimiter and are dropped.
+ */
+VLIB_NODE_FN (nfchain_fused_node) (vlib_main_t * vm,
+				   vlib_node_runtime_t * node,
+				   vlib_frame_t * frame)
+{
+  nfchain_main_t *nm = &nfchain_main;
+  u32 thread_index = vm->thread_index;
+  vlib_buffer_t *bufs[VLIB_FRAME_SIZE], **b;
+  clib_bihash_kv_16_8_t keys[VLIB_FRAME_SIZE];
+  u64 hashes[VLIB_FRAME_SIZE];
+  u64 count[NFCHAIN_N_FUSED_NF];
+  u8 is_new[NFCHAIN_N_FUSED_NF];
+  u32 inserted[NFCHAIN_N_FUSED_NF] = { 0 };
+  u32 processed[NFCHAIN_N_FUSED_NF] = { 0 };
+  u16 nexts[VLIB_FRAME_SIZE];
+  u32 lens[VLIB_FRAME_SIZE];
+  u32 expired[NFCHAIN_N_FUSED_NF];
+  u32 clb_no_backend = 0;
+  u32 *from, n_left_from, i, now, flow_now;
+  nfchain_nf_sample_t sample;
+
+  nfchain_nf_stats_begin (&nfchain_fused_nf_stats, thread_index, &sample);
+
+  from = vlib_frame_vector_args (frame);
+  n_left_from = frame->n_vectors;
+
+  vlib_get_buffers (vm, from, bufs, n_left_from);
+
+  /* Parse and hash once, or reuse an upstream NF's flow context */
+  nfchain_flow_ctx_get_n (bufs, n_left_from);
+
+  b = bufs;
+  for (i = 0; i < n_left_from; i++)
+    {
+      vnet_buffer_opaque2_t *o0 = vnet_buffer2 (b[0]);
+
+      keys[i] = nfchain_flow_ctx_key (o0);
+      hashes[i] = o0->flow_ctx.hash;
+      lens[i] = vlib_buffer_length_in_chain (vm, b[0]);
+
+      /* Send pkt back out the RX interface */
+      vnet_buffer (b[0])->sw_if_index[VLIB_TX] =
+	vnet_buffer (b[0])->sw_if_index[VLIB_RX];
+      b++;
+    }
+
+  /* Prefetch once per IPv4 table, then run every NF body per packet */
+#define _(nf,NF)                                                        \
+  clib_bihash_prefetch_buckets_16_8                                     \
+    (&nm->nf##_main->per_cpu[thread_index].hash_table, hashes,          \
+     clib_min (n_left_from, 8));
+  foreach_nfchain_fused_nf
+#undef _
+
+  processed[NFCHAIN_FUSED_NF_CLB] = n_left_from;
+  processed[NFCHAIN_FUSED_NF_RATELIMITER] = n_left_from;
+  now = ratelimiter_now (nm->ratelimiter_main);
+  flow_now = nfchain_flow_now (vm);
+
+  b = bufs;
+  for (i = 0; i < n_left_from; i++)
+    {
+      ratelimiter_bucket_t bucket;
+      int conform, rl_is_new;
+      u32 backend;
+
+      if (i + 8 < n_left_from)
+	{
+#define _(nf,NF)                                                        \
+	  clib_bihash_prefetch_bucket_16_8                              \
+	    (&nm->nf##_main->per_cpu[thread_index].hash_table, hashes[i + 8]);
+	  foreach_nfchain_fused_nf
+#undef _
+	}
+      if (i + 4 < n_left_from)
+	{
+#define _(nf,NF)                                                        \
+	  clib_bihash_prefetch_data_16_8                                \
+	    (&nm->nf##_main->per_cpu[thread_index].hash_table, hashes[i + 4]);
+	  foreach_nfchain_fused_nf
+#undef _
+	}
+
+      is_new[NFCHAIN_FUSED_NF_CLB] =
+	clb_flow_update_buffer (nm->clb_main, thread_index, b[0], &keys[i],
+				hashes[i], flow_now, &backend);
+      /* The clb's count is its backend */
+      count[NFCHAIN_FUSED_NF_CLB] = backend;
+      if (PREDICT_TRUE (backend != ~0))
+	{
+	  vnet_buffer_opaque2_t *o0;
+
+	  clb_rewrite (nm->clb_main, b[0], backend);
+	  /* Key the NFs downstream on the backend, as their nodes would */
+	  o0 = nfchain_flow_ctx_get (b[0]);
+	  keys[i] = nfchain_flow_ctx_key (o0);
+	  hashes[i] = o0->flow_ctx.hash;
+	}
+      else
+	clb_no_backend++;
+
+      if (PREDICT_FALSE (vnet_buffer2 (b[0])->flow_ctx.ip_version == 6))
+	conform = ratelimiter_flow_update6 (nm->ratelimiter_main,
+					    thread_index, b[0], hashes[i], now,
+					    lens[i], &rl_is_new, &bucket);
+      else
+	conform = ratelimiter_flow_update (nm->ratelimiter_main,
+					   thread_index, &keys[i], hashes[i],
+					   now, lens[i], &rl_is_new, &bucket);
+      is_new[NFCHAIN_FUSED_NF_RATELIMITER] = rl_is_new;
+      /* The ratelimiter's count is its tokens left */
+      count[NFCHAIN_FUSED_NF_RATELIMITER] =
+	ratelimiter_bucket_tokens (bucket);
+
+      if (PREDICT_TRUE (conform))
+	{
+	  is_new[NFCHAIN_FUSED_NF_FLOWCOUNTER] =
+	    flowcounter_flow_update_buffer (nm->flowcounter_main,
+					    thread_index, b[0], &keys[i],
+					    hashes[i], flow_now,
+					    &count[NFCHAIN_FUSED_NF_FLOWCOUNTER]);
+	  processed[NFCHAIN_FUSED_NF_FLOWCOUNTER]++;
+	  nexts[i] = NFCHAIN_FUSED_NEXT_INTERFACE_OUTPUT;
+	}
+      else
+	{
+	  is_new[NFCHAIN_FUSED_NF_FLOWCOUNTER] = 0;
+	  nexts[i] = NFCHAIN_FUSED_NEXT_DROP;
+	  b[0]->error = nm->ratelimiter_drop_error;
+	}
+
+#define _(nf,NF)                                                        \
+      inserted[NFCHAIN_FUSED_NF_##NF] += is_new[NFCHAIN_FUSED_NF_##NF];
+      foreach_nfchain_fused_nf
+#undef _
+
+      if (PREDICT_FALSE ((node->flags & VLIB_NODE_FLAG_TRACE)
+			 && (b[0]->flags & VLIB_BUFFER_IS_TRACED)))
+	{
+	  nfchain_fused_trace_t *t =
+	    vlib_add_trace (vm, node, b[0], sizeof (*t));
+	  t->sw_if_index = vnet_buffer (b[0])->sw_if_index[VLIB_RX];
+	  t->next_index = nexts[i];
+	  t->src_ip.as_u32 = keys[i].key[0] >> 32;
+	  t->dst_ip.as_u32 = (u32) keys[i].key[0];
+	  t->src_port = keys[i].key[1] >> 16;
+	  t->dst_port = (u16) keys[i].key[1];
+	  clib_memcpy_fast (t->count, count, sizeof (count));
+	  clib_memcpy_fast (t->is_new, is_new, sizeof (is_new));
+	  t->len = lens[i];
+	}
+      b++;
+    }
+
+  vlib_buffer_enqueue_to_next (vm, node, from, nexts, n_left_from);
+  nfchain_nf_stats_end (&nfchain_fused_nf_stats, thread_index,
+			NFCHAIN_NF_STAGE_FRAME, &sample, n_left_from);
+
+  /* Age out idle flows, a few buckets of each NF's table per dispatch */
+  nfchain_nf_stats_begin (&nfchain_fused_nf_stats, thread_index, &sample);
+  expired[NFCHAIN_FUSED_NF_CLB] =
+    clb_flow_age (nm->clb_main, thread_index, flow_now);
+  expired[NFCHAIN_FUSED_NF_FLOWCOUNTER] =
+    flowcounter_flow_age (nm->flowcounter_main, thread_index, flow_now);
+  expired[NFCHAIN_FUSED_NF_RATELIMITER] =
+    ratelimiter_flow_age (nm->ratelimiter_main, thread_index, now);
+  nfchain_nf_stats_end (&nfchain_fused_nf_stats, thread_index,
+			NFCHAIN_NF_STAGE_SWEEP, &sample, n_left_from);
+
+#define _(nf,NF)                                                        \
+  vlib_node_increment_counter (vm, nm->nf##_node_index,                 \
+			       NF##_ERROR_SWAPPED,                      \
+			       processed[NFCHAIN_FUSED_NF_##NF]);       \
+  vlib_node_increment_counter (vm, nm->nf##_node_index,                 \
+			       NF##_ERROR_INSERTS,                      \
+			       inserted[NFCHAIN_FUSED_NF_##NF]);        \
+  vlib_node_increment_counter (vm, nm->nf##_node_index,                 \
+			       NF##_ERROR_EXPIRED,                      \
+			       expired[NFCHAIN_FUSED_NF_##NF]);
+  foreach_nfchain_fused_nf
+#undef _
+  vlib_node_increment_counter (vm, nm->clb_node_index,
+			       CLB_ERROR_NO_BACKEND, clb_no_backend);
+
+  return frame->n_vectors;
+}
+
+
+/* *INDENT-OFF* */
+VLIB_REGISTER_NODE (nfchain_fused_node) =
+{
+  .name = "nfchain-fused",
+  .vector_size = sizeof (u32),
+  .format_trace = format_nfchain_fused_trace,
+  .type = VLIB_NODE_TYPE_INTERNAL,
+
+  .n_next_nodes = NFCHAIN_FUSED_N_NEXT,
+
+  /* edit / add dispositions here */
+  .next_nodes = {
+    [NFCHAIN_FUSED_NEXT_INTERFACE_OUTPUT] = "sample",
+    [NFCHAIN_FUSED_NEXT_DROP] = "error-drop",
+  },
+};
+/* *INDENT-ON* */
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
@@ -20,9 +20,12 @@
 #include <vnet/vnet.h>
 #include <vnet/plugin/plugin.h>
 #include <ratelimiter/ratelimiter.h>
+#include <nfchain/flow_dump.h>
+#include <vnet/ip/ip_types_api.h>
 
 #include <vlibapi/api.h>
 #include <vlibmemory/api.h>
+#include <vnet/format_fns.h>
 
 #include <ratelimiter/ratelimiter.api_enum.h>
 #include <ratelimiter/ratelimiter.api_types.h>
@@ -36,7 +39,9 @@ VLIB_PLUGIN_REGISTER () = {
     .description = "RateLimiter plugin",
 };
 
-ratelimiter_main_t ratelimiter_main;
+__clib_export ratelimiter_main_t ratelimiter_main;
+__clib_export nfchain_hop_t ratelimiter_chain_hop;
+__clib_export nfchain_nf_stats_t ratelimiter_nf_stats;
 
 /**
  * @brief Enable/disable the macswap plugin. 
@@ -121,6 +126,300 @@ VLIB_CLI_COMMAND (sr_content_command, static) = {
     .function = macswap_enable_disable_command_fn,
 };
 
+static void
+ratelimiter_rule_update_rates (ratelimiter_main_t * rm, ratelimiter_rule_t * r)
+{
+  f64 unit = (f64) (1ULL << rm->time_shift) / rm->clocks_per_second;
+  /* Each thread keeps its own prefix bucket, at 1/n of the rule */
+  u32 n = r->is_aggregate ? rm->n_shares : 1;
+
+  r->bucket_burst = r->burst ? clib_max (r->burst / n, 1) : 0;
+  r->rate_per_unit =
+    clib_max ((u64) ((f64) r->rate / n * unit * 65536.0), 1);
+  r->fill_units = ((u64) r->bucket_burst << 16) / r->rate_per_unit + 1;
+}
+
+static int
+ratelimiter_prefix_len_cmp (void *a1, void *a2)
+{
+  u8 *l1 = a1, *l2 = a2;
+
+  return (int) *l2 - (int) *l1;
+}
+
+/**
+ * @brief Add, update or delete a rate limiting rule.
+ *
+ * A 0.0.0.0/0 rule sets the default applied to flows no other prefix
+ * matches, deleting it makes them unlimited again. Rates are enforced
+ * per worker: each flow gets the rate and burst on the worker it lands
+ * on, and for aggregate rules each of the n workers polices the prefix
+ * at 1/n of them, so the rule holds for traffic spread evenly over the
+ * workers, as by RSS, and is stricter for a prefix served by fewer.
+ * Existing flows keep their rule until it is deleted or reused.
+ */
+int ratelimiter_rule_add_del (ratelimiter_main_t * rm, ip4_address_t * prefix,
+                              u8 len, u64 rate, u32 burst, u8 is_aggregate,
+                              int is_add)
+{
+  vlib_main_t * vm = vlib_get_main ();
+  ratelimiter_rule_t * r;
+  ip4_address_t masked;
+  u64 key;
+  uword * p;
+  u32 index;
+
+  if (len > 32)
+    return VNET_API_ERROR_INVALID_VALUE;
+  if (is_add && (burst > RATELIMITER_MAX_BURST || (rate && burst == 0)))
+    return VNET_API_ERROR_INVALID_VALUE_2;
+
+  masked.as_u32 = prefix->as_u32 & ip4_main.fib_masks[len];
+  key = ((u64) masked.as_u32 << 8) | len;
+  p = hash_get (rm->rule_by_prefix, key);
+
+  if (len == 0)
+    index = 0;
+  else if (p)
+    index = p[0];
+  else if (!is_add)
+    return VNET_API_ERROR_NO_SUCH_ENTRY;
+  else
+    {
+      for (index = 1; index < RATELIMITER_MAX_RULES; index++)
+        if (!rm->rules[index].is_active)
+          break;
+      if (index == RATELIMITER_MAX_RULES)
+        return VNET_API_ERROR_TABLE_TOO_BIG;
+    }
+
+  vlib_worker_thread_barrier_sync (vm);
+
+  r = &rm->rules[index];
+  if (is_add || index == 0)
+    {
+      r->prefix = masked;
+      r->len = len;
+      r->is_active = 1;
+      r->is_aggregate = is_add ? is_aggregate : 0;
+      r->rate = is_add ? rate : 0;
+      r->burst = is_add ? burst : 0;
+      ratelimiter_rule_update_rates (rm, r);
+      if (index)
+        hash_set (rm->rule_by_prefix, key, index);
+    }
+  else
+    {
+      clib_memset (r, 0, sizeof (*r));
+      hash_unset (rm->rule_by_prefix, key);
+    }
+
+  /* Rebuild the lengths probed by ratelimiter_classify */
+  vec_reset_length (rm->prefix_lens);
+  vec_foreach (r, rm->rules)
+    if (r->is_active && r->len && vec_search (rm->prefix_lens, r->len) == ~0)
+      vec_add1 (rm->prefix_lens, r->len);
+  vec_sort_with_function (rm->prefix_lens, ratelimiter_prefix_len_cmp);
+
+  vlib_worker_thread_barrier_release (vm);
+
+  return 0;
+}
+
+static clib_error_t *
+rule_add_del_command_fn (vlib_main_t * vm,
+                         unformat_input_t * input,
+                         vlib_cli_command_t * cmd)
+{
+  ratelimiter_main_t * sm = &ratelimiter_main;
+  ip4_address_t prefix;
+  u32 len = ~0, burst = 0;
+  u64 rate = 0;
+  u8 is_aggregate = 0;
+  int is_add = 1;
+  int rv;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "%U/%d", unformat_ip4_address, &prefix, &len))
+      ;
+    else if (unformat (input, "rate %llu", &rate))
+      ;
+    else if (unformat (input, "burst %u", &burst))
+      ;
+    else if (unformat (input, "aggregate"))
+      is_aggregate = 1;
+    else if (unformat (input, "del"))
+      is_add = 0;
+    else
+      return clib_error_return (0, "unknown input `%U'",
+                                format_unformat_error, input);
+  }
+
+  if (len == ~0)
+    return clib_error_return (0, "Please specify a prefix...");
+
+  rv = ratelimiter_rule_add_del (sm, &prefix, len, rate, burst, is_aggregate,
+                                 is_add);
+
+  switch(rv) {
+  case 0:
+    break;
+
+  case VNET_API_ERROR_INVALID_VALUE:
+    return clib_error_return (0, "Invalid prefix length %d", len);
+
+  case VNET_API_ERROR_INVALID_VALUE_2:
+    return clib_error_return
+      (0, "Burst must be non-zero and at most %d bytes",
+       RATELIMITER_MAX_BURST);
+
+  case VNET_API_ERROR_NO_SUCH_ENTRY:
+    return clib_error_return (0, "No such rule");
+
+  case VNET_API_ERROR_TABLE_TOO_BIG:
+    return clib_error_return (0, "Too many rules");
+
+  default:
+    return clib_error_return (0, "ratelimiter_rule_add_del returned %d",
+                              rv);
+  }
+  return 0;
+}
+
+/**
+ * @brief CLI command to add/delete ratelimiter rules.
+ * Each worker polices its share of an aggregate prefix at 1/n of the
+ * rate and burst, n the number of workers, see ratelimiter_rule_add_del.
+ */
+VLIB_CLI_COMMAND (rule_add_del_command, static) = {
+    .path = "ratelimiter rule",
+    .short_help =
+    "ratelimiter rule <ip4-prefix> rate <bytes/s> burst <bytes> "
+    "[aggregate] [del]",
+    .long_help =
+    "Rates are per flow, on the worker the flow lands on. An aggregate\n"
+    "rule polices the whole prefix instead, each of the n workers at 1/n\n"
+    "of the rate and burst.\n",
+    .function = rule_add_del_command_fn,
+};
+
+static clib_error_t *
+show_rules_command_fn (vlib_main_t * vm,
+                       unformat_input_t * input,
+                       vlib_cli_command_t * cmd)
+{
+  ratelimiter_main_t * sm = &ratelimiter_main;
+  ratelimiter_rule_t * r;
+
+  vec_foreach (r, sm->rules)
+    {
+      if (!r->is_active)
+        continue;
+      vlib_cli_output (vm, "[%d] %U/%d rate %llu burst %u%s",
+                       r - sm->rules, format_ip4_address, &r->prefix, r->len,
+                       r->rate, r->burst,
+                       r->rate == 0 ? " (unlimited)" :
+                       r->is_aggregate ? " aggregate" : "");
+      if (r->rate && r->is_aggregate)
+        vlib_cli_output (vm, "  per thread (1/%u), rate %llu burst %u",
+                         sm->n_shares, r->rate / sm->n_shares,
+                         r->bucket_burst);
+    }
+  return 0;
+}
+
+/**
+ * @brief CLI command to show ratelimiter rules.
+ */
+VLIB_CLI_COMMAND (show_rules_command, static) = {
+    .path = "show ratelimiter rules",
+    .short_help = "show ratelimiter rules",
+    .function = show_rules_command_fn,
+};
+
+static int
+ratelimiter_show_flow (clib_bihash_kv_16_8_t * kv, void *arg)
+{
+  nfchain_flow_show_ctx_t *ctx = arg;
+
+  ip4_address_t prefix;
+
+  if (kv->key[1] & RATELIMITER_PREFIX_KEY)
+    {
+      prefix.as_u32 = kv->key[0] >> 32;
+      vlib_cli_output (ctx->vm, "[%d] %U/%d rule %d tokens %u",
+                       ctx->thread_index, format_ip4_address, &prefix,
+                       (u8) kv->key[1], ratelimiter_bucket_rule (kv->value),
+                       ratelimiter_bucket_tokens (kv->value));
+    }
+  else
+    vlib_cli_output (ctx->vm, "[%d] %U rule %d tokens %u",
+                     ctx->thread_index, format_nfchain_flow_key, kv,
+                     ratelimiter_bucket_rule (kv->value),
+                     ratelimiter_bucket_tokens (kv->value));
+
+  return --ctx->n_left ? BIHASH_WALK_CONTINUE : BIHASH_WALK_STOP;
+}
+
+static int
+ratelimiter_show_flow6 (clib_bihash_kv_40_8_t * kv, void *arg)
+{
+  nfchain_flow_show_ctx_t *ctx = arg;
+
+  vlib_cli_output (ctx->vm, "[%d] %U rule %d tokens %u",
+                   ctx->thread_index, format_nfchain_flow_key6, kv,
+                   ratelimiter_bucket_rule (kv->value),
+                   ratelimiter_bucket_tokens (kv->value));
+
+  return --ctx->n_left ? BIHASH_WALK_CONTINUE : BIHASH_WALK_STOP;
+}
+
+static clib_error_t *
+show_ratelimiter_flows_command_fn (vlib_main_t * vm,
+                                   unformat_input_t * input,
+                                   vlib_cli_command_t * cmd)
+{
+  ratelimiter_main_t * sm = &ratelimiter_main;
+  nfchain_flow_show_ctx_t ctx = { .vm = vm, .n_left = 100 };
+  u32 bucket;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "max %u", &ctx.n_left))
+      ;
+    else
+      return clib_error_return (0, "unknown input `%U'",
+                                format_unformat_error, input);
+  }
+
+  ctx.now = nfchain_flow_now (vm);
+  for (ctx.thread_index = 0; ctx.thread_index < vec_len (sm->per_cpu) &&
+         ctx.n_left; ctx.thread_index++)
+    {
+      bucket = 0;
+      clib_bihash_foreach_key_value_pair_from_16_8
+        (&sm->per_cpu[ctx.thread_index].hash_table, &bucket, ~0,
+         ratelimiter_show_flow, &ctx);
+    }
+  for (ctx.thread_index = 0; ctx.thread_index < vec_len (sm->per_cpu) &&
+         ctx.n_left; ctx.thread_index++)
+    {
+      bucket = 0;
+      clib_bihash_foreach_key_value_pair_from_40_8
+        (&sm->per_cpu[ctx.thread_index].hash_table6, &bucket, ~0,
+         ratelimiter_show_flow6, &ctx);
+    }
+  return 0;
+}
+
+/**
+ * @brief CLI command to show the token buckets.
+ */
+VLIB_CLI_COMMAND (show_ratelimiter_flows_command, static) = {
+    .path = "show ratelimiter flows",
+    .short_help = "show ratelimiter flows [max <n>]",
+    .function = show_ratelimiter_flows_command_fn,
+};
+
 /**
  * @brief Plugin API message handler.
  */
@@ -137,6 +436,84 @@ static void vl_api_ratelimiter_macswap_enable_disable_t_handler
   REPLY_MACRO(VL_API_RATELIMITER_MACSWAP_ENABLE_DISABLE_REPLY);
 }
 
+static void vl_api_ratelimiter_rule_add_del_t_handler
+(vl_api_ratelimiter_rule_add_del_t * mp)
+{
+  vl_api_ratelimiter_rule_add_del_reply_t * rmp;
+  ratelimiter_main_t * sm = &ratelimiter_main;
+  ip4_address_t prefix;
+  int rv;
+
+  ip4_address_decode (mp->prefix.address, &prefix);
+  rv = ratelimiter_rule_add_del (sm, &prefix, mp->prefix.len,
+                                 clib_net_to_host_u64 (mp->rate),
+                                 ntohl (mp->burst), mp->is_aggregate,
+                                 mp->is_add);
+
+  REPLY_MACRO(VL_API_RATELIMITER_RULE_ADD_DEL_REPLY);
+}
+
+static int
+ratelimiter_send_flow_details (clib_bihash_kv_16_8_t * kv, void *arg)
+{
+  nfchain_flow_dump_ctx_t *ctx = arg;
+  vl_api_ratelimiter_flow_details_t *mp;
+
+  mp = vl_msg_api_alloc (sizeof (*mp));
+  clib_memset (mp, 0, sizeof (*mp));
+  mp->_vl_msg_id = htons (VL_API_RATELIMITER_FLOW_DETAILS + ctx->msg_id_base);
+  mp->context = ctx->context;
+  mp->thread_index = htonl (ctx->thread_index);
+  if (kv->key[1] & RATELIMITER_PREFIX_KEY)
+    {
+      mp->src_address.af = ADDRESS_IP4;
+      clib_memcpy (mp->src_address.un.ip4, &((u32) { kv->key[0] >> 32 }),
+                   sizeof (mp->src_address.un.ip4));
+      mp->is_prefix = 1;
+      mp->prefix_len = (u8) kv->key[1];
+    }
+  else
+    nfchain_flow_details_address (kv, &mp->src_address, &mp->dst_address,
+                                  &mp->src_port, &mp->dst_port);
+  mp->rule_index = ratelimiter_bucket_rule (kv->value);
+  mp->tokens = htonl (ratelimiter_bucket_tokens (kv->value));
+
+  vl_api_send_msg (ctx->rp, (u8 *) mp);
+  return BIHASH_WALK_CONTINUE;
+}
+
+static int
+ratelimiter_send_flow_details6 (clib_bihash_kv_40_8_t * kv, void *arg)
+{
+  nfchain_flow_dump_ctx_t *ctx = arg;
+  vl_api_ratelimiter_flow_details_t *mp;
+
+  mp = vl_msg_api_alloc (sizeof (*mp));
+  clib_memset (mp, 0, sizeof (*mp));
+  mp->_vl_msg_id = htons (VL_API_RATELIMITER_FLOW_DETAILS + ctx->msg_id_base);
+  mp->context = ctx->context;
+  mp->thread_index = htonl (ctx->thread_index);
+  nfchain_flow_details_address6 (kv, &mp->src_address, &mp->dst_address,
+                                 &mp->src_port, &mp->dst_port);
+  mp->rule_index = ratelimiter_bucket_rule (kv->value);
+  mp->tokens = htonl (ratelimiter_bucket_tokens (kv->value));
+
+  vl_api_send_msg (ctx->rp, (u8 *) mp);
+  return BIHASH_WALK_CONTINUE;
+}
+
+static void vl_api_ratelimiter_flow_get_t_handler
+(vl_api_ratelimiter_flow_get_t * mp)
+{
+  vl_api_ratelimiter_flow_get_reply_t * rmp;
+  ratelimiter_main_t * sm = &ratelimiter_main;
+  int rv = 0;
+
+  NFCHAIN_FLOW_DUMP46_MACRO (VL_API_RATELIMITER_FLOW_GET_REPLY, sm->per_cpu,
+                             ratelimiter_send_flow_details,
+                             ratelimiter_send_flow_details6);
+}
+
 /* API definitions */
 #include <ratelimiter/ratelimiter.api.c>
 
@@ -152,17 +529,31 @@ static uint32_t ipv4_hash_crc(const void *data,  uint32_t data_len, uint32_t ini
 static clib_error_t * ratelimiter_init (vlib_main_t * vm)
 {
   ratelimiter_main_t * sm = &ratelimiter_main;
+  uword memory_size;
+  u32 nbuckets;
 
   sm->vnet_main =  vnet_get_main ();
 
   /* Add our API messages to the global name_crc hash table */
   sm->msg_id_base = setup_message_id_table ();
 
+  /* Bucket time unit: the power of two clocks closest above 1us */
+  sm->clocks_per_second = vm->clib_time.clocks_per_second;
+  sm->time_shift = max_log2 ((u64) (sm->clocks_per_second * 1e-6));
+
+  /* Rule 0 is the default, unlimited until configured */
+  vec_validate (sm->rules, RATELIMITER_MAX_RULES - 1);
+  sm->rules[0].is_active = 1;
+  sm->rule_by_prefix = hash_create (0, sizeof (uword));
+
   /* Create per CPU hash tables! */
   sm->per_cpu = 0;
   vlib_thread_main_t *tm = vlib_get_thread_main ();
   vec_validate(sm->per_cpu, tm->n_vlib_mains - 1);
 
+  /* The workers police, or the main thread when there are none */
+  sm->n_shares = clib_max (tm->n_vlib_mains - 1, 1);
+
 /*
   struct rte_hash_parameters hash_params = {0};
   hash_params.key_len = sizeof(u32);
@@ -172,10 +563,22 @@ static clib_error_t * ratelimiter_init (vlib_main_t * vm)
   hash_params.hash_func = ipv4_hash_crc;
 */
   
+  if (sm->flow_timeout == 0)
+    sm->flow_timeout = NFCHAIN_FLOW_DEFAULT_TIMEOUT;
+  if (sm->max_flows == 0)
+    sm->max_flows = NFCHAIN_FLOW_DEFAULT_MAX_FLOWS;
+  nfchain_flow_table_size (sm->max_flows, &nbuckets, &memory_size);
+  sm->flow_timeout_units =
+    (u64) (sm->flow_timeout * sm->clocks_per_second) >> sm->time_shift;
+
   for (int i=0; i < tm->n_vlib_mains; i++) {
     char* name = (char *) format(0, "ratelimiter_%d", i);
-    clib_bihash_init_16_8(&sm->per_cpu[i].hash_table, 
-                            name, 2097152, 1 << 30);
+    nfchain_flow_table_init (16_8, &sm->per_cpu[i].hash_table, name, i,
+                             nbuckets, memory_size, sm->log2_page_sz);
+    /* IPv6 entries are twice the size */
+    name = (char *) format(0, "ratelimiter6_%d", i);
+    nfchain_flow_table_init (40_8, &sm->per_cpu[i].hash_table6, name, i,
+                             nbuckets, 2 * memory_size, sm->log2_page_sz);
 //    hash_params.name = (char *) format(0, "ratelimiter_%d", i);
 //    sm->per_cpu[i].sticky_ht = rte_hash_create(&hash_params); 
   }
@@ -185,6 +588,39 @@ static clib_error_t * ratelimiter_init (vlib_main_t * vm)
 
 VLIB_INIT_FUNCTION (ratelimiter_init);
 
+/**
+ * @brief Startup config, e.g. ratelimiter { flows 1000000 timeout 60 }
+ *
+ * Each thread's table is sized for flows concurrent flows, on the
+ * thread's NUMA node, on page-size pages (e.g. 2m) if set. Flows idle
+ * for timeout seconds are deleted.
+ */
+static clib_error_t *
+ratelimiter_config (vlib_main_t * vm, unformat_input_t * input)
+{
+  ratelimiter_main_t * sm = &ratelimiter_main;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "flows %u", &sm->max_flows))
+      ;
+    else if (unformat (input, "page-size %U", unformat_log2_page_size,
+                       &sm->log2_page_sz))
+      ;
+    else if (unformat (input, "timeout %u", &sm->flow_timeout))
+      ;
+    else
+      return clib_error_return (0, "unknown input '%U'",
+                                format_unformat_error, input);
+  }
+
+  if (sm->flow_timeout > RATELIMITER_MAX_FLOW_TIMEOUT)
+    return clib_error_return (0, "timeout %u too large", sm->flow_timeout);
+
+  return 0;
+}
+
+VLIB_EARLY_CONFIG_FUNCTION (ratelimiter_config, "ratelimiter");
+
 /**
  * @brief Hook the ratelimiter plugin into the VPP graph hierarchy.
  */
@@ -24,14 +24,71 @@
 #include <vppinfra/elog.h>
 
 #include <vppinfra/bihash_16_8.h>
+#include <vppinfra/bihash_40_8.h>
+#include <nfchain/flow_age.h>
+#include <nfchain/flow_ctx.h>
+#include <nfchain/chain.h>
+#include <nfchain/nf_stats.h>
 
 typedef struct {
   /**
-   * Each CPU has its own sticky flow hash table.
-   * One single table is used for all VIPs.
+   * Each CPU has its own flow table. Values are token buckets, see
+   * ratelimiter_bucket_t, so no lookup is needed besides the flow's.
    */
   clib_bihash_16_8_t hash_table;
-} fc_per_cpu_t;
+
+  /* IPv6 flows, keyed by nfchain_flow_ctx_key6 */
+  clib_bihash_40_8_t hash_table6;
+
+  /* Next buckets for the aging sweeps */
+  u32 sweep_cursor;
+  u32 sweep_cursor6;
+} ratelimiter_per_cpu_t;
+
+/**
+ * Token bucket, packed in the 8 byte bihash value:
+ * tokens (bytes) in bits 0-23, rule index in bits 24-31, time of the
+ * last refill in bits 32-63, in units of 2^time_shift cpu clocks.
+ *
+ * The ~1us time unit wraps after ~71 minutes, a bucket idle for that
+ * long may be refilled short once. The time stamp doubles as the flow's
+ * last-seen time for aging, so unlimited and aggregate flows refresh it
+ * on every packet.
+ */
+typedef u64 ratelimiter_bucket_t;
+
+#define RATELIMITER_MAX_BURST ((1 << 24) - 1)
+#define RATELIMITER_MAX_RULES 256
+
+/* Idle timeouts must stay well inside the bucket time wrap */
+#define RATELIMITER_MAX_FLOW_TIMEOUT 3600
+
+/* Aggregate buckets are keyed by prefix, flagged in key[1] */
+#define RATELIMITER_PREFIX_KEY (1ULL << 63)
+
+typedef struct {
+  /* Rule 0 is the 0.0.0.0/0 default */
+  ip4_address_t prefix;
+  u8 len;
+  u8 is_active;
+
+  /* One bucket per prefix instead of one per flow */
+  u8 is_aggregate;
+
+  /* bytes/s, 0 means unlimited */
+  u64 rate;
+  u32 burst;
+
+  /* Bucket depth, a worker's share of the burst for aggregate rules */
+  u32 bucket_burst;
+
+  /* bytes per time unit, 16.16 fixed point, a worker's share for
+     aggregate rules */
+  u64 rate_per_unit;
+
+  /* time units to fill an empty bucket */
+  u32 fill_units;
+} ratelimiter_rule_t;
 
 typedef struct {
     /* API message ID base */
@@ -40,8 +97,34 @@ typedef struct {
     /* convenience */
     vnet_main_t * vnet_main;
 
+    /* Idle flow timeout in seconds, table size in concurrent flows */
+    u32 flow_timeout;
+    u32 max_flows;
+
+    /* Flow table page size, 0 for default pages */
+    clib_mem_page_sz_t log2_page_sz;
+
+    /* Idle flow timeout in bucket time units */
+    u32 flow_timeout_units;
+
     /* Some global data is per-cpu */
-    fc_per_cpu_t *per_cpu;
+    ratelimiter_per_cpu_t *per_cpu;
+
+    /* Rules, indexed by the rule index stored in each bucket */
+    ratelimiter_rule_t *rules;
+
+    /* Rule index by (prefix << 8 | len) */
+    uword *rule_by_prefix;
+
+    /* Active rule prefix lengths, longest first */
+    u8 *prefix_lens;
+
+    /* Bucket time unit is 2^time_shift clocks */
+    u8 time_shift;
+    f64 clocks_per_second;
+
+    /* Threads policing, each at 1/n_shares of aggregate rules */
+    u32 n_shares;
 
 } ratelimiter_main_t;
 
@@ -49,6 +132,260 @@ extern ratelimiter_main_t ratelimiter_main;
 
 extern vlib_node_registration_t ratelimiter_node;
 
+/* Next hops when on a runtime NF chain, see nfchain/chain.h */
+extern nfchain_hop_t ratelimiter_chain_hop;
+extern nfchain_nf_stats_t ratelimiter_nf_stats;
+
+int ratelimiter_rule_add_del (ratelimiter_main_t * rm, ip4_address_t * prefix,
+                              u8 len, u64 rate, u32 burst, u8 is_aggregate,
+                              int is_add);
+
+#define foreach_ratelimiter_error \
+_(SWAPPED, "Mac swap packets processed") \
+_(INSERTS, "Packets inserted") \
+_(DROPPED, "Packets over rate limit") \
+_(EXPIRED, "Flows expired")
+
+typedef enum
+{
+#define _(sym,str) RATELIMITER_ERROR_##sym,
+  foreach_ratelimiter_error
+#undef _
+    RATELIMITER_N_ERROR,
+} ratelimiter_error_t;
+
+static_always_inline u32
+ratelimiter_now (ratelimiter_main_t * rm)
+{
+  return clib_cpu_time_now () >> rm->time_shift;
+}
+
+static_always_inline ratelimiter_bucket_t
+ratelimiter_bucket_pack (u32 tokens, u32 rule_index, u32 ts)
+{
+  return ((u64) ts << 32) | (rule_index << 24) | tokens;
+}
+
+static_always_inline u32
+ratelimiter_bucket_tokens (ratelimiter_bucket_t b)
+{
+  return b & RATELIMITER_MAX_BURST;
+}
+
+static_always_inline u32
+ratelimiter_bucket_rule (ratelimiter_bucket_t b)
+{
+  return (b >> 24) & 0xff;
+}
+
+/**
+ * @brief Aging sweep callback, age is in bucket time units.
+ */
+static int
+ratelimiter_flow_is_stale (clib_bihash_kv_16_8_t * kv, void *arg)
+{
+  nfchain_flow_age_t *age = arg;
+
+  return (u32) (age->now - (kv->value >> 32)) > age->timeout;
+}
+
+static int
+ratelimiter_flow_is_stale6 (clib_bihash_kv_40_8_t * kv, void *arg)
+{
+  nfchain_flow_age_t *age = arg;
+
+  return (u32) (age->now - (kv->value >> 32)) > age->timeout;
+}
+
+/**
+ * @brief Sweep a few buckets of the thread's tables for idle flows.
+ * Returns the number of flows deleted.
+ */
+static_always_inline u32
+ratelimiter_flow_age (ratelimiter_main_t * rm, u32 thread_index, u32 now)
+{
+  ratelimiter_per_cpu_t *pc = &rm->per_cpu[thread_index];
+  nfchain_flow_age_t age = { .now = now, .timeout = rm->flow_timeout_units };
+
+  return clib_bihash_sweep_16_8 (&pc->hash_table, &pc->sweep_cursor,
+                                 NFCHAIN_FLOW_SWEEP_WORK,
+                                 ratelimiter_flow_is_stale, &age) +
+    clib_bihash_sweep_40_8 (&pc->hash_table6, &pc->sweep_cursor6,
+                            NFCHAIN_FLOW_SWEEP_WORK,
+                            ratelimiter_flow_is_stale6, &age);
+}
+
+/**
+ * @brief Longest prefix rule matching a source address, 0 if none.
+ * Only called for new flows.
+ */
+static_always_inline u32
+ratelimiter_classify (ratelimiter_main_t * rm, u32 src)
+{
+  uword *p;
+  u8 *len;
+
+  vec_foreach (len, rm->prefix_lens)
+    {
+      u64 key = ((u64) (src & ip4_main.fib_masks[*len]) << 8) | *len;
+      p = hash_get (rm->rule_by_prefix, key);
+      if (p)
+        return p[0];
+    }
+  return 0;
+}
+
+/**
+ * @brief Refill a token bucket and take len bytes from it.
+ * Returns 1 if the packet conforms.
+ */
+static_always_inline int
+ratelimiter_bucket_police (ratelimiter_rule_t * r, u32 rule_index,
+                           ratelimiter_bucket_t * b, u32 now, u32 len)
+{
+  u32 tokens = ratelimiter_bucket_tokens (*b);
+  u32 ts = *b >> 32;
+  u32 delta = now - ts;
+  int conform;
+
+  if (delta >= r->fill_units)
+    {
+      tokens = r->bucket_burst;
+      ts = now;
+    }
+  else
+    {
+      u64 refill = ((u64) delta * r->rate_per_unit) >> 16;
+
+      /* Keep the timestamp until at least a byte has accrued */
+      if (refill)
+        {
+          tokens = clib_min ((u64) r->bucket_burst, tokens + refill);
+          ts = now;
+        }
+      tokens = clib_min (tokens, r->bucket_burst);
+    }
+
+  conform = tokens >= len;
+  tokens -= conform ? len : 0;
+  *b = ratelimiter_bucket_pack (tokens, rule_index, ts);
+
+  return conform;
+}
+
+/**
+ * @brief Police a packet against its live flow entry.
+ * value is the flow entry's bucket, src its IPv4 source address. New
+ * flows are classified and start with a full bucket, IPv6 flows always
+ * take the default rule 0. Flows under an aggregate rule are policed
+ * against the rule's per-prefix bucket in the thread's IPv4 table, at
+ * the thread's share of the rule, which invalidates value.
+ * The bucket after policing is returned in bucket.
+ * Returns 1 if the packet conforms.
+ */
+static_always_inline int
+ratelimiter_police (ratelimiter_main_t * rm, u32 thread_index, u64 * value,
+                    u32 src, int is_ip6, int is_new, u32 now, u32 len,
+                    ratelimiter_bucket_t * bucket)
+{
+  u32 rule_index = ratelimiter_bucket_rule (*value);
+  ratelimiter_rule_t *r = &rm->rules[rule_index];
+  clib_bihash_kv_16_8_t pkey, *pkv;
+  int conform, is_new_prefix;
+
+  /* New flow, or its rule was deleted or reused since */
+  if (PREDICT_FALSE (is_new || !r->is_active ||
+                     (is_ip6 ? rule_index != 0 :
+                      (src & ip4_main.fib_masks[r->len]) !=
+                      r->prefix.as_u32)))
+    {
+      rule_index = is_ip6 ? 0 : ratelimiter_classify (rm, src);
+      r = &rm->rules[rule_index];
+      *value = ratelimiter_bucket_pack (r->bucket_burst, rule_index, now);
+    }
+
+  if (r->rate == 0)
+    {
+      *value = ratelimiter_bucket_pack (r->bucket_burst, rule_index, now);
+      *bucket = *value;
+      return 1;
+    }
+
+  if (PREDICT_TRUE (!r->is_aggregate))
+    {
+      conform = ratelimiter_bucket_police (r, rule_index, value, now, len);
+      *bucket = *value;
+      return conform;
+    }
+
+  /* The flow's own entry only keeps its rule and last-seen time */
+  *value = ratelimiter_bucket_pack (0, rule_index, now);
+
+  pkey.key[0] = (u64) r->prefix.as_u32 << 32;
+  pkey.key[1] = RATELIMITER_PREFIX_KEY | r->len;
+  pkey.value = ratelimiter_bucket_pack (r->bucket_burst, rule_index, now);
+  pkv = clib_bihash_search_or_add_16_8
+    (&rm->per_cpu[thread_index].hash_table, &pkey, &is_new_prefix);
+  if (PREDICT_FALSE (pkv == 0))
+    {
+      *bucket = pkey.value;
+      return 1;
+    }
+
+  conform = ratelimiter_bucket_police (r, rule_index, &pkv->value, now, len);
+  *bucket = pkv->value;
+  return conform;
+}
+
+/**
+ * @brief Per-packet body of the ratelimiter node, shared with fused NF chains.
+ * Looks the flow up in the calling thread's table and polices len bytes
+ * against its bucket. Returns 1 if the packet conforms.
+ */
+static_always_inline int
+ratelimiter_flow_update (ratelimiter_main_t * rm, u32 thread_index,
+                         clib_bihash_kv_16_8_t * key, u64 hash, u32 now,
+                         u32 len, int * is_new, ratelimiter_bucket_t * bucket)
+{
+  clib_bihash_kv_16_8_t *kv;
+
+  key->value = 0;
+  kv = clib_bihash_search_or_add_with_hash_16_8
+    (&rm->per_cpu[thread_index].hash_table, hash, key, is_new);
+  if (PREDICT_FALSE (kv == 0))
+    {
+      *bucket = 0;
+      return 1;
+    }
+
+  return ratelimiter_police (rm, thread_index, &kv->value, kv->key[0] >> 32,
+                             0, *is_new, now, len, bucket);
+}
+
+/**
+ * @brief ratelimiter_flow_update for the IPv6 flow of buffer b, keyed in
+ * the thread's bihash_40_8 table. hash is the buffer's flow hash.
+ */
+static_always_inline int
+ratelimiter_flow_update6 (ratelimiter_main_t * rm, u32 thread_index,
+                          vlib_buffer_t * b, u64 hash, u32 now, u32 len,
+                          int * is_new, ratelimiter_bucket_t * bucket)
+{
+  clib_bihash_kv_40_8_t key6, *kv;
+
+  nfchain_flow_ctx_key6 (b, &key6);
+  kv = clib_bihash_search_or_add_with_hash_40_8
+    (&rm->per_cpu[thread_index].hash_table6, hash, &key6, is_new);
+  if (PREDICT_FALSE (kv == 0))
+    {
+      *bucket = 0;
+      return 1;
+    }
+
+  return ratelimiter_police (rm, thread_index, &kv->value, 0, 1, *is_new,
+                             now, len, bucket);
+}
+
 #define RATELIMITER_PLUGIN_BUILD_VER "1.0"
 
 #endif /* __included_ratelimiter_h__ */
@@ -22,6 +22,9 @@
 #include <vlibapi/api.h>
 #include <vlibmemory/api.h>
 #include <vppinfra/error.h>
+#include <vpp/api/types.h>
+#include <vnet/ip/ip.h>
+#include <vnet/ip/ip_types_api.h>
 
 #define __plugin_msg_base ratelimiter_test_main.msg_id_base
 #include <vlibapi/vat_helper_macros.h>
@@ -29,6 +32,7 @@
 uword unformat_sw_if_index (unformat_input_t * input, va_list * args);
 
 /* Declare message IDs */
+#include <vnet/format_fns.h>
 #include <ratelimiter/ratelimiter.api_enum.h>
 #include <ratelimiter/ratelimiter.api_types.h>
 
@@ -78,6 +82,115 @@ static int api_ratelimiter_macswap_enable_disable (vat_main_t * vam)
     return ret;
 }
 
+static int api_ratelimiter_rule_add_del (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    vl_api_ratelimiter_rule_add_del_t * mp;
+    ip4_address_t prefix;
+    u32 len = ~0, burst = 0;
+    u64 rate = 0;
+    u8 is_aggregate = 0;
+    int is_add = 1;
+    int ret;
+
+    /* Parse args required to build the message */
+    while (unformat_check_input (i) != UNFORMAT_END_OF_INPUT) {
+        if (unformat (i, "%U/%d", unformat_ip4_address, &prefix, &len))
+            ;
+        else if (unformat (i, "rate %llu", &rate))
+            ;
+        else if (unformat (i, "burst %u", &burst))
+            ;
+        else if (unformat (i, "aggregate"))
+            is_aggregate = 1;
+        else if (unformat (i, "del"))
+            is_add = 0;
+        else
+            break;
+    }
+
+    if (len == ~0) {
+        errmsg ("missing prefix\n");
+        return -99;
+    }
+
+    /* Construct the API message */
+    M(RATELIMITER_RULE_ADD_DEL, mp);
+    clib_memcpy (mp->prefix.address, &prefix, sizeof (prefix));
+    mp->prefix.len = len;
+    mp->rate = clib_host_to_net_u64 (rate);
+    mp->burst = ntohl (burst);
+    mp->is_aggregate = is_aggregate;
+    mp->is_add = is_add;
+
+    /* send it... */
+    S(mp);
+
+    /* Wait for a reply... */
+    W (ret);
+    return ret;
+}
+
+static int api_ratelimiter_flow_get (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    vl_api_ratelimiter_flow_get_t * mp;
+    u64 cursor = 0;
+    int ret;
+
+    /* Parse args required to build the message */
+    while (unformat_check_input (i) != UNFORMAT_END_OF_INPUT) {
+        if (unformat (i, "cursor %llu", &cursor))
+            ;
+        else
+            break;
+    }
+
+    /* Construct the API message */
+    M(RATELIMITER_FLOW_GET, mp);
+    mp->cursor = clib_host_to_net_u64 (cursor);
+
+    /* send it... */
+    S(mp);
+
+    /* Wait for a reply... */
+    W (ret);
+    return ret;
+}
+
+static __clib_unused void vl_api_ratelimiter_flow_details_t_handler
+(vl_api_ratelimiter_flow_details_t * mp)
+{
+    vat_main_t * vam = ratelimiter_test_main.vat_main;
+
+    if (mp->is_prefix)
+      fformat (vam->ofp, "[%d] %U/%d rule %d tokens %u\n",
+               ntohl (mp->thread_index), format_vl_api_address,
+               &mp->src_address, mp->prefix_len, mp->rule_index,
+               ntohl (mp->tokens));
+    else
+      fformat (vam->ofp, "[%d] %U:%d -> %U:%d rule %d tokens %u\n",
+               ntohl (mp->thread_index),
+               format_vl_api_address, &mp->src_address, ntohs (mp->src_port),
+               format_vl_api_address, &mp->dst_address, ntohs (mp->dst_port),
+               mp->rule_index, ntohl (mp->tokens));
+}
+
+static void vl_api_ratelimiter_flow_get_reply_t_handler
+(vl_api_ratelimiter_flow_get_reply_t * mp)
+{
+    vat_main_t * vam = ratelimiter_test_main.vat_main;
+    i32 retval = ntohl (mp->retval);
+
+    if (retval == VNET_API_ERROR_EAGAIN) {
+        fformat (vam->ofp, "more to come, continue with cursor %llu\n",
+                 clib_net_to_host_u64 (mp->cursor));
+        retval = 0;
+    }
+    vam->retval = retval;
+    vam->result_ready = 1;
+}
+
 /*
  * List of messages that the api test plugin sends,
  * and that the data plane plugin processes
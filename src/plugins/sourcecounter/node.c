@@ -18,6 +18,8 @@
 #include <vnet/ethernet/ethernet.h>
 #include <vppinfra/error.h>
 #include <sourcecounter/sourcecounter.h>
+#include <nfchain/flow_ctx.h>
+#include <nfchain/flow_pipeline.h>
 
 typedef struct
 {
@@ -57,7 +59,8 @@ extern vlib_node_registration_t sourcecounter_node;
 
 #define foreach_sourcecounter_error \
 _(SWAPPED, "Mac swap packets processed") \
-_(INSERTS, "Packets inserted")
+_(INSERTS, "Packets inserted") \
+_(EXPIRED, "Flows expired")
 
 typedef enum
 {
@@ -81,305 +84,182 @@ typedef enum
 
 
 static_always_inline clib_bihash_kv_16_8_t
-get_hash_key(ip4_header_t *ip4){
+get_hash_key(vnet_buffer_opaque2_t *o){
 	clib_bihash_kv_16_8_t key;
 
-	key.key[0] = (((u64) ip4->src_address.as_u32) << 32);
+	/* src address, high half of the 5-tuple key. IPv6 and non-IP
+	 * packets have none, and are all counted under 0.0.0.0 */
+	key.key[0] = o->flow_ctx.key[0] & 0xffffffff00000000ULL;
 	key.key[1] = 0;
 
 	return key;
 }
 
-static_always_inline void hash_callback(clib_bihash_kv_16_8_t *key, void *arg){
-	// If we are here it means that the key already exists! So, simply return the existing value.
-	clib_bihash_kv_16_8_t *my_kv = (clib_bihash_kv_16_8_t *)arg;
-	my_kv->value = key->value;
+typedef struct
+{
+  sourcecounter_main_t *sm;
+  u32 thread_index;
+  u32 now;
+  u32 n_inserted;
+} sourcecounter_frame_ctx_t;
+
+static_always_inline u64
+sourcecounter_key (vlib_buffer_t * b, clib_bihash_kv_16_8_t * key, void *aux)
+{
+  *key = get_hash_key (vnet_buffer2 (b));
+  return clib_bihash_hash_16_8 (key);
 }
 
+static_always_inline u64
+sourcecounter_sketch_key (vlib_buffer_t * b, clib_bihash_kv_16_8_t * key,
+			  void *aux)
+{
+  *key = get_hash_key (vnet_buffer2 (b));
+  return nfchain_flow_sketch_hash (key->key[0]);
+}
 
-/*
- * Simple dual/single loop version, default version which will compile
- * everywhere.
- *
- * Node costs 30 clocks/pkt at a vector size of 51
- */
+static_always_inline u16
+sourcecounter_forward (vlib_main_t * vm, vlib_node_runtime_t * node,
+		       vlib_buffer_t * b)
+{
+  u32 sw_if_index = vnet_buffer (b)->sw_if_index[VLIB_RX];
+  u16 next;
 
-#define VERSION_1 1
-#ifdef VERSION_1
-#define foreach_mac_address_offset              \
-_(0)                                            \
-_(1)                                            \
-_(2)                                            \
-_(3)                                            \
-_(4)                                            \
-_(5)
+  /* Send pkt back out the RX interface, via the rest of its chain */
+  vnet_buffer (b)->sw_if_index[VLIB_TX] = sw_if_index;
+  next = nfchain_hop_next (&sourcecounter_chain_hop, sw_if_index,
+			   SOURCECOUNTER_NEXT_INTERFACE_OUTPUT);
 
-VLIB_NODE_FN (sourcecounter_node) (vlib_main_t * vm, vlib_node_runtime_t * node,
-			    vlib_frame_t * frame)
+  if (PREDICT_FALSE ((node->flags & VLIB_NODE_FLAG_TRACE)
+		     && (b->flags & VLIB_BUFFER_IS_TRACED)))
+    {
+      clib_bihash_kv_16_8_t flow = nfchain_flow_ctx_key (vnet_buffer2 (b));
+      ethernet_header_t *en = vlib_buffer_get_current (b);
+      sourcecounter_trace_t *t = vlib_add_trace (vm, node, b, sizeof (*t));
+      t->sw_if_index = sw_if_index;
+      t->next_index = next;
+      clib_memcpy_fast (t->new_src_mac, en->src_address,
+			sizeof (t->new_src_mac));
+      clib_memcpy_fast (t->new_dst_mac, en->dst_address,
+			sizeof (t->new_dst_mac));
+      t->src_ip.as_u32 = flow.key[0] >> 32;
+      t->dst_ip.as_u32 = (u32) flow.key[0];
+      t->src_port = flow.key[1] >> 16;
+      t->dst_port = (u16) flow.key[1];
+    }
+
+  return next;
+}
+
+static_always_inline u16
+sourcecounter_update (vlib_main_t * vm, vlib_node_runtime_t * node,
+                      vlib_buffer_t * b, clib_bihash_kv_16_8_t * key, u64 hash,
+                      void *aux, void *arg)
 {
-  u32 n_left_from, *from, *to_next;
-  sourcecounter_next_t next_index;
-  u32 thread_index = 0;
-  clib_bihash_16_8_t hash_table = sourcecounter_main.per_cpu[thread_index].hash_table;
+  sourcecounter_frame_ctx_t *ctx = arg;
+  clib_bihash_kv_16_8_t *kv;
+  int is_new;
+
+  /* Bump in place, the pointer is only valid until the next add */
+  key->value = 0;
+  kv = clib_bihash_search_or_add_with_hash_16_8
+    (&ctx->sm->per_cpu[ctx->thread_index].hash_table, hash, key, &is_new);
+  if (PREDICT_TRUE (kv != 0))
+    kv->value = nfchain_flow_touch (kv->value, ctx->now);
+  ctx->n_inserted += is_new;
+
+  return sourcecounter_forward (vm, node, b);
+}
 
-  u32 pkts_swapped = 0;
-  u32 pkts_inserted = 0;
+static_always_inline u16
+sourcecounter_sketch_update (vlib_main_t * vm, vlib_node_runtime_t * node,
+			     vlib_buffer_t * b, clib_bihash_kv_16_8_t * key,
+			     u64 hash, void *aux, void *arg)
+{
+  sourcecounter_frame_ctx_t *ctx = arg;
 
-  from = vlib_frame_vector_args (frame);
-  n_left_from = frame->n_vectors;
-  next_index = node->cached_next_index;
+  nfchain_flow_sketch_add (&ctx->sm->per_cpu[ctx->thread_index].sketch,
+			   key->key[0], hash, 1);
+  return sourcecounter_forward (vm, node, b);
+}
+
+/*
+ * Sketch mode: no table, nothing to prefetch or age. Counts are halved
+ * every flow timeout instead, so that sources that stopped fade out.
+ */
+static_always_inline uword
+sourcecounter_sketch_node_fn (vlib_main_t * vm, vlib_node_runtime_t * node,
+			      vlib_frame_t * frame,
+			      sourcecounter_frame_ctx_t * ctx)
+{
+  fc_per_cpu_t *pc = &ctx->sm->per_cpu[ctx->thread_index];
+  nfchain_nf_sample_t sample;
 
-  while (n_left_from > 0)
+  nfchain_nf_stats_begin (&sourcecounter_nf_stats, ctx->thread_index, &sample);
+  if (((ctx->now - pc->sketch_decayed) & NFCHAIN_FLOW_TIME_MASK) >=
+      ctx->sm->flow_timeout)
     {
-      u32 n_left_to_next;
+      nfchain_flow_sketch_decay (&pc->sketch);
+      pc->sketch_decayed = ctx->now;
+    }
+  nfchain_nf_stats_end (&sourcecounter_nf_stats, ctx->thread_index,
+			NFCHAIN_NF_STAGE_SWEEP, &sample, frame->n_vectors);
 
-      vlib_get_next_frame (vm, node, next_index, to_next, n_left_to_next);
+  nfchain_nf_stats_begin (&sourcecounter_nf_stats, ctx->thread_index, &sample);
+  nfchain_flow_dispatch_pipeline (vm, node, frame, &pc->hash_table, 0, 0,
+				  sourcecounter_sketch_key,
+				  sourcecounter_sketch_update, ctx);
+  nfchain_nf_stats_end (&sourcecounter_nf_stats, ctx->thread_index,
+			NFCHAIN_NF_STAGE_FRAME, &sample, frame->n_vectors);
 
-	  clib_bihash_kv_16_8_t key0, key1, key2, key3, key4, key5;
-	  u64 hash2, hash3, hash4, hash5;
+  vlib_node_increment_counter (vm, sourcecounter_node.index,
+			       SOURCECOUNTER_ERROR_SWAPPED, frame->n_vectors);
+  return frame->n_vectors;
+}
 
-
-	  if (n_left_from >= 8 && n_left_to_next >= 2) {
-		vlib_buffer_t *p0, *p1, *p2, *p3;
-		ethernet_header_t *en0, *en1, *en2, *en3;
-
-		p0 = vlib_get_buffer (vm, from[0]);
-		p1 = vlib_get_buffer (vm, from[1]);
-		p2 = vlib_get_buffer (vm, from[2]);
-		p3 = vlib_get_buffer (vm, from[3]);
-
-		en0 = vlib_buffer_get_current (p0);
-		en1 = vlib_buffer_get_current (p1);
-		en2 = vlib_buffer_get_current (p2);
-		en3 = vlib_buffer_get_current (p3);
-
-		key0 = get_hash_key((ip4_header_t *) (en0 + 1));
-		key1 = get_hash_key((ip4_header_t *) (en1 + 1));
-		key2 = get_hash_key((ip4_header_t *) (en2 + 1));
-		key3 = get_hash_key((ip4_header_t *) (en3 + 1));
-
-		hash2 = clib_bihash_hash_16_8(&key2);
-		hash3 = clib_bihash_hash_16_8(&key3);
-
-	  }
-	  
-	  while (n_left_from >= 8 && n_left_to_next >= 2){
-		u32 next0 = SOURCECOUNTER_NEXT_INTERFACE_OUTPUT;
-	  	u32 next1 = SOURCECOUNTER_NEXT_INTERFACE_OUTPUT;
-	  	u32 sw_if_index0, sw_if_index1;
-
-	  	u32 bi0, bi1;
-	  	vlib_buffer_t *b0, *b1;
-		
-
-		/* Prefetch 6th and 7th vlib buffers. */
-	  	{
-	    	vlib_buffer_t *p6, *p7;
-
-		    p6 = vlib_get_buffer (vm, from[6]);
-		    p7 = vlib_get_buffer (vm, from[7]);
-
-	    	vlib_prefetch_buffer_header (p6, LOAD);
-	    	vlib_prefetch_buffer_header (p7, LOAD);
-
-		    clib_prefetch_store (p6->data);
-		    clib_prefetch_store (p7->data);
-	  	}
-
-		/* record keys and hashes, plus prefetch buckets. */
-		{
-			vlib_buffer_t *p4, *p5;
-			ethernet_header_t *en4, *en5;
-
-		    p4 = vlib_get_buffer (vm, from[4]);
-		    p5 = vlib_get_buffer (vm, from[5]);
-
-			en4 = vlib_buffer_get_current (p4);
-			en5 = vlib_buffer_get_current (p5);
-
-			key4 = get_hash_key((ip4_header_t *) (en4 + 1));
-			key5 = get_hash_key((ip4_header_t *) (en5 + 1));
-
-			hash4 = clib_bihash_hash_16_8(&key4);
-			hash5 = clib_bihash_hash_16_8(&key5);
-
-			clib_bihash_prefetch_bucket_16_8(&hash_table, hash4);
-			clib_bihash_prefetch_bucket_16_8(&hash_table, hash5);
-
-		}
-
-		/* prefetch data. */
-		{
-			clib_bihash_prefetch_data_16_8(&hash_table, hash2);
-			clib_bihash_prefetch_data_16_8(&hash_table, hash3);
-		}
-
-		to_next[0] = bi0 = from[0];
-		to_next[1] = bi1 = from[1];
-	  	from += 2;
-	  	to_next += 2;
-	  	n_left_from -= 2;
-	  	n_left_to_next -= 2;
-	  	
-		b0 = vlib_get_buffer (vm, bi0);
-	  	b1 = vlib_get_buffer (vm, bi1);
-
-		sourcecounter_main_t * fcm = &sourcecounter_main;
-
-		clib_bihash_kv_16_8_t value0, value1;		
-
-		if (clib_bihash_search_16_8 (&fcm->per_cpu[thread_index].hash_table, &key0, &value0) < 0) {
-			clib_spinlock_lock (&sourcecounter_main.writer_lock);
-			fcm->count++;
-			key0.value = fcm->count;
-			clib_bihash_add_with_overwrite_cb_16_8(&fcm->per_cpu[thread_index].hash_table, &key0, hash_callback, &key0);
-			// It means that other thread has already added the key, so we need to decrement the count.
-			if (key0.value != fcm->count)
-				fcm->count--;
-			
-			value0.value = key0.value;
-			clib_spinlock_unlock (&sourcecounter_main.writer_lock);
-		}
-		if (clib_bihash_search_16_8 (&fcm->per_cpu[thread_index].hash_table, &key1, &value1) < 0) {
-			clib_spinlock_lock (&sourcecounter_main.writer_lock);
-			fcm->count++;
-			key1.value = fcm->count;
-			clib_bihash_add_with_overwrite_cb_16_8(&fcm->per_cpu[thread_index].hash_table, &key1, hash_callback, &key1);
-			// It means that other thread has already added the key, so we need to decrement the count.
-			if (key1.value != fcm->count)
-				fcm->count--;
-			
-			value1.value = key1.value;
-
-			clib_spinlock_unlock (&sourcecounter_main.writer_lock);
-		}
-
-
-		clib_atomic_fetch_add(&fcm->stats[value0.value],1);
-		clib_atomic_fetch_add(&fcm->stats[value1.value],1);
-
-		clib_bihash_add_with_overwrite_cb_16_8(&sourcecounter_main.per_cpu[0].hash_table, &key0, hash_callback, &key0);
-		clib_bihash_add_with_overwrite_cb_16_8(&sourcecounter_main.per_cpu[0].hash_table, &key1, hash_callback, &key1);
-
-		/* shift stored keys and hashes by 2 on every iteration */
-		key0 = key2;
-		key1 = key3;
-		key2 = key4;
-		key3 = key5;
-		hash2 = hash4;
-		hash3 = hash5;
-
-
-    	sw_if_index0 = vnet_buffer (b0)->sw_if_index[VLIB_RX];
-    	sw_if_index1 = vnet_buffer (b1)->sw_if_index[VLIB_RX];
-
-	    /* Send pkt back out the RX interface */
-	  	vnet_buffer (b0)->sw_if_index[VLIB_TX] = sw_if_index0;
-	  	vnet_buffer (b1)->sw_if_index[VLIB_TX] = sw_if_index1;
-
-		vlib_validate_buffer_enqueue_x2 (vm, node, next_index,
-					   to_next, n_left_to_next,
-					   bi0, bi1, next0, next1);
-	  }
-
-      while (n_left_from > 0 && n_left_to_next > 0)
-	  {
-		u32 bi0;
-		vlib_buffer_t *b0;
-		u32 next0 = SOURCECOUNTER_NEXT_INTERFACE_OUTPUT;
-		u32 sw_if_index0;
-		ethernet_header_t *en0;
-		u16 src_port;
-		u16 dst_port;
-
-		/* speculatively enqueue b0 to the current next frame */
-		bi0 = from[0];
-		to_next[0] = bi0;
-		from += 1;
-		to_next += 1;
-		n_left_from -= 1;
-		n_left_to_next -= 1;
-
-		b0 = vlib_get_buffer (vm, bi0);
-	  	/*
-	   	* Direct from the driver, we should be at offset 0
-	   	* aka at &b0->data[0]
-	   	*/
-	  	ASSERT (b0->current_data == 0);
-
-		en0 = vlib_buffer_get_current (b0);
-		en0->dst_address[0] = en0->dst_address[1];
-
-		ip4_header_t* ip40 = (ip4_header_t *) (en0 + 1);
-		ip4_address_t src_ip;
-		ip4_address_t dst_ip;
-		src_ip = ip40->src_address;
-		dst_ip = ip40->dst_address;
-		udp_header_t *udp0 = (udp_header_t *)(ip40 + 1);
-		src_port = udp0->src_port;
-		dst_port = udp0->dst_port;
-
-
-		clib_bihash_kv_16_8_t key = get_hash_key(ip40);
-
-		sourcecounter_main_t * fcm = &sourcecounter_main;
-		clib_bihash_kv_16_8_t value;		
-
-		if (clib_bihash_search_16_8 (&fcm->per_cpu[thread_index].hash_table, &key, &value) < 0) {
-			clib_spinlock_lock (&sourcecounter_main.writer_lock);
-			fcm->count++;
-			key.value = fcm->count;
-			clib_bihash_add_with_overwrite_cb_16_8(&fcm->per_cpu[thread_index].hash_table, &key, hash_callback, &key);
-			// It means that other thread has already added the key, so we need to decrement the count.
-			if (key.value != fcm->count)
-				fcm->count--;
-			
-			value.value = key.value;
-
-			clib_spinlock_unlock (&sourcecounter_main.writer_lock);
-		}
-
-		clib_atomic_fetch_add(&fcm->stats[value.value],1);
-
-    	sw_if_index0 = vnet_buffer (b0)->sw_if_index[VLIB_RX];
-
-	    /* Send pkt back out the RX interface */
-	  	vnet_buffer (b0)->sw_if_index[VLIB_TX] = sw_if_index0;
-
-	  	if (PREDICT_FALSE ((node->flags & VLIB_NODE_FLAG_TRACE)
-			     && (b0->flags & VLIB_BUFFER_IS_TRACED)))
-	    {
-	      sourcecounter_trace_t *t = vlib_add_trace (vm, node, b0, sizeof (*t));
-	      t->sw_if_index = sw_if_index0;
-	      t->next_index = next0;
-	      clib_memcpy_fast (t->new_src_mac, en0->src_address,
-				sizeof (t->new_src_mac));
-	      clib_memcpy_fast (t->new_dst_mac, en0->dst_address,
-				sizeof (t->new_dst_mac));
-		  t->src_ip = src_ip;
-	      t->dst_ip = dst_ip;
-	      t->src_port = src_port;
-		  t->dst_port = dst_port;
-	    }
-
-	  	pkts_swapped += 1;
-
-	  	/* verify speculative enqueue, maybe switch current next frame */
-	  	vlib_validate_buffer_enqueue_x1 (vm, node, next_index,
-					   to_next, n_left_to_next,
-					   bi0, next0);
-	  }
-
-      vlib_put_next_frame (vm, node, next_index, n_left_to_next);
-    }
-  
+/*
+ * Frame at a time through the flow pipeline, see nfchain/flow_pipeline.h.
+ */
+VLIB_NODE_FN (sourcecounter_node) (vlib_main_t * vm, vlib_node_runtime_t * node,
+			    vlib_frame_t * frame)
+{
+  sourcecounter_main_t *sm = &sourcecounter_main;
+  sourcecounter_frame_ctx_t ctx = {
+    .sm = sm,
+    .thread_index = vm->thread_index,
+    .now = nfchain_flow_now (vm),
+  };
+  nfchain_flow_age_t age = { .now = ctx.now, .timeout = sm->flow_timeout };
+  nfchain_nf_sample_t sample;
+  u32 n_expired;
+
+  if (sm->sketch_width)
+    return sourcecounter_sketch_node_fn (vm, node, frame, &ctx);
+
+  nfchain_nf_stats_begin (&sourcecounter_nf_stats, ctx.thread_index, &sample);
+  nfchain_flow_dispatch_pipeline
+    (vm, node, frame, &sm->per_cpu[ctx.thread_index].hash_table,
+     sm->prefetch_distance, 0, sourcecounter_key, sourcecounter_update, &ctx);
+  nfchain_nf_stats_end (&sourcecounter_nf_stats, ctx.thread_index,
+			NFCHAIN_NF_STAGE_FRAME, &sample, frame->n_vectors);
+
+  /* Age out idle flows, a few buckets per dispatch */
+  nfchain_nf_stats_begin (&sourcecounter_nf_stats, ctx.thread_index, &sample);
+  n_expired = clib_bihash_sweep_16_8
+    (&sm->per_cpu[ctx.thread_index].hash_table,
+     &sm->per_cpu[ctx.thread_index].sweep_cursor, NFCHAIN_FLOW_SWEEP_WORK,
+     nfchain_flow_is_stale, &age);
+  nfchain_nf_stats_end (&sourcecounter_nf_stats, ctx.thread_index,
+			NFCHAIN_NF_STAGE_SWEEP, &sample, frame->n_vectors);
+
+  vlib_node_increment_counter (vm, sourcecounter_node.index,
+			       SOURCECOUNTER_ERROR_SWAPPED, frame->n_vectors);
   vlib_node_increment_counter (vm, sourcecounter_node.index,
-			       SOURCECOUNTER_ERROR_SWAPPED, pkts_swapped);
+			       SOURCECOUNTER_ERROR_INSERTS, ctx.n_inserted);
   vlib_node_increment_counter (vm, sourcecounter_node.index,
-			       SOURCECOUNTER_ERROR_INSERTS, pkts_inserted);
+			       SOURCECOUNTER_ERROR_EXPIRED, n_expired);
   return frame->n_vectors;
 }
-#endif
 
 
 /* *INDENT-OFF* */
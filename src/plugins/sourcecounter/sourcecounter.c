@@ -20,9 +20,11 @@
 #include <vnet/vnet.h>
 #include <vnet/plugin/plugin.h>
 #include <sourcecounter/sourcecounter.h>
+#include <nfchain/flow_dump.h>
 
 #include <vlibapi/api.h>
 #include <vlibmemory/api.h>
+#include <vnet/format_fns.h>
 
 #include <sourcecounter/sourcecounter.api_enum.h>
 #include <sourcecounter/sourcecounter.api_types.h>
@@ -30,15 +32,14 @@
 #define REPLY_MSG_ID_BASE sm->msg_id_base
 #include <vlibapi/api_helper_macros.h>
 
-#define sourcecounter_get_writer_lock() clib_spinlock_lock (&sourcecounter_main.writer_lock)
-#define sourcecounter_put_writer_lock() clib_spinlock_unlock (&sourcecounter_main.writer_lock)
-
 VLIB_PLUGIN_REGISTER () = {
     .version = SOURCECOUNTER_PLUGIN_BUILD_VER,
     .description = "SourceCounter plugin",
 };
 
 sourcecounter_main_t sourcecounter_main;
+__clib_export nfchain_hop_t sourcecounter_chain_hop;
+__clib_export nfchain_nf_stats_t sourcecounter_nf_stats;
 
 /**
  * @brief Enable/disable the macswap plugin. 
@@ -123,6 +124,136 @@ VLIB_CLI_COMMAND (sr_content_command, static) = {
     .function = macswap_enable_disable_command_fn,
 };
 
+/**
+ * @brief Merge the per-thread sketches into sm->merged.
+ */
+void sourcecounter_sketch_merge (sourcecounter_main_t * sm)
+{
+  nfchain_flow_sketch_t **sketches = 0;
+  int i;
+
+  for (i = 0; i < vec_len (sm->per_cpu); i++)
+    vec_add1 (sketches, &sm->per_cpu[i].sketch);
+  nfchain_flow_sketch_merge (&sm->merged, sketches);
+  vec_free (sketches);
+}
+
+/**
+ * @brief Sum the per-thread replicas for a single source address,
+ * or estimate it from the merged sketches in sketch mode.
+ */
+u64 sourcecounter_get_count (sourcecounter_main_t * sm, ip4_address_t * src)
+{
+  clib_bihash_kv_16_8_t kv, value;
+  u64 count = 0;
+  int i;
+
+  kv.key[0] = ((u64) src->as_u32) << 32;
+  kv.key[1] = 0;
+
+  if (sm->sketch_width)
+    {
+      sourcecounter_sketch_merge (sm);
+      return nfchain_flow_sketch_estimate
+        (&sm->merged, nfchain_flow_sketch_hash (kv.key[0]));
+    }
+
+  for (i = 0; i < vec_len (sm->per_cpu); i++)
+    if (clib_bihash_search_16_8 (&sm->per_cpu[i].hash_table, &kv, &value) == 0)
+      count += nfchain_flow_count (value.value);
+
+  return count;
+}
+
+typedef struct {
+  uword *index_by_key;
+  u64 *keys;
+  u64 *counts;
+} sourcecounter_merge_ctx_t;
+
+static int
+sourcecounter_merge_kvp (clib_bihash_kv_16_8_t * kv, void *arg)
+{
+  sourcecounter_merge_ctx_t *ctx = arg;
+  uword *p;
+
+  p = hash_get (ctx->index_by_key, kv->key[0]);
+  if (p)
+    ctx->counts[p[0]] += nfchain_flow_count (kv->value);
+  else
+    {
+      hash_set (ctx->index_by_key, kv->key[0], vec_len (ctx->keys));
+      vec_add1 (ctx->keys, kv->key[0]);
+      vec_add1 (ctx->counts, nfchain_flow_count (kv->value));
+    }
+  return BIHASH_WALK_CONTINUE;
+}
+
+static clib_error_t *
+show_sourcecounter_command_fn (vlib_main_t * vm,
+                                unformat_input_t * input,
+                                vlib_cli_command_t * cmd)
+{
+  sourcecounter_main_t * sm = &sourcecounter_main;
+  sourcecounter_merge_ctx_t ctx = { 0 };
+  ip4_address_t addr;
+  int i;
+
+  if (unformat (input, "%U", unformat_ip4_address, &addr))
+    {
+      vlib_cli_output (vm, "%U: %llu", format_ip4_address, &addr,
+                       sourcecounter_get_count (sm, &addr));
+      return 0;
+    }
+
+  if (sm->sketch_width)
+    {
+      u32 *order;
+
+      sourcecounter_sketch_merge (sm);
+      order = nfchain_flow_sketch_sort (&sm->merged);
+      vlib_cli_output (vm, "sketch of %u x %u counters, top %d sources",
+                       NFCHAIN_FLOW_SKETCH_DEPTH, sm->sketch_width,
+                       vec_len (order));
+      for (i = 0; i < vec_len (order); i++)
+        {
+          addr.as_u32 = (u32) (sm->merged.keys[order[i]] >> 32);
+          vlib_cli_output (vm, "  %U: ~%llu", format_ip4_address, &addr,
+                           sm->merged.estimates[order[i]]);
+        }
+      vec_free (order);
+      return 0;
+    }
+
+  /* Merge the per-thread replicas into a single view */
+  ctx.index_by_key = hash_create (0, sizeof (uword));
+  for (i = 0; i < vec_len (sm->per_cpu); i++)
+    clib_bihash_foreach_key_value_pair_16_8 (&sm->per_cpu[i].hash_table,
+                                             sourcecounter_merge_kvp, &ctx);
+
+  vlib_cli_output (vm, "%d sources", vec_len (ctx.keys));
+  for (i = 0; i < vec_len (ctx.keys); i++)
+    {
+      addr.as_u32 = (u32) (ctx.keys[i] >> 32);
+      vlib_cli_output (vm, "  %U: %llu", format_ip4_address, &addr,
+                       ctx.counts[i]);
+    }
+
+  hash_free (ctx.index_by_key);
+  vec_free (ctx.keys);
+  vec_free (ctx.counts);
+  return 0;
+}
+
+/**
+ * @brief CLI command to show the merged per-source counters.
+ */
+VLIB_CLI_COMMAND (show_sourcecounter_command, static) = {
+    .path = "show sourcecounter",
+    .short_help = "show sourcecounter [<ip4-address>]",
+    .function = show_sourcecounter_command_fn,
+};
+
 /**
  * @brief Plugin API message handler.
  */
@@ -139,6 +270,80 @@ static void vl_api_sourcecounter_macswap_enable_disable_t_handler
   REPLY_MACRO(VL_API_SOURCECOUNTER_MACSWAP_ENABLE_DISABLE_REPLY);
 }
 
+static int
+sourcecounter_send_flow_details (clib_bihash_kv_16_8_t * kv, void *arg)
+{
+  nfchain_flow_dump_ctx_t *ctx = arg;
+  vl_api_sourcecounter_flow_details_t *mp;
+
+  mp = vl_msg_api_alloc (sizeof (*mp));
+  clib_memset (mp, 0, sizeof (*mp));
+  mp->_vl_msg_id = htons (VL_API_SOURCECOUNTER_FLOW_DETAILS + ctx->msg_id_base);
+  mp->context = ctx->context;
+  mp->thread_index = htonl (ctx->thread_index);
+  clib_memcpy (mp->src_address, &((u32) { kv->key[0] >> 32 }),
+               sizeof (mp->src_address));
+  mp->packets = clib_host_to_net_u64 (nfchain_flow_count (kv->value));
+  mp->idle = htonl (nfchain_flow_idle (ctx->now, kv->value));
+
+  vl_api_send_msg (ctx->rp, (u8 *) mp);
+  return BIHASH_WALK_CONTINUE;
+}
+
+/*
+ * Sketch mode has no per-thread entries to walk. The merged top sources
+ * go out in one page instead, with thread_index ~0 and estimated counts.
+ */
+static void
+sourcecounter_send_sketch_details (sourcecounter_main_t * sm,
+                                   vl_api_sourcecounter_flow_get_t * mp)
+{
+  vl_api_sourcecounter_flow_details_t *dmp;
+  vl_api_registration_t *rp;
+  u32 *order, i;
+
+  rp = vl_api_client_index_to_registration (mp->client_index);
+  if (rp == 0)
+    return;
+
+  sourcecounter_sketch_merge (sm);
+  order = nfchain_flow_sketch_sort (&sm->merged);
+  for (i = 0; i < vec_len (order); i++)
+    {
+      dmp = vl_msg_api_alloc (sizeof (*dmp));
+      clib_memset (dmp, 0, sizeof (*dmp));
+      dmp->_vl_msg_id = htons (VL_API_SOURCECOUNTER_FLOW_DETAILS +
+                               sm->msg_id_base);
+      dmp->context = mp->context;
+      dmp->thread_index = ~0;
+      clib_memcpy (dmp->src_address,
+                   &((u32) { sm->merged.keys[order[i]] >> 32 }),
+                   sizeof (dmp->src_address));
+      dmp->packets = clib_host_to_net_u64 (sm->merged.estimates[order[i]]);
+      vl_api_send_msg (rp, (u8 *) dmp);
+    }
+  vec_free (order);
+}
+
+static void vl_api_sourcecounter_flow_get_t_handler
+(vl_api_sourcecounter_flow_get_t * mp)
+{
+  vl_api_sourcecounter_flow_get_reply_t * rmp;
+  sourcecounter_main_t * sm = &sourcecounter_main;
+  int rv = 0;
+
+  if (sm->sketch_width)
+    {
+      sourcecounter_send_sketch_details (sm, mp);
+      REPLY_MACRO2 (VL_API_SOURCECOUNTER_FLOW_GET_REPLY,
+                    ({ rmp->cursor = clib_host_to_net_u64 (~0ULL); }));
+      return;
+    }
+
+  NFCHAIN_FLOW_DUMP_MACRO (VL_API_SOURCECOUNTER_FLOW_GET_REPLY, sm->per_cpu,
+                           sourcecounter_send_flow_details);
+}
+
 /* API definitions */
 #include <sourcecounter/sourcecounter.api.c>
 
@@ -148,12 +353,50 @@ static uint32_t ipv4_hash_crc(const void *data,  uint32_t data_len, uint32_t ini
 }
 */
 
+static u8 *
+format_sourcecounter_key (u8 * s, va_list * args)
+{
+  clib_bihash_kv_16_8_t *kv = va_arg (*args, clib_bihash_kv_16_8_t *);
+  ip4_address_t src = { .as_u32 = kv->key[0] >> 32 };
+
+  return format (s, "%U", format_ip4_address, &src);
+}
+
+static void
+sourcecounter_topk_collect (vlib_stats_collector_data_t * d)
+{
+  sourcecounter_main_t * sm = &sourcecounter_main;
+  nfchain_flow_topk_t * t = &sm->topk;
+  clib_bihash_kv_16_8_t *m;
+  u32 i;
+
+  /* Sketch mode: merge the threads once per stats update */
+  if (sm->sketch_width)
+    {
+      sourcecounter_sketch_merge (sm);
+      for (i = 0; i < sm->merged.n_keys; i++)
+        {
+          vec_add2 (t->merged, m, 1);
+          m->key[0] = sm->merged.keys[i];
+          m->key[1] = 0;
+          m->value = sm->merged.estimates[i];
+        }
+      nfchain_flow_topk_publish (t, d);
+      return;
+    }
+
+  nfchain_flow_topk_collect (t, &sm->per_cpu[t->thread_index].hash_table,
+                             0, vec_len (sm->per_cpu), d);
+}
+
 /**
  * @brief Initialize the sourcecounter plugin.
  */
 static clib_error_t * sourcecounter_init (vlib_main_t * vm)
 {
   sourcecounter_main_t * sm = &sourcecounter_main;
+  uword memory_size;
+  u32 nbuckets;
 
   sm->vnet_main =  vnet_get_main ();
 
@@ -165,20 +408,107 @@ static clib_error_t * sourcecounter_init (vlib_main_t * vm)
   vlib_thread_main_t *tm = vlib_get_thread_main ();
   vec_validate(sm->per_cpu, tm->n_vlib_mains - 1);
   
-  int i = 0;
-  char* name = (char *) format(0, "sourcecounter_%d", i);
-  clib_bihash_init_16_8(&sm->per_cpu[i].hash_table, 
-                            name, 4194304, 1 << 30);
+  /*
+   * One replica per thread, so workers never contend on bucket locks.
+   * Each is sized for max_flows concurrent flows, idle ones are aged out.
+   */
+  if (sm->flow_timeout == 0)
+    sm->flow_timeout = NFCHAIN_FLOW_DEFAULT_TIMEOUT;
+  if (sm->max_flows == 0)
+    sm->max_flows = NFCHAIN_FLOW_DEFAULT_MAX_FLOWS;
+  if (sm->prefetch_distance == 0)
+    sm->prefetch_distance = NFCHAIN_FLOW_PREFETCH_DISTANCE;
+  nfchain_flow_table_size (sm->max_flows, &nbuckets, &memory_size);
+
+  /* Sketch mode: fixed size sketches, no tables */
+  if (sm->sketch_width)
+    {
+      if (sm->topk.k == 0)
+        sm->topk.k = NFCHAIN_FLOW_SKETCH_DEFAULT_K;
+      for (int i = 0; i < tm->n_vlib_mains; i++)
+        nfchain_flow_sketch_init (&sm->per_cpu[i].sketch, sm->sketch_width,
+                                  sm->topk.k);
+      nfchain_flow_sketch_init (&sm->merged, sm->sketch_width, sm->topk.k);
+    }
+
+  for (int i=0; i < tm->n_vlib_mains && sm->sketch_width == 0; i++) {
+    char* name = (char *) format(0, "sourcecounter_%d", i);
+    nfchain_flow_table_init (16_8, &sm->per_cpu[i].hash_table, name, i,
+                             nbuckets, memory_size, sm->log2_page_sz);
+  }
 
-  clib_spinlock_init (&sm->writer_lock);
-  sm->stats = calloc(20000000, sizeof(u64));
-  sm->count = 0;
+  if (sm->topk.k)
+    nfchain_flow_topk_init (&sm->topk, "sourcecounter",
+                            format_sourcecounter_key, 0,
+                            sourcecounter_topk_collect);
 
   return 0;
 }
 
 VLIB_INIT_FUNCTION (sourcecounter_init);
 
+/**
+ * @brief Startup config, e.g.
+ *   sourcecounter { flows 1000000 timeout 60 prefetch-distance 4 topk 10 }
+ *   sourcecounter { sketch width 2048 topk 64 }
+ *
+ * Each thread's table is sized for flows concurrent flows, on the
+ * thread's NUMA node, on page-size pages (e.g. 2m) if set. Flows idle
+ * for timeout seconds are deleted. topk exports the top K counters to
+ * the stats segment, see nfchain/flow_topk.h.
+ * Flow table lookups are prefetched prefetch-distance packets ahead.
+ *
+ * sketch counts sources in a fixed size sketch per thread instead, see
+ * nfchain/flow_sketch.h, tracking the top K sources (64 by default).
+ * Counts are halved every timeout seconds.
+ */
+static clib_error_t *
+sourcecounter_config (vlib_main_t * vm, unformat_input_t * input)
+{
+  sourcecounter_main_t * sm = &sourcecounter_main;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat (input, "flows %u", &sm->max_flows))
+      ;
+    else if (unformat (input, "page-size %U", unformat_log2_page_size,
+                       &sm->log2_page_sz))
+      ;
+    else if (unformat (input, "timeout %u", &sm->flow_timeout))
+      ;
+    else if (unformat (input, "prefetch-distance %u",
+                       &sm->prefetch_distance))
+      ;
+    else if (unformat (input, "topk %u", &sm->topk.k))
+      ;
+    else if (unformat (input, "sketch width %u", &sm->sketch_width))
+      ;
+    else if (unformat (input, "sketch"))
+      sm->sketch_width = NFCHAIN_FLOW_SKETCH_DEFAULT_WIDTH;
+    else
+      return clib_error_return (0, "unknown input '%U'",
+                                format_unformat_error, input);
+  }
+
+  if (sm->flow_timeout > NFCHAIN_FLOW_TIME_MASK / 2)
+    return clib_error_return (0, "timeout %u too large", sm->flow_timeout);
+  if (sm->prefetch_distance > NFCHAIN_FLOW_PREFETCH_DISTANCE_MAX)
+    return clib_error_return (0, "prefetch-distance %u too large",
+                              sm->prefetch_distance);
+  if (sm->topk.k > NFCHAIN_FLOW_TOPK_MAX)
+    return clib_error_return (0, "topk %u too large", sm->topk.k);
+  if (sm->sketch_width && (!is_pow2 (sm->sketch_width) ||
+                           sm->sketch_width < NFCHAIN_FLOW_SKETCH_MIN_WIDTH ||
+                           sm->sketch_width > NFCHAIN_FLOW_SKETCH_MAX_WIDTH))
+    return clib_error_return (0, "sketch width %u not a power of 2 in "
+                              "[%u, %u]", sm->sketch_width,
+                              NFCHAIN_FLOW_SKETCH_MIN_WIDTH,
+                              NFCHAIN_FLOW_SKETCH_MAX_WIDTH);
+
+  return 0;
+}
+
+VLIB_EARLY_CONFIG_FUNCTION (sourcecounter_config, "sourcecounter");
+
 /**
  * @brief Hook the sourcecounter plugin into the VPP graph hierarchy.
  */
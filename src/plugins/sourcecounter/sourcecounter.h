@@ -24,13 +24,27 @@
 #include <vppinfra/elog.h>
 
 #include <vppinfra/bihash_16_8.h>
+#include <nfchain/flow_age.h>
+#include <nfchain/chain.h>
+#include <nfchain/nf_stats.h>
+#include <nfchain/flow_pipeline.h>
+#include <nfchain/flow_topk.h>
+#include <nfchain/flow_sketch.h>
 
 typedef struct {
   /**
-   * Each CPU has its own sticky flow hash table.
-   * One single table is used for all VIPs.
+   * Each CPU has its own replica of the per-source table.
+   * Workers only ever touch their own replica, the control plane
+   * sums the replicas when it needs a global view.
    */
   clib_bihash_16_8_t hash_table;
+
+  /* Next bucket for the aging sweep */
+  u32 sweep_cursor;
+
+  /* Sketch mode: counts in place of the table, and when last halved */
+  nfchain_flow_sketch_t sketch;
+  u32 sketch_decayed;
 } fc_per_cpu_t;
 
 typedef struct {
@@ -40,20 +54,43 @@ typedef struct {
     /* convenience */
     vnet_main_t * vnet_main;
 
+    /* Idle flow timeout in seconds, table size in concurrent flows */
+    u32 flow_timeout;
+    u32 max_flows;
+
+    /* Flow table page size, 0 for default pages */
+    clib_mem_page_sz_t log2_page_sz;
+
+    /* Flow table prefetch distance in packets, see nfchain/flow_pipeline.h */
+    u32 prefetch_distance;
+
+    /* Top K export to the stats segment */
+    nfchain_flow_topk_t topk;
+
+    /*
+     * Sketch mode, see nfchain/flow_sketch.h: a sketch width wide per
+     * thread instead of the tables, 0 if off. The merge of the threads'
+     * sketches is rebuilt from scratch by each reader.
+     */
+    u32 sketch_width;
+    nfchain_flow_sketch_t merged;
+
     /* Some global data is per-cpu */
     fc_per_cpu_t *per_cpu;
 
-    clib_spinlock_t writer_lock;
-    
-    u64 *stats;
-    u64 count;
-
 } sourcecounter_main_t;
 
 extern sourcecounter_main_t sourcecounter_main;
 
 extern vlib_node_registration_t sourcecounter_node;
 
+/* Next hops when on a runtime NF chain, see nfchain/chain.h */
+extern nfchain_hop_t sourcecounter_chain_hop;
+extern nfchain_nf_stats_t sourcecounter_nf_stats;
+
+u64 sourcecounter_get_count (sourcecounter_main_t * sm, ip4_address_t * src);
+void sourcecounter_sketch_merge (sourcecounter_main_t * sm);
+
 #define SOURCECOUNTER_PLUGIN_BUILD_VER "1.0"
 
 #endif /* __included_sourcecounter_h__ */
@@ -22,6 +22,8 @@
 #include <vlibapi/api.h>
 #include <vlibmemory/api.h>
 #include <vppinfra/error.h>
+#include <vnet/ip/ip.h>
+#include <vnet/ip/ip_types_api.h>
 
 #define __plugin_msg_base sourcecounter_test_main.msg_id_base
 #include <vlibapi/vat_helper_macros.h>
@@ -29,6 +31,7 @@
 uword unformat_sw_if_index (unformat_input_t * input, va_list * args);
 
 /* Declare message IDs */
+#include <vnet/format_fns.h>
 #include <sourcecounter/sourcecounter.api_enum.h>
 #include <sourcecounter/sourcecounter.api_types.h>
 
@@ -78,6 +81,58 @@ static int api_sourcecounter_macswap_enable_disable (vat_main_t * vam)
     return ret;
 }
 
+static int api_sourcecounter_flow_get (vat_main_t * vam)
+{
+    unformat_input_t * i = vam->input;
+    vl_api_sourcecounter_flow_get_t * mp;
+    u64 cursor = 0;
+    int ret;
+
+    /* Parse args required to build the message */
+    while (unformat_check_input (i) != UNFORMAT_END_OF_INPUT) {
+        if (unformat (i, "cursor %llu", &cursor))
+            ;
+        else
+            break;
+    }
+
+    /* Construct the API message */
+    M(SOURCECOUNTER_FLOW_GET, mp);
+    mp->cursor = clib_host_to_net_u64 (cursor);
+
+    /* send it... */
+    S(mp);
+
+    /* Wait for a reply... */
+    W (ret);
+    return ret;
+}
+
+static __clib_unused void vl_api_sourcecounter_flow_details_t_handler
+(vl_api_sourcecounter_flow_details_t * mp)
+{
+    vat_main_t * vam = sourcecounter_test_main.vat_main;
+
+    fformat (vam->ofp, "[%d] %U packets %llu idle %us\n",
+             ntohl (mp->thread_index), format_ip4_address, mp->src_address,
+             clib_net_to_host_u64 (mp->packets), ntohl (mp->idle));
+}
+
+static void vl_api_sourcecounter_flow_get_reply_t_handler
+(vl_api_sourcecounter_flow_get_reply_t * mp)
+{
+    vat_main_t * vam = sourcecounter_test_main.vat_main;
+    i32 retval = ntohl (mp->retval);
+
+    if (retval == VNET_API_ERROR_EAGAIN) {
+        fformat (vam->ofp, "more to come, continue with cursor %llu\n",
+                 clib_net_to_host_u64 (mp->cursor));
+        retval = 0;
+    }
+    vam->retval = retval;
+    vam->result_ready = 1;
+}
+
 /*
  * List of messages that the api test plugin sends,
  * and that the data plane plugin processes
@@ -224,6 +224,90 @@ VLIB_CLI_COMMAND (test_vlib2_command, static) =
 };
 /* *INDENT-ON* */
 
+static void
+test_rcu_callback (void *data)
+{
+  (*(u32 *) data)++;
+}
+
+static clib_error_t *
+test_rcu_command_fn (vlib_main_t * vm,
+		     unformat_input_t * input, vlib_cli_command_t * cmd)
+{
+  vlib_rcu_main_t *rm = &vlib_rcu_main;
+  u64 *saved = 0;
+  u32 i, n_calls = 0;
+  clib_error_t *error = 0;
+
+  if (vec_len (rm->threads) != vlib_get_n_threads ())
+    return clib_error_return (0, "%u rcu threads, %u threads",
+			      vec_len (rm->threads), vlib_get_n_threads ());
+  if (vec_len (rm->threads) < 2)
+    return clib_error_return (0, "needs a worker");
+
+  /* Workers are parked at the barrier, fake their epochs */
+  for (i = 0; i < vec_len (rm->threads); i++)
+    vec_add1 (saved, rm->threads[i].epoch);
+
+  /* Run what was pending before, so that only ours is left */
+  for (i = 1; i < vec_len (rm->threads); i++)
+    rm->threads[i].epoch = rm->epoch;
+  vlib_rcu_reclaim (vm);
+
+  vlib_rcu_call (test_rcu_callback, &n_calls);
+
+  /* Worker 1 has not passed a quiescent point since the call */
+  for (i = 2; i < vec_len (rm->threads); i++)
+    rm->threads[i].epoch = rm->epoch;
+  vlib_rcu_reclaim (vm);
+  if (n_calls != 0)
+    {
+      error = clib_error_return (0, "callback ran before worker 1 was "
+				 "quiescent");
+      goto done;
+    }
+
+  rm->threads[1].epoch = rm->epoch;
+  vlib_rcu_reclaim (vm);
+  if (n_calls != 1)
+    {
+      error = clib_error_return (0, "callback did not run after worker 1 "
+				 "was quiescent");
+      goto done;
+    }
+
+  /* An offline worker holds nothing back */
+  vlib_rcu_call (test_rcu_callback, &n_calls);
+  rm->threads[1].epoch = VLIB_RCU_OFFLINE;
+  vlib_rcu_reclaim (vm);
+  if (n_calls != 2)
+    error = clib_error_return (0, "callback waited for an offline worker");
+
+done:
+  /* Never leave a callback on our stack behind */
+  for (i = 1; i < vec_len (rm->threads); i++)
+    rm->threads[i].epoch = rm->epoch;
+  vlib_rcu_reclaim (vm);
+
+  for (i = 0; i < vec_len (rm->threads); i++)
+    rm->threads[i].epoch = saved[i];
+  vec_free (saved);
+  if (!error)
+    vlib_cli_output (vm, "rcu test OK");
+  return error;
+}
+
+/*?
+ * Check that deferred reclamation callbacks wait for every worker.
+ *
+ * @cliexcmd{test rcu}
+?*/
+VLIB_CLI_COMMAND (test_rcu_command, static) = {
+  .path = "test rcu",
+  .short_help = "vlib deferred reclamation unit test",
+  .function = test_rcu_command_fn,
+};
+
 
 
 
@@ -480,6 +480,201 @@ vlib_buffer_alloc_size (uword ext_hdr_size, uword data_size)
   return alloc_size;
 }
 
+static void
+vlib_buffer_pool_threads_init (vlib_buffer_main_t * bm,
+			       vlib_buffer_pool_t * bp)
+{
+  vlib_buffer_pool_thread_t *bpt;
+
+  vec_validate_aligned (bp->threads, vlib_get_n_threads () - 1,
+			CLIB_CACHE_LINE_BYTES);
+
+  vec_foreach (bpt, bp->threads)
+    {
+      if (bpt->returns)
+	continue;
+      bpt->cache_size = bm->per_thread_cache_size ?
+	bm->per_thread_cache_size : VLIB_BUFFER_POOL_PER_THREAD_CACHE_SZ;
+      vec_validate_aligned (bpt->returns, VLIB_BUFFER_POOL_N_RETURNS - 1,
+			    CLIB_CACHE_LINE_BYTES);
+    }
+}
+
+u32
+vlib_buffer_pool_take_returns (vlib_buffer_pool_thread_t * bpt)
+{
+  vlib_buffer_pool_return_t *r;
+  u32 head = bpt->return_head, n = 0;
+
+  while (head != clib_atomic_load_acq_n (&bpt->return_tail))
+    {
+      r = bpt->returns + (head & (VLIB_BUFFER_POOL_N_RETURNS - 1));
+
+      /* Senders fill their slots in any order */
+      if (!clib_atomic_load_acq_n (&r->valid)
+	  || bpt->n_cached + r->n_buffers > bpt->cache_size)
+	break;
+
+      vlib_buffer_copy_indices (bpt->cached_buffers + bpt->n_cached,
+				r->buffers, r->n_buffers);
+      bpt->n_cached += r->n_buffers;
+      r->valid = 0;
+
+      /* The slot is free for senders */
+      clib_atomic_store_rel_n (&bpt->return_head, ++head);
+      n++;
+    }
+
+  bpt->n_returns_taken += n;
+  return n;
+}
+
+/*
+ * Called every VLIB_BUFFER_POOL_CHECK_RETURNS_LOOPS main loops. A thread
+ * that has not refilled its cache since the last call stops asking for
+ * returns, and gives the buffers it was returned back to the pool, rather
+ * than holding them until it allocates again.
+ */
+void
+vlib_buffer_pool_check_returns (vlib_main_t * vm)
+{
+  vlib_buffer_main_t *bm = vm->buffer_main;
+  vlib_buffer_pool_return_t *r;
+  vlib_buffer_pool_thread_t *bpt;
+  vlib_buffer_pool_t *bp;
+  u32 head;
+
+  vec_foreach (bp, bm->buffer_pools)
+    {
+      if (vm->thread_index >= vec_len (bp->threads))
+	continue;
+
+      bpt = bp->threads + vm->thread_index;
+      if (bpt->refilled)
+	{
+	  bpt->refilled = 0;
+	  continue;
+	}
+
+      if (bpt->wants_returns)
+	bpt->wants_returns = 0;
+
+      /* Including those filled by senders that still saw it set */
+      head = bpt->return_head;
+      if (head == clib_atomic_load_acq_n (&bpt->return_tail))
+	continue;
+
+      vlib_buffer_pool_lock (vm, bp);
+      while (head != clib_atomic_load_acq_n (&bpt->return_tail))
+	{
+	  r = bpt->returns + (head & (VLIB_BUFFER_POOL_N_RETURNS - 1));
+	  if (!clib_atomic_load_acq_n (&r->valid))
+	    break;
+
+	  vlib_buffer_copy_indices (bp->buffers + bp->n_avail, r->buffers,
+				    r->n_buffers);
+	  bp->n_avail += r->n_buffers;
+	  r->valid = 0;
+	  clib_atomic_store_rel_n (&bpt->return_head, ++head);
+	}
+      clib_spinlock_unlock (&bp->lock);
+    }
+}
+
+/* Queue up to VLIB_BUFFER_POOL_RETURN_SZ buffers to thread rt, 0 if full */
+static_always_inline int
+vlib_buffer_pool_return_put (vlib_buffer_pool_thread_t * rt, u32 * buffers,
+			     u32 n_buffers)
+{
+  vlib_buffer_pool_return_t *r;
+  u32 tail;
+
+  do
+    {
+      tail = rt->return_tail;
+      if (tail - clib_atomic_load_acq_n (&rt->return_head) >=
+	  VLIB_BUFFER_POOL_N_RETURNS)
+	return 0;
+    }
+  while (!clib_atomic_bool_cmp_and_swap (&rt->return_tail, tail, tail + 1));
+
+  r = rt->returns + (tail & (VLIB_BUFFER_POOL_N_RETURNS - 1));
+  vlib_buffer_copy_indices (r->buffers, buffers, n_buffers);
+  r->n_buffers = n_buffers;
+  clib_atomic_store_rel_n (&r->valid, 1);
+  return 1;
+}
+
+/* Return buffers to threads refilling from the pool, the rest to the pool */
+static void
+vlib_buffer_pool_return (vlib_main_t * vm, vlib_buffer_pool_t * bp,
+			 vlib_buffer_pool_thread_t * bpt, u32 * buffers,
+			 u32 n_buffers)
+{
+  vlib_buffer_pool_thread_t *rt;
+  u32 i, t, n, n_threads = vec_len (bp->threads);
+  u32 batch = clib_min (VLIB_BUFFER_POOL_RETURN_SZ, bpt->cache_size / 2);
+
+  for (i = 0, t = bpt->next_return_thread; i < n_threads && n_buffers;
+       i++, t = (t + 1) % n_threads)
+    {
+      rt = bp->threads + t;
+      if (t == vm->thread_index || !rt->wants_returns)
+	continue;
+
+      while (n_buffers)
+	{
+	  n = clib_min (n_buffers, batch);
+	  if (!vlib_buffer_pool_return_put (rt, buffers + n_buffers - n, n))
+	    break;
+	  n_buffers -= n;
+	  bpt->n_returns_sent++;
+	}
+
+      /* Spread returns over the threads that want them */
+      if (!n_buffers)
+	bpt->next_return_thread = (t + 1) % n_threads;
+    }
+
+  if (!n_buffers)
+    return;
+
+  vlib_buffer_pool_lock (vm, bp);
+  vlib_buffer_copy_indices (bp->buffers + bp->n_avail, buffers, n_buffers);
+  bp->n_avail += n_buffers;
+  clib_spinlock_unlock (&bp->lock);
+}
+
+void
+vlib_buffer_pool_put_slow (vlib_main_t * vm, vlib_buffer_pool_t * bp,
+			   vlib_buffer_pool_thread_t * bpt, u32 * buffers,
+			   u32 n_buffers)
+{
+  u32 n_cached = bpt->n_cached, n_keep = bpt->cache_size / 2;
+
+  /* The thread frees more than it allocates */
+  if (bpt->wants_returns)
+    bpt->wants_returns = 0;
+
+  /* Keep half the cache, so that the next frees go to it */
+  if (n_cached + n_buffers <= VLIB_BUFFER_POOL_PER_THREAD_CACHE_SZ_MAX)
+    {
+      vlib_buffer_copy_indices (bpt->cached_buffers + n_cached, buffers,
+				n_buffers);
+      n_cached += n_buffers;
+    }
+  else
+    vlib_buffer_pool_return (vm, bp, bpt, buffers, n_buffers);
+
+  if (n_cached > n_keep)
+    {
+      vlib_buffer_pool_return (vm, bp, bpt, bpt->cached_buffers + n_keep,
+			       n_cached - n_keep);
+      n_cached = n_keep;
+    }
+  bpt->n_cached = n_cached;
+}
+
 u8
 vlib_buffer_pool_create (vlib_main_t *vm, u32 data_size, u32 physmem_map_index,
 			 char *fmt, ...)
@@ -538,8 +733,7 @@ vlib_buffer_pool_create (vlib_main_t *vm, u32 data_size, u32 physmem_map_index,
   bp->name = va_format (0, fmt, &va);
   va_end (va);
 
-  vec_validate_aligned (bp->threads, vlib_get_n_threads () - 1,
-			CLIB_CACHE_LINE_BYTES);
+  vlib_buffer_pool_threads_init (bm, bp);
 
   alloc_size = vlib_buffer_alloc_size (bm->ext_hdr_size, data_size);
   bp->alloc_size = alloc_size;
@@ -585,23 +779,38 @@ vlib_buffer_pool_create (vlib_main_t *vm, u32 data_size, u32 physmem_map_index,
   return bp->index;
 }
 
+/* Buffers in the caches of threads and in their return slots */
+static u32
+vlib_buffer_pool_n_cached (vlib_buffer_pool_t * bp)
+{
+  vlib_buffer_pool_thread_t *bpt;
+  vlib_buffer_pool_return_t *r;
+  u32 cached = 0;
+
+  vec_foreach (bpt, bp->threads)
+    {
+      cached += bpt->n_cached;
+      vec_foreach (r, bpt->returns)
+	if (r->valid)
+	  cached += r->n_buffers;
+    }
+
+  return cached;
+}
+
 static u8 *
 format_vlib_buffer_pool (u8 * s, va_list * va)
 {
   vlib_main_t *vm = va_arg (*va, vlib_main_t *);
   vlib_buffer_pool_t *bp = va_arg (*va, vlib_buffer_pool_t *);
-  vlib_buffer_pool_thread_t *bpt;
-  u32 cached = 0;
+  u32 cached;
 
   if (!bp)
     return format (s, "%-20s%=6s%=6s%=6s%=11s%=6s%=8s%=8s%=8s",
 		   "Pool Name", "Index", "NUMA", "Size", "Data Size",
 		   "Total", "Avail", "Cached", "Used");
 
-  /* *INDENT-OFF* */
-  vec_foreach (bpt, bp->threads)
-    cached += bpt->n_cached;
-  /* *INDENT-ON* */
+  cached = vlib_buffer_pool_n_cached (bp);
 
   s = format (s, "%-20v%=6d%=6d%=6u%=11u%=6u%=8u%=8u%=8u", bp->name, bp->index,
 	      bp->numa_node,
@@ -628,18 +837,59 @@ format_vlib_buffer_pool_all (u8 *s, va_list *va)
   return s;
 }
 
+static u8 *
+format_vlib_buffer_pool_threads (u8 *s, va_list *va)
+{
+  vlib_buffer_pool_t *bp = va_arg (*va, vlib_buffer_pool_t *);
+  vlib_buffer_pool_thread_t *bpt;
+  u32 indent = format_get_indent (s);
+
+  s = format (s, "%v", bp->name);
+  s = format (s, "\n%U%-8s%=8s%=8s%=12s%=12s%=12s%=10s%=10s",
+	      format_white_space, indent + 2, "Thread", "Size", "Cached",
+	      "Locks", "Contended", "Wait/lock", "Sent", "Taken");
+  vec_foreach (bpt, bp->threads)
+    s = format (s, "\n%U%-8u%=8u%=8u%=12llu%=12llu%=12.2f%=10llu%=10llu",
+		format_white_space, indent + 2, bpt - bp->threads,
+		bpt->cache_size, bpt->n_cached, bpt->n_lock,
+		bpt->n_lock_contended,
+		bpt->n_lock_contended ?
+		  (f64) bpt->lock_wait_clocks / bpt->n_lock_contended : 0,
+		bpt->n_returns_sent, bpt->n_returns_taken);
+
+  return s;
+}
+
 static clib_error_t *
 show_buffers (vlib_main_t *vm, unformat_input_t *input,
 	      vlib_cli_command_t *cmd)
 {
+  vlib_buffer_main_t *bm = vm->buffer_main;
+  vlib_buffer_pool_t *bp;
+
+  if (unformat (input, "threads"))
+    {
+      vec_foreach (bp, bm->buffer_pools)
+	vlib_cli_output (vm, "%U", format_vlib_buffer_pool_threads, bp);
+      return 0;
+    }
+
   vlib_cli_output (vm, "%U", format_vlib_buffer_pool_all, vm);
   return 0;
 }
 
+/*?
+ * Show the buffer pools. With 'threads', show by thread its cache size
+ * and fill, how often it took the pool lock, found it taken, and the
+ * clocks it then waited on average, and the batches of buffers it
+ * returned to threads refilling their cache, and took from others.
+ *
+ * @cliexcmd{show buffers threads}
+?*/
 /* *INDENT-OFF* */
 VLIB_CLI_COMMAND (show_buffers_command, static) = {
   .path = "show buffers",
-  .short_help = "Show packet buffer allocation",
+  .short_help = "show buffers [threads]",
   .function = show_buffers,
 };
 /* *INDENT-ON* */
@@ -651,8 +901,7 @@ vlib_buffer_num_workers_change (vlib_main_t *vm)
   vlib_buffer_pool_t *bp;
 
   vec_foreach (bp, bm->buffer_pools)
-    vec_validate_aligned (bp->threads, vlib_get_n_threads () - 1,
-			  CLIB_CACHE_LINE_BYTES);
+    vlib_buffer_pool_threads_init (bm, bp);
 
   return 0;
 }
@@ -760,16 +1009,10 @@ vlib_buffer_main_alloc (vlib_main_t * vm)
 static u32
 buffer_get_cached (vlib_buffer_pool_t * bp)
 {
-  u32 cached = 0;
-  vlib_buffer_pool_thread_t *bpt;
+  u32 cached;
 
   clib_spinlock_lock (&bp->lock);
-
-  /* *INDENT-OFF* */
-  vec_foreach (bpt, bp->threads)
-    cached += bpt->n_cached;
-  /* *INDENT-ON* */
-
+  cached = vlib_buffer_pool_n_cached (bp);
   clib_spinlock_unlock (&bp->lock);
 
   return cached;
@@ -810,6 +1053,25 @@ buffer_gauges_collect_available_fn (vlib_stats_collector_data_t *d)
   d->entry->value = bp->n_avail;
 }
 
+static void
+buffer_counters_collect_contended_fn (vlib_stats_collector_data_t *d)
+{
+  vlib_main_t *vm = vlib_get_main ();
+  vlib_buffer_pool_t *bp =
+    buffer_get_by_index (vm->buffer_main, d->private_data);
+  counter_t **counters;
+  u32 i;
+
+  if (!bp)
+    return;
+
+  /* One per thread */
+  vlib_stats_validate (d->entry_index, vec_len (bp->threads) - 1, 0);
+  counters = d->entry->data;
+  vec_foreach_index (i, bp->threads)
+    counters[i][0] = bp->threads[i].n_lock_contended;
+}
+
 static void
 buffer_gauges_collect_cached_fn (vlib_stats_collector_data_t *d)
 {
@@ -910,6 +1172,11 @@ vlib_buffer_main_init (struct vlib_main_t * vm)
       vlib_stats_add_gauge ("/buffer-pools/%v/available", bp->name);
     reg.collect_fn = buffer_gauges_collect_available_fn;
     vlib_stats_register_collector_fn (&reg);
+
+    reg.entry_index = vlib_stats_add_counter_vector (
+      "/buffer-pools/%v/lock-contended", bp->name);
+    reg.collect_fn = buffer_counters_collect_contended_fn;
+    vlib_stats_register_collector_fn (&reg);
   }
 
 done:
@@ -939,6 +1206,16 @@ vlib_buffers_configure (vlib_main_t * vm, unformat_input_t * input)
       else if (unformat (input, "default data-size %u",
 			 &bm->default_data_size))
 	;
+      else if (unformat (input, "per-thread-cache-size %u",
+			 &bm->per_thread_cache_size))
+	{
+	  u32 sz = bm->per_thread_cache_size;
+	  if (sz < 64 || sz > VLIB_BUFFER_POOL_PER_THREAD_CACHE_SZ_MAX ||
+	      sz % 32)
+	    return clib_error_return (0, "per-thread-cache-size must be a "
+				      "multiple of 32, from 64 to %u",
+				      VLIB_BUFFER_POOL_PER_THREAD_CACHE_SZ_MAX);
+	}
       else
 	return unformat_parse_error (input);
     }
@@ -454,13 +454,66 @@ vlib_buffer_pull (vlib_buffer_t * b, u8 size)
 /* Forward declaration. */
 struct vlib_main_t;
 
+/* Default and largest per-thread cache size, see per-thread-cache-size */
 #define VLIB_BUFFER_POOL_PER_THREAD_CACHE_SZ 512
+#define VLIB_BUFFER_POOL_PER_THREAD_CACHE_SZ_MAX 2048
+
+/* Return slots per thread, a power of 2, and buffers per slot */
+#define VLIB_BUFFER_POOL_N_RETURNS 8
+#define VLIB_BUFFER_POOL_RETURN_SZ 256
+
+/* Main loops, a power of 2, after which a thread that did not refill its
+   cache stops asking for returns, see vlib_buffer_pool_check_returns */
+#define VLIB_BUFFER_POOL_CHECK_RETURNS_LOOPS 1024
+
+typedef struct
+{
+  /* Set by the sender once the buffers are in */
+  volatile u32 valid;
+  u32 n_buffers;
+  u32 buffers[VLIB_BUFFER_POOL_RETURN_SZ];
+} vlib_buffer_pool_return_t;
 
 typedef struct
 {
   CLIB_CACHE_LINE_ALIGN_MARK (cacheline0);
-  u32 cached_buffers[VLIB_BUFFER_POOL_PER_THREAD_CACHE_SZ];
+  u32 cached_buffers[VLIB_BUFFER_POOL_PER_THREAD_CACHE_SZ_MAX];
   u32 n_cached;
+
+  /* Buffers the cache holds before some go back */
+  u32 cache_size;
+
+  /* Thread to return buffers to first */
+  u32 next_return_thread;
+
+  /* Refilled from the pool since the last vlib_buffer_pool_check_returns */
+  u8 refilled;
+
+  /* Pool lock taken, found taken, and clocks spent waiting for it */
+  u64 n_lock;
+  u64 n_lock_contended;
+  u64 lock_wait_clocks;
+
+  /* Batches of buffers returned to other threads, and taken from them */
+  u64 n_returns_sent;
+  u64 n_returns_taken;
+
+  /* Read by other threads */
+  CLIB_CACHE_LINE_ALIGN_MARK (cacheline1);
+  /* Set while the thread refills its cache from the pool, for threads
+     freeing more buffers than they allocate to return them here.
+     Cleared once it frees more than it allocates, or stops refilling */
+  volatile u8 wants_returns;
+
+  /* Next return slot to take, moved by the thread */
+  volatile u32 return_head;
+
+  /* VLIB_BUFFER_POOL_N_RETURNS slots */
+  vlib_buffer_pool_return_t *returns;
+
+  CLIB_CACHE_LINE_ALIGN_MARK (cacheline2);
+  /* Next return slot to fill, reserved by senders */
+  volatile u32 return_tail;
 } vlib_buffer_pool_thread_t;
 
 typedef struct
@@ -509,6 +562,7 @@ typedef struct
 
   /* config */
   u32 buffers_per_numa;
+  u32 per_thread_cache_size;
   u16 ext_hdr_size;
   u32 default_data_size;
   clib_mem_page_sz_t log2_page_size;
@@ -526,6 +580,13 @@ typedef struct
 
 clib_error_t *vlib_buffer_main_init (struct vlib_main_t *vm);
 
+u32 vlib_buffer_pool_take_returns (vlib_buffer_pool_thread_t * bpt);
+void vlib_buffer_pool_check_returns (struct vlib_main_t *vm);
+void vlib_buffer_pool_put_slow (struct vlib_main_t *vm,
+				vlib_buffer_pool_t * bp,
+				vlib_buffer_pool_thread_t * bpt, u32 * buffers,
+				u32 n_buffers);
+
 format_function_t format_vlib_buffer_pool_all;
 
 int vlib_buffer_set_alloc_free_callback (
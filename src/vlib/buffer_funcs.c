@@ -254,9 +254,15 @@ CLIB_MULTIARCH_FN (vlib_buffer_enqueue_to_single_next_with_aux_fn)
 }
 CLIB_MARCH_FN_REGISTRATION (vlib_buffer_enqueue_to_single_next_with_aux_fn);
 
-static inline vlib_frame_queue_elt_t *
-vlib_get_frame_queue_elt (vlib_frame_queue_main_t *fqm, u32 index,
-			  int dont_wait)
+/*
+ * Reserve up to n_elts consecutive elements of a frame queue with one
+ * tail update, never the whole ring. Returns the tail they follow, and the
+ * number reserved in n_got. With dont_wait, takes what is free, possibly
+ * none, otherwise waits until all of them are.
+ */
+static inline u64
+vlib_frame_queue_reserve (vlib_frame_queue_main_t *fqm, u32 index,
+			  u32 n_elts, int dont_wait, u32 *n_got)
 {
   vlib_frame_queue_t *fq;
   u64 nelts, tail, new_tail;
@@ -264,28 +270,43 @@ vlib_get_frame_queue_elt (vlib_frame_queue_main_t *fqm, u32 index,
   fq = vec_elt (fqm->vlib_frame_queues, index);
   ASSERT (fq);
   nelts = fq->nelts;
+  n_elts = clib_min (n_elts, nelts - 1);
 
 retry:
   tail = __atomic_load_n (&fq->tail, __ATOMIC_ACQUIRE);
-  new_tail = tail + 1;
+  new_tail = tail + n_elts;
 
   if (new_tail >= fq->head + nelts)
     {
       if (dont_wait)
-	return 0;
-
-      /* Wait until a ring slot is available */
-      while (new_tail >= fq->head + nelts)
-	vlib_worker_thread_barrier_check ();
+	{
+	  new_tail = fq->head + nelts - 1;
+	  if (new_tail <= tail)
+	    {
+	      *n_got = 0;
+	      return tail;
+	    }
+	}
+      else
+	/* Wait until the ring slots are available */
+	while (new_tail >= fq->head + nelts)
+	  vlib_worker_thread_barrier_check ();
     }
 
   if (!__atomic_compare_exchange_n (&fq->tail, &tail, new_tail, 0 /* weak */,
 				    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
     goto retry;
 
-  return fq->elts + (new_tail & (nelts - 1));
+  *n_got = new_tail - tail;
+  return tail;
 }
 
+/*
+ * Up to VLIB_FRAME_QUEUE_BULK frames of packets are split by thread. Each
+ * destination gets all of its frames with one tail update on its queue and
+ * one wakeup write, a single frame is gathered in place, several are
+ * gathered first and copied to their elements.
+ */
 static_always_inline u32
 vlib_buffer_enqueue_to_thread_inline (vlib_main_t *vm,
 				      vlib_node_runtime_t *node,
@@ -294,49 +315,132 @@ vlib_buffer_enqueue_to_thread_inline (vlib_main_t *vm,
 				      u32 n_packets, int drop_on_congestion,
 				      int with_aux, u32 *aux_data)
 {
-  u32 drop_list[VLIB_FRAME_SIZE], n_drop = 0;
-  vlib_frame_bitmap_t mask, used_elts = {};
-  vlib_frame_queue_elt_t *hf = 0;
+  u32 buffers[VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE];
+  u32 aux[VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE];
+  u32 drop_list[VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE], n_drop = 0;
+  vlib_frame_bitmap_t masks[VLIB_FRAME_QUEUE_BULK] = {};
+  vlib_frame_bitmap_t used_elts[VLIB_FRAME_QUEUE_BULK] = {};
+  vlib_frame_queue_elt_t *hf;
+  vlib_frame_queue_t *fq;
+  vlib_main_t *dvm;
   u16 thread_index;
-  u32 n_comp, off = 0, n_left = n_packets;
+  u32 *to, *to_aux;
+  u32 c, i, n, n_chunks, n_comp, n_elts, n_got, n_done, n_enq;
+  u32 chunk = 0, off = 0, n_left = n_packets;
+  u64 tail;
 
+  ASSERT (n_packets <= VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE);
+  n_chunks = (n_packets + VLIB_FRAME_SIZE - 1) / VLIB_FRAME_SIZE;
   thread_index = thread_indices[0];
 
 more:
-  clib_mask_compare_u16 (thread_index, thread_indices, mask, n_packets);
-  hf = vlib_get_frame_queue_elt (fqm, thread_index, drop_on_congestion);
+  n_comp = 0;
+  for (c = chunk; c < n_chunks; c++)
+    {
+      n = clib_min (n_packets - c * VLIB_FRAME_SIZE, VLIB_FRAME_SIZE);
+      clib_mask_compare_u16 (thread_index,
+			     thread_indices + c * VLIB_FRAME_SIZE, masks[c], n);
+      n_comp += vlib_frame_bitmap_count_set_bits (masks[c]);
+    }
 
-  n_comp = clib_compress_u32 (hf ? hf->buffer_index : drop_list + n_drop,
-			      buffer_indices, mask, n_packets);
-  if (with_aux)
-    clib_compress_u32 (hf ? hf->aux_data : drop_list + n_drop, aux_data, mask,
-		       n_packets);
+  fq = vec_elt (fqm->vlib_frame_queues, thread_index);
+  n_elts = (n_comp + VLIB_FRAME_SIZE - 1) / VLIB_FRAME_SIZE;
+  tail = vlib_frame_queue_reserve (fqm, thread_index, n_elts,
+				   drop_on_congestion, &n_got);
+
+  if (n_got == 0)
+    {
+      to = drop_list + n_drop;
+      to_aux = aux;
+    }
+  else if (n_elts == 1)
+    {
+      hf = fq->elts + ((tail + 1) & (fq->nelts - 1));
+      to = hf->buffer_index;
+      to_aux = hf->aux_data;
+    }
+  else
+    {
+      to = buffers;
+      to_aux = aux;
+    }
 
-  if (hf)
+  for (c = chunk, i = 0; c < n_chunks; c++)
     {
+      n = clib_min (n_packets - c * VLIB_FRAME_SIZE, VLIB_FRAME_SIZE);
+      if (with_aux)
+	clib_compress_u32 (to_aux + i, aux_data + c * VLIB_FRAME_SIZE,
+			   masks[c], n);
+      i += clib_compress_u32 (to + i, buffer_indices + c * VLIB_FRAME_SIZE,
+			      masks[c], n);
+      vlib_frame_bitmap_or (used_elts[c], masks[c]);
+    }
+
+  n_done = 0;
+publish:
+  for (i = 0; i < n_got; i++, n_done++)
+    {
+      n = clib_min (n_comp - n_done * VLIB_FRAME_SIZE, VLIB_FRAME_SIZE);
+      hf = fq->elts + ((tail + 1 + i) & (fq->nelts - 1));
+      if (to == buffers)
+	{
+	  vlib_buffer_copy_indices (hf->buffer_index,
+				    buffers + n_done * VLIB_FRAME_SIZE, n);
+	  if (with_aux)
+	    clib_memcpy_fast (hf->aux_data, aux + n_done * VLIB_FRAME_SIZE,
+			      n * sizeof (u32));
+	}
       if (node->flags & VLIB_NODE_FLAG_TRACE)
 	hf->maybe_trace = 1;
-      hf->n_vectors = n_comp;
+      hf->n_vectors = n;
       __atomic_store_n (&hf->valid, 1, __ATOMIC_RELEASE);
-      vlib_get_main_by_index (thread_index)->check_frame_queues = 1;
     }
-  else
-    n_drop += n_comp;
+
+  /* Only a ring smaller than the burst takes several reservations */
+  if (!drop_on_congestion && n_done < n_elts)
+    {
+      tail = vlib_frame_queue_reserve (fqm, thread_index, n_elts - n_done,
+				       0 /* dont_wait */, &n_got);
+      goto publish;
+    }
+
+  n_enq = clib_min (n_comp, n_done * VLIB_FRAME_SIZE);
+  if (n_done)
+    {
+      /* Spare the receiver's cache line when it is already told */
+      dvm = vlib_get_main_by_index (thread_index);
+      if (!dvm->check_frame_queues)
+	dvm->check_frame_queues = 1;
+      /* What found no room is dropped */
+      vlib_buffer_copy_indices (drop_list + n_drop, buffers + n_enq,
+				n_comp - n_enq);
+    }
+  n_drop += n_comp - n_enq;
+
+  /* Congestion feedback, see vlib_frame_queue_backpressure */
+  if (PREDICT_FALSE (n_enq < n_comp ||
+		     fq->tail - fq->head >= fq->congestion_threshold))
+    {
+      vm->frame_queue_congested_loop = vm->main_loop_count;
+      vm->frame_queue_n_congested += n_comp;
+    }
 
   n_left -= n_comp;
 
   if (n_left)
     {
-      vlib_frame_bitmap_or (used_elts, mask);
-
-      while (PREDICT_FALSE (used_elts[off] == ~0))
+      while (PREDICT_FALSE (used_elts[chunk][off] == ~0))
 	{
-	  off++;
-	  ASSERT (off < ARRAY_LEN (used_elts));
+	  if (++off == ARRAY_LEN (used_elts[chunk]))
+	    {
+	      off = 0;
+	      chunk++;
+	      ASSERT (chunk < n_chunks);
+	    }
 	}
 
-      thread_index =
-	thread_indices[off * 64 + count_trailing_zeros (~used_elts[off])];
+      thread_index = thread_indices[chunk * VLIB_FRAME_SIZE + off * 64 +
+				    count_trailing_zeros (~used_elts[chunk][off])];
       goto more;
     }
 
@@ -358,14 +462,14 @@ CLIB_MULTIARCH_FN (vlib_buffer_enqueue_to_thread_fn)
 
   fqm = vec_elt_at_index (tm->frame_queue_mains, frame_queue_index);
 
-  while (n_packets >= VLIB_FRAME_SIZE)
+  while (n_packets >= VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE)
     {
       n_enq += vlib_buffer_enqueue_to_thread_inline (
-	vm, node, fqm, buffer_indices, thread_indices, VLIB_FRAME_SIZE,
-	drop_on_congestion, 0 /* with_aux */, NULL);
-      buffer_indices += VLIB_FRAME_SIZE;
-      thread_indices += VLIB_FRAME_SIZE;
-      n_packets -= VLIB_FRAME_SIZE;
+	vm, node, fqm, buffer_indices, thread_indices,
+	VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE, drop_on_congestion, 0 /* with_aux */, NULL);
+      buffer_indices += VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE;
+      thread_indices += VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE;
+      n_packets -= VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE;
     }
 
   if (n_packets == 0)
@@ -390,14 +494,15 @@ CLIB_MULTIARCH_FN (vlib_buffer_enqueue_to_thread_with_aux_fn)
 
   fqm = vec_elt_at_index (tm->frame_queue_mains, frame_queue_index);
 
-  while (n_packets >= VLIB_FRAME_SIZE)
+  while (n_packets >= VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE)
     {
       n_enq += vlib_buffer_enqueue_to_thread_inline (
-	vm, node, fqm, buffer_indices, thread_indices, VLIB_FRAME_SIZE,
-	drop_on_congestion, 1 /* with_aux */, aux);
-      buffer_indices += VLIB_FRAME_SIZE;
-      thread_indices += VLIB_FRAME_SIZE;
-      n_packets -= VLIB_FRAME_SIZE;
+	vm, node, fqm, buffer_indices, thread_indices,
+	VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE, drop_on_congestion, 1 /* with_aux */, aux);
+      buffer_indices += VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE;
+      thread_indices += VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE;
+      aux += VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE;
+      n_packets -= VLIB_FRAME_QUEUE_BULK * VLIB_FRAME_SIZE;
     }
 
   if (n_packets == 0)
@@ -446,10 +551,10 @@ vlib_frame_queue_dequeue_inline (vlib_main_t *vm, vlib_frame_queue_main_t *fqm,
       fqt->tail = fq->tail;
       fqt->threshold = fq->vector_threshold;
       fqt->n_in_use = fqt->tail - fqt->head;
-      if (fqt->n_in_use >= fqt->nelts)
+      if (fqt->n_in_use >= clib_min (fqt->nelts, FRAME_QUEUE_MAX_NELTS))
 	{
 	  // if beyond max then use max
-	  fqt->n_in_use = fqt->nelts - 1;
+	  fqt->n_in_use = clib_min (fqt->nelts, FRAME_QUEUE_MAX_NELTS) - 1;
 	}
 
       /* Record the number of elements in use in the histogram */
@@ -457,7 +562,8 @@ vlib_frame_queue_dequeue_inline (vlib_main_t *vm, vlib_frame_queue_main_t *fqm,
       fqh->count[fqt->n_in_use]++;
 
       /* Record a snapshot of the elements in use */
-      for (elix = 0; elix < fqt->nelts; elix++)
+      for (elix = 0; elix < clib_min (fqt->nelts, FRAME_QUEUE_MAX_NELTS);
+	   elix++)
 	{
 	  elt = fq->elts + ((fq->head + 1 + elix) & (mask));
 	  if (1 || elt->valid)
@@ -505,6 +505,28 @@ vlib_get_buffer_pool (vlib_main_t * vm, u8 buffer_pool_index)
   return vec_elt_at_index (bm->buffer_pools, buffer_pool_index);
 }
 
+/** \brief Take the lock of a buffer pool, counting contention by thread
+
+    @param vm - (vlib_main_t *) vlib main data structure pointer
+    @param bp - (vlib_buffer_pool_t *) buffer pool
+*/
+static_always_inline void
+vlib_buffer_pool_lock (vlib_main_t * vm, vlib_buffer_pool_t * bp)
+{
+  vlib_buffer_pool_thread_t *bpt = vec_elt_at_index (bp->threads,
+						     vm->thread_index);
+  u64 t;
+
+  bpt->n_lock++;
+  if (PREDICT_TRUE (clib_spinlock_trylock (&bp->lock)))
+    return;
+
+  t = clib_cpu_time_now ();
+  clib_spinlock_lock (&bp->lock);
+  bpt->n_lock_contended++;
+  bpt->lock_wait_clocks += clib_cpu_time_now () - t;
+}
+
 static_always_inline __clib_warn_unused_result uword
 vlib_buffer_pool_get (vlib_main_t * vm, u8 buffer_pool_index, u32 * buffers,
 		      u32 n_buffers)
@@ -514,7 +536,7 @@ vlib_buffer_pool_get (vlib_main_t * vm, u8 buffer_pool_index, u32 * buffers,
 
   ASSERT (bp->buffers);
 
-  clib_spinlock_lock (&bp->lock);
+  vlib_buffer_pool_lock (vm, bp);
   len = bp->n_avail;
   if (PREDICT_TRUE (n_buffers < len))
     {
@@ -579,8 +601,22 @@ vlib_buffer_alloc_from_pool (vlib_main_t * vm, u32 * buffers, u32 n_buffers,
       goto done;
     }
 
+  /* buffers other threads returned to this one */
+  if (PREDICT_FALSE (bpt->return_head != bpt->return_tail) &&
+      vlib_buffer_pool_take_returns (bpt))
+    {
+      len = bpt->n_cached;
+      if (len >= n_buffers)
+	{
+	  src = bpt->cached_buffers + len - n_buffers;
+	  vlib_buffer_copy_indices (dst, src, n_buffers);
+	  bpt->n_cached -= n_buffers;
+	  goto done;
+	}
+    }
+
   /* alloc bigger than cache - take buffers directly from main pool */
-  if (n_buffers >= VLIB_BUFFER_POOL_PER_THREAD_CACHE_SZ)
+  if (n_buffers >= bpt->cache_size)
     {
       n_buffers = vlib_buffer_pool_get (vm, buffer_pool_index, buffers,
 					n_buffers);
@@ -596,6 +632,10 @@ vlib_buffer_alloc_from_pool (vlib_main_t * vm, u32 * buffers, u32 n_buffers,
       n_left -= len;
     }
 
+  if (!bpt->wants_returns)
+    bpt->wants_returns = 1;
+  bpt->refilled = 1;
+
   len = round_pow2 (n_left, 32);
   len = vlib_buffer_pool_get (vm, buffer_pool_index, bpt->cached_buffers,
 			      len);
@@ -733,8 +773,8 @@ vlib_buffer_pool_put (vlib_main_t * vm, u8 buffer_pool_index,
     bm->free_callback_fn (vm, buffer_pool_index, buffers, n_buffers);
 
   n_cached = bpt->n_cached;
-  n_empty = VLIB_BUFFER_POOL_PER_THREAD_CACHE_SZ - n_cached;
-  if (n_buffers <= n_empty)
+  n_empty = bpt->cache_size - n_cached;
+  if (PREDICT_TRUE (n_buffers <= n_empty))
     {
       vlib_buffer_copy_indices (bpt->cached_buffers + n_cached,
 				buffers, n_buffers);
@@ -742,15 +782,7 @@ vlib_buffer_pool_put (vlib_main_t * vm, u8 buffer_pool_index,
       return;
     }
 
-  vlib_buffer_copy_indices (bpt->cached_buffers + n_cached,
-			    buffers + n_buffers - n_empty, n_empty);
-  bpt->n_cached = VLIB_BUFFER_POOL_PER_THREAD_CACHE_SZ;
-
-  clib_spinlock_lock (&bp->lock);
-  vlib_buffer_copy_indices (bp->buffers + bp->n_avail, buffers,
-			    n_buffers - n_empty);
-  bp->n_avail += n_buffers - n_empty;
-  clib_spinlock_unlock (&bp->lock);
+  vlib_buffer_pool_put_slow (vm, bp, bpt, buffers, n_buffers);
 }
 
 /** \brief return unused buffers back to pool
@@ -183,6 +183,7 @@ vlib_put_frame_to_node (vlib_main_t * vm, u32 to_node_index, vlib_frame_t * f)
   p->frame = vlib_get_frame (vm, f);
   p->node_runtime_index = to_node->runtime_index;
   p->next_frame_index = VLIB_PENDING_FRAME_NO_NEXT_FRAME;
+  p->hold_start = 0;
 }
 
 /* Free given frame. */
@@ -485,6 +486,7 @@ vlib_put_next_frame (vlib_main_t * vm,
 	  p->frame = nf->frame;
 	  p->node_runtime_index = nf->node_runtime_index;
 	  p->next_frame_index = nf - nm->next_frames;
+	  p->hold_start = 0;
 	  nf->flags |= VLIB_FRAME_PENDING;
 	  f->frame_flags |= VLIB_FRAME_PENDING;
 	}
@@ -1185,6 +1187,62 @@ dispatch_pending_node (vlib_main_t * vm, uword pending_frame_index,
   return last_time_stamp;
 }
 
+/*
+ * Hold a pending frame back for another main loop iteration, so that
+ * upstream nodes append more vectors to it: frames of nodes with a
+ * hold_frame_size wait until they reach it, for at most
+ * vm->dispatch_hold_clocks. Under load frames fill up and go at once,
+ * at low load the node runs on fewer, larger frames.
+ */
+static_always_inline int
+dispatch_pending_node_hold (vlib_main_t * vm, uword pending_frame_index,
+			    u64 cpu_time_now)
+{
+  vlib_node_main_t *nm = &vm->node_main;
+  vlib_pending_frame_t *p = nm->pending_frames + pending_frame_index;
+  vlib_node_runtime_t *n;
+  vlib_next_frame_t *nf;
+  vlib_frame_t *f;
+
+  n = vec_elt_at_index (nm->nodes_by_type[VLIB_NODE_TYPE_INTERNAL],
+			p->node_runtime_index);
+  if (PREDICT_TRUE (n->hold_frame_size == 0)
+      || p->next_frame_index == VLIB_PENDING_FRAME_NO_NEXT_FRAME)
+    return 0;
+
+  /* Only the frame upstream nodes append to can grow */
+  f = vlib_get_frame (vm, p->frame);
+  nf = vec_elt_at_index (nm->next_frames, p->next_frame_index);
+  if (nf->frame != p->frame || f->n_vectors >= n->hold_frame_size
+      || (f->frame_flags & VLIB_FRAME_NO_APPEND))
+    return 0;
+
+  if (p->hold_start == 0)
+    p->hold_start = cpu_time_now;
+  return cpu_time_now - p->hold_start < vm->dispatch_hold_clocks;
+}
+
+static_always_inline u64
+dispatch_pending_frames (vlib_main_t * vm, u64 cpu_time_now, int hold)
+{
+  vlib_node_main_t *nm = &vm->node_main;
+  uword i, n_held = 0;
+
+  /* Input nodes may have added work to the pending vector.
+     Process pending vector until there is nothing left.
+     All pending vectors will be processed from input -> output. */
+  for (i = 0; i < _vec_len (nm->pending_frames); i++)
+    if (hold && dispatch_pending_node_hold (vm, i, cpu_time_now))
+      nm->pending_frames[n_held++] = nm->pending_frames[i];
+    else
+      cpu_time_now = dispatch_pending_node (vm, i, cpu_time_now);
+
+  /* Reset pending vector for next iteration, held frames first. */
+  vec_set_len (nm->pending_frames, n_held);
+
+  return cpu_time_now;
+}
+
 always_inline uword
 vlib_process_stack_is_valid (vlib_process_t * p)
 {
@@ -1449,7 +1507,6 @@ vlib_main_or_worker_loop (vlib_main_t * vm, int is_main)
 {
   vlib_node_main_t *nm = &vm->node_main;
   vlib_thread_main_t *tm = vlib_get_thread_main ();
-  uword i;
   u64 cpu_time_now;
   f64 now;
   vlib_frame_queue_main_t *fqm;
@@ -1481,6 +1538,8 @@ vlib_main_or_worker_loop (vlib_main_t * vm, int is_main)
   vm->numa_node = clib_get_current_numa_node ();
   os_set_numa_index (vm->numa_node);
 
+  vlib_set_dispatch_hold (vm, vlib_thread_dispatch_hold (vm->thread_index));
+
   /* Start all processes. */
   if (is_main)
     {
@@ -1510,7 +1569,23 @@ vlib_main_or_worker_loop (vlib_main_t * vm, int is_main)
 	}
 
       if (!is_main)
-	vlib_worker_thread_barrier_check ();
+	{
+	  /* Held frames go first, the barrier may refork the graph */
+	  if (PREDICT_FALSE (_vec_len (nm->pending_frames) > 0)
+	      && *vlib_worker_threads->wait_at_barrier)
+	    cpu_time_now = dispatch_pending_frames (vm, cpu_time_now, 0);
+	  vlib_worker_thread_barrier_check ();
+	  vlib_rcu_quiescent (vm->thread_index);
+	}
+      else if (PREDICT_FALSE (_vec_len (vlib_rcu_main.pending) > 0))
+	vlib_rcu_reclaim (vm);
+
+      if (PREDICT_FALSE (_vec_len (vlib_steal_mains) > 0))
+	vlib_steal_dispatch (vm);
+
+      if (PREDICT_FALSE ((vm->main_loop_count &
+			  (VLIB_BUFFER_POOL_CHECK_RETURNS_LOOPS - 1)) == 0))
+	vlib_buffer_pool_check_returns (vm);
 
       if (PREDICT_FALSE (vm->check_frame_queues + frame_queue_check_counter))
 	{
@@ -1565,13 +1640,15 @@ vlib_main_or_worker_loop (vlib_main_t * vm, int is_main)
 	    }
 	}
 
-      /* Next process input nodes. */
-      vec_foreach (n, nm->nodes_by_type[VLIB_NODE_TYPE_INPUT])
-	cpu_time_now = dispatch_node (vm, n,
-				      VLIB_NODE_TYPE_INPUT,
-				      VLIB_NODE_STATE_POLLING,
-				      /* frame */ 0,
-				      cpu_time_now);
+      /* Next process input nodes, every other loop while handing off
+         to congested frame queues: the rx rings absorb the excess */
+      if (PREDICT_TRUE (!vlib_frame_queue_backpressure (vm)))
+	vec_foreach (n, nm->nodes_by_type[VLIB_NODE_TYPE_INPUT])
+	  cpu_time_now = dispatch_node (vm, n,
+					VLIB_NODE_TYPE_INPUT,
+					VLIB_NODE_STATE_POLLING,
+					/* frame */ 0,
+					cpu_time_now);
 
       if (PREDICT_TRUE (is_main && vm->queue_signal_pending == 0))
 	vm->queue_signal_callback (vm);
@@ -1592,13 +1669,8 @@ vlib_main_or_worker_loop (vlib_main_t * vm, int is_main)
 	    }
 	}
 
-      /* Input nodes may have added work to the pending vector.
-         Process pending vector until there is nothing left.
-         All pending vectors will be processed from input -> output. */
-      for (i = 0; i < _vec_len (nm->pending_frames); i++)
-	cpu_time_now = dispatch_pending_node (vm, i, cpu_time_now);
-      /* Reset pending vector for next iteration. */
-      vec_set_len (nm->pending_frames, 0);
+      cpu_time_now = dispatch_pending_frames (vm, cpu_time_now,
+					      vm->dispatch_hold_clocks != 0);
 
       if (is_main)
 	{
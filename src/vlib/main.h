@@ -131,6 +131,15 @@ typedef struct vlib_main_t
   /* Instantaneous vector rate */
   u32 internal_node_last_vectors_per_main_loop;
 
+  /* Main loop count of the last enqueue to a congested frame queue, and
+     packets enqueued to, or dropped at, congested frame queues */
+  u32 frame_queue_congested_loop;
+  u64 frame_queue_n_congested;
+
+  /* Longest a pending frame may be held back for more vectors, in clocks,
+     0 to never hold frames. See vlib_node_runtime_t hold_frame_size. */
+  u64 dispatch_hold_clocks;
+
   /* Main loop hw / sw performance counters */
   vlib_node_runtime_perf_callback_set_t vlib_node_runtime_perf_callbacks;
 
@@ -421,6 +430,12 @@ vlib_clear_internal_node_vector_rate (vlib_main_t * vm)
   vm->internal_node_vectors_last_clear = vm->internal_node_vectors;
 }
 
+always_inline void
+vlib_set_dispatch_hold (vlib_main_t * vm, u32 usec)
+{
+  vm->dispatch_hold_clocks = usec * 1e-6 * vm->clib_time.clocks_per_second;
+}
+
 always_inline void
 vlib_increment_main_loop_counter (vlib_main_t * vm)
 {
@@ -931,6 +931,25 @@ vlib_node_set_march_variant (vlib_main_t *vm, u32 node_index,
     }
   return -1;
 }
+
+int
+vlib_node_set_hold_frame_size (vlib_main_t *vm, u32 node_index,
+			       u32 frame_size)
+{
+  vlib_node_t *n = vlib_get_node (vm, node_index);
+
+  if (n->type != VLIB_NODE_TYPE_INTERNAL || frame_size > VLIB_FRAME_SIZE)
+    return -1;
+
+  for (int i = 0; i < vlib_get_n_threads (); i++)
+    {
+      vlib_node_runtime_t *nrt;
+      nrt = vlib_node_get_runtime (vlib_get_main_by_index (i), n->index);
+      nrt->hold_frame_size = frame_size;
+    }
+  return 0;
+}
+
 /*
  * fd.io coding-style-patch-verification: ON
  *
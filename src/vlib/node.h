@@ -456,6 +456,9 @@ typedef struct
 
   /* Special value for next_frame_index when there is no next frame. */
 #define VLIB_PENDING_FRAME_NO_NEXT_FRAME ((u32) ~0)
+
+  /* CPU time the frame was first held back, 0 if never */
+  u64 hold_start;
 } vlib_pending_frame_t;
 
 typedef struct vlib_node_runtime_t
@@ -507,6 +510,12 @@ typedef struct vlib_node_runtime_t
 					  zero before first run of this
 					  node. */
 
+  u16 hold_frame_size;			/**< Internal nodes: pending frames
+					  smaller than this are held back
+					  for more vectors, up to the
+					  thread's dispatch hold time.
+					  0 dispatches at once. */
+
   CLIB_ALIGN_MARK (runtime_data_pad, 8);
 
   u8 runtime_data[0];			/**< Function dependent
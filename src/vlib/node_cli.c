@@ -916,6 +916,77 @@ VLIB_CLI_COMMAND (set_node_fn_command, static) = {
 };
 /* *INDENT-ON* */
 
+static clib_error_t *
+set_node_frame_size (vlib_main_t *vm, unformat_input_t *input,
+		     vlib_cli_command_t *cmd)
+{
+  u32 node_index, frame_size;
+
+  if (!unformat (input, "%U %u", unformat_vlib_node, vm, &node_index,
+		 &frame_size))
+    return clib_error_return (0, "please specify node name and frame size");
+
+  if (vlib_node_set_hold_frame_size (vm, node_index, frame_size))
+    return clib_error_return (
+      0, "frame size applies to internal nodes, up to %u", VLIB_FRAME_SIZE);
+
+  return 0;
+}
+
+/*?
+ * Hold the pending frames of an internal node back until they carry
+ * <frame-size> packets, or for the dispatch hold time of the thread, see
+ * 'set dispatch-hold'. Larger frames amortize the node's fixed cost over
+ * more packets at low load, at the price of latency. 0 dispatches frames
+ * at once, the default.
+ *
+ * @cliexcmd{set node frame-size ip4-lookup 64}
+?*/
+VLIB_CLI_COMMAND (set_node_frame_size_command, static) = {
+  .path = "set node frame-size",
+  .short_help = "set node frame-size <node-name> <frame-size>",
+  .function = set_node_frame_size,
+};
+
+static clib_error_t *
+set_dispatch_hold (vlib_main_t *vm, unformat_input_t *input,
+		   vlib_cli_command_t *cmd)
+{
+  u32 usec, worker = ~0;
+
+  if (!unformat (input, "%u", &usec))
+    return clib_error_return (0, "please specify the hold time in usec");
+  if (unformat (input, "worker %u", &worker)
+      && worker >= vlib_get_n_threads () - 1)
+    return clib_error_return (0, "no worker %u", worker);
+
+  foreach_vlib_main ()
+    {
+      /* The main thread forwards only when there are no workers */
+      if (this_vlib_main->thread_index == 0 && vlib_get_n_threads () > 1)
+	continue;
+      if (worker == ~0 || this_vlib_main->thread_index == worker + 1)
+	vlib_set_dispatch_hold (this_vlib_main, usec);
+    }
+
+  return 0;
+}
+
+/*?
+ * Set the longest time a thread holds pending frames back for more
+ * packets, in microseconds, on all workers or on one, or on the main
+ * thread when there are no workers. Frames are only held for nodes with
+ * a frame size, see 'set node frame-size'. The startup default is
+ * 'dispatch-hold' in the cpu section, 0: never hold.
+ *
+ * @cliexcmd{set dispatch-hold 50 worker 0}
+?*/
+VLIB_CLI_COMMAND (set_dispatch_hold_command, static) = {
+  .path = "set dispatch-hold",
+  .short_help = "set dispatch-hold <usec> [worker <n>]",
+  .function = set_dispatch_hold,
+};
+
 /* Dummy function to get us linked in. */
 void
 vlib_node_cli_reference (void)
@@ -1379,6 +1379,14 @@ vlib_node_set_dispatch_wrapper (vlib_main_t *vm, vlib_node_function_t *fn)
 int vlib_node_set_march_variant (vlib_main_t *vm, u32 node_index,
 				 clib_march_variant_type_t march_variant);
 
+/**
+ * Hold pending frames of an internal node until they carry frame_size
+ * vectors, or for the thread's dispatch hold time, 0 to dispatch at once.
+ * Returns -1 for other node types, or sizes over VLIB_FRAME_SIZE.
+ */
+int vlib_node_set_hold_frame_size (vlib_main_t *vm, u32 node_index,
+				   u32 frame_size);
+
 vlib_node_function_t *
 vlib_node_get_preferred_node_fn_variant (vlib_main_t *vm,
 					 vlib_node_fn_registration_t *regs);
@@ -48,7 +48,7 @@ vlib_node_config (vlib_main_t *vm, unformat_input_t *input)
   unformat_input_t sub_input;
   u32 *march_variant_by_node = 0;
   clib_march_variant_type_t march_variant;
-  u32 node_index;
+  u32 node_index, frame_size;
   int i;
 
   /* specify prioritization defaults for all graph nodes */
@@ -80,6 +80,15 @@ vlib_node_config (vlib_main_t *vm, unformat_input_t *input)
 	      while (unformat_check_input (&sub_input) !=
 		     UNFORMAT_END_OF_INPUT)
 		{
+		  if (unformat (&sub_input, "frame-size %u", &frame_size))
+		    {
+		      if (vlib_node_set_hold_frame_size (vm, node_index,
+							 frame_size))
+			return clib_error_return (
+			  0, "frame-size applies to internal nodes, up to %u",
+			  VLIB_FRAME_SIZE);
+		      continue;
+		    }
 		  if (!unformat (&sub_input, "variant %U",
 				 unformat_vlib_node_variant, &march_variant))
 		    return clib_error_return (0,
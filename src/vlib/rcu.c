@@ -0,0 +1,164 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright(c) 2021 Cisco Systems, Inc.
+ */
+
+#include <vlib/vlib.h>
+
+vlib_rcu_main_t vlib_rcu_main;
+
+void
+vlib_rcu_call (vlib_rcu_fn_t * fn, void *data)
+{
+  vlib_rcu_main_t *rm = &vlib_rcu_main;
+  vlib_rcu_callback_t *c;
+  u64 epoch = rm->epoch + 1;
+
+  ASSERT (vlib_get_thread_index () == 0);
+
+  /* After the caller's release store of the new version */
+  clib_atomic_store_rel_n (&rm->epoch, epoch);
+
+  vec_add2 (rm->pending, c, 1);
+  c->fn = fn;
+  c->data = data;
+  c->epoch = epoch;
+  c->time = vlib_time_now (vlib_get_main ());
+  rm->n_calls++;
+}
+
+void
+vlib_rcu_vec_free_fn (void *v)
+{
+  vec_free (v);
+}
+
+static u64
+vlib_rcu_min_epoch (void)
+{
+  vlib_rcu_main_t *rm = &vlib_rcu_main;
+  u64 epoch, min = rm->epoch;
+  u32 i;
+
+  /* Pairs with the fence of vlib_rcu_online */
+  CLIB_MEMORY_BARRIER ();
+
+  /* The main thread is at its quiescent point */
+  for (i = 1; i < vec_len (rm->threads); i++)
+    {
+      epoch = clib_atomic_load_acq_n (&rm->threads[i].epoch);
+      min = clib_min (min, epoch);
+    }
+  return min;
+}
+
+static void
+vlib_rcu_run (vlib_main_t * vm, u32 n)
+{
+  vlib_rcu_main_t *rm = &vlib_rcu_main;
+  vlib_rcu_callback_t *c;
+  f64 now = vlib_time_now (vm);
+  u32 i;
+
+  /* Callbacks may call vlib_rcu_call, which appends to pending */
+  for (i = 0; i < n; i++)
+    {
+      c = rm->pending + i;
+      rm->max_wait = clib_max (rm->max_wait, now - c->time);
+      c->fn (c->data);
+    }
+  vec_delete (rm->pending, n, 0);
+}
+
+void
+vlib_rcu_reclaim (vlib_main_t * vm)
+{
+  vlib_rcu_main_t *rm = &vlib_rcu_main;
+  u64 min = vlib_rcu_min_epoch ();
+  u32 n = 0;
+
+  while (n < vec_len (rm->pending) && rm->pending[n].epoch <= min)
+    n++;
+
+  if (n < vec_len (rm->pending)
+      && rm->pending[n].time + VLIB_RCU_MAX_WAIT < vlib_time_now (vm))
+    {
+      /* Workers parked at the barrier are at their quiescent point */
+      vlib_worker_thread_barrier_sync (vm);
+      vlib_worker_thread_barrier_release (vm);
+      n = vec_len (rm->pending);
+      rm->n_barriers++;
+    }
+
+  if (n)
+    vlib_rcu_run (vm, n);
+}
+
+static clib_error_t *
+vlib_rcu_init (vlib_main_t * vm)
+{
+  vlib_rcu_main_t *rm = &vlib_rcu_main;
+
+  /* Workers start later, and report quiescent from their first loop: a
+     thread that never did has epoch 0, and holds back every callback */
+  vec_validate_aligned (rm->threads, vlib_get_thread_main ()->n_vlib_mains
+			- 1, CLIB_CACHE_LINE_BYTES);
+  return 0;
+}
+
+VLIB_INIT_FUNCTION (vlib_rcu_init);
+
+static clib_error_t *
+vlib_rcu_num_workers_change (vlib_main_t * vm)
+{
+  vlib_rcu_main_t *rm = &vlib_rcu_main;
+
+  vec_validate_aligned (rm->threads, vlib_get_n_threads () - 1,
+			CLIB_CACHE_LINE_BYTES);
+  return 0;
+}
+
+VLIB_NUM_WORKERS_CHANGE_FN (vlib_rcu_num_workers_change);
+
+static clib_error_t *
+show_rcu_fn (vlib_main_t * vm, unformat_input_t * input,
+	     vlib_cli_command_t * cmd)
+{
+  vlib_rcu_main_t *rm = &vlib_rcu_main;
+  u64 epoch;
+  u32 i;
+
+  vlib_cli_output (vm, "epoch %llu, %u pending, %llu calls, %llu barriers, "
+		   "max wait %.3f ms", rm->epoch, vec_len (rm->pending),
+		   rm->n_calls, rm->n_barriers, rm->max_wait * 1e3);
+  for (i = 1; i < vec_len (rm->threads); i++)
+    {
+      epoch = rm->threads[i].epoch;
+      if (epoch == VLIB_RCU_OFFLINE)
+	vlib_cli_output (vm, "  thread %u: offline", i);
+      else
+	vlib_cli_output (vm, "  thread %u: epoch %llu", i, epoch);
+    }
+  return 0;
+}
+
+/*?
+ * Show the deferred reclamation state: the global epoch, the callbacks
+ * waiting for quiescent points, how many were forced by a barrier, the
+ * longest wait, and the epoch each worker last saw.
+ *
+ * @cliexcmd{show rcu}
+?*/
+VLIB_CLI_COMMAND (show_rcu_command, static) = {
+  .path = "show rcu",
+  .short_help = "show rcu",
+  .function = show_rcu_fn,
+};
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
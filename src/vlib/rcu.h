@@ -0,0 +1,145 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright(c) 2021 Cisco Systems, Inc.
+ */
+
+#ifndef included_vlib_rcu_h
+#define included_vlib_rcu_h
+
+#include <vppinfra/clib.h>
+#include <vppinfra/atomics.h>
+#include <vppinfra/vec.h>
+
+/**
+ * Deferred reclamation of data read by workers, without a barrier.
+ *
+ * The main thread replaces shared data by publishing a new version with a
+ * release store (clib_atomic_store_rel_n), and hands the old one to
+ * vlib_rcu_call(). Every thread passes a quiescent point at the top of
+ * each main loop iteration, where it holds no reference from the previous
+ * one: the callback runs on the main thread once every thread has passed
+ * one since the call, so that no thread can still read the old version.
+ *
+ * Each call advances a global epoch. Workers store the epoch they see at
+ * their quiescent points, and the main thread runs the callbacks whose
+ * epoch all threads have reached. A worker sleeping in epoll is offline,
+ * and never delays a callback. A callback still pending after
+ * VLIB_RCU_MAX_WAIT, behind a worker stuck in a long node, runs after a
+ * barrier sync.
+ *
+ * Readers need no annotation, but must not keep a pointer to published
+ * data across main loop iterations: they reload it, and only the main
+ * thread writes it.
+ */
+
+typedef void (vlib_rcu_fn_t) (void *data);
+
+/* Thread epoch while the thread does not read shared data */
+#define VLIB_RCU_OFFLINE (~0ULL)
+
+/* Seconds a callback may wait for quiescent points before a barrier */
+#define VLIB_RCU_MAX_WAIT 100e-3
+
+typedef struct
+{
+  CLIB_CACHE_LINE_ALIGN_MARK (cacheline0);
+  /* Epoch seen at the last quiescent point, or VLIB_RCU_OFFLINE */
+  volatile u64 epoch;
+} vlib_rcu_thread_t;
+
+typedef struct
+{
+  vlib_rcu_fn_t *fn;
+  void *data;
+  u64 epoch;
+  f64 time;
+} vlib_rcu_callback_t;
+
+typedef struct
+{
+  CLIB_CACHE_LINE_ALIGN_MARK (cacheline0);
+  /* Advanced by the main thread on each call, read by every thread */
+  volatile u64 epoch;
+
+  CLIB_CACHE_LINE_ALIGN_MARK (cacheline1);
+  /* By thread */
+  vlib_rcu_thread_t *threads;
+
+  /* Pending callbacks, in epoch order */
+  vlib_rcu_callback_t *pending;
+
+  /* Statistics */
+  u64 n_calls;
+  u64 n_barriers;
+  f64 max_wait;
+} vlib_rcu_main_t;
+
+extern vlib_rcu_main_t vlib_rcu_main;
+
+/**
+ * @brief Run fn (data) on the main thread once every thread has passed a
+ * quiescent point. Main thread only, after the new version is published.
+ */
+void vlib_rcu_call (vlib_rcu_fn_t * fn, void *data);
+
+/**
+ * @brief Run the callbacks every thread is done with, main loop only.
+ */
+void vlib_rcu_reclaim (vlib_main_t * vm);
+
+void vlib_rcu_vec_free_fn (void *v);
+
+/**
+ * @brief vec_free a vector once no thread can read it, and zero v.
+ */
+#define vlib_rcu_vec_free(v)					\
+do {								\
+  if (v)							\
+    vlib_rcu_call (vlib_rcu_vec_free_fn, (void *) (v));	\
+  (v) = 0;							\
+} while (0)
+
+/**
+ * @brief Quiescent point of the calling thread: it holds no reference
+ * to published data.
+ */
+static_always_inline void
+vlib_rcu_quiescent (u32 thread_index)
+{
+  vlib_rcu_main_t *rm = &vlib_rcu_main;
+
+  /* Prior reads are done before the main thread sees the epoch */
+  clib_atomic_store_rel_n (&rm->threads[thread_index].epoch,
+			   clib_atomic_load_acq_n (&rm->epoch));
+}
+
+/**
+ * @brief Stop reading published data, e.g. before blocking.
+ */
+static_always_inline void
+vlib_rcu_offline (u32 thread_index)
+{
+  clib_atomic_store_rel_n (&vlib_rcu_main.threads[thread_index].epoch,
+			   VLIB_RCU_OFFLINE);
+}
+
+/**
+ * @brief Read published data again, after vlib_rcu_offline.
+ */
+static_always_inline void
+vlib_rcu_online (u32 thread_index)
+{
+  vlib_rcu_quiescent (thread_index);
+  /* The main thread sees us online before we read anything */
+  CLIB_MEMORY_BARRIER ();
+}
+
+#endif /* included_vlib_rcu_h */
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
@@ -0,0 +1,251 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright(c) 2021 Cisco Systems, Inc.
+ */
+
+#include <vlib/vlib.h>
+
+vlib_steal_main_t *vlib_steal_mains;
+
+u32
+vlib_steal_main_init (u32 node_index, int is_ordered)
+{
+  vlib_steal_main_t *sm;
+  vlib_steal_lane_t *lane;
+  u32 n_threads = vlib_get_n_threads ();
+
+  vec_add2 (vlib_steal_mains, sm, 1);
+  sm->node_index = node_index;
+  sm->is_ordered = is_ordered;
+  sm->n_lanes = is_ordered ? VLIB_STEAL_N_ORDERED_LANES : 1;
+
+  vec_validate_aligned (sm->lanes, n_threads * sm->n_lanes - 1,
+			CLIB_CACHE_LINE_BYTES);
+  vec_foreach (lane, sm->lanes)
+    vec_validate_aligned (lane->frames, VLIB_STEAL_LANE_SIZE - 1,
+			  CLIB_CACHE_LINE_BYTES);
+  vec_validate_aligned (sm->threads, n_threads - 1, CLIB_CACHE_LINE_BYTES);
+
+  return sm - vlib_steal_mains;
+}
+
+/* Next frame to fill of a lane of the calling thread, 0 if full */
+static_always_inline vlib_steal_frame_t *
+vlib_steal_lane_get (vlib_steal_lane_t * lane)
+{
+  vlib_steal_frame_t *f;
+
+  if (lane->tail - clib_atomic_load_acq_n (&lane->head) ==
+      VLIB_STEAL_LANE_SIZE)
+    return 0;
+
+  f = lane->frames + (lane->tail & (VLIB_STEAL_LANE_SIZE - 1));
+  f->n_vectors = 0;
+  return f;
+}
+
+static_always_inline void
+vlib_steal_lane_put (vlib_steal_lane_t * lane)
+{
+  clib_atomic_store_rel_n (&lane->tail, lane->tail + 1);
+}
+
+u32
+vlib_steal_enqueue (vlib_main_t * vm, u32 steal_index, u32 * buffers,
+		    u32 * hashes, u32 n)
+{
+  vlib_steal_main_t *sm = vec_elt_at_index (vlib_steal_mains, steal_index);
+  vlib_steal_thread_t *t = sm->threads + vm->thread_index;
+  vlib_steal_lane_t *lanes = sm->lanes + vm->thread_index * sm->n_lanes;
+  vlib_steal_frame_t *frames[VLIB_STEAL_N_ORDERED_LANES] = { 0 };
+  u32 full[VLIB_STEAL_N_ORDERED_LANES] = { 0 };
+  vlib_steal_frame_t *f;
+  u32 i, l, n_copy, n_left = 0;
+
+  if (!sm->is_ordered)
+    {
+      for (i = 0; i < n; i += n_copy)
+	{
+	  n_copy = clib_min (n - i, VLIB_FRAME_SIZE);
+	  if (!(f = vlib_steal_lane_get (lanes)))
+	    break;
+	  clib_memcpy_fast (f->buffer_index, buffers + i,
+			    n_copy * sizeof (u32));
+	  f->n_vectors = n_copy;
+	  vlib_steal_lane_put (lanes);
+	  t->n_enqueued++;
+	}
+      n_left = n - i;
+      if (n_left && i)
+	clib_memmove (buffers, buffers + i, n_left * sizeof (u32));
+      t->n_full += n_left;
+      return n_left;
+    }
+
+  ASSERT (n <= VLIB_FRAME_SIZE);
+
+  for (i = 0; i < n; i++)
+    {
+      l = hashes[i] & (sm->n_lanes - 1);
+      if (PREDICT_FALSE (frames[l] == 0))
+	{
+	  if (full[l] || !(frames[l] = vlib_steal_lane_get (lanes + l)))
+	    {
+	      full[l] = 1;
+	      buffers[n_left++] = buffers[i];
+	      continue;
+	    }
+	}
+      f = frames[l];
+      f->buffer_index[f->n_vectors++] = buffers[i];
+    }
+
+  for (l = 0; l < sm->n_lanes; l++)
+    if (frames[l])
+      {
+	vlib_steal_lane_put (lanes + l);
+	t->n_enqueued++;
+      }
+
+  t->n_full += n_left;
+  return n_left;
+}
+
+/* Take up to n_max frames of a lane to the node, returns how many */
+static u32
+vlib_steal_take (vlib_main_t * vm, vlib_steal_main_t * sm,
+		 vlib_steal_lane_t * lane, u32 n_max)
+{
+  vlib_steal_frame_t *sf;
+  vlib_frame_t *f;
+  u32 head, tail, n = 0;
+
+  if (lane->head == clib_atomic_load_acq_n (&lane->tail) || lane->holder
+      || !clib_atomic_bool_cmp_and_swap (&lane->holder, 0,
+					 vm->thread_index + 1))
+    return 0;
+
+  head = lane->head;
+  tail = clib_atomic_load_acq_n (&lane->tail);
+  for (; head != tail && n < n_max; head++, n++)
+    {
+      sf = lane->frames + (head & (VLIB_STEAL_LANE_SIZE - 1));
+      f = vlib_get_frame_to_node (vm, sm->node_index);
+      clib_memcpy_fast (vlib_frame_vector_args (f), sf->buffer_index,
+			sf->n_vectors * sizeof (u32));
+      f->n_vectors = sf->n_vectors;
+      vlib_put_frame_to_node (vm, sm->node_index, f);
+    }
+
+  /* The owner may refill the frames taken */
+  clib_atomic_store_rel_n (&lane->head, head);
+
+  if (sm->is_ordered)
+    vec_add1 (sm->threads[vm->thread_index].held, lane - sm->lanes);
+  else
+    clib_atomic_store_rel_n (&lane->holder, 0);
+
+  return n;
+}
+
+void
+vlib_steal_dispatch (vlib_main_t * vm)
+{
+  u32 thread_index = vm->thread_index, n_workers = vlib_num_workers ();
+  vlib_steal_main_t *sm;
+  vlib_steal_thread_t *t;
+  vlib_steal_lane_t *lanes;
+  u32 i, l, v, n, *held;
+
+  vec_foreach (sm, vlib_steal_mains)
+    {
+      t = sm->threads + thread_index;
+
+      /* Frames taken last time went through the graph */
+      if (vec_len (t->held)
+	  && _vec_len (vm->node_main.pending_frames) == 0)
+	{
+	  vec_foreach (held, t->held)
+	    clib_atomic_store_rel_n (&sm->lanes[held[0]].holder, 0);
+	  vec_reset_length (t->held);
+	}
+
+      n = 0;
+      lanes = sm->lanes + thread_index * sm->n_lanes;
+      for (l = 0; l < sm->n_lanes && n < VLIB_STEAL_BATCH; l++)
+	n += vlib_steal_take (vm, sm, lanes + l, VLIB_STEAL_BATCH - n);
+      t->n_own += n;
+
+      /* The main thread never steals */
+      if (n || thread_index == 0)
+	continue;
+
+      for (i = 0; i < n_workers && n < VLIB_STEAL_BATCH; i++)
+	{
+	  v = 1 + (t->victim + i) % n_workers;
+	  if (v == thread_index)
+	    continue;
+	  lanes = sm->lanes + v * sm->n_lanes;
+	  for (l = 0; l < sm->n_lanes && n < VLIB_STEAL_BATCH; l++)
+	    n += vlib_steal_take (vm, sm, lanes + l, VLIB_STEAL_BATCH - n);
+	  /* Come back to a loaded worker first */
+	  if (n)
+	    t->victim = v - 1;
+	}
+      t->n_stolen += n;
+    }
+}
+
+static clib_error_t *
+show_work_steal_fn (vlib_main_t * vm, unformat_input_t * input,
+		    vlib_cli_command_t * cmd)
+{
+  vlib_steal_main_t *sm;
+  vlib_steal_thread_t *t;
+  vlib_steal_lane_t *lane;
+  u32 i, l, n_queued;
+
+  vec_foreach (sm, vlib_steal_mains)
+    {
+      vlib_cli_output (vm, "to %U, %s, %u lanes per thread",
+		       format_vlib_node_name, vm, sm->node_index,
+		       sm->is_ordered ? "ordered" : "unordered", sm->n_lanes);
+      vlib_cli_output (vm, "  %-8s%12s%12s%12s%12s%10s", "thread",
+		       "enqueued", "own", "stolen", "full", "queued");
+      vec_foreach_index (i, sm->threads)
+	{
+	  t = sm->threads + i;
+	  n_queued = 0;
+	  for (l = 0; l < sm->n_lanes; l++)
+	    {
+	      lane = sm->lanes + i * sm->n_lanes + l;
+	      n_queued += lane->tail - lane->head;
+	    }
+	  vlib_cli_output (vm, "  %-8u%12llu%12llu%12llu%12llu%10u", i,
+			   t->n_enqueued, t->n_own, t->n_stolen, t->n_full,
+			   n_queued);
+	}
+    }
+  return 0;
+}
+
+/*?
+ * Show the work steal queues: by thread, the frames it queued, took
+ * from its own lanes and from other workers', the packets that found
+ * their lane full, and the frames waiting in its lanes.
+ *
+ * @cliexcmd{show work-steal}
+?*/
+VLIB_CLI_COMMAND (show_work_steal_command, static) = {
+  .path = "show work-steal",
+  .short_help = "show work-steal",
+  .function = show_work_steal_fn,
+};
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
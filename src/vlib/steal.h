@@ -0,0 +1,129 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright(c) 2021 Cisco Systems, Inc.
+ */
+
+#ifndef included_vlib_steal_h
+#define included_vlib_steal_h
+
+#include <vppinfra/clib.h>
+#include <vppinfra/atomics.h>
+#include <vppinfra/vec.h>
+
+/**
+ * Work stealing of whole frames between threads.
+ *
+ * A steal queue feeds one node. Each thread owns lanes of it, rings of
+ * frames of buffer indices it fills with vlib_steal_enqueue(). At the top
+ * of each main loop iteration, every thread takes up to VLIB_STEAL_BATCH
+ * frames from its own lanes, and a worker whose own lanes are empty takes
+ * them from another worker's: the frames run through the node and the
+ * rest of the graph on that thread.
+ *
+ * A thread takes frames from a lane while holding it. Unordered queues
+ * have one lane per thread, released as soon as frames are taken, so
+ * several threads can drain a loaded one. Ordered queues spread the
+ * packets over lanes by flow hash, and a thread keeps a lane until the
+ * frames it took have gone through the graph, at its next loop iteration
+ * with no pending frame. Packets of a flow then never run on two threads
+ * at once, and leave in order. Only subgraphs without per-thread state
+ * can run on any thread.
+ */
+
+/* Frames per lane, a power of 2 */
+#define VLIB_STEAL_LANE_SIZE 16
+
+/* Lanes per thread of ordered queues, a power of 2 */
+#define VLIB_STEAL_N_ORDERED_LANES 16
+
+/* Frames a thread takes per main loop iteration */
+#define VLIB_STEAL_BATCH 2
+
+typedef struct
+{
+  u32 n_vectors;
+  u32 buffer_index[VLIB_FRAME_SIZE];
+} vlib_steal_frame_t;
+
+typedef struct
+{
+  CLIB_CACHE_LINE_ALIGN_MARK (cacheline0);
+  /* Next frame to take, moved by the holder */
+  volatile u32 head;
+
+  /* Thread index + 1 of the holder, 0 if free */
+  volatile u32 holder;
+
+  CLIB_CACHE_LINE_ALIGN_MARK (cacheline1);
+  /* Next frame to fill, moved by the owner thread */
+  volatile u32 tail;
+
+  /* VLIB_STEAL_LANE_SIZE frames */
+  vlib_steal_frame_t *frames;
+} vlib_steal_lane_t;
+
+typedef struct
+{
+  CLIB_CACHE_LINE_ALIGN_MARK (cacheline0);
+  /* Ordered lanes held until the taken frames are dispatched */
+  u32 *held;
+
+  /* Worker to steal from next */
+  u32 victim;
+
+  /* Frames queued, taken from own lanes, and from other threads */
+  u64 n_enqueued;
+  u64 n_own;
+  u64 n_stolen;
+
+  /* Packets that found their lane full */
+  u64 n_full;
+} vlib_steal_thread_t;
+
+typedef struct
+{
+  /* Node the frames go to */
+  u32 node_index;
+
+  /* Lanes per thread, a power of 2, 1 if unordered */
+  u32 n_lanes;
+  u8 is_ordered;
+
+  /* By thread, n_lanes each */
+  vlib_steal_lane_t *lanes;
+
+  /* By thread */
+  vlib_steal_thread_t *threads;
+} vlib_steal_main_t;
+
+extern vlib_steal_main_t *vlib_steal_mains;
+
+/**
+ * @brief Create a steal queue to node_index, returns its index.
+ * Main thread, with the workers stopped.
+ */
+u32 vlib_steal_main_init (u32 node_index, int is_ordered);
+
+/**
+ * @brief Queue n buffers from a node of the calling thread.
+ * Buffers go to lanes by hashes for ordered queues, in frames of up to
+ * VLIB_FRAME_SIZE otherwise, hashes is then unused. Returns the number of
+ * buffers whose lane was full, moved to the front of buffers.
+ */
+u32 vlib_steal_enqueue (vlib_main_t * vm, u32 steal_index, u32 * buffers,
+			u32 * hashes, u32 n);
+
+/**
+ * @brief Take frames for the calling thread, at the top of its main loop.
+ */
+void vlib_steal_dispatch (vlib_main_t * vm);
+
+#endif /* included_vlib_steal_h */
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
@@ -344,6 +344,7 @@ vlib_frame_queue_alloc (int nelts)
   clib_memset (fq, 0, sizeof (*fq));
   fq->nelts = nelts;
   fq->vector_threshold = 2 * VLIB_FRAME_SIZE;
+  fq->congestion_threshold = nelts - nelts / 4;
   vec_validate_aligned (fq->elts, nelts - 1, CLIB_CACHE_LINE_BYTES);
 
   if (nelts & (nelts - 1))
@@ -460,6 +461,67 @@ vlib_get_thread_core_numa (vlib_worker_thread_t * w, unsigned cpu_id)
   w->numa_id = numa_id;
 }
 
+/*
+ * NUMA node a thread runs on, known before the workers are launched:
+ * the workers of each registration run on its coremask's cores, in
+ * order. -1 if unknown, or not pinned.
+ */
+int
+vlib_get_thread_numa (u32 thread_index)
+{
+  vlib_thread_main_t *tm = vlib_get_thread_main ();
+  vlib_thread_registration_t *tr;
+  vlib_worker_thread_t w = { .numa_id = -1 };
+  uword c;
+  u32 i, n;
+
+  if (thread_index == 0 || thread_index >= vec_len (vlib_worker_threads))
+    return vlib_worker_threads[0].numa_id;
+
+  /* Launched already */
+  if (vlib_worker_threads[thread_index].lwp)
+    return vlib_worker_threads[thread_index].numa_id;
+
+  for (i = 0; i < vec_len (tm->registrations); i++)
+    {
+      tr = tm->registrations[i];
+      if (thread_index < tr->first_index ||
+	  thread_index >= tr->first_index + tr->count)
+	continue;
+      if (tr->use_pthreads || tm->use_pthreads)
+	break;
+
+      n = thread_index - tr->first_index;
+      clib_bitmap_foreach (c, tr->coremask)
+	if (n-- == 0)
+	  {
+	    vlib_get_thread_core_numa (&w, c);
+	    break;
+	  }
+      break;
+    }
+
+  return w.numa_id;
+}
+
+/*
+ * Configured frame hold time of a thread in usec. The main thread only
+ * forwards, and holds frames, without workers.
+ */
+u32
+vlib_thread_dispatch_hold (u32 thread_index)
+{
+  vlib_thread_main_t *tm = vlib_get_thread_main ();
+  u32 *by_worker = tm->dispatch_hold_usec_by_worker;
+
+  if (thread_index == 0)
+    return vlib_get_n_threads () > 1 ? 0 : tm->dispatch_hold_usec;
+  if (thread_index - 1 < vec_len (by_worker) && by_worker[thread_index - 1]
+      != ~0)
+    return by_worker[thread_index - 1];
+  return tm->dispatch_hold_usec;
+}
+
 static clib_error_t *
 vlib_launch_thread_int (void *fp, vlib_worker_thread_t * w, unsigned cpu_id)
 {
@@ -1124,7 +1186,7 @@ cpu_config (vlib_main_t * vm, unformat_input_t * input)
   vlib_thread_main_t *tm = &vlib_thread_main;
   u8 *name;
   uword *bitmap;
-  u32 count;
+  u32 count, worker, usec;
 
   tm->thread_registrations_by_name = hash_create_string (0, sizeof (uword));
 
@@ -1184,6 +1246,24 @@ cpu_config (vlib_main_t * vm, unformat_input_t * input)
 	;
       else if (unformat (input, "scheduler-priority %u", &tm->sched_priority))
 	;
+      else if (unformat (input, "dispatch-hold worker %u %u", &worker,
+			 &usec))
+	{
+	  vec_validate_init_empty (tm->dispatch_hold_usec_by_worker, worker,
+				   ~0);
+	  tm->dispatch_hold_usec_by_worker[worker] = usec;
+	}
+      else if (unformat (input, "dispatch-hold %u", &tm->dispatch_hold_usec))
+	;
+      else if (unformat (input, "handoff-queue-size %u",
+			 &tm->frame_queue_nelts))
+	{
+	  if (!is_pow2 (tm->frame_queue_nelts) || tm->frame_queue_nelts < 16)
+	    return clib_error_return (0, "handoff-queue-size must be a "
+				      "power of 2, at least 16");
+	}
+      else if (unformat (input, "handoff-backpressure"))
+	tm->frame_queue_backpressure = 1;
       else if (unformat (input, "%s %u", &name, &count))
 	{
 	  p = hash_get_mem (tm->thread_registrations_by_name, name);
@@ -1634,6 +1714,8 @@ vlib_frame_queue_main_init (u32 node_index, u32 frame_queue_nelts)
   int i;
   u32 num_threads;
 
+  if (frame_queue_nelts == 0)
+    frame_queue_nelts = tm->frame_queue_nelts;
   if (frame_queue_nelts == 0)
     frame_queue_nelts = FRAME_QUEUE_MAX_NELTS;
 
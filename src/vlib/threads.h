@@ -108,6 +108,9 @@ typedef struct
   u64 trace;
   u32 nelts;
 
+  /* Elements in use from which senders see the queue congested */
+  u32 congestion_threshold;
+
   /* modified by enqueue side  */
   CLIB_CACHE_LINE_ALIGN_MARK (cacheline1);
   volatile u64 tail;
@@ -118,6 +121,9 @@ typedef struct
 }
 vlib_frame_queue_t;
 
+/* Frames a sender hands to one thread with a single tail update */
+#define VLIB_FRAME_QUEUE_BULK 4
+
 struct vlib_frame_queue_main_t_;
 typedef u32 (vlib_frame_queue_dequeue_fn_t) (
   vlib_main_t *vm, struct vlib_frame_queue_main_t_ *fqm);
@@ -281,6 +287,17 @@ typedef struct
   /* NUMA-bound heap size */
   uword numa_heap_size;
 
+  /* Default handoff frame queue size, a power of 2 */
+  u32 frame_queue_nelts;
+
+  /* Skip input polling after a loop that met a congested frame queue */
+  u8 frame_queue_backpressure;
+
+  /* Frame hold time of forwarding threads in usec, and by worker, ~0 for
+     the default, see vlib_node_runtime_t hold_frame_size */
+  u32 dispatch_hold_usec;
+  u32 *dispatch_hold_usec_by_worker;
+
 } vlib_thread_main_t;
 
 extern vlib_thread_main_t vlib_thread_main;
@@ -458,6 +475,34 @@ vlib_get_worker_vlib_main (u32 worker_index)
   return vm;
 }
 
+/**
+ * @brief Whether the frame queue of thread_index is congested: senders
+ * enqueueing to it should slow down, or find another way.
+ */
+static_always_inline int
+vlib_frame_queue_is_congested (u32 frame_queue_index, u32 thread_index)
+{
+  vlib_thread_main_t *tm = vlib_get_thread_main ();
+  vlib_frame_queue_main_t *fqm;
+  vlib_frame_queue_t *fq;
+
+  fqm = vec_elt_at_index (tm->frame_queue_mains, frame_queue_index);
+  fq = vec_elt (fqm->vlib_frame_queues, thread_index);
+  return fq->tail - clib_atomic_load_acq_n (&fq->head) >=
+    fq->congestion_threshold;
+}
+
+/**
+ * @brief Whether the calling thread should hold back input this main loop:
+ * it met a congested frame queue in the last one, with backpressure on.
+ */
+static_always_inline int
+vlib_frame_queue_backpressure (vlib_main_t * vm)
+{
+  return vm->frame_queue_congested_loop + 1 == vm->main_loop_count
+    && vlib_get_thread_main ()->frame_queue_backpressure;
+}
+
 static inline u8
 vlib_thread_is_main_w_barrier (void)
 {
@@ -474,6 +519,8 @@ vlib_process_signal_event_mt_helper (vlib_process_signal_event_mt_args_t *
 				     args);
 void vlib_rpc_call_main_thread (void *function, u8 * args, u32 size);
 void vlib_get_thread_core_numa (vlib_worker_thread_t * w, unsigned cpu_id);
+int vlib_get_thread_numa (u32 thread_index);
+u32 vlib_thread_dispatch_hold (u32 thread_index);
 vlib_thread_main_t *vlib_get_thread_main_not_inline (void);
 
 /**
@@ -172,7 +172,8 @@ linux_epoll_input_inline (vlib_main_t * vm, vlib_node_runtime_t * node,
       }
     /* If we're not working very hard, decide how long to sleep */
     else if (is_main && vector_rate < 2 && vm->api_queue_nonempty == 0
-	     && nm->input_node_counts_by_state[VLIB_NODE_STATE_POLLING] == 0)
+	     && nm->input_node_counts_by_state[VLIB_NODE_STATE_POLLING] == 0
+	     && _vec_len (nm->pending_frames) == 0)
       {
 	ticks_until_expiration = TW (tw_timer_first_expires_in_ticks)
 	  ((TWT (tw_timer_wheel) *) nm->timing_wheel);
@@ -200,7 +201,9 @@ linux_epoll_input_inline (vlib_main_t * vm, vlib_node_runtime_t * node,
       }
     else if (is_main == 0 && vector_rate < 2 &&
 	     (vlib_get_first_main ()->time_last_barrier_release + 0.5 < now) &&
-	     nm->input_node_counts_by_state[VLIB_NODE_STATE_POLLING] == 0)
+	     nm->input_node_counts_by_state[VLIB_NODE_STATE_POLLING] == 0 &&
+	     /* Frames held back, see dispatch_pending_node_hold */
+	     _vec_len (nm->pending_frames) == 0)
       {
 	timeout = 10e-3;
 	timeout_ms = max_timeout_ms;
@@ -212,6 +215,10 @@ linux_epoll_input_inline (vlib_main_t * vm, vlib_node_runtime_t * node,
 	node->input_main_loops_per_call = 1024;
       }
 
+    /* A sleeping worker holds no reference, see vlib/rcu.h */
+    if (!is_main && timeout_ms)
+      vlib_rcu_offline (thread_index);
+
     /* Allow any signal to wakeup our sleep. */
     if (is_main || em->epoll_fd != -1)
       {
@@ -229,6 +236,8 @@ linux_epoll_input_inline (vlib_main_t * vm, vlib_node_runtime_t * node,
 				      vec_len (em->epoll_events), timeout_ms);
 	  }
 
+	if (!is_main && timeout_ms)
+	  vlib_rcu_online (thread_index);
       }
     else
       {
@@ -254,8 +263,9 @@ linux_epoll_input_inline (vlib_main_t * vm, vlib_node_runtime_t * node,
 		      nm->input_node_interrupts) ||
 		    clib_interrupt_is_any_pending (
 		      nm->pre_input_node_interrupts))
-		  goto done;
+		  break;
 	      }
+	    vlib_rcu_online (thread_index);
 	  }
 	goto done;
       }
@@ -65,15 +65,15 @@
   _ (16, IS_DVR, "dvr", 1)                                                    \
   _ (17, QOS_DATA_VALID, "qos-data-valid", 0)                                 \
   _ (18, GSO, "gso", 0)                                                       \
-  _ (19, AVAIL1, "avail1", 1)                                                 \
-  _ (20, AVAIL2, "avail2", 1)                                                 \
-  _ (21, AVAIL3, "avail3", 1)                                                 \
-  _ (22, AVAIL4, "avail4", 1)                                                 \
-  _ (23, AVAIL5, "avail5", 1)                                                 \
-  _ (24, AVAIL6, "avail6", 1)                                                 \
-  _ (25, AVAIL7, "avail7", 1)                                                 \
-  _ (26, AVAIL8, "avail8", 1)                                                 \
-  _ (27, AVAIL9, "avail9", 1)
+  _ (19, FLOW_CTX_VALID, "flow-ctx-valid", 1)                                 \
+  _ (20, AVAIL1, "avail1", 1)                                                 \
+  _ (21, AVAIL2, "avail2", 1)                                                 \
+  _ (22, AVAIL3, "avail3", 1)                                                 \
+  _ (23, AVAIL4, "avail4", 1)                                                 \
+  _ (24, AVAIL5, "avail5", 1)                                                 \
+  _ (25, AVAIL6, "avail6", 1)                                                 \
+  _ (26, AVAIL7, "avail7", 1)                                                 \
+  _ (27, AVAIL8, "avail8", 1)
 
 /*
  * Please allocate the FIRST available bit, redefine
@@ -84,7 +84,7 @@
 #define VNET_BUFFER_FLAGS_ALL_AVAIL                                           \
   (VNET_BUFFER_F_AVAIL1 | VNET_BUFFER_F_AVAIL2 | VNET_BUFFER_F_AVAIL3 |       \
    VNET_BUFFER_F_AVAIL4 | VNET_BUFFER_F_AVAIL5 | VNET_BUFFER_F_AVAIL6 |       \
-   VNET_BUFFER_F_AVAIL7 | VNET_BUFFER_F_AVAIL8 | VNET_BUFFER_F_AVAIL9)
+   VNET_BUFFER_F_AVAIL7 | VNET_BUFFER_F_AVAIL8)
 
 #define VNET_BUFFER_FLAGS_VLAN_BITS \
   (VNET_BUFFER_F_VLAN_1_DEEP | VNET_BUFFER_F_VLAN_2_DEEP)
@@ -495,7 +495,35 @@ typedef struct
     };
   } nat;
 
-  u32 unused[8];
+  union
+  {
+    /**
+     * Flow context, parsed once by the first flow-aware node and reused by
+     * the nodes chained after it. Valid while VNET_BUFFER_F_FLOW_CTX_VALID
+     * is set; a node that rewrites the 5-tuple, or reuses this space as
+     * scratch (e.g. esp decrypt), must clear the flag.
+     */
+    struct
+    {
+      /*
+       * IPv4: src << 32 | dst, protocol << 32 | src_port << 16 | dst_port
+       * (network order). IPv6: key[0] is 0, key[1] as for IPv4, the
+       * addresses are too long and stay in the packet.
+       */
+      u64 key[2];
+      /* hash of the key, by clib_bihash_hash_16_8 or, for IPv6,
+       * clib_bihash_hash_40_8 of addresses and key[1] */
+      u64 hash;
+      i16 l3_hdr_offset;
+      i16 l4_hdr_offset;
+      u8 protocol;
+      /* 4 or 6, 0 if not IP */
+      u8 ip_version;
+      u8 __unused[2];
+    } flow_ctx;
+
+    u32 unused[8];
+  };
 } vnet_buffer_opaque2_t;
 
 #define vnet_buffer2(b) ((vnet_buffer_opaque2_t *) (b)->opaque2)
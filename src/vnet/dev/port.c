@@ -58,6 +58,14 @@ VNET_FEATURE_INIT (worker_handoff, static) = {
   .runs_before = VNET_FEATURES ("ethernet-input"),
 };
 
+VNET_FEATURE_INIT (work_steal, static) = {
+  .arc_name = "port-rx-eth",
+  .node_name = "work-steal",
+  .runs_before = VNET_FEATURES ("ethernet-input"),
+  .runs_after = VNET_FEATURES ("l2-patch", "worker-handoff", "span-input",
+			       "p2p-ethernet-input"),
+};
+
 VNET_FEATURE_INIT (span_input, static) = {
   .arc_name = "port-rx-eth",
   .node_name = "span-input",
@@ -36,6 +36,14 @@ typedef struct
 
   /* Worker handoff index */
   u32 frame_queue_index;
+
+  /* Work steal queues, unordered and ordered, and ordering by interface */
+  u32 steal_index[2];
+  u8 *steal_ordered;
+  vnet_hash_fn_t steal_hash_fn;
+
+  /* Smallest frame unordered work steal queues */
+  u32 steal_min_vectors;
 } handoff_main_t;
 
 extern handoff_main_t handoff_main;
@@ -54,7 +62,8 @@ typedef struct
 } worker_handoff_trace_t;
 
 #define foreach_worker_handoff_error			\
-  _(CONGESTION_DROP, "congestion drop")
+  _(CONGESTION_DROP, "congestion drop")			\
+  _(CONGESTED, "enqueued to congested queue")
 
 typedef enum
 {
@@ -115,6 +124,7 @@ VLIB_NODE_FN (worker_handoff_node) (vlib_main_t * vm,
   vlib_buffer_t *bufs[VLIB_FRAME_SIZE], **b;
   u32 n_enq, n_left_from, *from;
   u16 thread_indices[VLIB_FRAME_SIZE], *ti;
+  u64 n_congested = vm->frame_queue_n_congested;
 
   from = vlib_frame_vector_args (frame);
   n_left_from = frame->n_vectors;
@@ -163,6 +173,12 @@ VLIB_NODE_FN (worker_handoff_node) (vlib_main_t * vm,
     vlib_node_increment_counter (vm, node->node_index,
 				 WORKER_HANDOFF_ERROR_CONGESTION_DROP,
 				 frame->n_vectors - n_enq);
+
+  n_congested = vm->frame_queue_n_congested - n_congested;
+  if (n_congested > frame->n_vectors - n_enq)
+    vlib_node_increment_counter (vm, node->node_index,
+				 WORKER_HANDOFF_ERROR_CONGESTED,
+				 n_congested - (frame->n_vectors - n_enq));
   return frame->n_vectors;
 }
 
@@ -180,6 +196,106 @@ VLIB_REGISTER_NODE (worker_handoff_node) = {
   },
 };
 
+#define foreach_work_steal_error		\
+  _(QUEUED, "queued for work stealing")		\
+  _(CONGESTION_DROP, "congestion drop")
+
+typedef enum
+{
+#define _(sym,str) WORK_STEAL_ERROR_##sym,
+  foreach_work_steal_error
+#undef _
+    WORK_STEAL_N_ERROR,
+} work_steal_error_t;
+
+static char *work_steal_error_strings[] = {
+#define _(sym,string) string,
+  foreach_work_steal_error
+#undef _
+};
+
+typedef enum
+{
+  WORK_STEAL_NEXT_DROP,
+  WORK_STEAL_NEXT_ETHERNET_INPUT,
+  WORK_STEAL_N_NEXT,
+} work_steal_next_t;
+
+/*
+ * Queue frames for any worker to run from ethernet-input, see
+ * vlib/steal.h. Unordered, only frames of at least steal_min_vectors are
+ * queued, smaller ones and those that find no room go on locally, to
+ * ethernet-input as well: work-steal is last on the arc, so both paths
+ * resume at the same node whatever the load.
+ * Ordered, every packet goes to its flow's lane, or is dropped if it is
+ * full, so that packets of a flow never take two paths.
+ */
+VLIB_NODE_FN (work_steal_node) (vlib_main_t * vm,
+				vlib_node_runtime_t * node,
+				vlib_frame_t * frame)
+{
+  handoff_main_t *hm = &handoff_main;
+  vlib_buffer_t *bufs[VLIB_FRAME_SIZE];
+  u32 buffers[VLIB_FRAME_SIZE], hashes[VLIB_FRAME_SIZE];
+  void *data[VLIB_FRAME_SIZE];
+  u32 i, n_left, n_vectors = frame->n_vectors, *from;
+  u32 sw_if_index;
+  int is_ordered;
+
+  from = vlib_frame_vector_args (frame);
+  vlib_get_buffers (vm, from, bufs, n_vectors);
+  clib_memcpy_fast (buffers, from, n_vectors * sizeof (u32));
+
+  sw_if_index = vnet_buffer (bufs[0])->sw_if_index[VLIB_RX];
+  is_ordered = vec_elt (hm->steal_ordered, sw_if_index);
+
+  if (is_ordered)
+    {
+      for (i = 0; i < n_vectors; i++)
+	data[i] = vlib_buffer_get_current (bufs[i]);
+      hm->steal_hash_fn (data, hashes, n_vectors);
+      n_left = vlib_steal_enqueue (vm, hm->steal_index[1], buffers, hashes,
+				   n_vectors);
+      if (n_left)
+	{
+	  vlib_buffer_free (vm, buffers, n_left);
+	  vlib_node_increment_counter (vm, node->node_index,
+				       WORK_STEAL_ERROR_CONGESTION_DROP,
+				       n_left);
+	}
+    }
+  else if (n_vectors >= hm->steal_min_vectors)
+    n_left = vlib_steal_enqueue (vm, hm->steal_index[0], buffers, 0,
+				 n_vectors);
+  else
+    n_left = n_vectors;
+
+  vlib_node_increment_counter (vm, node->node_index, WORK_STEAL_ERROR_QUEUED,
+			       n_vectors - n_left);
+
+  if (is_ordered || n_left == 0)
+    return n_vectors;
+
+  vlib_buffer_enqueue_to_single_next (vm, node, buffers,
+				      WORK_STEAL_NEXT_ETHERNET_INPUT, n_left);
+
+  return n_vectors;
+}
+
+VLIB_REGISTER_NODE (work_steal_node) = {
+  .name = "work-steal",
+  .vector_size = sizeof (u32),
+  .type = VLIB_NODE_TYPE_INTERNAL,
+  .n_errors = ARRAY_LEN(work_steal_error_strings),
+  .error_strings = work_steal_error_strings,
+
+  .n_next_nodes = WORK_STEAL_N_NEXT,
+  .next_nodes = {
+    [WORK_STEAL_NEXT_DROP] = "error-drop",
+    [WORK_STEAL_NEXT_ETHERNET_INPUT] = "ethernet-input",
+  },
+};
+
 #ifndef CLIB_MARCH_VARIANT
 
 int
@@ -321,6 +437,112 @@ VLIB_CLI_COMMAND (set_interface_handoff_command, static) = {
 };
 /* *INDENT-ON* */
 
+int
+interface_work_steal_enable_disable (vlib_main_t *vm, u32 sw_if_index,
+				     int is_ordered, int enable_disable)
+{
+  handoff_main_t *hm = &handoff_main;
+  vnet_main_t *vnm = vnet_get_main ();
+  vnet_sw_interface_t *sw;
+
+  if (pool_is_free_index (vnm->interface_main.sw_interfaces, sw_if_index))
+    return VNET_API_ERROR_INVALID_SW_IF_INDEX;
+
+  sw = vnet_get_sw_interface (vnm, sw_if_index);
+  if (sw->type != VNET_SW_INTERFACE_TYPE_HARDWARE)
+    return VNET_API_ERROR_INVALID_SW_IF_INDEX;
+
+  if (hm->num_workers < 2)
+    return VNET_API_ERROR_INVALID_WORKER;
+
+  if (enable_disable && hm->steal_index[is_ordered] == ~0)
+    {
+      vlib_node_t *n = vlib_get_node_by_name (vm, (u8 *) "ethernet-input");
+      hm->steal_index[is_ordered] = vlib_steal_main_init (n->index,
+							  is_ordered);
+      hm->steal_hash_fn = vnet_hash_function_from_name (
+	"handoff-eth", VNET_HASH_FN_TYPE_ETHERNET);
+    }
+
+  vec_validate (hm->steal_ordered, sw_if_index);
+  hm->steal_ordered[sw_if_index] = is_ordered;
+
+  vnet_feature_enable_disable ("device-input", "work-steal", sw_if_index,
+			       enable_disable, 0, 0);
+  vnet_feature_enable_disable ("port-rx-eth", "work-steal", sw_if_index,
+			       enable_disable, 0, 0);
+  return 0;
+}
+
+static clib_error_t *
+set_interface_work_steal_command_fn (vlib_main_t *vm,
+				     unformat_input_t *input,
+				     vlib_cli_command_t *cmd)
+{
+  handoff_main_t *hm = &handoff_main;
+  u32 sw_if_index = ~0, min_vectors;
+  int enable_disable = 1, is_ordered = 0;
+  int rv;
+
+  while (unformat_check_input (input) != UNFORMAT_END_OF_INPUT)
+    {
+      if (unformat (input, "disable"))
+	enable_disable = 0;
+      else if (unformat (input, "ordered"))
+	is_ordered = 1;
+      else if (unformat (input, "min-vectors %u", &min_vectors))
+	hm->steal_min_vectors = min_vectors;
+      else if (unformat (input, "%U", unformat_vnet_sw_interface,
+			 vnet_get_main (), &sw_if_index))
+	;
+      else
+	break;
+    }
+
+  if (sw_if_index == ~0)
+    return clib_error_return (0, "Please specify an interface...");
+
+  rv = interface_work_steal_enable_disable (vm, sw_if_index, is_ordered,
+					    enable_disable);
+
+  switch (rv)
+    {
+    case 0:
+      break;
+
+    case VNET_API_ERROR_INVALID_SW_IF_INDEX:
+      return clib_error_return (0, "Invalid interface");
+
+    case VNET_API_ERROR_INVALID_WORKER:
+      return clib_error_return (0, "Work stealing needs 2 workers or more");
+
+    default:
+      return clib_error_return (0, "unknown return value %d", rv);
+    }
+
+  return 0;
+}
+
+/*?
+ * Let idle workers run frames received on an interface, from
+ * ethernet-input on. The receiving worker queues its frames of at least
+ * min-vectors packets (default half a frame), and takes them back when
+ * no other worker does. With 'ordered', packets are queued by flow hash,
+ * and the packets of a flow run on one worker at a time, in order. Only
+ * for graphs without per-worker state, such as routing: stateful
+ * features see flows on several workers. See 'show work-steal'.
+ *
+ * @cliexcmd{set interface work-steal GigabitEthernet0/8/0 ordered}
+?*/
+/* *INDENT-OFF* */
+VLIB_CLI_COMMAND (set_interface_work_steal_command, static) = {
+  .path = "set interface work-steal",
+  .short_help = "set interface work-steal <interface-name> [ordered]"
+		" [min-vectors <n>] [disable]",
+  .function = set_interface_work_steal_command_fn,
+};
+/* *INDENT-ON* */
+
 clib_error_t *
 handoff_init (vlib_main_t * vm)
 {
@@ -346,6 +568,8 @@ handoff_init (vlib_main_t * vm)
     }
 
   hm->frame_queue_index = ~0;
+  hm->steal_index[0] = hm->steal_index[1] = ~0;
+  hm->steal_min_vectors = VLIB_FRAME_SIZE / 2;
 
   return 0;
 }
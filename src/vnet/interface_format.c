@@ -701,6 +701,12 @@ format_vnet_buffer_opaque2 (u8 * s, va_list * args)
 	      (u32) (o->gso_size), (u32) (o->gso_l4_hdr_sz));
   vec_add1 (s, '\n');
 
+  s = format (s, "flow_ctx.hash: %llx, l3_hdr_offset: %d, l4_hdr_offset: %d, "
+	      "protocol: %d", o->flow_ctx.hash,
+	      (i32) (o->flow_ctx.l3_hdr_offset),
+	      (i32) (o->flow_ctx.l4_hdr_offset), (u32) (o->flow_ctx.protocol));
+  vec_add1 (s, '\n');
+
   for (i = 0; i < vec_len (im->buffer_opaque2_format_helpers); i++)
     {
       helper_fp = im->buffer_opaque2_format_helpers[i];
@@ -757,7 +757,9 @@ out:
     }
 
   *async_pd = *pd;
+  /* pd2 shares opaque2 space with the flow context */
   *async_pd2 = *pd2;
+  b->flags &= ~VNET_BUFFER_F_FLOW_CTX_VALID;
 
   /* for AEAD integ_len - crypto_len will be negative, it is ok since it
    * is ignored by the engine. */
@@ -518,6 +518,40 @@ VLIB_CLI_COMMAND (show_bihash_command, static) =
 };
 /* *INDENT-ON* */
 
+/*
+ * Top up the free page reserves of the tables which ran low, see
+ * clib_bihash_set_reserve. A table whose writers split buckets faster
+ * than the reserve lasts between two runs falls back to allocating
+ * pages in the writer, as without a reserve.
+ */
+static uword
+bihash_refill_process (vlib_main_t * vm, vlib_node_runtime_t * rt,
+		       vlib_frame_t * f)
+{
+  clib_bihash_8_8_t *h;
+  int i;
+
+  while (1)
+    {
+      vlib_process_suspend (vm, 10e-3);
+
+      for (i = 0; i < vec_len (clib_all_bihashes); i++)
+	{
+	  h = (clib_bihash_8_8_t *) clib_all_bihashes[i];
+	  if (h->refill_pending && h->refill_fn)
+	    h->refill_fn (h);
+	}
+    }
+
+  return 0;
+}
+
+VLIB_REGISTER_NODE (bihash_refill_node, static) = {
+  .function = bihash_refill_process,
+  .type = VLIB_NODE_TYPE_PROCESS,
+  .name = "bihash-refill-process",
+};
+
 #ifdef CLIB_SANITIZE_ADDR
 /* default options for Address Sanitizer */
 const char *
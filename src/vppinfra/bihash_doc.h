@@ -139,7 +139,8 @@ void clib_bihash_free (clib_bihash *h);
  * @param h - the bi-hash table to search
  * @param add_v - the (key,value) pair to add
  * @param is_add - add=1 (BIHASH_ADD), delete=0 (BIHASH_DEL)
- * @returns 0 on success, < 0 on error
+ * @returns 0 on success, < 0 on error, -1 if a private heap or the
+ * arena of the table is exhausted
  * @note This function will replace an existing (key,value) pair if the
  * new key matches an existing key
  */
@@ -242,6 +243,17 @@ void clib_bihash_prefetch_bucket (clib_bihash * h, u64 hash);
  */
 void clib_bihash_prefetch_data (clib_bihash * h, u64 hash);
 
+/**
+ * Prefetch the bi-hash buckets of several hash codes
+ *
+ * @param h - the bi-hash table to search
+ * @param hashes - the hash codes
+ * @param n - number of hash codes
+ * @note keep n to a window a few packets ahead, prefetching a whole
+ * frame at once evicts the first buckets before they are used
+ */
+void clib_bihash_prefetch_buckets (clib_bihash * h, u64 * hashes, u32 n);
+
 /**
  * Search a bi-hash table
  *
@@ -254,6 +266,41 @@ void clib_bihash_prefetch_data (clib_bihash * h, u64 hash);
 int clib_bihash_search_inline_2
   (clib_bihash * h, clib_bihash_kv * search_key, clib_bihash_kv * valuep);
 
+/**
+ * Find a (key,value) pair, adding it if the key is not present
+ *
+ * @param h - the bi-hash table
+ * @param hash - the precomputed hash of the key
+ * @param add_v - (key,value) pair to search for, inserted on a miss
+ * @param is_new - set to 1 if add_v was inserted, 0 otherwise
+ * @returns pointer to the live (key,value) pair, 0 on error
+ * @note a hit costs one lock-free bucket walk, the value may be updated
+ * in place. The pointer is invalidated by the next add or delete, so this
+ * is only safe for tables with a single writer (e.g. per-thread tables)
+ */
+clib_bihash_kv *clib_bihash_search_or_add_with_hash (clib_bihash * h,
+						     u64 hash,
+						     clib_bihash_kv * add_v,
+						     int *is_new);
+
+/**
+ * Find-or-add a batch of (key,value) pairs with precomputed hashes
+ *
+ * @param h - the bi-hash table
+ * @param kvs - (key,value) pairs to search for, inserted on a miss
+ * @param hashes - precomputed hashes of the keys
+ * @param n - number of keys
+ * @param update_cb - called with the live (key,value) pair for kvs[i],
+ * its index i, whether it was just inserted, and ctx
+ * @param ctx - opaque argument passed to update_cb
+ * @returns number of (key,value) pairs inserted
+ * @note buckets and data are prefetched BIHASH_BATCH_PREFETCH_DISTANCE
+ * and BIHASH_BATCH_PREFETCH_DISTANCE / 2 keys ahead
+ */
+u32 clib_bihash_search_or_add_batch_with_hash (
+  clib_bihash *h, clib_bihash_kv *kvs, u64 *hashes, u32 n,
+  void (*update_cb) (clib_bihash_kv *, u32, int, void *), void *ctx);
+
 /**
  * Calback function for walking a bihash table
  *
@@ -276,6 +323,46 @@ void clib_bihash_foreach_key_value_pair (clib_bihash * h,
 					 clib_bihash_foreach_key_value_pair_cb
 					 * callback, void *arg);
 
+/**
+ * Visit the (key,value) pairs of a slice of the bucket array
+ *
+ * @param h - the bi-hash table
+ * @param cursor - first bucket to visit, advanced past the slice, 0 to
+ * start a walk
+ * @param n_buckets - number of buckets to visit
+ * @param callback - function to call with each active (key,value) pair,
+ * returning BIHASH_WALK_STOP ends the slice after the current bucket
+ * @param arg - arbitrary second argument passed to the callback function
+ * @returns 1 if buckets remain, 0 once the walk is complete
+ * @note each bucket is copied under its lock and the callback gets the
+ * copies, so a table can be walked while other threads update it, a
+ * slice at a time, e.g. to page through a dump
+ */
+int clib_bihash_foreach_key_value_pair_from (clib_bihash * h, u32 * cursor,
+					     u32 n_buckets,
+					     clib_bihash_foreach_key_value_pair_cb
+					     * callback, void *arg);
+
+/**
+ * Delete stale (key,value) pairs from a slice of the bucket array
+ *
+ * @param h - the bi-hash table
+ * @param cursor - first bucket to visit, advanced past the slice
+ * @param max_work - buckets plus entries to visit, at most one lap
+ * @param is_stale_cb - callback receiving a kv pair, returning 1 if it
+ * should be deleted. Every pair it returns 1 for is deleted, so it may
+ * release what the value refers to
+ * @param arg - opaque argument passed to is_stale_cb
+ * @returns number of (key,value) pairs deleted
+ * @note meant to be called with a small budget from the thread which
+ * owns the table, to age entries out without a separate walk. A bucket
+ * with more stale entries than one pass deletes is swept again, so a lap
+ * finishes whatever the number of buckets
+ */
+u32 clib_bihash_sweep (clib_bihash * h, u32 * cursor, u32 max_work,
+		       int (*is_stale_cb) (clib_bihash_kv *, void *),
+		       void *arg);
+
 /*
  * fd.io coding-style-patch-verification: ON
  *
@@ -27,6 +27,18 @@
 #define BIHASH_USE_HEAP 1
 #endif
 
+/*
+ * A private heap or an arena is the table's own budget: running out of it
+ * fails the add (see clib_bihash_add_del) rather than the process. Tables
+ * on the shared heap still take the process down with it.
+ */
+static inline void *BV (alloc_chunk) (BVT (clib_bihash) * h, uword nbytes)
+{
+  if (h->private_heap)
+    return clib_mem_alloc_aligned_or_null (nbytes, CLIB_CACHE_LINE_BYTES);
+  return clib_mem_alloc_aligned (nbytes, CLIB_CACHE_LINE_BYTES);
+}
+
 static inline void *BV (alloc_aligned) (BVT (clib_bihash) * h, uword nbytes)
 {
   uword rv;
@@ -56,9 +68,10 @@ static inline void *BV (alloc_aligned) (BVT (clib_bihash) * h, uword nbytes)
       if (nbytes >= chunk_sz)
 	{
 	  oldheap = clib_mem_set_heap (h->heap);
-	  chunk = clib_mem_alloc_aligned (nbytes + sizeof (*chunk),
-					  CLIB_CACHE_LINE_BYTES);
+	  chunk = BV (alloc_chunk) (h, nbytes + sizeof (*chunk));
 	  clib_mem_set_heap (oldheap);
+	  if (chunk == 0)
+	    return 0;
 	  clib_memset_u8 (chunk, 0, sizeof (*chunk));
 	  chunk->size = nbytes;
 	  rv = (u8 *) (chunk + 1);
@@ -78,9 +91,10 @@ static inline void *BV (alloc_aligned) (BVT (clib_bihash) * h, uword nbytes)
 	}
 
       oldheap = clib_mem_set_heap (h->heap);
-      chunk = clib_mem_alloc_aligned (chunk_sz + sizeof (*chunk),
-				      CLIB_CACHE_LINE_BYTES);
+      chunk = BV (alloc_chunk) (h, chunk_sz + sizeof (*chunk));
       clib_mem_set_heap (oldheap);
+      if (chunk == 0)
+	return 0;
       chunk->size = chunk_sz;
       chunk->bytes_left = chunk_sz;
       chunk->next_alloc = (u8 *) (chunk + 1);
@@ -99,7 +113,10 @@ static inline void *BV (alloc_aligned) (BVT (clib_bihash) * h, uword nbytes)
   alloc_arena_next (h) += nbytes;
 
   if (alloc_arena_next (h) > alloc_arena_size (h))
-    os_out_of_memory ();
+    {
+      alloc_arena_next (h) = rv;
+      return 0;
+    }
 
   if (alloc_arena_next (h) > alloc_arena_mapped (h))
     {
@@ -125,7 +142,10 @@ static inline void *BV (alloc_aligned) (BVT (clib_bihash) * h, uword nbytes)
 	rv = mmap (base, alloc, PROT_READ | PROT_WRITE, mmap_flags, -1, 0);
 
       if (rv == MAP_FAILED)
-	os_out_of_memory ();
+	{
+	  alloc_arena_next (h) -= nbytes;
+	  return 0;
+	}
 
       alloc_arena_mapped (h) += alloc;
     }
@@ -133,13 +153,58 @@ static inline void *BV (alloc_aligned) (BVT (clib_bihash) * h, uword nbytes)
   return (void *) (uword) (rv + alloc_arena (h));
 }
 
+static void *BV (clib_bihash_create_heap) (BVT (clib_bihash) * h)
+{
+  clib_mem_page_sz_t log2_page_sz = h->log2_page_sz;
+  void *base = CLIB_MEM_VM_MAP_FAILED;
+  void *heap;
+
+  /*
+   * Hugepages are faulted in by the map, under the thread's policy.
+   * Default pages fault in later, from whichever thread touches them
+   * first, so the range gets a policy of its own.
+   */
+  if (log2_page_sz != CLIB_MEM_PAGE_SZ_UNKNOWN &&
+      log2_page_sz != CLIB_MEM_PAGE_SZ_DEFAULT &&
+      log2_page_sz != clib_mem_get_log2_page_size ())
+    {
+      if (h->numa_node != BIHASH_NUMA_ANY)
+	clib_mem_set_numa_affinity (h->numa_node, 1 /* force */);
+      base = clib_mem_vm_map (0, h->memory_size, log2_page_sz, "%s",
+			      h->name);
+      if (h->numa_node != BIHASH_NUMA_ANY)
+	clib_mem_set_default_numa_affinity ();
+      if (base == CLIB_MEM_VM_MAP_FAILED)
+	clib_warning ("%s: not enough %U pages, using default pages",
+		      h->name, format_log2_page_size, log2_page_sz);
+    }
+
+  if (base == CLIB_MEM_VM_MAP_FAILED)
+    {
+      base = clib_mem_vm_map (0, h->memory_size, CLIB_MEM_PAGE_SZ_DEFAULT,
+			      "%s", h->name);
+      if (base == CLIB_MEM_VM_MAP_FAILED)
+	os_out_of_memory ();
+      if (h->numa_node != BIHASH_NUMA_ANY)
+	clib_mem_vm_set_numa_affinity (base, h->memory_size, h->numa_node);
+      h->log2_page_sz = clib_mem_get_log2_page_size ();
+    }
+
+  heap = clib_mem_create_heap (base, h->memory_size, 1 /* is_locked */ ,
+			       "%s", h->name);
+  if (heap == 0)
+    os_out_of_memory ();
+  return heap;
+}
+
 static void BV (clib_bihash_instantiate) (BVT (clib_bihash) * h)
 {
   uword bucket_size;
 
   if (BIHASH_USE_HEAP)
     {
-      h->heap = clib_mem_get_heap ();
+      h->heap = h->private_heap ? BV (clib_bihash_create_heap) (h) :
+	clib_mem_get_heap ();
       h->chunks = 0;
       alloc_arena (h) = (uword) clib_mem_get_heap_base (h->heap);
     }
@@ -161,6 +226,8 @@ static void BV (clib_bihash_instantiate) (BVT (clib_bihash) * h)
       h->nbuckets * BIHASH_KVP_PER_PAGE * sizeof (BVT (clib_bihash_kv));
 
   h->buckets = BV (alloc_aligned) (h, bucket_size);
+  if (h->buckets == 0)
+    os_out_of_memory ();
   clib_memset_u8 (h->buckets, 0, bucket_size);
 
   if (BIHASH_KVP_AT_BUCKET_LEVEL)
@@ -188,6 +255,8 @@ static void BV (clib_bihash_instantiate) (BVT (clib_bihash) * h)
 			 sizeof (BVT (clib_bihash_kv))));
 	}
     }
+  /* Reserves set before a lazy instantiation */
+  h->refill_pending = vec_len (h->reserve) != 0;
   CLIB_MEMORY_STORE_BARRIER ();
   h->instantiated = 1;
 }
@@ -203,11 +272,15 @@ void BV (clib_bihash_init2) (BVT (clib_bihash_init2_args) * a)
   h->name = (u8 *) a->name;
   h->nbuckets = a->nbuckets;
   h->log2_nbuckets = max_log2 (a->nbuckets);
-  h->memory_size = BIHASH_USE_HEAP ? 0 : a->memory_size;
+  h->private_heap = BIHASH_USE_HEAP && a->private_heap;
+  h->memory_size = BIHASH_USE_HEAP && !h->private_heap ? 0 : a->memory_size;
+  h->numa_node = a->numa_node;
+  h->log2_page_sz = a->log2_page_sz;
   h->instantiated = 0;
   h->dont_add_to_all_bihash_list = a->dont_add_to_all_bihash_list;
   h->fmt_fn = BV (format_bihash);
   h->kvp_fmt_fn = a->kvp_fmt_fn;
+  h->refill_fn = (uword (*) (void *)) BV (clib_bihash_refill);
 
   alloc_arena (h) = 0;
 
@@ -320,6 +393,8 @@ void BV (clib_bihash_initiator_init_svm)
 
   bucket_size = nbuckets * sizeof (h->buckets[0]);
   h->buckets = BV (alloc_aligned) (h, bucket_size);
+  if (h->buckets == 0)
+    os_out_of_memory ();
   clib_memset_u8 (h->buckets, 0, bucket_size);
   h->sh->buckets_as_u64 = (u64) BV (clib_bihash_get_offset) (h, h->buckets);
 
@@ -413,7 +488,14 @@ void BV (clib_bihash_free) (BVT (clib_bihash) * h)
 
   h->instantiated = 0;
 
-  if (BIHASH_USE_HEAP)
+  if (BIHASH_USE_HEAP && h->private_heap)
+    {
+      void *base = clib_mem_get_heap_base (h->heap);
+
+      clib_mem_destroy_heap (h->heap);
+      clib_mem_vm_unmap (base);
+    }
+  else if (BIHASH_USE_HEAP)
     {
       BVT (clib_bihash_alloc_chunk) * next, *chunk;
       void *oldheap = clib_mem_set_heap (h->heap);
@@ -441,6 +523,8 @@ void BV (clib_bihash_free) (BVT (clib_bihash) * h)
     clib_mem_vm_free ((void *) (uword) (alloc_arena (h)),
 		      alloc_arena_size (h));
 never_initialized:
+  vec_free (h->n_free);
+  vec_free (h->reserve);
   if (h->dont_add_to_all_bihash_list)
     {
       clib_memset_u8 (h, 0, sizeof (*h));
@@ -476,11 +560,27 @@ BV (value_alloc) (BVT (clib_bihash) * h, u32 log2_pages)
     {
       vec_validate_init_empty (h->freelists, log2_pages, 0);
       rv = BV (alloc_aligned) (h, (sizeof (*rv) * (1 << log2_pages)));
+      if (rv == 0)
+	return 0;
+      if (log2_pages < vec_len (h->reserve) && h->reserve[log2_pages])
+	{
+	  h->n_reserve_misses++;
+	  h->refill_pending = 1;
+	}
       goto initialize;
     }
   rv = BV (clib_bihash_get_value) (h, (uword) h->freelists[log2_pages]);
   h->freelists[log2_pages] = rv->next_free_as_u64;
 
+  if (log2_pages < vec_len (h->n_free))
+    {
+      /* Free lists may hold pages from before the reserve was set */
+      if (h->n_free[log2_pages])
+	h->n_free[log2_pages]--;
+      if (h->n_free[log2_pages] < h->reserve[log2_pages])
+	h->refill_pending = 1;
+    }
+
 initialize:
   ASSERT (rv);
 
@@ -530,9 +630,95 @@ BV (value_free) (BVT (clib_bihash) * h, BVT (clib_bihash_value) * v,
 
   v->next_free_as_u64 = (u64) h->freelists[log2_pages];
   h->freelists[log2_pages] = (u64) BV (clib_bihash_get_offset) (h, v);
+  if (log2_pages < vec_len (h->n_free))
+    h->n_free[log2_pages]++;
+}
+
+/**
+ * Keep n free page groups of 1 << log2_pages pages at hand, so that bucket
+ * splits pop a free list rather than allocate and fault in fresh memory
+ * under the bucket lock. clib_bihash_refill tops the free lists up; vpp
+ * calls it from a process for the tables on clib_all_bihashes which ran
+ * low, the owners of other tables have to call it themselves.
+ */
+void BV (clib_bihash_set_reserve) (BVT (clib_bihash) * h, u32 log2_pages,
+				   u32 n)
+{
+#if BIHASH_32_64_SVM
+  /* Shared free lists don't grow */
+  return;
+#else
+  /* Chunk sized allocations go back to the heap when freed */
+  ASSERT (!BIHASH_USE_HEAP || log2_pages < BIIHASH_MIN_ALLOC_LOG2_PAGES);
+
+  BV (clib_bihash_alloc_lock) (h);
+  vec_validate_init_empty (h->freelists, log2_pages, 0);
+  vec_validate (h->n_free, log2_pages);
+  vec_validate (h->reserve, log2_pages);
+  h->reserve[log2_pages] = n;
+  h->refill_pending = h->instantiated != 0;
+  BV (clib_bihash_alloc_unlock) (h);
+#endif
+}
+
+#define BIHASH_REFILL_BATCH 64
+
+/**
+ * Top the free lists up to their reserve, returns the number of page
+ * groups added. Page groups are allocated a batch at a time under the
+ * alloc lock, and faulted in outside of it, so that writers never wait
+ * longer than a batch of allocations.
+ */
+uword BV (clib_bihash_refill) (BVT (clib_bihash) * h)
+{
+  BVT (clib_bihash_value) * batch[BIHASH_REFILL_BATCH];
+  uword n_added = 0, bytes;
+  u32 log2_pages, i, n;
+  int out_of_memory = 0;
+
+  if (h->instantiated == 0)
+    return 0;
+
+  h->refill_pending = 0;
+
+  for (log2_pages = 0; log2_pages < vec_len (h->reserve) && !out_of_memory;
+       log2_pages++)
+    {
+      bytes = sizeof (BVT (clib_bihash_value)) << log2_pages;
+      while (!out_of_memory)
+	{
+	  BV (clib_bihash_alloc_lock) (h);
+	  n = h->reserve[log2_pages] - clib_min (h->n_free[log2_pages],
+						 h->reserve[log2_pages]);
+	  n = clib_min (n, BIHASH_REFILL_BATCH);
+	  for (i = 0; i < n; i++)
+	    if ((batch[i] = BV (alloc_aligned) (h, bytes)) == 0)
+	      break;
+	  BV (clib_bihash_alloc_unlock) (h);
+
+	  /* Out of memory: keep what we got, adds will fail soon enough */
+	  out_of_memory = i < n;
+	  n = i;
+
+	  if (n == 0)
+	    break;
+
+	  /* No one else sees them yet */
+	  for (i = 0; i < n; i++)
+	    clib_memset_u8 (batch[i], 0, bytes);
+
+	  BV (clib_bihash_alloc_lock) (h);
+	  for (i = 0; i < n; i++)
+	    BV (value_free) (h, batch[i], log2_pages);
+	  BV (clib_bihash_alloc_unlock) (h);
+	  n_added += n;
+	}
+    }
+
+  return n_added;
 }
 
-static inline void
+static inline int
 BV (make_working_copy) (BVT (clib_bihash) * h, BVT (clib_bihash_bucket) * b)
 {
   BVT (clib_bihash_value) * v;
@@ -568,6 +754,8 @@ BV (make_working_copy) (BVT (clib_bihash) * h, BVT (clib_bihash_bucket) * b)
        */
       working_copy = BV (alloc_aligned)
 	(h, sizeof (working_copy[0]) * (1 << b->log2_pages));
+      if (working_copy == 0)
+	return -1;
       h->working_copy_lengths[thread_index] = b->log2_pages;
       h->working_copies[thread_index] = working_copy;
 
@@ -583,6 +771,7 @@ BV (make_working_copy) (BVT (clib_bihash) * h, BVT (clib_bihash_bucket) * b)
   CLIB_MEMORY_STORE_BARRIER ();
   b->as_u64 = working_bucket.as_u64;
   h->working_copies[thread_index] = working_copy;
+  return 0;
 }
 
 static
@@ -598,6 +787,8 @@ BV (split_and_rehash)
   ASSERT (h->alloc_lock[0]);
 
   new_values = BV (value_alloc) (h, new_log2_pages);
+  if (new_values == 0)
+    return 0;
   length_in_kvs = (1 << old_log2_pages) * BIHASH_KVP_PER_PAGE;
 
   for (i = 0; i < length_in_kvs; i++)
@@ -646,6 +837,8 @@ BV (split_and_rehash_linear)
   ASSERT (h->alloc_lock[0]);
 
   new_values = BV (value_alloc) (h, new_log2_pages);
+  if (new_values == 0)
+    return 0;
   new_length = (1 << new_log2_pages) * BIHASH_KVP_PER_PAGE;
   old_length = (1 << old_log2_pages) * BIHASH_KVP_PER_PAGE;
 
@@ -744,6 +937,12 @@ static_always_inline int BV (clib_bihash_add_del_inline_with_hash) (
       v = BV (value_alloc) (h, 0);
       BV (clib_bihash_alloc_unlock) (h);
 
+      if (PREDICT_FALSE (v == 0))
+	{
+	  BV (clib_bihash_unlock_bucket) (b);
+	  return (-1);
+	}
+
       *v->kvp = *add_v;
       tmp_b.as_u64 = 0;		/* clears bucket lock */
       tmp_b.offset = BV (clib_bihash_get_offset) (h, v);
@@ -913,7 +1112,12 @@ static_always_inline int BV (clib_bihash_add_del_inline_with_hash) (
 
   /* Move readers to a (locked) temp copy of the bucket */
   BV (clib_bihash_alloc_lock) (h);
-  BV (make_working_copy) (h, b);
+  if (PREDICT_FALSE (BV (make_working_copy) (h, b) != 0))
+    {
+      BV (clib_bihash_alloc_unlock) (h);
+      BV (clib_bihash_unlock_bucket) (b);
+      return (-1);
+    }
 
   v = BV (clib_bihash_get_value) (h, h->saved_bucket.offset);
 
@@ -945,6 +1149,8 @@ static_always_inline int BV (clib_bihash_add_del_inline_with_hash) (
 	  new_v =
 	    BV (split_and_rehash_linear) (h, working_copy, old_log2_pages,
 					  new_log2_pages);
+	  if (PREDICT_FALSE (new_v == 0))
+	    goto out_of_memory;
 	  mark_bucket_linear = 1;
 	  BV (clib_bihash_increment_stat) (h, BIHASH_STAT_linear, 1);
 	}
@@ -1012,6 +1218,15 @@ expand_ok:
 
   BV (clib_bihash_alloc_unlock) (h);
   return (0);
+
+out_of_memory:
+  /* Point readers back at the original pages, which are untouched */
+  tmp_b.as_u64 = h->saved_bucket.as_u64;
+  tmp_b.lock = 0;
+  CLIB_MEMORY_STORE_BARRIER ();
+  b->as_u64 = tmp_b.as_u64;
+  BV (clib_bihash_alloc_unlock) (h);
+  return (-1);
 }
 
 static_always_inline int BV (clib_bihash_add_del_inline)
@@ -1150,9 +1365,15 @@ u8 *BV (format_bihash) (u8 * s, va_list * args)
 	  free_elt_as_u64 = free_elt->next_free_as_u64;
 	}
 
-      if (nfree || verbose)
+      if (i < vec_len (h->reserve) && h->reserve[i])
+	s = format (s, "       [len %d] %u free elts, reserve %u\n", 1 << i,
+		    nfree, h->reserve[i]);
+      else if (nfree || verbose)
 	s = format (s, "       [len %d] %u free elts\n", 1 << i, nfree);
     }
+  if (vec_len (h->reserve))
+    s = format (s, "    %llu allocs missed the reserve\n",
+		h->n_reserve_misses);
 
   s = format (s, "    %lld linear search buckets\n", linear_buckets);
   if (BIHASH_USE_HEAP)
@@ -1172,6 +1393,14 @@ u8 *BV (format_bihash) (u8 * s, va_list * args)
 		  "          bytes: used %U, scrap %U\n", n_chunks,
 		  format_memory_size, total_size,
 		  format_memory_size, bytes_left);
+      if (h->private_heap && h->numa_node == BIHASH_NUMA_ANY)
+	s = format (s, "    private heap: %U, any numa, %U pages\n",
+		    format_memory_size, h->memory_size,
+		    format_log2_page_size, h->log2_page_sz);
+      else if (h->private_heap)
+	s = format (s, "    private heap: %U, numa %u, %U pages\n",
+		    format_memory_size, h->memory_size, h->numa_node,
+		    format_log2_page_size, h->log2_page_sz);
     }
   else
     {
@@ -1229,6 +1458,136 @@ void BV (clib_bihash_foreach_key_value_pair)
     }
 }
 
+int BV (clib_bihash_foreach_key_value_pair_from)
+  (BVT (clib_bihash) * h, u32 * cursor, u32 n_buckets,
+   BV (clib_bihash_foreach_key_value_pair_cb) cb, void *arg)
+{
+  BVT (clib_bihash_kv) * kvs = 0;
+  BVT (clib_bihash_bucket) * b;
+  BVT (clib_bihash_value) * v;
+  u32 i, j, k, bucket_index;
+  int rv = BIHASH_WALK_CONTINUE;
+
+#if BIHASH_LAZY_INSTANTIATE
+  if (PREDICT_FALSE (h->instantiated == 0))
+    {
+      *cursor = 0;
+      return 0;
+    }
+#endif
+
+  bucket_index = *cursor;
+
+  for (i = 0; i < n_buckets && bucket_index < h->nbuckets; i++)
+    {
+      b = BV (clib_bihash_get_bucket) (h, bucket_index++);
+      if (BV (clib_bihash_bucket_is_empty) (b))
+	continue;
+
+      /*
+       * Copy the bucket under its lock, so writers on other threads
+       * never show us a half-split bucket, and call back unlocked.
+       */
+      vec_reset_length (kvs);
+      BV (clib_bihash_lock_bucket) (b);
+      if (!BV (clib_bihash_bucket_is_empty) (b))
+	{
+	  v = BV (clib_bihash_get_value) (h, b->offset);
+	  for (j = 0; j < (1 << b->log2_pages); j++)
+	    {
+	      for (k = 0; k < BIHASH_KVP_PER_PAGE; k++)
+		if (!BV (clib_bihash_is_free) (&v->kvp[k]))
+		  vec_add1 (kvs, v->kvp[k]);
+	      v++;
+	    }
+	}
+      BV (clib_bihash_unlock_bucket) (b);
+
+      for (j = 0; j < vec_len (kvs) && rv == BIHASH_WALK_CONTINUE; j++)
+	rv = cb (&kvs[j], arg);
+      if (rv == BIHASH_WALK_STOP)
+	break;
+    }
+
+  vec_free (kvs);
+
+  if (bucket_index >= h->nbuckets)
+    {
+      *cursor = 0;
+      return 0;
+    }
+  *cursor = bucket_index;
+  return 1;
+}
+
+#ifndef BIHASH_SWEEP_MAX_STALE
+#define BIHASH_SWEEP_MAX_STALE 64
+#endif
+
+u32 BV (clib_bihash_sweep)
+  (BVT (clib_bihash) * h, u32 * cursor, u32 max_work,
+   int (*is_stale_cb) (BVT (clib_bihash_kv) *, void *), void *arg)
+{
+  BVT (clib_bihash_kv) stale[BIHASH_SWEEP_MAX_STALE];
+  BVT (clib_bihash_bucket) * b;
+  BVT (clib_bihash_value) * v;
+  u32 j, k, n_stale, n_deleted = 0, work = 0, n_visited = 0;
+  u32 bucket_index;
+  int full;
+
+#if BIHASH_LAZY_INSTANTIATE
+  if (PREDICT_FALSE (h->instantiated == 0))
+    return 0;
+#endif
+
+  bucket_index = *cursor & (h->nbuckets - 1);
+
+  /* Each bucket and each entry visited is a unit of work */
+  while (work < max_work && n_visited < h->nbuckets)
+    {
+      b = BV (clib_bihash_get_bucket) (h, bucket_index);
+      work++;
+
+      /*
+       * Collect first: a delete may free or shrink the bucket's pages.
+       * Entries past the limit are not even offered to is_stale_cb, the
+       * bucket is swept again once those collected are gone.
+       */
+      n_stale = 0;
+      full = 0;
+      if (!BV (clib_bihash_bucket_is_empty) (b))
+	{
+	  v = BV (clib_bihash_get_value) (h, b->offset);
+	  for (j = 0; j < (1 << b->log2_pages) && !full; j++, v++)
+	    for (k = 0; k < BIHASH_KVP_PER_PAGE; k++)
+	      {
+		if (BV (clib_bihash_is_free) (&v->kvp[k]))
+		  continue;
+		work++;
+		if (n_stale == BIHASH_SWEEP_MAX_STALE)
+		  {
+		    full = 1;
+		    break;
+		  }
+		if (is_stale_cb (&v->kvp[k], arg))
+		  stale[n_stale++] = v->kvp[k];
+	      }
+	}
+
+      for (j = 0; j < n_stale; j++)
+	n_deleted += BV (clib_bihash_add_del) (h, &stale[j], 0) == 0;
+
+      if (!full)
+	{
+	  bucket_index = (bucket_index + 1) & (h->nbuckets - 1);
+	  n_visited++;
+	}
+    }
+
+  *cursor = bucket_index;
+  return n_deleted;
+}
+
 /** @endcond */
 
 /*
@@ -161,6 +161,17 @@ BVS (clib_bihash)
 
   u64 *freelists;
 
+  /*
+   * Free page groups by log2_pages, and how many of them to keep at
+   * hand, see clib_bihash_set_reserve. Ahead of sh, so that walkers of
+   * clib_all_bihashes find them whatever the flavour.
+   */
+  u32 *n_free;
+  u32 *reserve;
+  u64 n_reserve_misses;
+  volatile u8 refill_pending;
+  uword (*refill_fn) (void *h);
+
 #if BIHASH_32_64_SVM
   BVT (clib_bihash_shared_header) * sh;
   int memfd;
@@ -172,6 +183,11 @@ BVS (clib_bihash)
   volatile u8 instantiated;
   u8 dont_add_to_all_bihash_list;
 
+  /* Heap of its own, see clib_bihash_init2_args */
+  u8 private_heap;
+  u8 numa_node;
+  clib_mem_page_sz_t log2_page_sz;
+
   /**
     * A custom format function to print the Key and Value of bihash_key instead of default hexdump
     */
@@ -196,8 +212,25 @@ typedef struct
   format_function_t *kvp_fmt_fn;
   u8 instantiate_immediately;
   u8 dont_add_to_all_bihash_list;
+
+  /*
+   * BIHASH_USE_HEAP tables only: allocate from a heap of memory_size
+   * bytes of log2_page_sz pages (default pages if 0), placed on
+   * numa_node (anywhere if BIHASH_NUMA_ANY), rather than from the
+   * current heap. Hugepages are faulted
+   * in and locked up front, and the table falls back to default pages
+   * if there aren't enough of them. Adds fail once the heap is full.
+   */
+  u8 private_heap;
+  u8 numa_node;
+  clib_mem_page_sz_t log2_page_sz;
 } BVT (clib_bihash_init2_args);
 
+#ifndef BIHASH_NUMA_ANY
+/* Private heap numa_node for no placement preference */
+#define BIHASH_NUMA_ANY 0xff
+#endif
+
 extern void **clib_all_bihashes;
 
 #if BIHASH_32_64_SVM
@@ -354,6 +387,10 @@ void BV (clib_bihash_set_kvp_format_fn) (BVT (clib_bihash) * h,
 
 void BV (clib_bihash_free) (BVT (clib_bihash) * h);
 
+void BV (clib_bihash_set_reserve) (BVT (clib_bihash) * h, u32 log2_pages,
+				   u32 n);
+uword BV (clib_bihash_refill) (BVT (clib_bihash) * h);
+
 int BV (clib_bihash_add_del) (BVT (clib_bihash) * h,
 			      BVT (clib_bihash_kv) * add_v, int is_add);
 
@@ -385,6 +422,15 @@ void BV (clib_bihash_foreach_key_value_pair) (BVT (clib_bihash) * h,
 					      BV
 					      (clib_bihash_foreach_key_value_pair_cb)
 					      cb, void *arg);
+int BV (clib_bihash_foreach_key_value_pair_from) (BVT (clib_bihash) * h,
+						  u32 * cursor, u32 n_buckets,
+						  BV
+						  (clib_bihash_foreach_key_value_pair_cb)
+						  cb, void *arg);
+u32 BV (clib_bihash_sweep) (BVT (clib_bihash) * h, u32 * cursor,
+			    u32 max_work,
+			    int (*is_stale_cb) (BVT (clib_bihash_kv) *,
+						void *), void *arg);
 void *clib_all_bihash_set_heap (void);
 void clib_bihash_copied (void *dst, void *src);
 
@@ -509,6 +555,19 @@ static inline void BV (clib_bihash_prefetch_data)
 		 LOAD);
 }
 
+/*
+ * Prefetch the buckets of n precomputed hashes, e.g. a window of those
+ * produced for a whole frame by clib_flow_key_crc32c.
+ */
+static inline void BV (clib_bihash_prefetch_buckets)
+  (BVT (clib_bihash) * h, u64 * hashes, u32 n)
+{
+  u32 i;
+
+  for (i = 0; i < n; i++)
+    BV (clib_bihash_prefetch_bucket) (h, hashes[i]);
+}
+
 static inline int BV (clib_bihash_search_inline_2_with_hash)
   (BVT (clib_bihash) * h,
    u64 hash, BVT (clib_bihash_kv) * search_key, BVT (clib_bihash_kv) * valuep)
@@ -583,6 +642,190 @@ static inline int BV (clib_bihash_search_inline_2)
 						     valuep);
 }
 
+/*
+ * Return a pointer to the live key/value pair matching search_key,
+ * or 0 if the key is not in the table.
+ */
+static inline BVT (clib_bihash_kv) *
+  BV (clib_bihash_get_kvp_with_hash) (BVT (clib_bihash) * h, u64 hash,
+				      BVT (clib_bihash_kv) * search_key)
+{
+  BVT (clib_bihash_value) * v;
+  BVT (clib_bihash_bucket) * b;
+  int i, limit;
+
+  /* *INDENT-OFF* */
+  static const BVT (clib_bihash_bucket) mask = {
+    .linear_search = 1,
+    .log2_pages = -1
+  };
+  /* *INDENT-ON* */
+
+#if BIHASH_LAZY_INSTANTIATE
+  if (PREDICT_FALSE (h->instantiated == 0))
+    return 0;
+#endif
+
+  b = BV (clib_bihash_get_bucket) (h, hash);
+
+  if (PREDICT_FALSE (BV (clib_bihash_bucket_is_empty) (b)))
+    return 0;
+
+  if (PREDICT_FALSE (b->lock))
+    {
+      volatile BVT (clib_bihash_bucket) * bv = b;
+      while (bv->lock)
+	CLIB_PAUSE ();
+    }
+
+  v = BV (clib_bihash_get_value) (h, b->offset);
+
+  /* If the bucket has unresolvable collisions, use linear search */
+  limit = BIHASH_KVP_PER_PAGE;
+
+  if (PREDICT_FALSE (b->as_u64 & mask.as_u64))
+    {
+      if (PREDICT_FALSE (b->linear_search))
+	limit <<= b->log2_pages;
+      else
+	v += extract_bits (hash, h->log2_nbuckets, b->log2_pages);
+    }
+
+  for (i = 0; i < limit; i++)
+    {
+      if (BV (clib_bihash_key_compare) (v->kvp[i].key, search_key->key))
+	{
+	  if (BV (clib_bihash_is_free) (&v->kvp[i]))
+	    return 0;
+	  return &v->kvp[i];
+	}
+    }
+  return 0;
+}
+
+/*
+ * Find-or-insert. Returns a pointer to the live key/value pair for
+ * add_v->key, inserting add_v first if the key is not present. *is_new
+ * is set to 1 when the entry was inserted by this call.
+ *
+ * Existing keys cost a single lock-free bucket walk, so callers can
+ * update the value in place (e.g. bump a counter). The pointer is only
+ * valid until the next add or delete on the table: this is meant for
+ * tables with a single writer, such as per-thread flow tables.
+ */
+static inline BVT (clib_bihash_kv) *
+  BV (clib_bihash_search_or_add_with_hash) (BVT (clib_bihash) * h, u64 hash,
+					    BVT (clib_bihash_kv) * add_v,
+					    int *is_new)
+{
+  BVT (clib_bihash_kv) * kvp;
+
+  kvp = BV (clib_bihash_get_kvp_with_hash) (h, hash, add_v);
+  if (PREDICT_TRUE (kvp != 0))
+    {
+      *is_new = 0;
+      return kvp;
+    }
+
+  /* Add, but don't overwrite: -2 means somebody else beat us to it */
+  *is_new = BV (clib_bihash_add_del_with_hash) (h, add_v, hash, 2) == 0;
+
+  return BV (clib_bihash_get_kvp_with_hash) (h, hash, add_v);
+}
+
+static inline BVT (clib_bihash_kv) *
+  BV (clib_bihash_search_or_add) (BVT (clib_bihash) * h,
+				  BVT (clib_bihash_kv) * add_v, int *is_new)
+{
+  u64 hash;
+
+  hash = BV (clib_bihash_hash) (add_v);
+
+  return BV (clib_bihash_search_or_add_with_hash) (h, hash, add_v, is_new);
+}
+
+#ifndef BIHASH_BATCH_PREFETCH_DISTANCE
+#define BIHASH_BATCH_PREFETCH_DISTANCE 8
+#endif
+
+/*
+ * Batched find-or-insert over n keys with precomputed hashes.
+ * Buckets are prefetched BIHASH_BATCH_PREFETCH_DISTANCE keys ahead and
+ * key/value pages half that distance ahead. update_cb is called with the
+ * live key/value pair for kvs[i] right away, since a later insert in the
+ * same batch may move it. Returns the number of new entries.
+ */
+static inline u32
+  BV (clib_bihash_search_or_add_batch_with_hash) (
+    BVT (clib_bihash) * h, BVT (clib_bihash_kv) * kvs, u64 *hashes, u32 n,
+    void (*update_cb) (BVT (clib_bihash_kv) *, u32, int, void *), void *ctx)
+{
+  const u32 bucket_dist = BIHASH_BATCH_PREFETCH_DISTANCE;
+  const u32 data_dist = BIHASH_BATCH_PREFETCH_DISTANCE / 2;
+  BVT (clib_bihash_kv) * kvp;
+  u32 i, n_new = 0;
+  int is_new;
+
+  for (i = 0; i < clib_min (n, bucket_dist); i++)
+    BV (clib_bihash_prefetch_bucket) (h, hashes[i]);
+  for (i = 0; i < clib_min (n, data_dist); i++)
+    BV (clib_bihash_prefetch_data) (h, hashes[i]);
+
+  for (i = 0; i < n; i++)
+    {
+      if (i + bucket_dist < n)
+	BV (clib_bihash_prefetch_bucket) (h, hashes[i + bucket_dist]);
+      if (i + data_dist < n)
+	BV (clib_bihash_prefetch_data) (h, hashes[i + data_dist]);
+
+      kvp = BV (clib_bihash_search_or_add_with_hash) (h, hashes[i], &kvs[i],
+						      &is_new);
+      if (PREDICT_TRUE (kvp != 0))
+	update_cb (kvp, i, is_new, ctx);
+      n_new += is_new;
+    }
+
+  return n_new;
+}
+
+/*
+ * Batched lookup of n keys with precomputed hashes, e.g. those of a
+ * frame from clib_flow_key_crc32c, prefetched like the batched
+ * find-or-insert above so that the n lookups overlap their misses.
+ * results[i] gets the key/value pair of keys[i], or is marked free (see
+ * clib_bihash_is_free) if keys[i] is not in the table; keys and results
+ * may be the same array. Returns the number of keys found.
+ */
+static inline u32
+  BV (clib_bihash_search_batch) (BVT (clib_bihash) * h,
+				 BVT (clib_bihash_kv) * keys, u64 *hashes,
+				 u32 n, BVT (clib_bihash_kv) * results)
+{
+  const u32 bucket_dist = BIHASH_BATCH_PREFETCH_DISTANCE;
+  const u32 data_dist = BIHASH_BATCH_PREFETCH_DISTANCE / 2;
+  u32 i, n_found = 0;
+
+  for (i = 0; i < clib_min (n, bucket_dist); i++)
+    BV (clib_bihash_prefetch_bucket) (h, hashes[i]);
+  for (i = 0; i < clib_min (n, data_dist); i++)
+    BV (clib_bihash_prefetch_data) (h, hashes[i]);
+
+  for (i = 0; i < n; i++)
+    {
+      if (i + bucket_dist < n)
+	BV (clib_bihash_prefetch_bucket) (h, hashes[i + bucket_dist]);
+      if (i + data_dist < n)
+	BV (clib_bihash_prefetch_data) (h, hashes[i + data_dist]);
+
+      if (BV (clib_bihash_search_inline_2_with_hash) (h, hashes[i], &keys[i],
+						      &results[i]) == 0)
+	n_found++;
+      else
+	BV (clib_bihash_mark_free) (&results[i]);
+    }
+
+  return n_found;
+}
 
 #endif /* __included_bihash_template_h__ */
 
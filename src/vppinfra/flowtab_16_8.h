@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#undef FLOWTAB_TYPE
+#undef FLOWTAB_KEY_U64S
+#undef FLOWTAB_VALUE_T
+#undef FLOWTAB_SLOTS
+
+#define FLOWTAB_TYPE _16_8
+#define FLOWTAB_KEY_U64S 2
+#define FLOWTAB_VALUE_T u64
+#define FLOWTAB_SLOTS 5
+
+#ifndef __included_flowtab_16_8_h__
+#define __included_flowtab_16_8_h__
+
+#include <vppinfra/xxhash.h>
+#include <vppinfra/crc32.h>
+
+typedef struct
+{
+  u64 key[2];
+  u64 value;
+} clib_flowtab_kv_16_8_t;
+
+static inline u64
+clib_flowtab_hash_16_8 (clib_flowtab_kv_16_8_t * v)
+{
+#ifdef clib_crc32c_uses_intrinsics
+  /* Tags are the top byte, spread the 32 bit CRC over all 64 */
+  return clib_crc32c ((u8 *) v->key, 16) * 0x9e3779b97f4a7c15ULL;
+#else
+  u64 tmp = v->key[0] ^ v->key[1];
+  return clib_xxhash (tmp);
+#endif
+}
+
+static inline int
+clib_flowtab_key_compare_16_8 (u64 * a, u64 * b)
+{
+  return ((a[0] ^ b[0]) | (a[1] ^ b[1])) == 0;
+}
+
+#undef __included_flowtab_template_h__
+#include <vppinfra/flowtab_template.h>
+
+#endif /* __included_flowtab_16_8_h__ */
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
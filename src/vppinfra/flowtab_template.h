@@ -0,0 +1,594 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Note: to instantiate the template multiple times in a single file,
+ * #undef __included_flowtab_template_h__...
+ */
+#ifndef __included_flowtab_template_h__
+#define __included_flowtab_template_h__
+
+#include <vppinfra/format.h>
+#include <vppinfra/cache.h>
+#include <vppinfra/mem.h>
+
+/**
+ * Compact fixed-key flow table, for per-thread flow counters.
+ *
+ * A partial-key cuckoo hash: each key lives in one of two buckets,
+ *   b1 = hash & mask
+ *   b2 = b1 ^ (tag * FLOWTAB_ALT_MULT) & mask
+ * where the tag is the top byte of the hash, never 0. A bucket is one or
+ * two cache lines holding the tags, values and keys of FLOWTAB_SLOTS
+ * slots:
+ *   instance  slots  bucket  bytes / slot
+ *   _16_8     5      128     25.6
+ *   _16_4     3      64      21.3
+ * A lookup compares the searched tag to all of a bucket's at once, as
+ * bytes of one word, then the full key of matching slots only: most
+ * lookups touch a single bucket, one cache miss for _16_4. bihash_16_8
+ * with two flows per bucket, as the NF plugins size it, spends about
+ * 64 bytes per flow.
+ *
+ * The table is sized once, at init, and never splits nor rehashes.
+ * When both buckets of a new key are full, a random walk looks for a
+ * path of displacements to a free slot, FLOWTAB_MAX_KICKS long at most,
+ * and entries are moved along it from its end. An add fails once the
+ * table is too full for such a path, in practice above 90% to 95% load.
+ *
+ * Tables have a single writer, such as the worker owning a per-thread
+ * table. Readers on other threads may run concurrently: a moved entry
+ * is copied to its new slot before it is overwritten in its old one, so
+ * a lookup never misses a key present throughout, though a walk may see
+ * a key twice.
+ */
+
+#ifndef FLOWTAB_TYPE
+#error FLOWTAB_TYPE not defined
+#endif
+
+#define _fv(a,b) a##b
+#define __fv(a,b) _fv(a,b)
+#define FV(a) __fv(a,FLOWTAB_TYPE)
+
+#define _fvt(a,b) a##b##_t
+#define __fvt(a,b) _fvt(a,b)
+#define FVT(a) __fvt(a,FLOWTAB_TYPE)
+
+/* Longest displacement path of an add */
+#ifndef FLOWTAB_MAX_KICKS
+#define FLOWTAB_MAX_KICKS 64
+#endif
+
+/* Odd multiplier spreading tags over the table, see FV (clib_flowtab_alt) */
+#define FLOWTAB_ALT_MULT 0x5bd1e995
+
+#define FLOWTAB_WALK_CONTINUE 1
+#define FLOWTAB_WALK_STOP 0
+
+/* Tags of a bucket, as one word */
+#if FLOWTAB_SLOTS <= 4
+typedef u32 FVT (clib_flowtab_tags);
+#else
+typedef u64 FVT (clib_flowtab_tags);
+#endif
+
+typedef struct
+{
+  union
+  {
+    /* Slot fingerprints, 0 for a free slot */
+    u8 tags[sizeof (FVT (clib_flowtab_tags))];
+    FVT (clib_flowtab_tags) tag_word;
+  };
+  FLOWTAB_VALUE_T values[FLOWTAB_SLOTS];
+  u64 keys[FLOWTAB_SLOTS][FLOWTAB_KEY_U64S];
+} __attribute__ ((aligned (CLIB_CACHE_LINE_BYTES)))
+FVT (clib_flowtab_bucket);
+
+STATIC_ASSERT (FLOWTAB_SLOTS <= 8, "at most 8 slots per bucket");
+
+typedef struct
+{
+  FVT (clib_flowtab_bucket) * buckets;
+  u32 nbuckets;
+  u32 bucket_mask;
+  u32 n_elts;
+
+  /* Random walk state */
+  u32 seed;
+
+  u64 n_kicks;
+  u64 n_add_fails;
+
+  u8 *name;
+} FVT (clib_flowtab);
+
+typedef struct
+{
+  FVT (clib_flowtab_bucket) * b;
+  u32 slot;
+} FVT (clib_flowtab_path);
+
+static_always_inline u8
+FV (clib_flowtab_tag) (u64 hash)
+{
+  u8 tag = hash >> 56;
+  return tag ? tag : 1;
+}
+
+static_always_inline u32
+FV (clib_flowtab_alt) (FVT (clib_flowtab) * h, u32 bucket, u8 tag)
+{
+  return (bucket ^ ((u32) tag * FLOWTAB_ALT_MULT)) & h->bucket_mask;
+}
+
+static_always_inline FVT (clib_flowtab_bucket) *
+FV (clib_flowtab_get_bucket) (FVT (clib_flowtab) * h, u32 bucket)
+{
+  return h->buckets + bucket;
+}
+
+/**
+ * @brief Slots of b whose tag is tag, as a byte mask: 0x80 in the byte of
+ * each matching slot. A tag of 0 gives the free slots.
+ */
+static_always_inline FVT (clib_flowtab_tags)
+FV (clib_flowtab_match) (FVT (clib_flowtab_bucket) * b, u8 tag)
+{
+  FVT (clib_flowtab_tags) ones = (FVT (clib_flowtab_tags)) ~0 / 0xff;
+  FVT (clib_flowtab_tags) low7 = ones * 0x7f;
+  FVT (clib_flowtab_tags) slots = (FVT (clib_flowtab_tags)) ~0;
+  FVT (clib_flowtab_tags) x, y;
+
+  /* Padding bytes are 0, never a slot */
+  if (FLOWTAB_SLOTS < sizeof (slots))
+    slots >>= 8 * (sizeof (slots) - FLOWTAB_SLOTS);
+
+  /* Zero bytes of x, without the false positives of (x - ones) & ~x */
+  x = b->tag_word ^ (ones * tag);
+  y = (x & low7) + low7;
+  return ~(y | x | low7) & slots;
+}
+
+static_always_inline u32
+FV (clib_flowtab_first_slot) (FVT (clib_flowtab_tags) m)
+{
+  return count_trailing_zeros (m) / 8;
+}
+
+static_always_inline int
+FV (clib_flowtab_bucket_find) (FVT (clib_flowtab_bucket) * b, u8 tag,
+			       u64 * key)
+{
+  FVT (clib_flowtab_tags) m = FV (clib_flowtab_match) (b, tag);
+  u32 i;
+
+  while (m)
+    {
+      i = FV (clib_flowtab_first_slot) (m);
+      if (FV (clib_flowtab_key_compare) (b->keys[i], key))
+	return i;
+      m &= m - 1;
+    }
+  return -1;
+}
+
+/**
+ * @brief Size a table for max_elts keys, at about 85% load.
+ */
+static void
+FV (clib_flowtab_init) (FVT (clib_flowtab) * h, char *name, u32 max_elts)
+{
+  u64 nbuckets = (u64) max_elts * 20 / (17 * FLOWTAB_SLOTS) + 1;
+  uword size;
+
+  clib_memset (h, 0, sizeof (*h));
+  h->nbuckets = 1 << max_log2 (clib_max (nbuckets, 2));
+  h->bucket_mask = h->nbuckets - 1;
+  h->seed = 0x9e3779b9;
+  h->name = (u8 *) name;
+
+  size = (uword) h->nbuckets * sizeof (h->buckets[0]);
+  h->buckets = clib_mem_alloc_aligned (size, CLIB_CACHE_LINE_BYTES);
+  clib_memset (h->buckets, 0, size);
+}
+
+static void
+FV (clib_flowtab_free) (FVT (clib_flowtab) * h)
+{
+  clib_mem_free (h->buckets);
+  clib_memset (h, 0, sizeof (*h));
+}
+
+static_always_inline uword
+FV (clib_flowtab_memory_size) (FVT (clib_flowtab) * h)
+{
+  return (uword) h->nbuckets * sizeof (h->buckets[0]);
+}
+
+static_always_inline void
+FV (clib_flowtab_prefetch_bucket) (FVT (clib_flowtab) * h, u64 hash)
+{
+  FVT (clib_flowtab_bucket) * b =
+    FV (clib_flowtab_get_bucket) (h, hash & h->bucket_mask);
+
+  clib_prefetch_load (b);
+  if (sizeof (*b) > CLIB_CACHE_LINE_BYTES)
+    clib_prefetch_load ((u8 *) b + CLIB_CACHE_LINE_BYTES);
+}
+
+/**
+ * @brief Pointer to the value of key, 0 if the key is not in the table.
+ * Only valid until the next add or delete.
+ */
+static_always_inline FLOWTAB_VALUE_T *
+FV (clib_flowtab_get_value_with_hash) (FVT (clib_flowtab) * h, u64 hash,
+				       u64 * key)
+{
+  u32 bucket = hash & h->bucket_mask;
+  u8 tag = FV (clib_flowtab_tag) (hash);
+  FVT (clib_flowtab_bucket) * b;
+  int i;
+
+  b = FV (clib_flowtab_get_bucket) (h, bucket);
+  if ((i = FV (clib_flowtab_bucket_find) (b, tag, key)) >= 0)
+    return &b->values[i];
+
+  b = FV (clib_flowtab_get_bucket) (h, FV (clib_flowtab_alt) (h, bucket,
+							       tag));
+  if ((i = FV (clib_flowtab_bucket_find) (b, tag, key)) >= 0)
+    return &b->values[i];
+
+  return 0;
+}
+
+static_always_inline int
+FV (clib_flowtab_search_with_hash) (FVT (clib_flowtab) * h, u64 hash,
+				    FVT (clib_flowtab_kv) * kv)
+{
+  FLOWTAB_VALUE_T *v;
+
+  v = FV (clib_flowtab_get_value_with_hash) (h, hash, kv->key);
+  if (v == 0)
+    return -1;
+  kv->value = *v;
+  return 0;
+}
+
+static_always_inline int
+FV (clib_flowtab_search) (FVT (clib_flowtab) * h, FVT (clib_flowtab_kv) * kv)
+{
+  return FV (clib_flowtab_search_with_hash) (h, FV (clib_flowtab_hash) (kv),
+					     kv);
+}
+
+static_always_inline void
+FV (clib_flowtab_set_slot) (FVT (clib_flowtab_bucket) * b, u32 slot, u8 tag,
+			    u64 * key, FLOWTAB_VALUE_T value)
+{
+  /* Readers see the slot once key and value are in place */
+  if (b->tags[slot])
+    __atomic_store_n (&b->tags[slot], 0, __ATOMIC_RELEASE);
+  clib_memcpy_fast (b->keys[slot], key, sizeof (b->keys[slot]));
+  b->values[slot] = value;
+  __atomic_store_n (&b->tags[slot], tag, __ATOMIC_RELEASE);
+}
+
+static_always_inline int
+FV (clib_flowtab_path_has) (FVT (clib_flowtab_path) * path, u32 n,
+			    FVT (clib_flowtab_bucket) * b, u32 slot)
+{
+  u32 i;
+
+  for (i = 0; i < n; i++)
+    if (path[i].b == b && path[i].slot == slot)
+      return 1;
+  return 0;
+}
+
+/**
+ * @brief Random walk from bucket b for a path of displacements ending in
+ * a free slot, then move the entries along it. Returns the freed slot of
+ * b, -1 if no path was found.
+ *
+ * A path never goes through a slot twice: the entry moved out of it the
+ * second time would not be the one whose alternate bucket was followed.
+ */
+static int
+FV (clib_flowtab_kick) (FVT (clib_flowtab) * h, u32 bucket)
+{
+  FVT (clib_flowtab_path) path[FLOWTAB_MAX_KICKS], *p;
+  FVT (clib_flowtab_bucket) * b, *to;
+  FVT (clib_flowtab_tags) empty;
+  u32 n, i, slot, to_slot = 0;
+  u8 tag;
+
+  b = FV (clib_flowtab_get_bucket) (h, bucket);
+  for (n = 0; n < FLOWTAB_MAX_KICKS; n++)
+    {
+      h->seed = h->seed * 1103515245 + 12345;
+      slot = (h->seed >> 16) % FLOWTAB_SLOTS;
+      for (i = 0; i < FLOWTAB_SLOTS; i++)
+	{
+	  if (!FV (clib_flowtab_path_has) (path, n, b, slot))
+	    break;
+	  slot = slot + 1 < FLOWTAB_SLOTS ? slot + 1 : 0;
+	}
+      if (i == FLOWTAB_SLOTS)
+	return -1;
+
+      path[n].b = b;
+      path[n].slot = slot;
+
+      tag = b->tags[slot];
+      bucket = FV (clib_flowtab_alt) (h, bucket, tag);
+      b = FV (clib_flowtab_get_bucket) (h, bucket);
+      if ((empty = FV (clib_flowtab_match) (b, 0)))
+	{
+	  to_slot = FV (clib_flowtab_first_slot) (empty);
+	  break;
+	}
+    }
+
+  if (n == FLOWTAB_MAX_KICKS)
+    return -1;
+
+  /* From the end, copy each entry to its alternate slot */
+  to = b;
+  for (p = path + n; p >= path; p--)
+    {
+      FV (clib_flowtab_set_slot) (to, to_slot, p->b->tags[p->slot],
+				  p->b->keys[p->slot],
+				  p->b->values[p->slot]);
+      to = p->b;
+      to_slot = p->slot;
+    }
+
+  h->n_kicks += n + 1;
+  return path[0].slot;
+}
+
+/**
+ * @brief Find-or-insert. Returns a pointer to the value of kv->key,
+ * inserting kv first if the key is not present, and sets *is_new when
+ * this call inserted it. Returns 0 if the table is full. The pointer is
+ * only valid until the next add or delete.
+ */
+static_always_inline FLOWTAB_VALUE_T *
+FV (clib_flowtab_search_or_add_with_hash) (FVT (clib_flowtab) * h, u64 hash,
+					   FVT (clib_flowtab_kv) * kv,
+					   int *is_new)
+{
+  u32 bucket = hash & h->bucket_mask, alt;
+  u8 tag = FV (clib_flowtab_tag) (hash);
+  FVT (clib_flowtab_bucket) * b1, *b2, *b = 0;
+  FVT (clib_flowtab_tags) empty;
+  int i;
+
+  *is_new = 0;
+  b1 = FV (clib_flowtab_get_bucket) (h, bucket);
+  if ((i = FV (clib_flowtab_bucket_find) (b1, tag, kv->key)) >= 0)
+    return &b1->values[i];
+
+  alt = FV (clib_flowtab_alt) (h, bucket, tag);
+  b2 = FV (clib_flowtab_get_bucket) (h, alt);
+  if ((i = FV (clib_flowtab_bucket_find) (b2, tag, kv->key)) >= 0)
+    return &b2->values[i];
+
+  /* Fill the first bucket first, most lookups then stop there */
+  if ((empty = FV (clib_flowtab_match) (b1, 0)))
+    b = b1;
+  else if ((empty = FV (clib_flowtab_match) (b2, 0)))
+    b = b2;
+
+  if (empty)
+    i = FV (clib_flowtab_first_slot) (empty);
+  else if ((i = FV (clib_flowtab_kick) (h, bucket)) >= 0)
+    b = b1;
+  else if ((i = FV (clib_flowtab_kick) (h, alt)) >= 0)
+    b = b2;
+  else
+    {
+      h->n_add_fails++;
+      return 0;
+    }
+
+  FV (clib_flowtab_set_slot) (b, i, tag, kv->key, kv->value);
+  h->n_elts++;
+  *is_new = 1;
+  return &b->values[i];
+}
+
+static_always_inline FLOWTAB_VALUE_T *
+FV (clib_flowtab_search_or_add) (FVT (clib_flowtab) * h,
+				 FVT (clib_flowtab_kv) * kv, int *is_new)
+{
+  return FV (clib_flowtab_search_or_add_with_hash)
+    (h, FV (clib_flowtab_hash) (kv), kv, is_new);
+}
+
+static_always_inline void
+FV (clib_flowtab_del_slot) (FVT (clib_flowtab) * h,
+			    FVT (clib_flowtab_bucket) * b, u32 slot)
+{
+  __atomic_store_n (&b->tags[slot], 0, __ATOMIC_RELEASE);
+  h->n_elts--;
+}
+
+/**
+ * @brief Add (is_add = 1, overwriting the value of a present key) or
+ * delete (is_add = 0) kv. Returns 0, or -1 if the table is full or the
+ * key to delete is not present.
+ */
+static inline int
+FV (clib_flowtab_add_del_with_hash) (FVT (clib_flowtab) * h, u64 hash,
+				     FVT (clib_flowtab_kv) * kv, int is_add)
+{
+  FVT (clib_flowtab_bucket) * b;
+  FLOWTAB_VALUE_T *v;
+  u32 bucket;
+  int is_new, i;
+  u8 tag;
+
+  if (is_add)
+    {
+      if ((v = FV (clib_flowtab_search_or_add_with_hash) (h, hash, kv,
+							  &is_new)) == 0)
+	return -1;
+      *v = kv->value;
+      return 0;
+    }
+
+  tag = FV (clib_flowtab_tag) (hash);
+  bucket = hash & h->bucket_mask;
+  b = FV (clib_flowtab_get_bucket) (h, bucket);
+  if ((i = FV (clib_flowtab_bucket_find) (b, tag, kv->key)) < 0)
+    {
+      b = FV (clib_flowtab_get_bucket) (h, FV (clib_flowtab_alt) (h, bucket,
+								   tag));
+      if ((i = FV (clib_flowtab_bucket_find) (b, tag, kv->key)) < 0)
+	return -1;
+    }
+  FV (clib_flowtab_del_slot) (h, b, i);
+  return 0;
+}
+
+static inline int
+FV (clib_flowtab_add_del) (FVT (clib_flowtab) * h,
+			   FVT (clib_flowtab_kv) * kv, int is_add)
+{
+  return FV (clib_flowtab_add_del_with_hash) (h, FV (clib_flowtab_hash) (kv),
+					      kv, is_add);
+}
+
+typedef int (*FV (clib_flowtab_foreach_key_value_pair_cb))
+  (FVT (clib_flowtab_kv) *, void *);
+
+/**
+ * @brief Call cb with a copy of each pair in buckets [*bucket, *bucket +
+ * n_buckets), and advance *bucket past them. Returns 0 once the walk has
+ * covered the table, or cb returned FLOWTAB_WALK_STOP, 1 otherwise.
+ */
+static inline int
+FV (clib_flowtab_foreach_key_value_pair_from) (FVT (clib_flowtab) * h,
+					       u32 * bucket, u32 n_buckets,
+					       FV
+					       (clib_flowtab_foreach_key_value_pair_cb)
+					       cb, void *arg)
+{
+  FVT (clib_flowtab_bucket) * b;
+  FVT (clib_flowtab_kv) kv;
+  u32 end = clib_min ((u64) * bucket + n_buckets, h->nbuckets), i;
+
+  for (; *bucket < end; (*bucket)++)
+    {
+      b = FV (clib_flowtab_get_bucket) (h, *bucket);
+      for (i = 0; i < FLOWTAB_SLOTS; i++)
+	{
+	  if (b->tags[i] == 0)
+	    continue;
+	  clib_memcpy_fast (kv.key, b->keys[i], sizeof (kv.key));
+	  kv.value = b->values[i];
+	  if (cb (&kv, arg) == FLOWTAB_WALK_STOP)
+	    {
+	      (*bucket)++;
+	      return 0;
+	    }
+	}
+    }
+
+  if (*bucket < h->nbuckets)
+    return 1;
+  *bucket = 0;
+  return 0;
+}
+
+static inline void
+FV (clib_flowtab_foreach_key_value_pair) (FVT (clib_flowtab) * h,
+					  FV
+					  (clib_flowtab_foreach_key_value_pair_cb)
+					  cb, void *arg)
+{
+  u32 bucket = 0;
+
+  FV (clib_flowtab_foreach_key_value_pair_from) (h, &bucket, ~0, cb, arg);
+}
+
+typedef int (*FV (clib_flowtab_is_stale_cb)) (FVT (clib_flowtab_kv) *,
+					      void *);
+
+/**
+ * @brief Delete the entries of buckets [*cursor, *cursor + n_buckets)
+ * for which is_stale returns 1, and advance *cursor past them, wrapping
+ * around. Call from the writer. Returns the number of deleted entries.
+ */
+static inline u32
+FV (clib_flowtab_sweep) (FVT (clib_flowtab) * h, u32 * cursor,
+			 u32 n_buckets, FV (clib_flowtab_is_stale_cb) is_stale,
+			 void *arg)
+{
+  FVT (clib_flowtab_bucket) * b;
+  FVT (clib_flowtab_kv) kv;
+  u32 n_deleted = 0, i;
+
+  n_buckets = clib_min (n_buckets, h->nbuckets);
+  while (n_buckets--)
+    {
+      b = FV (clib_flowtab_get_bucket) (h, *cursor);
+      for (i = 0; i < FLOWTAB_SLOTS; i++)
+	{
+	  if (b->tags[i] == 0)
+	    continue;
+	  clib_memcpy_fast (kv.key, b->keys[i], sizeof (kv.key));
+	  kv.value = b->values[i];
+	  if (is_stale (&kv, arg))
+	    {
+	      FV (clib_flowtab_del_slot) (h, b, i);
+	      n_deleted++;
+	    }
+	}
+      *cursor = (*cursor + 1) & h->bucket_mask;
+    }
+  return n_deleted;
+}
+
+static inline u8 *
+FV (format_flowtab) (u8 * s, va_list * args)
+{
+  FVT (clib_flowtab) * h = va_arg (*args, FVT (clib_flowtab) *);
+  u64 n_slots = (u64) h->nbuckets * FLOWTAB_SLOTS;
+
+  s = format (s, "Flow table '%s'\n", h->name ? h->name : (u8 *) "(unnamed)");
+  s = format (s, "    %u buckets of %u slots, %u bytes\n", h->nbuckets,
+	      FLOWTAB_SLOTS, (u32) sizeof (h->buckets[0]));
+  s = format (s, "    %u active elements, load %.1f%%\n", h->n_elts,
+	      n_slots ? 100.0 * h->n_elts / n_slots : 0.0);
+  s = format (s, "    %llu kicks, %llu failed adds\n", h->n_kicks,
+	      h->n_add_fails);
+  s = format (s, "    memory: %U", format_memory_size,
+	      FV (clib_flowtab_memory_size) (h));
+  return s;
+}
+
+#endif /* __included_flowtab_template_h__ */
+
+/*
+ * fd.io coding-style-patch-verification: ON
+ *
+ * Local Variables:
+ * eval: (c-set-style "gnu")
+ * End:
+ */
@@ -663,6 +663,32 @@ clib_mem_set_default_numa_affinity ()
   return 0;
 }
 
+__clib_export int
+clib_mem_vm_set_numa_affinity (void *base, uword size, u8 numa_node)
+{
+  clib_mem_main_t *mm = &clib_mem_main;
+  clib_bitmap_t *bmp = 0;
+  int rv;
+
+  /* no numa support */
+  if (mm->numa_node_bitmap == 0)
+    return 0;
+
+  /* Preferred, so that faults on a full node take pages elsewhere */
+  bmp = clib_bitmap_set (bmp, numa_node, 1);
+  rv = syscall (__NR_mbind, base, size, MPOL_PREFERRED, bmp,
+		vec_len (bmp) * sizeof (bmp[0]) * 8 + 1, 0);
+  clib_bitmap_free (bmp);
+
+  if (rv)
+    {
+      vec_reset_length (mm->error);
+      mm->error = clib_error_return_unix (mm->error, (char *) __func__);
+      return CLIB_MEM_ERROR;
+    }
+  return 0;
+}
+
 /*
  * fd.io coding-style-patch-verification: ON
  *
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: Apache-2.0
+ * Copyright(c) 2021 Cisco Systems, Inc.
+ */
+
+#include <vppinfra/format.h>
+#include <vppinfra/test/test.h>
+#include <vppinfra/vector/flow_key.h>
+
+__test_funct_fn void
+clib_ip4_flow_key_extract_wrapper (void **ip4, u64 *key0, u64 *key1, u32 n)
+{
+  clib_ip4_flow_key_extract (ip4, key0, key1, n);
+}
+
+#define N_PACKETS 67
+#define HDR_STRIDE 40
+
+static clib_error_t *
+test_clib_ip4_flow_key (clib_error_t *err)
+{
+  u8 *hdrs = test_mem_alloc_and_fill_inc_u8 (N_PACKETS * HDR_STRIDE + 3, 0, 0);
+  void **ip4 = test_mem_alloc (N_PACKETS * sizeof (void *));
+  u64 *key0 = test_mem_alloc (N_PACKETS * sizeof (u64));
+  u64 *key1 = test_mem_alloc (N_PACKETS * sizeof (u64));
+  u32 i, n;
+
+  /* Odd offsets so that no header is aligned */
+  for (i = 0; i < N_PACKETS; i++)
+    ip4[i] = hdrs + i * HDR_STRIDE + (i & 3);
+
+  for (n = 0; n <= N_PACKETS; n++)
+    {
+      clib_memset_u64 (key0, 0, N_PACKETS);
+      clib_memset_u64 (key1, 0, N_PACKETS);
+      clib_ip4_flow_key_extract_wrapper (ip4, key0, key1, n);
+
+      for (i = 0; i < N_PACKETS; i++)
+	{
+	  u8 *h = ip4[i];
+	  u64 k0 = 0, k1 = 0;
+
+	  if (i < n)
+	    {
+	      k0 = (u64) *(u32u *) (h + 12) << 32 | *(u32u *) (h + 16);
+	      k1 = (u64) h[9] << 32 | (u64) *(u16u *) (h + 20) << 16 |
+		   *(u16u *) (h + 22);
+	    }
+	  if (key0[i] != k0 || key1[i] != k1)
+	    return clib_error_return (err,
+				      "n_packets %u packet %u: key 0x%lx 0x%lx, "
+				      "expected 0x%lx 0x%lx",
+				      n, i, key0[i], key1[i], k0, k1);
+	}
+
+#ifdef clib_crc32c_uses_intrinsics
+      u64 hash[N_PACKETS];
+
+      clib_flow_key_crc32c (key0, key1, hash, n);
+      for (i = 0; i < n; i++)
+	{
+	  u64 key[2] = { key0[i], key1[i] };
+	  u32 h = clib_crc32c ((u8 *) key, 16);
+
+	  if (hash[i] != h)
+	    return clib_error_return (err,
+				      "n_keys %u key %u: hash 0x%lx, "
+				      "expected 0x%x",
+				      n, i, hash[i], h);
+	}
+#endif
+    }
+
+  return err;
+}
+
+REGISTER_TEST (clib_ip4_flow_key) = {
+  .name = "clib_ip4_flow_key",
+  .fn = test_clib_ip4_flow_key,
+};
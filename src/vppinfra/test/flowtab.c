@@ -0,0 +1,145 @@
+/* SPDX-License-Identifier: Apache-2.0
+ * Copyright(c) 2021 Cisco Systems, Inc.
+ */
+
+#include <vppinfra/format.h>
+#include <vppinfra/test/test.h>
+#include <vppinfra/flowtab_16_8.h>
+#include <vppinfra/flowtab_16_4.h>
+
+STATIC_ASSERT_SIZEOF (clib_flowtab_bucket_16_8_t, 2 * CLIB_CACHE_LINE_BYTES);
+STATIC_ASSERT_SIZEOF (clib_flowtab_bucket_16_4_t, CLIB_CACHE_LINE_BYTES);
+
+#define N_KEYS 20000
+
+static int
+flowtab_count_cb (clib_flowtab_kv_16_8_t *kv, void *arg)
+{
+  u32 *n = arg;
+
+  n[0]++;
+  return FLOWTAB_WALK_CONTINUE;
+}
+
+static int
+flowtab_is_odd_cb (clib_flowtab_kv_16_8_t *kv, void *arg)
+{
+  return kv->value & 1;
+}
+
+static void
+flowtab_key (clib_flowtab_kv_16_8_t *kv, u32 i)
+{
+  /* 5-tuple like keys, the same but for the source port */
+  kv->key[0] = 0x0a0000010a000002ULL + ((u64) (i >> 16) << 32);
+  kv->key[1] = 17ULL << 32 | (i & 0xffff) << 16 | 80;
+  kv->value = i;
+}
+
+static clib_error_t *
+test_clib_flowtab_16_8 (clib_error_t *err)
+{
+  clib_flowtab_16_8_t h;
+  clib_flowtab_kv_16_8_t kv;
+  u64 *v;
+  u32 i, n, cursor = 0;
+  int is_new;
+
+  clib_flowtab_init_16_8 (&h, "test", N_KEYS);
+
+  for (i = 0; i < N_KEYS; i++)
+    {
+      flowtab_key (&kv, i);
+      v = clib_flowtab_search_or_add_16_8 (&h, &kv, &is_new);
+      if (v == 0 || !is_new || *v != i)
+	return clib_error_return (err, "add %u failed at load %u of %u", i,
+				  h.n_elts, h.nbuckets * 5);
+    }
+
+  for (i = 0; i < N_KEYS; i++)
+    {
+      flowtab_key (&kv, i);
+      v = clib_flowtab_search_or_add_16_8 (&h, &kv, &is_new);
+      if (v == 0 || is_new || *v != i)
+	return clib_error_return (err, "key %u lost", i);
+      /* Counters are bumped in place */
+      *v += 2;
+    }
+
+  n = 0;
+  clib_flowtab_foreach_key_value_pair_16_8 (&h, flowtab_count_cb, &n);
+  if (n != N_KEYS || h.n_elts != N_KEYS)
+    return clib_error_return (err, "walked %u keys, %u elts, expected %u", n,
+			      h.n_elts, N_KEYS);
+
+  /* Delete the even keys, then sweep the odd ones */
+  for (i = 0; i < N_KEYS; i += 2)
+    {
+      flowtab_key (&kv, i);
+      if (clib_flowtab_add_del_16_8 (&h, &kv, 0))
+	return clib_error_return (err, "delete %u failed", i);
+    }
+  for (i = 0; i < N_KEYS; i++)
+    {
+      flowtab_key (&kv, i);
+      if (clib_flowtab_search_16_8 (&h, &kv) != (i & 1 ? 0 : -1))
+	return clib_error_return (err, "key %u %s after deletes", i,
+				  i & 1 ? "lost" : "found");
+      if ((i & 1) && kv.value != i + 2)
+	return clib_error_return (err, "key %u value %lu", i, kv.value);
+    }
+
+  n = clib_flowtab_sweep_16_8 (&h, &cursor, ~0, flowtab_is_odd_cb, 0);
+  if (n != N_KEYS / 2 || h.n_elts != 0)
+    return clib_error_return (err, "swept %u keys, %u left", n, h.n_elts);
+
+  clib_flowtab_free_16_8 (&h);
+  return err;
+}
+
+REGISTER_TEST (clib_flowtab_16_8) = {
+  .name = "clib_flowtab_16_8",
+  .fn = test_clib_flowtab_16_8,
+};
+
+static clib_error_t *
+test_clib_flowtab_16_4 (clib_error_t *err)
+{
+  clib_flowtab_16_4_t h;
+  clib_flowtab_kv_16_4_t kv = {};
+  u32 i, *v, n_full = 0;
+  int is_new;
+
+  /* Fill until adds fail, then check no key went missing on the way */
+  clib_flowtab_init_16_4 (&h, "test", N_KEYS);
+  for (i = 0; n_full == 0; i++)
+    {
+      kv.key[0] = i;
+      kv.key[1] = ~i;
+      kv.value = i;
+      if (clib_flowtab_search_or_add_16_4 (&h, &kv, &is_new) == 0)
+	n_full = i;
+    }
+
+  if (n_full < h.nbuckets * 3 * 9 / 10)
+    return clib_error_return (err, "table full at %u of %u slots", n_full,
+			      h.nbuckets * 3);
+
+  for (i = 0; i < n_full; i++)
+    {
+      kv.key[0] = i;
+      kv.key[1] = ~i;
+      v = clib_flowtab_get_value_with_hash_16_4 (
+	&h, clib_flowtab_hash_16_4 (&kv), kv.key);
+      if (v == 0 || *v != i)
+	return clib_error_return (err, "key %u lost", i);
+    }
+
+  clib_flowtab_free_16_4 (&h);
+  return err;
+}
+
+REGISTER_TEST (clib_flowtab_16_4) = {
+  .name = "clib_flowtab_16_4",
+  .fn = test_clib_flowtab_16_4,
+};
@@ -36,6 +36,7 @@ typedef struct
   u32 report_every_n;
   u32 search_iter;
   u32 noverwritten;
+  u32 ncallbacks;
   int careful_delete_tests;
   int verbose;
   int non_random_keys;
@@ -43,6 +44,10 @@ typedef struct
   uword *key_hash;
   u64 *keys;
   uword hash_memory_size;
+  u8 private_heap;
+  u32 reserve;
+  u32 numa_node;
+  clib_mem_page_sz_t log2_page_sz;
     BVT (clib_bihash) hash;
   clib_time_t clib_time;
   void *global_heap;
@@ -301,6 +306,331 @@ test_bihash_value_assert (test_main_t *tm)
   return 0;
 }
 
+static void
+search_or_add_batch_cb (BVT (clib_bihash_kv) * kvp, u32 index, int is_new,
+			void *ctx)
+{
+  test_main_t *tm = ctx;
+
+  tm->ncallbacks++;
+  kvp->value++;
+}
+
+static clib_error_t *
+test_bihash_search_or_add (test_main_t *tm)
+{
+  int i, j, is_new;
+  u32 n_new;
+  BVT (clib_bihash) * h;
+  BVT (clib_bihash_kv) kv, *kvp;
+  BVT (clib_bihash_kv) *kvs = 0;
+  u64 *hashes = 0;
+
+  h = &tm->hash;
+
+#if BIHASH_32_64_SVM
+  BV (clib_bihash_initiator_init_svm)
+  (h, "test", tm->nbuckets, 0x30000000 /* base_addr */, tm->hash_memory_size);
+#else
+  BV (clib_bihash_init) (h, "test", tm->nbuckets, tm->hash_memory_size);
+#endif
+
+  /* Count key i (i % 4) + 1 times, one at a time */
+  for (i = 0; i < tm->nitems; i++)
+    {
+      for (j = 0; j <= i % 4; j++)
+	{
+	  kv.key = i;
+	  kv.value = 0;
+	  kvp = BV (clib_bihash_search_or_add) (h, &kv, &is_new);
+	  if (kvp == 0)
+	    return clib_error_return (0, "search_or_add failed for %d", i);
+	  if (is_new != (j == 0))
+	    return clib_error_return (0, "key %d: is_new %d at iter %d", i,
+				      is_new, j);
+	  kvp->value++;
+	}
+    }
+
+  for (i = 0; i < tm->nitems; i++)
+    {
+      kv.key = i;
+      if (BV (clib_bihash_search) (h, &kv, &kv) < 0)
+	return clib_error_return (0, "key %d not found", i);
+      if (kv.value != i % 4 + 1)
+	return clib_error_return (0, "key %d: value %lld, expected %d", i,
+				  kv.value, i % 4 + 1);
+    }
+
+  /* Batch: half of the keys already exist */
+  for (i = 0; i < tm->nitems; i++)
+    {
+      vec_add2 (kvs, kvp, 1);
+      kvp->key = i + tm->nitems / 2;
+      kvp->value = 0;
+      vec_add1 (hashes, BV (clib_bihash_hash) (kvp));
+    }
+
+  tm->ncallbacks = 0;
+  n_new = BV (clib_bihash_search_or_add_batch_with_hash) (
+    h, kvs, hashes, tm->nitems, search_or_add_batch_cb, tm);
+  if (n_new != tm->nitems / 2)
+    return clib_error_return (0, "batch inserted %u, expected %u", n_new,
+			      tm->nitems / 2);
+  if (tm->ncallbacks != tm->nitems)
+    return clib_error_return (0, "batch callback ran %u times",
+			      tm->ncallbacks);
+
+  for (i = 0; i < tm->nitems + tm->nitems / 2; i++)
+    {
+      kv.key = i;
+      if (BV (clib_bihash_search) (h, &kv, &kv) < 0)
+	return clib_error_return (0, "key %d not found after batch", i);
+      if (kv.value !=
+	  (i < tm->nitems ? i % 4 + 1 : 0) + (i >= tm->nitems / 2))
+	return clib_error_return (0, "key %d: value %lld after batch", i,
+				  kv.value);
+    }
+
+  /* Batched lookup: keys past nitems + nitems / 2 are missing */
+  for (i = 0; i < tm->nitems; i++)
+    {
+      kvs[i].key = i + tm->nitems;
+      hashes[i] = BV (clib_bihash_hash) (&kvs[i]);
+    }
+  n_new = BV (clib_bihash_search_batch) (h, kvs, hashes, tm->nitems, kvs);
+  if (n_new != tm->nitems / 2)
+    return clib_error_return (0, "batch search found %u, expected %u", n_new,
+			      tm->nitems / 2);
+  for (i = 0; i < tm->nitems; i++)
+    {
+      if (i >= tm->nitems / 2)
+	{
+	  if (!BV (clib_bihash_is_free) (&kvs[i]))
+	    return clib_error_return (0, "batch search found key %d",
+				      i + tm->nitems);
+	}
+      else if (kvs[i].key != i + tm->nitems || kvs[i].value != 1)
+	return clib_error_return (0, "batch search key %d: value %lld",
+				  i + tm->nitems, kvs[i].value);
+    }
+
+  fformat (stdout, "search_or_add: %d keys OK\n",
+	   tm->nitems + tm->nitems / 2);
+
+  vec_free (kvs);
+  vec_free (hashes);
+  BV (clib_bihash_free) (h);
+  return 0;
+}
+
+/*
+ * Add nitems keys to a private heap of memory_size bytes, too small for
+ * them: adds have to start failing, rather than taking the process down,
+ * and what was added has to stay put.
+ */
+static clib_error_t *
+test_bihash_full (test_main_t *tm)
+{
+  int i, is_new;
+  u32 n_added = 0, n_failed = 0;
+  BVT (clib_bihash) * h;
+  BVT (clib_bihash_kv) kv;
+
+  h = &tm->hash;
+
+#if BIHASH_32_64_SVM
+  return clib_error_return (0, "no private heap for shared tables");
+#else
+  BVT (clib_bihash_init2_args) a = {
+    .h = h,
+    .name = "test",
+    .nbuckets = tm->nbuckets,
+    .memory_size = tm->hash_memory_size,
+    .private_heap = 1,
+    .numa_node = tm->numa_node,
+    .log2_page_sz = tm->log2_page_sz,
+  };
+  BV (clib_bihash_init2) (&a);
+  for (i = 0; i < 3 && tm->reserve; i++)
+    BV (clib_bihash_set_reserve) (h, i, tm->reserve);
+  BV (clib_bihash_refill) (h);
+#endif
+
+  for (i = 0; i < tm->nitems; i++)
+    {
+      kv.key = i;
+      kv.value = i;
+      if (BV (clib_bihash_add_del) (h, &kv, 1 /* is_add */) == 0)
+	n_added++;
+      else
+	n_failed++;
+      if (tm->reserve && h->refill_pending && (i & 255) == 0)
+	BV (clib_bihash_refill) (h);
+    }
+
+  if (n_failed == 0)
+    return clib_error_return (0, "%d keys fit in %U, use more", tm->nitems,
+			      format_memory_size, tm->hash_memory_size);
+
+  /* Adds which failed left the table as it was */
+  for (i = 0, n_failed = 0; i < tm->nitems; i++)
+    {
+      kv.key = i;
+      if (BV (clib_bihash_search) (h, &kv, &kv) == 0)
+	{
+	  if (kv.value != i)
+	    return clib_error_return (0, "key %d: value %lld", i, kv.value);
+	}
+      else
+	n_failed++;
+    }
+  if (tm->nitems - n_failed != n_added)
+    return clib_error_return (0, "found %u keys, added %u",
+			      tm->nitems - n_failed, n_added);
+
+  /* A full table still finds, and refuses what it can't add */
+  kv.key = 0;
+  kv.value = 0;
+  if (BV (clib_bihash_search_or_add) (h, &kv, &is_new) == 0 || is_new)
+    return clib_error_return (0, "search_or_add lost key 0");
+  for (i = tm->nitems; i < 2 * tm->nitems; i++)
+    {
+      kv.key = i;
+      if (BV (clib_bihash_search_or_add) (h, &kv, &is_new) == 0)
+	break;
+    }
+  if (i == 2 * tm->nitems)
+    return clib_error_return (0, "search_or_add never failed");
+
+  fformat (stdout, "full: %u of %d keys added in %U\n", n_added, tm->nitems,
+	   format_memory_size, tm->hash_memory_size);
+  if (tm->verbose)
+    fformat (stdout, "%U", BV (format_bihash), h, 0 /* very verbose */);
+
+  BV (clib_bihash_free) (h);
+  return 0;
+}
+
+static int
+sweep_is_stale (BVT (clib_bihash_kv) * kvp, void *ctx)
+{
+  return kvp->value & 1;
+}
+
+static clib_error_t *
+test_bihash_sweep (test_main_t *tm)
+{
+  int i;
+  u32 cursor = 0, n_deleted = 0, n, laps = 0;
+  BVT (clib_bihash) * h;
+  BVT (clib_bihash_kv) kv;
+
+  h = &tm->hash;
+
+#if BIHASH_32_64_SVM
+  BV (clib_bihash_initiator_init_svm)
+  (h, "test", tm->nbuckets, 0x30000000 /* base_addr */, tm->hash_memory_size);
+#else
+  BV (clib_bihash_init) (h, "test", tm->nbuckets, tm->hash_memory_size);
+#endif
+
+  for (i = 0; i < tm->nitems; i++)
+    {
+      kv.key = i;
+      kv.value = i;
+      BV (clib_bihash_add_del) (h, &kv, 1 /* is_add */);
+    }
+
+  /* Sweep with a small budget, until a full lap finds nothing */
+  do
+    {
+      u32 lap = 0, work;
+
+      for (work = 0; work < h->nbuckets + tm->nitems; work += 16)
+	lap += BV (clib_bihash_sweep) (h, &cursor, 16, sweep_is_stale, 0);
+      n_deleted += n = lap;
+      if (++laps > 64)
+	return clib_error_return (0, "sweep does not converge");
+    }
+  while (n);
+
+  if (n_deleted != tm->nitems / 2)
+    return clib_error_return (0, "sweep deleted %u, expected %u", n_deleted,
+			      tm->nitems / 2);
+
+  for (i = 0; i < tm->nitems; i++)
+    {
+      kv.key = i;
+      if ((BV (clib_bihash_search) (h, &kv, &kv) < 0) != (i & 1))
+	return clib_error_return (0, "key %d %s after sweep", i,
+				  (i & 1) ? "present" : "missing");
+    }
+
+  fformat (stdout, "sweep: %u of %d keys deleted in %u laps OK\n",
+	   n_deleted, tm->nitems, laps);
+
+  BV (clib_bihash_free) (h);
+  return 0;
+}
+
+static int
+walk_from_visit (BVT (clib_bihash_kv) * kvp, void *ctx)
+{
+  u8 *seen = ctx;
+
+  seen[kvp->key]++;
+  return BIHASH_WALK_CONTINUE;
+}
+
+static clib_error_t *
+test_bihash_walk_from (test_main_t *tm)
+{
+  int i;
+  u32 cursor = 0, calls = 0;
+  u8 *seen = 0;
+  BVT (clib_bihash) * h;
+  BVT (clib_bihash_kv) kv;
+
+  h = &tm->hash;
+
+#if BIHASH_32_64_SVM
+  BV (clib_bihash_initiator_init_svm)
+  (h, "test", tm->nbuckets, 0x30000000 /* base_addr */, tm->hash_memory_size);
+#else
+  BV (clib_bihash_init) (h, "test", tm->nbuckets, tm->hash_memory_size);
+#endif
+
+  for (i = 0; i < tm->nitems; i++)
+    {
+      kv.key = i;
+      kv.value = i;
+      BV (clib_bihash_add_del) (h, &kv, 1 /* is_add */);
+    }
+
+  /* Page through the table 16 buckets at a time */
+  vec_validate (seen, tm->nitems - 1);
+  do
+    calls++;
+  while (BV (clib_bihash_foreach_key_value_pair_from)
+	 (h, &cursor, 16, walk_from_visit, seen)
+	 && calls <= h->nbuckets / 16);
+
+  if (cursor != 0 || calls != (h->nbuckets + 15) / 16)
+    return clib_error_return (0, "walk took %u calls, cursor %u", calls,
+			      cursor);
+
+  for (i = 0; i < tm->nitems; i++)
+    if (seen[i] != 1)
+      return clib_error_return (0, "key %d visited %d times", i, seen[i]);
+
+  fformat (stdout, "walk-from: %d keys in %u calls OK\n", tm->nitems, calls);
+
+  vec_free (seen);
+  BV (clib_bihash_free) (h);
+  return 0;
+}
+
 static clib_error_t *
 test_bihash (test_main_t * tm)
 {
@@ -319,7 +649,18 @@ test_bihash (test_main_t * tm)
 				       0x30000000 /* base_addr */ ,
 				       tm->hash_memory_size);
 #else
-  BV (clib_bihash_init) (h, "test", tm->nbuckets, tm->hash_memory_size);
+  BVT (clib_bihash_init2_args) a = {
+    .h = h,
+    .name = "test",
+    .nbuckets = tm->nbuckets,
+    .memory_size = tm->hash_memory_size,
+    .private_heap = tm->private_heap,
+    .numa_node = tm->numa_node,
+    .log2_page_sz = tm->log2_page_sz,
+  };
+  BV (clib_bihash_init2) (&a);
+  for (i = 0; i < 3 && tm->reserve; i++)
+    BV (clib_bihash_set_reserve) (h, i, tm->reserve);
 #endif
 
   for (acycle = 0; acycle < tm->ncycles; acycle++)
@@ -366,6 +707,10 @@ test_bihash (test_main_t * tm)
 
 	  BV (clib_bihash_add_del) (h, &kv, 1 /* is_add */ );
 
+	  /* Stand-in for the vpp refill process */
+	  if (tm->reserve && h->refill_pending && (i & 255) == 0)
+	    BV (clib_bihash_refill) (h);
+
 	  if (tm->verbose > 1)
 	    {
 	      fformat (stdout, "--------------------\n");
@@ -559,6 +904,17 @@ test_bihash_main (test_main_t * tm)
       else if (unformat (i, "memory-size %U",
 			 unformat_memory_size, &tm->hash_memory_size))
 	;
+      else if (unformat (i, "reserve %u", &tm->reserve))
+	;
+      else if (unformat (i, "private-heap"))
+	tm->private_heap = 1;
+      else if (unformat (i, "page-size %U", unformat_log2_page_size,
+			 &tm->log2_page_sz))
+	;
+      else if (unformat (i, "numa any"))
+	tm->numa_node = BIHASH_NUMA_ANY;
+      else if (unformat (i, "numa %u", &tm->numa_node))
+	;
       else if (unformat (i, "vec64"))
 	which = 1;
       else if (unformat (i, "threads %u", &tm->nthreads))
@@ -571,6 +927,14 @@ test_bihash_main (test_main_t * tm)
 	which = 4;
       else if (unformat (i, "value-assert"))
 	which = 5;
+      else if (unformat (i, "search-or-add"))
+	which = 6;
+      else if (unformat (i, "sweep"))
+	which = 7;
+      else if (unformat (i, "walk-from"))
+	which = 8;
+      else if (unformat (i, "full"))
+	which = 9;
       else
 	return clib_error_return (0, "unknown input '%U'",
 				  format_unformat_error, i);
@@ -607,6 +971,22 @@ test_bihash_main (test_main_t * tm)
       error = test_bihash_value_assert (tm);
       break;
 
+    case 6:
+      error = test_bihash_search_or_add (tm);
+      break;
+
+    case 7:
+      error = test_bihash_sweep (tm);
+      break;
+
+    case 8:
+      error = test_bihash_walk_from (tm);
+      break;
+
+    case 9:
+      error = test_bihash_full (tm);
+      break;
+
     default:
       return clib_error_return (0, "no such test?");
     }
@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: Apache-2.0
+ * Copyright(c) 2021 Cisco Systems, Inc.
+ */
+
+#ifndef included_vector_flow_key_h
+#define included_vector_flow_key_h
+#include <vppinfra/clib.h>
+#include <vppinfra/crc32.h>
+
+/*
+ * IPv4 5-tuple flow keys for a batch of packets, gathered into two arrays:
+ *   key0[i] = src_address << 32 | dst_address
+ *   key1[i] = protocol << 32 | src_port << 16 | dst_port
+ * Addresses and ports stay in network byte order. The L4 header is taken
+ * to follow a 20 byte IPv4 header, the caller sorts out packets with
+ * options, fragments and protocols without ports.
+ *
+ * Each key is built from two 8 byte loads, at offset 8 (ttl, protocol,
+ * checksum, src_address) and 16 (dst_address, ports).
+ */
+
+static_always_inline u64
+clib_ip4_flow_key0 (u64 w8, u64 w16)
+{
+  return (w8 & 0xffffffff00000000ULL) | (w16 & 0xffffffff);
+}
+
+static_always_inline u64
+clib_ip4_flow_key1 (u64 w8, u64 w16)
+{
+  return ((w8 & 0xff00) << 24) | ((w16 >> 16) & 0xffff0000) | (w16 >> 48);
+}
+
+static_always_inline void
+clib_ip4_flow_key_extract (void **ip4, u64 *key0, u64 *key1, u32 n_packets)
+{
+#if defined(CLIB_HAVE_VEC512)
+  while (n_packets >= 8)
+    {
+      u64x8 ptr = u64x8_load_unaligned (ip4);
+      u64x8 w8 = u64x8_i64gather (ptr + 8, 0, 1);
+      u64x8 w16 = u64x8_i64gather (ptr + 16, 0, 1);
+
+      u64x8_store_unaligned ((w8 & 0xffffffff00000000ULL) | (w16 & 0xffffffff),
+			     key0);
+      u64x8_store_unaligned (((w8 & 0xff00) << 24) |
+			       ((w16 >> 16) & 0xffff0000) | (w16 >> 48),
+			     key1);
+
+      ip4 += 8;
+      key0 += 8;
+      key1 += 8;
+      n_packets -= 8;
+    }
+#elif defined(CLIB_HAVE_VEC256)
+  while (n_packets >= 4)
+    {
+      u8 **ip = (u8 **) ip4;
+      u64x4 w8 = u64x4_gather (ip[0] + 8, ip[1] + 8, ip[2] + 8, ip[3] + 8);
+      u64x4 w16 =
+	u64x4_gather (ip[0] + 16, ip[1] + 16, ip[2] + 16, ip[3] + 16);
+
+      u64x4_store_unaligned ((w8 & 0xffffffff00000000ULL) | (w16 & 0xffffffff),
+			     key0);
+      u64x4_store_unaligned (((w8 & 0xff00) << 24) |
+			       ((w16 >> 16) & 0xffff0000) | (w16 >> 48),
+			     key1);
+
+      ip4 += 4;
+      key0 += 4;
+      key1 += 4;
+      n_packets -= 4;
+    }
+#endif
+
+  while (n_packets)
+    {
+      u64 w8 = *(u64u *) ((u8 *) ip4[0] + 8);
+      u64 w16 = *(u64u *) ((u8 *) ip4[0] + 16);
+
+      key0[0] = clib_ip4_flow_key0 (w8, w16);
+      key1[0] = clib_ip4_flow_key1 (w8, w16);
+      ip4++;
+      key0++;
+      key1++;
+      n_packets--;
+    }
+}
+
+#ifdef clib_crc32c_uses_intrinsics
+/*
+ * CRC32C of each 16 byte key0[i], key1[i] pair, equal to
+ * clib_crc32c ((u8 *) key, 16) and so to clib_bihash_hash_16_8. There is
+ * no vector CRC32C instruction, but the chains are independent and four
+ * of them are kept in flight to hide the crc32 latency.
+ */
+static_always_inline void
+clib_flow_key_crc32c (u64 *key0, u64 *key1, u64 *hash, u32 n_keys)
+{
+  while (n_keys >= 4)
+    {
+      u32 h0 = clib_crc32c_u64 (0, key0[0]);
+      u32 h1 = clib_crc32c_u64 (0, key0[1]);
+      u32 h2 = clib_crc32c_u64 (0, key0[2]);
+      u32 h3 = clib_crc32c_u64 (0, key0[3]);
+
+      hash[0] = clib_crc32c_u64 (h0, key1[0]);
+      hash[1] = clib_crc32c_u64 (h1, key1[1]);
+      hash[2] = clib_crc32c_u64 (h2, key1[2]);
+      hash[3] = clib_crc32c_u64 (h3, key1[3]);
+
+      key0 += 4;
+      key1 += 4;
+      hash += 4;
+      n_keys -= 4;
+    }
+
+  while (n_keys)
+    {
+      hash[0] = clib_crc32c_u64 (clib_crc32c_u64 (0, key0[0]), key1[0]);
+      key0++;
+      key1++;
+      hash++;
+      n_keys--;
+    }
+}
+#endif
+
+#endif
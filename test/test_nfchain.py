@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+
+import re
+import unittest
+
+from scapy.packet import Raw
+from scapy.layers.l2 import Ether
+from scapy.layers.inet import IP, UDP
+
+from framework import VppTestCase
+from asfframework import VppTestRunner
+
+FLOW_RE = re.compile(r"\] (\S+):(\d+) -> (\S+):(\d+) proto (\d+) (.*)$")
+
+
+class TestNfchainFused(VppTestCase):
+    """NF chain fused node"""
+
+    vip = "192.0.2.1"
+    backend = "198.51.100.1"
+    backend_mac = "02:00:00:00:00:01"
+
+    def setUp(self):
+        super(TestNfchainFused, self).setUp()
+
+        self.create_pg_interfaces(range(2))
+        for i in self.pg_interfaces:
+            i.admin_up()
+            i.config_ip4()
+
+        self.vapi.cli("clb backend %s mac %s" % (self.backend, self.backend_mac))
+
+    def tearDown(self):
+        self.vapi.cli("nfchain chain pg0 del")
+        self.vapi.cli("nfchain fused pg1 disable")
+        self.vapi.cli("clb backend %s mac %s del" % (self.backend, self.backend_mac))
+        for i in self.pg_interfaces:
+            i.unconfig_ip4()
+            i.admin_down()
+        super(TestNfchainFused, self).tearDown()
+
+    def flows(self, cmd, src):
+        """Flows of a show command from src, less the source address"""
+        flows = set()
+        for line in self.vapi.cli(cmd).splitlines():
+            m = FLOW_RE.search(line)
+            if m and m.group(1) == src:
+                # Drop the idle time, it depends on when we look
+                flows.add(m.groups()[1:5] + (m.group(6).split(" idle")[0],))
+        return flows
+
+    def test_fused_keys(self):
+        """Fused and chained NFs key on the same flows"""
+
+        # pg0 runs the NFs one node each, pg1 the fused node
+        self.vapi.cli("nfchain chain pg0 clb ratelimiter flowcounter")
+        self.vapi.cli("nfchain fused pg1")
+
+        for pg in self.pg_interfaces:
+            pkts = [
+                (
+                    Ether(src=pg.remote_mac, dst=pg.local_mac)
+                    / IP(src=pg.remote_ip4, dst=self.vip)
+                    / UDP(sport=1024 + i, dport=80)
+                    / Raw(b"\xa5" * 64)
+                )
+                for i in range(16)
+                for j in range(i % 3 + 1)
+            ]
+            rxs = self.send_and_expect(pg, pkts, pg)
+            for rx in rxs:
+                self.assertEqual(rx[IP].dst, self.backend)
+
+        for cmd in [
+            "show ratelimiter flows max 1000",
+            "show flowcounter flows max 1000",
+        ]:
+            chained = self.flows(cmd, self.pg0.remote_ip4)
+            fused = self.flows(cmd, self.pg1.remote_ip4)
+            self.assertEqual(len(chained), 16, cmd)
+            self.assertEqual(chained, fused, cmd)
+            # Downstream of the clb, flows go to the backend, not the VIP
+            for flow in fused:
+                self.assertEqual(flow[1], self.backend, cmd)
+
+
+if __name__ == "__main__":
+    unittest.main(testRunner=VppTestRunner)
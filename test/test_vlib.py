@@ -223,6 +223,26 @@ class TestVlib(VppTestCase):
                     self.logger.info(cmd + " FAIL retval " + str(r.retval))
 
 
+class TestVlibRcu(VppTestCase):
+    """Vlib Deferred Reclamation Test Cases"""
+
+    vpp_worker_count = 2
+
+    @classmethod
+    def setUpClass(cls):
+        super(TestVlibRcu, cls).setUpClass()
+
+    @classmethod
+    def tearDownClass(cls):
+        super(TestVlibRcu, cls).tearDownClass()
+
+    def test_vlib_rcu_waits_for_workers(self):
+        """Grace periods wait for every worker"""
+        r = self.vapi.cli_return_response("test rcu")
+        self.assertEqual(r.retval, 0, r.reply)
+        self.assertIn("rcu test OK", r.reply)
+
+
 class TestVlibFrameLeak(VppTestCase):
     """Vlib Frame Leak Test Cases"""
 